@@ -172,6 +172,13 @@ int main(int argc, char **argv)
 
 	ctx = fz_new_context(NULL, &locks, FZ_STORE_UNLIMITED);
 
+	// Split the resource store into independently locked shards, so
+	// that the rendering threads do not all contend for one lock when
+	// looking up cached resources. This must be done before anything
+	// is placed in the store.
+
+	fz_set_store_shards(ctx, FZ_STORE_MAX_SHARDS);
+
 	// Register default file types.
 
 	fz_register_document_handlers(ctx);
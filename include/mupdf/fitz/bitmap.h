@@ -28,6 +28,8 @@ fz_bitmap *fz_new_bitmap_from_pixmap(fz_context *ctx, fz_pixmap *pix, fz_halfton
 
 fz_bitmap *fz_new_bitmap_from_pixmap_band(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht, int band_start);
 
+void fz_fill_bitmap_from_pixmap_band(fz_context *ctx, fz_bitmap *bit, fz_pixmap *pix, fz_halftone *ht, int band_start, int y0, int y1);
+
 struct fz_bitmap_s
 {
 	int refs;
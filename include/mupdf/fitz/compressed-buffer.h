@@ -10,6 +10,7 @@
 typedef struct fz_compression_params_s fz_compression_params;
 
 typedef struct fz_compressed_buffer_s fz_compressed_buffer;
+typedef struct fz_jpeg_index_s fz_jpeg_index;
 size_t fz_compressed_buffer_size(fz_compressed_buffer *buffer);
 
 fz_stream *fz_open_compressed_buffer(fz_context *ctx, fz_compressed_buffer *);
@@ -89,6 +90,7 @@ struct fz_compressed_buffer_s
 {
 	fz_compression_params params;
 	fz_buffer *buffer;
+	fz_jpeg_index *jpeg_index; /* Built on demand; see fz_new_jpeg_index */
 };
 
 void fz_drop_compressed_buffer(fz_context *ctx, fz_compressed_buffer *buf);
@@ -52,6 +52,43 @@
 */
 /* #define FZ_ENABLE_JS 1 */
 
+/*
+	Choose whether to enable the built-in allocation cache.
+	When enabled, small allocations are served from per-context
+	free lists of fixed size classes, carved out of larger blocks
+	obtained from the allocator. This avoids most calls to the
+	allocator (and taking of the alloc lock) in multi-threaded use,
+	at the cost of a small header on every allocation. It is
+	disabled by default, and always disabled in Memento builds.
+*/
+/* #define FZ_ENABLE_ALLOC_CACHE 1 */
+
+/*
+	Choose whether to use SIMD versions of the rendering kernels
+	where available (currently SSE2 and AVX2 on x86-64). The best
+	version supported by the CPU is chosen at runtime. Define to 0
+	to always use the portable C versions.
+*/
+/* #define FZ_ENABLE_SIMD 1 */
+
+/*
+	Choose whether to build a spatial index for big display lists
+	the first time they are run with a small scissor, so that later
+	runs can skip the parts of the list out of view. Define to 0 to
+	always check every node against the scissor.
+*/
+/* #define FZ_ENABLE_DISPLAY_LIST_INDEX 1 */
+
+/*
+	Choose how many of the pixmaps used for transparency groups,
+	soft masks, clips and knockouts the draw device keeps for reuse
+	once they are popped, and how many bytes of samples it may keep
+	in them. Define FZ_DRAW_POOL_COUNT to 0 to always allocate new
+	pixmaps.
+*/
+/* #define FZ_DRAW_POOL_COUNT 8 */
+/* #define FZ_DRAW_POOL_BYTES (64<<20) */
+
 /*
 	Choose which fonts to include.
 	By default we include the base 14 PDF fonts,
@@ -165,6 +202,31 @@
 #define FZ_ENABLE_ICC 1
 #endif /* FZ_ENABLE_ICC */
 
+#ifndef FZ_ENABLE_ALLOC_CACHE
+#define FZ_ENABLE_ALLOC_CACHE 0
+#endif /* FZ_ENABLE_ALLOC_CACHE */
+
+#ifdef MEMENTO
+#undef FZ_ENABLE_ALLOC_CACHE
+#define FZ_ENABLE_ALLOC_CACHE 0
+#endif
+
+#ifndef FZ_ENABLE_SIMD
+#define FZ_ENABLE_SIMD 1
+#endif /* FZ_ENABLE_SIMD */
+
+#ifndef FZ_ENABLE_DISPLAY_LIST_INDEX
+#define FZ_ENABLE_DISPLAY_LIST_INDEX 1
+#endif /* FZ_ENABLE_DISPLAY_LIST_INDEX */
+
+#ifndef FZ_DRAW_POOL_COUNT
+#define FZ_DRAW_POOL_COUNT 8
+#endif /* FZ_DRAW_POOL_COUNT */
+
+#ifndef FZ_DRAW_POOL_BYTES
+#define FZ_DRAW_POOL_BYTES (64<<20)
+#endif /* FZ_DRAW_POOL_BYTES */
+
 /* If Epub and HTML are both disabled, disable SIL fonts */
 #if FZ_ENABLE_HTML == 0 && FZ_ENABLE_EPUB == 0
 #undef TOFU_SIL
@@ -6,6 +6,7 @@
 #include "mupdf/fitz/geometry.h"
 
 typedef struct fz_alloc_context_s fz_alloc_context;
+typedef struct fz_alloc_cache_s fz_alloc_cache;
 typedef struct fz_error_context_s fz_error_context;
 typedef struct fz_error_stack_slot_s fz_error_stack_slot;
 typedef struct fz_warn_context_s fz_warn_context;
@@ -102,6 +103,19 @@ void fz_flush_warnings(fz_context *ctx);
 	when we already hold any lock i, where 0 <= i <= n. In order
 	to verify this, we have some debugging code, that can be
 	enabled by defining FITZ_DEBUG_LOCKING.
+
+	FZ_LOCK_STORE is the first of FZ_STORE_MAX_SHARDS consecutive
+	locks that protect the shards of the resource store when it
+	has been split using fz_set_store_shards.
+
+	Similarly, FZ_LOCK_GLYPHCACHE is the first of
+	FZ_GLYPH_CACHE_SHARDS consecutive locks, one for each shard of
+	the glyph cache.
+
+	The lock numbers and FZ_LOCK_MAX are not part of the binary
+	interface. They change as locks are added (the shard locks
+	renumbered FZ_LOCK_FREETYPE and FZ_LOCK_GLYPHCACHE), so clients
+	must be rebuilt against the headers of the library they use.
 */
 
 struct fz_locks_context_s
@@ -111,17 +125,24 @@ struct fz_locks_context_s
 	void (*unlock)(void *user, int lock);
 };
 
+enum {
+	FZ_STORE_MAX_SHARDS = 8,
+	FZ_GLYPH_CACHE_SHARDS = 8
+};
+
 enum {
 	FZ_LOCK_ALLOC = 0,
-	FZ_LOCK_FREETYPE,
+	FZ_LOCK_STORE,
+	FZ_LOCK_FREETYPE = FZ_LOCK_STORE + FZ_STORE_MAX_SHARDS,
 	FZ_LOCK_GLYPHCACHE,
-	FZ_LOCK_MAX
+	FZ_LOCK_MAX = FZ_LOCK_GLYPHCACHE + FZ_GLYPH_CACHE_SHARDS
 };
 
 struct fz_context_s
 {
 	void *user;
 	const fz_alloc_context *alloc;
+	fz_alloc_cache *alloc_cache;
 	fz_locks_context locks;
 	fz_error_context *error;
 	fz_warn_context *warn;
@@ -203,10 +224,46 @@ typedef void (fz_tune_image_decode_fn)(void *arg, int w, int h, int l2factor, fz
 */
 typedef int (fz_tune_image_scale_fn)(void *arg, int dst_w, int dst_h, int src_w, int src_h);
 
+/*
+	A job that can be done independently of the others in its set.
+
+	ctx: The context to do the job with.
+
+	job_arg: The argument given with the set of jobs.
+
+	i: The number of the job, from 0 to n-1.
+
+	A job must not throw.
+*/
+typedef void (fz_parallel_job_fn)(fz_context *ctx, void *job_arg, int i);
+
+/*
+	Run a set of independent jobs (such as the strips of a large
+	image), possibly several at once on different threads.
+
+	arg: The caller supplied opaque argument.
+
+	ctx: The context of the caller. Jobs run on other threads must
+	be given contexts of their own (see fz_clone_context).
+
+	n: The number of jobs.
+
+	job, job_arg: Call job(ctx, job_arg, i) once for each i from 0
+	to n-1, in any order.
+
+	Returns once all the jobs are done. The default runs them one
+	after another on the calling thread.
+*/
+typedef void (fz_tune_parallel_fn)(void *arg, fz_context *ctx, int n, fz_parallel_job_fn *job, void *job_arg);
+
 void fz_tune_image_decode(fz_context *ctx, fz_tune_image_decode_fn *image_decode, void *arg);
 
 void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, void *arg);
 
+void fz_tune_parallel(fz_context *ctx, fz_tune_parallel_fn *parallel, void *arg);
+
+void fz_tune_image_digests(fz_context *ctx, int digests);
+
 int fz_aa_level(fz_context *ctx);
 
 void fz_set_aa_level(fz_context *ctx, int bits);
@@ -9,6 +9,7 @@
 #include "mupdf/fitz/shade.h"
 #include "mupdf/fitz/path.h"
 #include "mupdf/fitz/text.h"
+#include "mupdf/fitz/bitmap.h"
 
 /*
 	The different format handlers (pdf, xps etc) interpret pages to a
@@ -251,6 +252,8 @@ fz_device *fz_new_draw_device_with_bbox_proof(fz_context *ctx, fz_matrix transfo
 
 fz_device *fz_new_draw_device_type3(fz_context *ctx, fz_matrix transform, fz_pixmap *dest);
 
+fz_device *fz_new_draw_device_with_bitmap(fz_context *ctx, fz_matrix transform, fz_pixmap *dest, fz_bitmap *bit, int band_start);
+
 /*
 	struct fz_draw_options: Options for creating a pixmap and draw device.
 */
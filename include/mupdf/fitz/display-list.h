@@ -5,6 +5,8 @@
 #include "mupdf/fitz/context.h"
 #include "mupdf/fitz/geometry.h"
 #include "mupdf/fitz/device.h"
+#include "mupdf/fitz/buffer.h"
+#include "mupdf/fitz/output.h"
 
 /*
 	Display list device -- record and play back device commands.
@@ -30,6 +32,8 @@ fz_device *fz_new_list_device(fz_context *ctx, fz_display_list *list);
 
 void fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_matrix ctm, fz_rect scissor, fz_cookie *cookie);
 
+void fz_prefetch_display_list_images(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_irect bbox, int band_height, fz_cookie *cookie);
+
 fz_display_list *fz_keep_display_list(fz_context *ctx, fz_display_list *list);
 void fz_drop_display_list(fz_context *ctx, fz_display_list *list);
 
@@ -39,4 +43,11 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+int fz_optimize_display_list(fz_context *ctx, fz_display_list *list);
+
+void fz_write_display_list(fz_context *ctx, fz_output *out, fz_display_list *list);
+void fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename);
+fz_display_list *fz_new_display_list_from_buffer(fz_context *ctx, fz_buffer *buf);
+fz_display_list *fz_load_display_list(fz_context *ctx, const char *filename);
+
 #endif
@@ -7,9 +7,25 @@
 #include "mupdf/fitz/pixmap.h"
 
 void fz_purge_glyph_cache(fz_context *ctx);
+void fz_set_glyph_cache_digest_keys(fz_context *ctx, int enable);
 fz_pixmap *fz_render_glyph_pixmap(fz_context *ctx, fz_font*, int, fz_matrix *, const fz_irect *scissor, int aa);
 void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, int gid, fz_matrix trm, void *gstate, fz_default_colorspaces *def_cs);
 void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid);
+
+typedef struct fz_glyph_cache_stats_s
+{
+	size_t lookups;
+	size_t hits;
+	size_t misses;
+	size_t inserts;
+	size_t evictions;
+	size_t evicted;
+	size_t size;
+	size_t max;
+	size_t high_water;
+} fz_glyph_cache_stats;
+
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats);
 void fz_dump_glyph_cache_stats(fz_context *ctx);
 float fz_subpixel_adjust(fz_context *ctx, fz_matrix *ctm, fz_matrix *subpix_ctm, unsigned char *qe, unsigned char *qf);
 
@@ -143,6 +143,12 @@ typedef struct fz_store_hash_s
 			unsigned int dst_extras:5;
 			unsigned int copy_spots:1;
 		} link; /* 36 bytes */
+		struct
+		{
+			unsigned char digest[16];
+			int i;
+			fz_irect r;
+		} dir; /* 36 bytes */
 	} u;
 } fz_store_hash; /* 40 or 44 bytes */
 
@@ -154,15 +160,28 @@ typedef struct fz_store_type_s
 	int (*cmp_key)(fz_context *ctx, void *a, void *b);
 	void (*format_key)(fz_context *ctx, char *buf, int size, void *key);
 	int (*needs_reap)(fz_context *ctx, void *key);
+	const char *name; /* For statistics; may be NULL */
 } fz_store_type;
 
 void fz_new_store_context(fz_context *ctx, size_t max);
 
+void fz_set_store_shards(fz_context *ctx, int nshards);
+
+enum
+{
+	FZ_STORE_POLICY_LRU = 0,
+	FZ_STORE_POLICY_GDS = 1
+};
+
+void fz_set_store_policy(fz_context *ctx, int policy);
+
 void fz_drop_store_context(fz_context *ctx);
 fz_store *fz_keep_store_context(fz_context *ctx);
 
 void *fz_store_item(fz_context *ctx, void *key, void *val, size_t itemsize, const fz_store_type *type);
 
+void *fz_store_item_with_cost(fz_context *ctx, void *key, void *val, size_t itemsize, size_t cost, const fz_store_type *type);
+
 void *fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_type *type);
 
 void fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_type *type);
@@ -181,6 +200,37 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const f
 
 void fz_debug_store(fz_context *ctx);
 
+/*
+	Usage statistics for the store; see fz_get_store_stats.
+*/
+enum { FZ_STORE_STATS_MAX_TYPES = 8 };
+
+typedef struct fz_store_type_stats_s
+{
+	const char *name;
+	size_t lookups;
+	size_t hits;
+	size_t misses;
+	size_t inserts;
+	size_t evictions;
+	size_t evicted;
+	size_t size;
+} fz_store_type_stats;
+
+typedef struct fz_store_stats_s
+{
+	size_t max;
+	size_t size;
+	size_t high_water;
+	size_t scavenges;
+	int num_types;
+	fz_store_type_stats type[FZ_STORE_STATS_MAX_TYPES];
+} fz_store_stats;
+
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+void fz_reset_store_stats(fz_context *ctx);
+void fz_print_store_stats(fz_context *ctx, fz_output *out);
+
 void fz_defer_reap_start(fz_context *ctx);
 
 void fz_defer_reap_end(fz_context *ctx);
@@ -54,6 +54,12 @@ typedef unsigned __int64 uint64_t;
 #endif
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64)
+#ifndef ARCH_X86_64
+#define ARCH_X86_64
+#endif
+#endif
+
 /*
 	Some differences in libc can be smoothed over
 */
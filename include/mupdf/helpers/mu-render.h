@@ -0,0 +1,97 @@
+#ifndef MUPDF_HELPERS_MU_RENDER_H
+#define MUPDF_HELPERS_MU_RENDER_H
+
+/*
+	Parallel rendering helper.
+
+	Renders a single display list into a pixmap on several threads
+	at once, using the mu-threads library. This lowers the latency
+	of rendering one page on a machine with many cores.
+*/
+
+#include "mupdf/fitz.h"
+
+/*
+	mu_render_display_list_parallel: Render a display list into a
+	pixmap using several threads.
+
+	The pixmap is split into tiles, and each thread is given a run
+	of neighbouring tiles to draw. A thread that finishes its own
+	tiles takes half of the remaining tiles from the busiest thread,
+	so the load stays balanced even when all the content is in one
+	part of the page. Each tile runs the display list with the tile
+	as the scissor rectangle, so only the nodes whose bounds touch
+	the tile are drawn. The threads all draw directly into pix,
+	each only within its own tiles.
+
+	The calling thread takes part in the rendering, and the function
+	returns once the whole pixmap has been drawn.
+
+	ctx: The context to use. It must have locking functions (see
+	fz_new_context), so that it can be cloned for each thread. If it
+	cannot be cloned, the rendering is done on the calling thread.
+
+	list: The display list to render.
+
+	ctm: The transform to apply to the display list.
+
+	pix: The pixmap to render into. This should already be cleared
+	to the required background.
+
+	proof_cs: Colorspace to proof through (see
+	fz_new_draw_device_with_proof), or NULL.
+
+	hints: Hints to enable on each draw device (see
+	fz_enable_device_hints), or 0.
+
+	threads: The number of threads to render on, including the
+	calling thread. Values less than 2 render on the calling thread
+	only.
+
+	cookie: NULL, or a cookie. Setting cookie->abort stops the
+	rendering once the current tiles are done. Tiles that fail to
+	render are counted in cookie->errors.
+*/
+void mu_render_display_list_parallel(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, fz_colorspace *proof_cs, int hints, int threads, fz_cookie *cookie);
+
+/*
+	mu_new_bitmap_from_pixmap_band_parallel: Halftone a pixmap into
+	a new bitmap using several threads, as
+	fz_new_bitmap_from_pixmap_band does on one.
+
+	The rows of the pixmap are split evenly between the threads, the
+	calling thread included.
+
+	ctx: The context to use. It must have locking functions, so that
+	it can be cloned for each thread. If it cannot be cloned, the
+	halftoning is done on the calling thread.
+
+	pix, ht, band_start: As for fz_new_bitmap_from_pixmap_band.
+
+	threads: The number of threads to use, including the calling
+	thread.
+*/
+fz_bitmap *mu_new_bitmap_from_pixmap_band_parallel(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht, int band_start, int threads);
+
+/*
+	mu_run_parallel: Run a set of independent jobs on several
+	threads. Install it with fz_tune_parallel so that fitz can split
+	up work such as decoding large JPEG images with restart markers.
+
+	Each thread takes the next job in turn until there are none
+	left. The calling thread takes part, and the function returns
+	once all the jobs are done.
+
+	arg: Pointer to an int holding the number of threads to use,
+	including the calling thread. NULL, or values less than 2, run
+	the jobs on the calling thread only.
+
+	ctx: The context to use. It must have locking functions, so that
+	it can be cloned for each thread. If it cannot be cloned, the
+	jobs are done on the calling thread.
+
+	n, job, job_arg: The jobs to run; see fz_tune_parallel_fn.
+*/
+void mu_run_parallel(void *arg, fz_context *ctx, int n, fz_parallel_job_fn *job, void *job_arg);
+
+#endif /* MUPDF_HELPERS_MU_RENDER_H */
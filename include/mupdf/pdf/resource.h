@@ -2,6 +2,7 @@
 #define MUPDF_PDF_RESOURCE_H
 
 void pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, size_t itemsize);
+void pdf_store_item_with_cost(fz_context *ctx, pdf_obj *key, void *val, size_t itemsize, size_t cost);
 void *pdf_find_item(fz_context *ctx, fz_store_drop_fn *drop, pdf_obj *key);
 void pdf_remove_item(fz_context *ctx, fz_store_drop_fn *drop, pdf_obj *key);
 void pdf_empty_store(fz_context *ctx, pdf_document *doc);
@@ -450,7 +450,8 @@ static fz_store_type fz_link_store_type =
 	fz_drop_link_key,
 	fz_cmp_link_key,
 	fz_format_link_key,
-	NULL
+	NULL,
+	"colorspace link"
 };
 
 static void
@@ -591,6 +592,23 @@ fz_get_icc_from_cal(fz_context *ctx, fz_colorspace *cs)
 	return icc;
 }
 
+/* Estimate the size of the table that the CMM precalculates for a link.
+ * lcms samples the transform over a grid of 33 points per source
+ * component for up to 3 components, 17 for 4 and 7 for more, keeping 16
+ * bits per destination component at each point. */
+static size_t
+fz_icc_link_table_size(fz_iccprofile *src, fz_iccprofile *dst)
+{
+	int n = src->num_devcomp;
+	int grid = n > 4 ? 7 : n == 4 ? 17 : 33;
+	size_t size = 2 * (size_t)dst->num_devcomp;
+
+	while (n-- > 0 && size < (1<<26))
+		size *= grid;
+
+	return size;
+}
+
 static fz_icclink *
 fz_get_icc_link(fz_context *ctx, fz_colorspace *dst, int dst_extras, fz_colorspace *src, int src_extras, fz_colorspace *prf, const fz_color_params *rend, int num_bytes, int copy_spots, int *src_n)
 {
@@ -650,8 +668,15 @@ fz_get_icc_link(fz_context *ctx, fz_colorspace *dst, int dst_extras, fz_colorspa
 		/* Not found.  Make new one add to store. */
 		if (link == NULL)
 		{
+			size_t table;
+
 			link = fz_new_icc_link(ctx, dst_icc, dst_extras, src_icc, src_extras, prf_icc, rend, num_bytes, copy_spots);
-			new_link = fz_store_item(ctx, key, link, sizeof(fz_icclink), &fz_link_store_type);
+			/* Every entry of the table is made by running the full
+			 * floating point pipeline through both profiles, which
+			 * we reckon at 16 times the work per byte of decoding
+			 * an image. */
+			table = link->is_identity ? 0 : fz_icc_link_table_size(src_icc, dst_icc);
+			new_link = fz_store_item_with_cost(ctx, key, link, sizeof(fz_icclink) + table, sizeof(fz_icclink) + 16 * table, &fz_link_store_type);
 			if (new_link != NULL)
 			{
 				/* Found one while adding! Perhaps from another thread? */
@@ -11,6 +11,7 @@ fz_drop_compressed_buffer(fz_context *ctx, fz_compressed_buffer *buf)
 		if (buf->params.type == FZ_IMAGE_JBIG2)
 			fz_drop_jbig2_globals(ctx, buf->params.u.jbig2.globals);
 		fz_drop_buffer(ctx, buf->buffer);
+		fz_free(ctx, buf->jpeg_index);
 		fz_free(ctx, buf);
 	}
 }
@@ -82,6 +82,7 @@ static void fz_new_tuning_context(fz_context *ctx)
 		ctx->tuning->refs = 1;
 		ctx->tuning->image_decode = fz_default_image_decode;
 		ctx->tuning->image_scale = fz_default_image_scale;
+		ctx->tuning->parallel = fz_default_parallel;
 	}
 }
 
@@ -130,6 +131,43 @@ void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, v
 	ctx->tuning->image_scale_arg = arg;
 }
 
+/*
+	Set the function to use for running
+	independent jobs, such as the strips of a large image, possibly
+	in parallel.
+
+	parallel: Function to use, or NULL to run the jobs one after
+	another.
+
+	arg: Opaque argument to be passed to the function.
+*/
+void fz_tune_parallel(fz_context *ctx, fz_tune_parallel_fn *parallel, void *arg)
+{
+	ctx->tuning->parallel = parallel ? parallel : fz_default_parallel;
+	ctx->tuning->parallel_arg = arg;
+}
+
+/*
+	Choose whether decoded image tiles in the
+	store are keyed on the image they came from (the default), or on
+	a digest of its compressed data and decoding parameters.
+
+	With digests, identical images in different documents share
+	their tiles, at the cost of hashing each image's data once. This
+	suits rendering many documents made from the same template.
+
+	Images in device or ICC based colorspaces can be shared; ICC
+	colorspaces match when their profiles do. Images in any other
+	colorspace (Indexed, Separation, DeviceN and so on) match
+	only within the document that made that colorspace.
+
+	digests: 1 to key tiles on digests, 0 to key them on the images.
+*/
+void fz_tune_image_digests(fz_context *ctx, int digests)
+{
+	ctx->tuning->image_digests = digests;
+}
+
 static void fz_init_random_context(fz_context *ctx)
 {
 	if (!ctx)
@@ -183,15 +221,18 @@ fz_drop_context(fz_context *ctx)
 		fz_free(ctx, ctx->error);
 	}
 
+	fz_drop_alloc_cache(ctx);
+
 	/* Free the context itself */
 	ctx->alloc->free(ctx->alloc->user, ctx);
 }
 
 /* Allocate new context structure, and initialise allocator, and sections
- * that aren't shared between contexts.
+ * that aren't shared between contexts. The allocation cache (if any)
+ * shares its depot with the parent context.
  */
 static fz_context *
-new_context_phase1(const fz_alloc_context *alloc, const fz_locks_context *locks)
+new_context_phase1(const fz_alloc_context *alloc, const fz_locks_context *locks, fz_context *parent)
 {
 	fz_context *ctx;
 
@@ -203,6 +244,9 @@ new_context_phase1(const fz_alloc_context *alloc, const fz_locks_context *locks)
 	ctx->alloc = alloc;
 	ctx->locks = *locks;
 
+	if (fz_new_alloc_cache(ctx, parent))
+		goto cleanup;
+
 	ctx->glyph_cache = NULL;
 
 	ctx->error = Memento_label(fz_malloc_no_throw(ctx, sizeof(fz_error_context)), "fz_error_context");
@@ -281,7 +325,7 @@ fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks,
 	if (!locks)
 		locks = &fz_locks_default;
 
-	ctx = new_context_phase1(alloc, locks);
+	ctx = new_context_phase1(alloc, locks, NULL);
 	if (!ctx)
 		return NULL;
 
@@ -341,7 +385,7 @@ fz_clone_context_internal(fz_context *ctx)
 	if (ctx == NULL || ctx->alloc == NULL)
 		return NULL;
 
-	new_ctx = new_context_phase1(ctx->alloc, &ctx->locks);
+	new_ctx = new_context_phase1(ctx->alloc, &ctx->locks, ctx);
 	if (!new_ctx)
 		return NULL;
 
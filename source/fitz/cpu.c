@@ -0,0 +1,103 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+#if FZ_SIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if FZ_SIMD_X86
+
+static void
+cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	regs[0] = r[0]; regs[1] = r[1]; regs[2] = r[2]; regs[3] = r[3];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* Which register states the OS saves on context switch (XCR0). */
+static unsigned int
+xgetbv(void)
+{
+#if defined(_MSC_VER)
+	return (unsigned int)_xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return eax;
+#endif
+}
+
+static int
+detect_cpu_features(void)
+{
+	unsigned int regs[4];
+	unsigned int max;
+	int features = FZ_CPU_SSE2; /* Always present on x86-64 */
+
+	cpuid(0, 0, regs);
+	max = regs[0];
+	if (max < 1)
+		return features;
+
+	cpuid(1, 0, regs);
+	if (regs[2] & (1<<19))
+		features |= FZ_CPU_SSE41;
+
+	/* AVX2 needs both the CPU (leaf 7) and the OS (saving of the
+	 * xmm and ymm registers, checked via OSXSAVE and XCR0). */
+	if (max >= 7 && (regs[2] & (1<<27)) && (xgetbv() & 6) == 6)
+	{
+		cpuid(7, 0, regs);
+		if (regs[1] & (1<<5))
+			features |= FZ_CPU_AVX2;
+	}
+
+	return features;
+}
+
+#endif
+
+static int masked_features = 0;
+
+/*
+	Return the set of FZ_CPU_... flags for the SIMD instruction sets
+	that may be used on this machine. The result is computed once and
+	then cached; computing it concurrently is harmless as every caller
+	arrives at the same answer.
+*/
+int
+fz_cpu_features(void)
+{
+#if FZ_SIMD_X86
+	static int features = -1;
+
+	if (features < 0)
+		features = detect_cpu_features();
+	return features & ~masked_features;
+#else
+	return 0;
+#endif
+}
+
+/*
+	Stop fz_cpu_features reporting the given FZ_CPU_... flags, so
+	that the plain C code is used instead of those SIMD kernels. This
+	is for tests and benchmarks that compare the two, and must not be
+	called while anything is drawing.
+
+	mask: The flags to hide, or 0 to use everything the machine has.
+*/
+void
+fz_mask_cpu_features(int mask)
+{
+	masked_features = mask;
+}
@@ -1,10 +1,16 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "fitz-imp.h"
 
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <assert.h>
 
+#if FZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
 /* Number of fraction bits for fixed point math */
 #define PREC 14
 #define MASK ((1<<PREC)-1)
@@ -3871,6 +3877,176 @@ fz_gridfit_matrix(int as_tiled, fz_matrix m)
 	return m;
 }
 
+#if FZ_SIMD_X86
+
+/*
+	AVX2 painters for the commonest image plots: opaque (alpha == 255)
+	gray, rgb and rgba images onto rgba, and cmyk onto cmyk, with no
+	shape or group alpha planes. They do 8 destination pixels at a
+	time, fetching the source pixels with gathers, and give the same
+	results as the C templates above.
+*/
+
+/* Fetch the n byte source pixels at byte offsets off (for the lanes in
+ * mask) into 32 bit lanes, pixel in the low bytes. The 4 bytes read end
+ * with the pixel rather than start with it, so that we never read past
+ * the end of the samples; the bytes above the pixel are not cleared. */
+FZ_TARGET_AVX2 static inline __m256i
+gather_pixels_avx2(const byte * FZ_RESTRICT sp, __m256i off, __m256i mask, int n)
+{
+	__m256i start = _mm256_max_epi32(_mm256_add_epi32(off, _mm256_set1_epi32(n - 4)), _mm256_setzero_si256());
+	__m256i px = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)sp, start, mask, 1);
+	return _mm256_srlv_epi32(px, _mm256_slli_epi32(_mm256_sub_epi32(off, start), 3));
+}
+
+/* Turn source pixels into destination pixels: gray is spread over rgb,
+ * and an opaque alpha is added where the source has none. */
+FZ_TARGET_AVX2 static inline __m256i
+expand_pixels_avx2(__m256i px, int sn, int sa)
+{
+	__m256i k255 = _mm256_set1_epi32(255);
+
+	if (sn == 1)
+	{
+		__m256i g = _mm256_mullo_epi32(_mm256_and_si256(px, k255), _mm256_set1_epi32(0x010101));
+		__m256i a = sa ? _mm256_and_si256(_mm256_srli_epi32(px, 8), k255) : k255;
+		return _mm256_or_si256(g, _mm256_slli_epi32(a, 24));
+	}
+	if (sn == 3 && !sa)
+		return _mm256_or_si256(_mm256_and_si256(px, _mm256_set1_epi32(0xFFFFFF)), _mm256_set1_epi32(0xFF000000));
+	return px;
+}
+
+/* dp = src + dp * (255 - a) for the 4 byte pixels in mask. */
+FZ_TARGET_AVX2 static inline void
+composite_avx2(byte * FZ_RESTRICT dp, __m256i src, __m256i a, __m256i mask)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i k128 = _mm256_set1_epi16(128);
+	__m256i d = _mm256_maskload_epi32((const int *)dp, mask);
+	__m256i t = _mm256_sub_epi32(_mm256_set1_epi32(255), a);
+	__m256i lo, hi;
+
+	t = _mm256_or_si256(t, _mm256_slli_epi32(t, 16));
+	lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi32(t, t)), k128);
+	hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi32(t, t)), k128);
+	lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+	hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+	_mm256_maskstore_epi32((int *)dp, mask, _mm256_add_epi8(src, _mm256_packus_epi16(lo, hi)));
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+lerp_avx2(__m256i a, __m256i b, __m256i t)
+{
+	return _mm256_add_epi32(a, _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(b, a), t), PREC));
+}
+
+FZ_TARGET_AVX2 static void
+paint_affine_near_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * FZ_RESTRICT color, byte * FZ_RESTRICT hp, byte * FZ_RESTRICT gp, const fz_overprint * FZ_RESTRICT eop)
+{
+	int n = sn + sa;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i vu = _mm256_add_epi32(_mm256_set1_epi32(u), _mm256_mullo_epi32(lane, _mm256_set1_epi32(fa)));
+	__m256i vv = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(lane, _mm256_set1_epi32(fb)));
+	__m256i du = _mm256_slli_epi32(_mm256_set1_epi32(fa), 3);
+	__m256i dv = _mm256_slli_epi32(_mm256_set1_epi32(fb), 3);
+	__m256i vw = _mm256_set1_epi32(sw);
+	__m256i vh = _mm256_set1_epi32(sh);
+
+	for (; w > 0; w -= 8, dp += 32)
+	{
+		__m256i ui = _mm256_srai_epi32(vu, PREC);
+		__m256i vi = _mm256_srai_epi32(vv, PREC);
+		__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(w), lane);
+		__m256i off, src, a;
+
+		mask = _mm256_and_si256(mask, _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, ui), _mm256_cmpgt_epi32(vw, ui)));
+		mask = _mm256_and_si256(mask, _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, vi), _mm256_cmpgt_epi32(vh, vi)));
+		if (_mm256_movemask_epi8(mask))
+		{
+			off = _mm256_add_epi32(_mm256_mullo_epi32(vi, _mm256_set1_epi32(ss)), _mm256_mullo_epi32(ui, _mm256_set1_epi32(n)));
+			src = expand_pixels_avx2(gather_pixels_avx2(sp, off, mask, n), sn, sa);
+			a = _mm256_srli_epi32(src, 24);
+			if (!sa)
+				a = _mm256_set1_epi32(255);
+			mask = _mm256_andnot_si256(_mm256_cmpeq_epi32(a, zero), mask);
+			composite_avx2(dp, src, a, mask);
+		}
+		vu = _mm256_add_epi32(vu, du);
+		vv = _mm256_add_epi32(vv, dv);
+	}
+}
+
+FZ_TARGET_AVX2 static void
+paint_affine_lerp_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * FZ_RESTRICT color, byte * FZ_RESTRICT hp, byte * FZ_RESTRICT gp, const fz_overprint * FZ_RESTRICT eop)
+{
+	int n = sn + sa;
+	int k;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i k255 = _mm256_set1_epi32(255);
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i vu = _mm256_add_epi32(_mm256_set1_epi32(u), _mm256_mullo_epi32(lane, _mm256_set1_epi32(fa)));
+	__m256i vv = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(lane, _mm256_set1_epi32(fb)));
+	__m256i du = _mm256_slli_epi32(_mm256_set1_epi32(fa), 3);
+	__m256i dv = _mm256_slli_epi32(_mm256_set1_epi32(fb), 3);
+	__m256i vw = _mm256_set1_epi32(sw);
+	__m256i vh = _mm256_set1_epi32(sh);
+	__m256i wmax = _mm256_set1_epi32((sw >> PREC) - 1);
+	__m256i hmax = _mm256_set1_epi32((sh >> PREC) - 1);
+	__m256i half = _mm256_set1_epi32(HALF);
+	__m256i one = _mm256_set1_epi32(ONE);
+	__m256i vn = _mm256_set1_epi32(n);
+	__m256i vs = _mm256_set1_epi32(ss);
+	__m256i kmask = _mm256_set1_epi32(MASK);
+
+	for (; w > 0; w -= 8, dp += 32)
+	{
+		__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(w), lane);
+		__m256i ui, vi, uf, vf, u0, u1, v0, v1, pa, pb, pc, pd, px, src, a;
+
+		mask = _mm256_and_si256(mask, _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, _mm256_add_epi32(vu, half)), _mm256_cmpgt_epi32(vw, _mm256_add_epi32(vu, one))));
+		mask = _mm256_and_si256(mask, _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, _mm256_add_epi32(vv, half)), _mm256_cmpgt_epi32(vh, _mm256_add_epi32(vv, one))));
+		if (_mm256_movemask_epi8(mask))
+		{
+			ui = _mm256_srai_epi32(vu, PREC);
+			vi = _mm256_srai_epi32(vv, PREC);
+			uf = _mm256_and_si256(vu, kmask);
+			vf = _mm256_and_si256(vv, kmask);
+			u0 = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(ui, zero), wmax), vn);
+			u1 = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(ui, _mm256_set1_epi32(1)), zero), wmax), vn);
+			v0 = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(vi, zero), hmax), vs);
+			v1 = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(vi, _mm256_set1_epi32(1)), zero), hmax), vs);
+			pa = gather_pixels_avx2(sp, _mm256_add_epi32(v0, u0), mask, n);
+			pb = gather_pixels_avx2(sp, _mm256_add_epi32(v0, u1), mask, n);
+			pc = gather_pixels_avx2(sp, _mm256_add_epi32(v1, u0), mask, n);
+			pd = gather_pixels_avx2(sp, _mm256_add_epi32(v1, u1), mask, n);
+
+			px = zero;
+			for (k = 0; k < n; k++)
+			{
+				__m256i ca = _mm256_and_si256(_mm256_srli_epi32(pa, 8 * k), k255);
+				__m256i cb = _mm256_and_si256(_mm256_srli_epi32(pb, 8 * k), k255);
+				__m256i cc = _mm256_and_si256(_mm256_srli_epi32(pc, 8 * k), k255);
+				__m256i cd = _mm256_and_si256(_mm256_srli_epi32(pd, 8 * k), k255);
+				__m256i x = lerp_avx2(lerp_avx2(ca, cb, uf), lerp_avx2(cc, cd, uf), vf);
+				px = _mm256_or_si256(px, _mm256_slli_epi32(x, 8 * k));
+			}
+
+			src = expand_pixels_avx2(px, sn, sa);
+			a = _mm256_srli_epi32(src, 24);
+			if (!sa)
+				a = _mm256_set1_epi32(255);
+			mask = _mm256_andnot_si256(_mm256_cmpeq_epi32(a, zero), mask);
+			composite_avx2(dp, src, a, mask);
+		}
+		vu = _mm256_add_epi32(vu, du);
+		vv = _mm256_add_epi32(vv, dv);
+	}
+}
+
+#endif /* FZ_SIMD_X86 */
+
 /* Draw an image with an affine transform on destination */
 
 static void
@@ -4066,6 +4242,15 @@ fz_paint_image_imp(fz_context *ctx,
 	if (paintfn == NULL)
 		return;
 
+#if FZ_SIMD_X86
+	/* The AVX2 painters handle opaque plots onto 4 byte pixels. */
+	if (!color && alpha == 255 && !shape && !group_alpha && !fz_overprint_required(eop) &&
+		dn + da == 4 && sn + sa <= 4 && (sn == dn || (sn == 1 && dn == 3)) &&
+		ss > 0 && (int64_t)ss * sh >= 4 && (int64_t)ss * sh <= INT_MAX &&
+		(fz_cpu_features() & FZ_CPU_AVX2))
+		paintfn = dolerp ? paint_affine_lerp_avx2 : paint_affine_near_avx2;
+#endif /* FZ_SIMD_X86 */
+
 	if (dolerp)
 	{
 		u -= HALF;
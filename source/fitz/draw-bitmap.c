@@ -0,0 +1,651 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+#include "draw-imp.h"
+
+#include <string.h>
+
+/*
+	The bitmap device renders into a 1bpp fz_bitmap by way of an 8 bit
+	gray pixmap the size of the band. Solid black or white fills,
+	strokes, glyphs and image masks are drawn as black by an ordinary
+	draw device into the gray pixmap, which is whitened only as far as
+	marks reach, not all at once. Marks of the same color collect
+	there, and only the area they cover is halftoned into the bitmap
+	(and cleared again) when the color changes or the device is closed.
+	As soon as anything appears that cannot be done that way
+	(shadings, images, groups, soft masks, non-rectangular clips,
+	gray or translucent colors) the bitmap is expanded into the gray
+	pixmap, and everything from there on is drawn as contone and
+	halftoned once at the end, exactly as if the gray pixmap had been
+	drawn and converted with fz_new_bitmap_from_pixmap_band.
+
+	The gray pixmap is needed whole, both as scratch space for marks
+	anywhere in the band and for the contone fallback, so this saves
+	no memory. What it saves, on black and white pages, is clearing
+	and halftoning the parts of the band that nothing is drawn into.
+*/
+
+enum
+{
+	BILEVEL_NOTHING,
+	BILEVEL_BLACK,
+	BILEVEL_WHITE,
+	BILEVEL_CONTONE
+};
+
+typedef struct fz_bitmap_device_s
+{
+	fz_device super;
+
+	fz_device *draw;
+	fz_pixmap *dest;
+	fz_bitmap *bit;
+	fz_halftone *ht;
+	unsigned char *ht_plane;
+	int ht_h;
+	unsigned char *row;
+	int band_start;
+	int contone;
+	/* The marks drawn but not yet halftoned, and their color. */
+	fz_irect pending;
+	int pending_kind;
+	/* The area of the gray pixmap that has been whitened. */
+	fz_irect clean;
+	fz_matrix transform;
+	fz_default_colorspaces *default_cs;
+} fz_bitmap_device;
+
+static fz_device *
+bitmap_draw(fz_context *ctx, fz_bitmap_device *dev)
+{
+	dev->draw->hints = dev->super.hints & ~FZ_MAINTAIN_CONTAINER_STACK;
+	return dev->draw;
+}
+
+static void bitmap_flush(fz_context *ctx, fz_bitmap_device *dev);
+
+/* Expand the bitmap into the gray pixmap, and draw as contone from now on. */
+static void
+bitmap_to_contone(fz_context *ctx, fz_bitmap_device *dev)
+{
+	fz_pixmap *dest = dev->dest;
+	unsigned char *s = dev->bit->samples;
+	unsigned char *d = dest->samples;
+	int x, y, i;
+
+	if (dev->contone)
+		return;
+
+	bitmap_flush(ctx, dev);
+	for (y = 0; y < dest->h; y++)
+	{
+		for (x = 0; x + 8 <= dest->w; x += 8)
+		{
+			int b = s[x>>3];
+			if (b == 0)
+				memset(d + x, 255, 8);
+			else if (b == 0xff)
+				memset(d + x, 0, 8);
+			else
+				for (i = 0; i < 8; i++)
+					d[x+i] = (b & (0x80>>i)) ? 0 : 255;
+		}
+		for (; x < dest->w; x++)
+			d[x] = (s[x>>3] & (0x80>>(x&7))) ? 0 : 255;
+		s += dev->bit->stride;
+		d += dest->stride;
+	}
+	dev->contone = 1;
+}
+
+static int
+bitmap_classify(fz_context *ctx, fz_bitmap_device *dev, fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	float gray;
+	int v;
+
+	if ((int)(alpha * 255) == 0)
+		return BILEVEL_NOTHING;
+	if (alpha < 1)
+		return BILEVEL_CONTONE;
+	if (colorspace == NULL)
+		return BILEVEL_BLACK;
+
+	if (color_params == NULL)
+		color_params = fz_default_color_params(ctx);
+	if (dev->default_cs)
+	{
+		switch (fz_colorspace_type(ctx, colorspace))
+		{
+		case FZ_COLORSPACE_GRAY:
+			if (colorspace == fz_device_gray(ctx))
+				colorspace = fz_default_gray(ctx, dev->default_cs);
+			break;
+		case FZ_COLORSPACE_RGB:
+			if (colorspace == fz_device_rgb(ctx))
+				colorspace = fz_default_rgb(ctx, dev->default_cs);
+			break;
+		case FZ_COLORSPACE_CMYK:
+			if (colorspace == fz_device_cmyk(ctx))
+				colorspace = fz_default_cmyk(ctx, dev->default_cs);
+			break;
+		default:
+			break;
+		}
+	}
+	fz_convert_color(ctx, color_params, NULL, fz_device_gray(ctx), &gray, colorspace, color);
+
+	/* Match the truncation in the draw device's resolve_color. */
+	v = gray * 255;
+	if (v <= 0)
+		return BILEVEL_BLACK;
+	if (v >= 255)
+		return BILEVEL_WHITE;
+	return BILEVEL_CONTONE;
+}
+
+static int
+bitmap_text_is_type3(fz_context *ctx, const fz_text *text)
+{
+	fz_text_span *span;
+
+	for (span = text->head; span; span = span->next)
+		if (fz_font_t3_procs(ctx, span->font))
+			return 1;
+	return 0;
+}
+
+/* Find the (clipped) area of the gray pixmap a mark with the given bounds can touch. */
+static fz_irect
+bitmap_area(fz_context *ctx, fz_bitmap_device *dev, fz_rect rect)
+{
+	float expand = 2 + fz_graphics_min_line_width(ctx);
+	fz_irect area;
+
+	rect = fz_expand_rect(fz_transform_rect(rect, dev->transform), expand);
+	area = fz_irect_from_rect(rect);
+	area = fz_intersect_irect(area, fz_pixmap_bbox(ctx, dev->dest));
+	return fz_intersect_irect(area, fz_draw_device_scissor(ctx, dev->draw));
+}
+
+/* Whiten whatever part of the area (widened to whole bytes of the
+ * bitmap) has not been whitened before. */
+static void
+bitmap_clean(fz_context *ctx, fz_bitmap_device *dev, fz_irect area)
+{
+	fz_pixmap *dest = dev->dest;
+	fz_irect c = dev->clean;
+	fz_irect u;
+
+	area.x0 = dest->x + ((area.x0 - dest->x) & ~7);
+	if (fz_is_empty_irect(c))
+	{
+		fz_clear_pixmap_rect_with_value(ctx, dest, 255, area);
+		dev->clean = area;
+		return;
+	}
+
+	u.x0 = fz_mini(c.x0, area.x0);
+	u.y0 = fz_mini(c.y0, area.y0);
+	u.x1 = fz_maxi(c.x1, area.x1);
+	u.y1 = fz_maxi(c.y1, area.y1);
+
+	/* Above, below, left and right of what is already white. */
+	fz_clear_pixmap_rect_with_value(ctx, dest, 255, fz_make_irect(u.x0, u.y0, u.x1, c.y0));
+	fz_clear_pixmap_rect_with_value(ctx, dest, 255, fz_make_irect(u.x0, c.y1, u.x1, u.y1));
+	fz_clear_pixmap_rect_with_value(ctx, dest, 255, fz_make_irect(u.x0, c.y0, c.x0, c.y1));
+	fz_clear_pixmap_rect_with_value(ctx, dest, 255, fz_make_irect(c.x1, c.y0, u.x1, c.y1));
+	dev->clean = u;
+}
+
+/* Halftone the pending marks into the bitmap, and clear them away. */
+static void
+bitmap_flush(fz_context *ctx, fz_bitmap_device *dev)
+{
+	fz_pixmap *dest = dev->dest;
+	fz_bitmap *bit = dev->bit;
+	fz_irect area = dev->pending;
+	int x0, len, y, py, i;
+
+	if (fz_is_empty_irect(area))
+		return;
+	dev->pending = fz_empty_irect;
+
+	/* Start on a whole byte of the bitmap. The pixels to the left
+	 * are white, and white never changes a bit. */
+	x0 = (area.x0 - dest->x) & ~7;
+	len = area.x1 - dest->x - x0;
+
+	for (y = area.y0; y < area.y1; y++)
+	{
+		unsigned char *s = dest->samples + (y - dest->y) * (size_t)dest->stride + x0;
+		unsigned char *o = bit->samples + (y - dest->y) * (size_t)bit->stride + (x0 >> 3);
+		unsigned char *row = dev->row;
+
+		py = (y + dev->band_start) % dev->ht_h;
+		if (py < 0)
+			py += dev->ht_h;
+
+		if (dev->pending_kind == BILEVEL_BLACK)
+		{
+			fz_threshold_bytes(dev->ht_plane + py * (size_t)((dest->w + 7) & ~7) + x0, s, row, len, 0);
+			for (i = 0; i < (len + 7) >> 3; i++)
+				o[i] |= row[i];
+		}
+		else
+		{
+			/* A white mark drawn with coverage c removes the bits
+			 * that a black pixel of value 255 - c would not set. */
+			for (i = 0; i < len; i++)
+				s[i] = 255 - s[i];
+			fz_threshold_bytes(dev->ht_plane + py * (size_t)((dest->w + 7) & ~7) + x0, s, row, len, 1);
+			for (i = 0; i < (len + 7) >> 3; i++)
+				o[i] &= ~row[i];
+		}
+		memset(s, 255, len);
+	}
+}
+
+/* Get ready to draw a mark of the given color and bounds. Returns 0
+ * if there is nothing to draw. */
+static int
+bitmap_begin(fz_context *ctx, fz_bitmap_device *dev, fz_rect rect, int kind)
+{
+	fz_irect area = bitmap_area(ctx, dev, rect);
+
+	if (fz_is_empty_irect(area))
+		return 0;
+	if (kind != dev->pending_kind)
+		bitmap_flush(ctx, dev);
+	bitmap_clean(ctx, dev, area);
+	dev->pending_kind = kind;
+	if (fz_is_empty_irect(dev->pending))
+		dev->pending = area;
+	else
+	{
+		dev->pending.x0 = fz_mini(dev->pending.x0, area.x0);
+		dev->pending.y0 = fz_mini(dev->pending.y0, area.y0);
+		dev->pending.x1 = fz_maxi(dev->pending.x1, area.x1);
+		dev->pending.y1 = fz_maxi(dev->pending.y1, area.y1);
+	}
+	return 1;
+}
+
+static const float bitmap_black[1] = { 0 };
+
+static void
+fz_bitmap_fill_path(fz_context *ctx, fz_device *devp, const fz_path *path, int even_odd, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	int kind;
+
+	if (!dev->contone)
+	{
+		kind = bitmap_classify(ctx, dev, colorspace, color, alpha, color_params);
+		if (kind == BILEVEL_NOTHING)
+			return;
+		if (kind != BILEVEL_CONTONE)
+		{
+			if (bitmap_begin(ctx, dev, fz_bound_path(ctx, path, NULL, ctm), kind))
+				fz_fill_path(ctx, bitmap_draw(ctx, dev), path, even_odd, ctm, fz_device_gray(ctx), bitmap_black, 1, color_params);
+			return;
+		}
+		bitmap_to_contone(ctx, dev);
+	}
+	fz_fill_path(ctx, bitmap_draw(ctx, dev), path, even_odd, ctm, colorspace, color, alpha, color_params);
+}
+
+static void
+fz_bitmap_stroke_path(fz_context *ctx, fz_device *devp, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	int kind;
+
+	if (!dev->contone)
+	{
+		kind = bitmap_classify(ctx, dev, colorspace, color, alpha, color_params);
+		if (kind == BILEVEL_NOTHING)
+			return;
+		if (kind != BILEVEL_CONTONE)
+		{
+			if (bitmap_begin(ctx, dev, fz_bound_path(ctx, path, stroke, ctm), kind))
+				fz_stroke_path(ctx, bitmap_draw(ctx, dev), path, stroke, ctm, fz_device_gray(ctx), bitmap_black, 1, color_params);
+			return;
+		}
+		bitmap_to_contone(ctx, dev);
+	}
+	fz_stroke_path(ctx, bitmap_draw(ctx, dev), path, stroke, ctm, colorspace, color, alpha, color_params);
+}
+
+static void
+fz_bitmap_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+
+	/* Rectangular clips only narrow the scissor, which bitmap_area honours. */
+	if (!dev->contone && !fz_draw_clip_path_is_rect(ctx, dev->draw, path, ctm, scissor))
+		bitmap_to_contone(ctx, dev);
+	fz_clip_path(ctx, bitmap_draw(ctx, dev), path, even_odd, ctm, scissor);
+}
+
+static void
+fz_bitmap_clip_stroke_path(fz_context *ctx, fz_device *devp, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_clip_stroke_path(ctx, bitmap_draw(ctx, dev), path, stroke, ctm, scissor);
+}
+
+static void
+fz_bitmap_fill_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	int kind;
+
+	if (!dev->contone)
+	{
+		kind = bitmap_classify(ctx, dev, colorspace, color, alpha, color_params);
+		if (kind == BILEVEL_NOTHING)
+			return;
+		if (kind != BILEVEL_CONTONE && !bitmap_text_is_type3(ctx, text))
+		{
+			if (bitmap_begin(ctx, dev, fz_bound_text(ctx, text, NULL, ctm), kind))
+				fz_fill_text(ctx, bitmap_draw(ctx, dev), text, ctm, fz_device_gray(ctx), bitmap_black, 1, color_params);
+			return;
+		}
+		bitmap_to_contone(ctx, dev);
+	}
+	fz_fill_text(ctx, bitmap_draw(ctx, dev), text, ctm, colorspace, color, alpha, color_params);
+}
+
+static void
+fz_bitmap_stroke_text(fz_context *ctx, fz_device *devp, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	int kind;
+
+	if (!dev->contone)
+	{
+		kind = bitmap_classify(ctx, dev, colorspace, color, alpha, color_params);
+		if (kind == BILEVEL_NOTHING)
+			return;
+		if (kind != BILEVEL_CONTONE && !bitmap_text_is_type3(ctx, text))
+		{
+			if (bitmap_begin(ctx, dev, fz_bound_text(ctx, text, stroke, ctm), kind))
+				fz_stroke_text(ctx, bitmap_draw(ctx, dev), text, stroke, ctm, fz_device_gray(ctx), bitmap_black, 1, color_params);
+			return;
+		}
+		bitmap_to_contone(ctx, dev);
+	}
+	fz_stroke_text(ctx, bitmap_draw(ctx, dev), text, stroke, ctm, colorspace, color, alpha, color_params);
+}
+
+static void
+fz_bitmap_clip_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_clip_text(ctx, bitmap_draw(ctx, dev), text, ctm, scissor);
+}
+
+static void
+fz_bitmap_clip_stroke_text(fz_context *ctx, fz_device *devp, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_clip_stroke_text(ctx, bitmap_draw(ctx, dev), text, stroke, ctm, scissor);
+}
+
+static void
+fz_bitmap_ignore_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matrix ctm)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_ignore_text(ctx, bitmap_draw(ctx, dev), text, ctm);
+}
+
+static void
+fz_bitmap_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, fz_matrix ctm, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_fill_shade(ctx, bitmap_draw(ctx, dev), shade, ctm, alpha, color_params);
+}
+
+static void
+fz_bitmap_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix ctm, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_fill_image(ctx, bitmap_draw(ctx, dev), image, ctm, alpha, color_params);
+}
+
+static void
+fz_bitmap_fill_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	int kind;
+
+	if (!dev->contone)
+	{
+		kind = bitmap_classify(ctx, dev, colorspace, color, alpha, color_params);
+		if (kind == BILEVEL_NOTHING)
+			return;
+		if (kind != BILEVEL_CONTONE)
+		{
+			if (bitmap_begin(ctx, dev, fz_transform_rect(fz_unit_rect, ctm), kind))
+				fz_fill_image_mask(ctx, bitmap_draw(ctx, dev), image, ctm, fz_device_gray(ctx), bitmap_black, 1, color_params);
+			return;
+		}
+		bitmap_to_contone(ctx, dev);
+	}
+	fz_fill_image_mask(ctx, bitmap_draw(ctx, dev), image, ctm, colorspace, color, alpha, color_params);
+}
+
+static void
+fz_bitmap_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_clip_image_mask(ctx, bitmap_draw(ctx, dev), image, ctm, scissor);
+}
+
+static void
+fz_bitmap_pop_clip(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_pop_clip(ctx, bitmap_draw(ctx, dev));
+}
+
+static void
+fz_bitmap_begin_mask(fz_context *ctx, fz_device *devp, fz_rect area, int luminosity, fz_colorspace *colorspace, const float *bc, const fz_color_params *color_params)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_begin_mask(ctx, bitmap_draw(ctx, dev), area, luminosity, colorspace, bc, color_params);
+}
+
+static void
+fz_bitmap_end_mask(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_end_mask(ctx, bitmap_draw(ctx, dev));
+}
+
+static void
+fz_bitmap_begin_group(fz_context *ctx, fz_device *devp, fz_rect area, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	fz_begin_group(ctx, bitmap_draw(ctx, dev), area, cs, isolated, knockout, blendmode, alpha);
+}
+
+static void
+fz_bitmap_end_group(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_end_group(ctx, bitmap_draw(ctx, dev));
+}
+
+static int
+fz_bitmap_begin_tile(fz_context *ctx, fz_device *devp, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	bitmap_to_contone(ctx, dev);
+	return fz_begin_tile_id(ctx, bitmap_draw(ctx, dev), area, view, xstep, ystep, ctm, id);
+}
+
+static void
+fz_bitmap_end_tile(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_end_tile(ctx, bitmap_draw(ctx, dev));
+}
+
+static void
+fz_bitmap_render_flags(fz_context *ctx, fz_device *devp, int set, int clear)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_render_flags(ctx, bitmap_draw(ctx, dev), set, clear);
+}
+
+static void
+fz_bitmap_set_default_colorspaces(fz_context *ctx, fz_device *devp, fz_default_colorspaces *default_cs)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_drop_default_colorspaces(ctx, dev->default_cs);
+	dev->default_cs = fz_keep_default_colorspaces(ctx, default_cs);
+	fz_set_default_colorspaces(ctx, bitmap_draw(ctx, dev), default_cs);
+}
+
+static void
+fz_bitmap_begin_layer(fz_context *ctx, fz_device *devp, const char *layer_name)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_begin_layer(ctx, bitmap_draw(ctx, dev), layer_name);
+}
+
+static void
+fz_bitmap_end_layer(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_end_layer(ctx, bitmap_draw(ctx, dev));
+}
+
+static void
+fz_bitmap_close_device(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+
+	fz_close_device(ctx, dev->draw);
+	if (dev->contone)
+		fz_fill_bitmap_from_pixmap_band(ctx, dev->bit, dev->dest, dev->ht, dev->band_start, 0, dev->dest->h);
+	else
+		bitmap_flush(ctx, dev);
+}
+
+static void
+fz_bitmap_drop_device(fz_context *ctx, fz_device *devp)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)devp;
+	fz_drop_device(ctx, dev->draw);
+	if (dev->ht_plane)
+		fz_release_halftone_plane(ctx, dev->ht, dev->ht_plane);
+	fz_drop_halftone(ctx, dev->ht);
+	fz_free(ctx, dev->row);
+	fz_drop_default_colorspaces(ctx, dev->default_cs);
+}
+
+/*
+	Create a device to draw directly into a 1 bit per pixel bitmap,
+	halftoned with the default halftone, as if drawn onto dest and
+	converted with fz_new_bitmap_from_pixmap_band.
+
+	dest: A gray pixmap without alpha, used as scratch space (and,
+	for pages with continuous tone content, to render the band
+	into). It must be as large as the band, but need not be
+	cleared. Its contents are undefined afterwards.
+
+	bit: A 1 component bitmap of the same size as dest, that is
+	cleared (to white) by this call, and holds the result once the
+	device has been closed.
+
+	band_start: Offset of dest within the page, for the phase of
+	the halftone screen.
+
+	transform: Transform from user space in points to device space in pixels.
+*/
+fz_device *
+fz_new_draw_device_with_bitmap(fz_context *ctx, fz_matrix transform, fz_pixmap *dest, fz_bitmap *bit, int band_start)
+{
+	fz_bitmap_device *dev;
+
+	if (dest->n != 1 || dest->alpha || fz_colorspace_type(ctx, dest->colorspace) != FZ_COLORSPACE_GRAY)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bitmap drawing requires a gray pixmap without alpha");
+	if (bit->n != 1 || bit->w != dest->w || bit->h != dest->h)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bitmap does not match pixmap");
+
+	dev = fz_new_derived_device(ctx, fz_bitmap_device);
+
+	dev->super.close_device = fz_bitmap_close_device;
+	dev->super.drop_device = fz_bitmap_drop_device;
+
+	dev->super.fill_path = fz_bitmap_fill_path;
+	dev->super.stroke_path = fz_bitmap_stroke_path;
+	dev->super.clip_path = fz_bitmap_clip_path;
+	dev->super.clip_stroke_path = fz_bitmap_clip_stroke_path;
+
+	dev->super.fill_text = fz_bitmap_fill_text;
+	dev->super.stroke_text = fz_bitmap_stroke_text;
+	dev->super.clip_text = fz_bitmap_clip_text;
+	dev->super.clip_stroke_text = fz_bitmap_clip_stroke_text;
+	dev->super.ignore_text = fz_bitmap_ignore_text;
+
+	dev->super.fill_shade = fz_bitmap_fill_shade;
+	dev->super.fill_image = fz_bitmap_fill_image;
+	dev->super.fill_image_mask = fz_bitmap_fill_image_mask;
+	dev->super.clip_image_mask = fz_bitmap_clip_image_mask;
+
+	dev->super.pop_clip = fz_bitmap_pop_clip;
+
+	dev->super.begin_mask = fz_bitmap_begin_mask;
+	dev->super.end_mask = fz_bitmap_end_mask;
+	dev->super.begin_group = fz_bitmap_begin_group;
+	dev->super.end_group = fz_bitmap_end_group;
+
+	dev->super.begin_tile = fz_bitmap_begin_tile;
+	dev->super.end_tile = fz_bitmap_end_tile;
+
+	dev->super.render_flags = fz_bitmap_render_flags;
+	dev->super.set_default_colorspaces = fz_bitmap_set_default_colorspaces;
+
+	dev->super.begin_layer = fz_bitmap_begin_layer;
+	dev->super.end_layer = fz_bitmap_end_layer;
+
+	dev->dest = dest;
+	dev->bit = bit;
+	dev->band_start = band_start;
+	dev->transform = transform;
+	dev->pending = fz_empty_irect;
+	dev->clean = fz_empty_irect;
+
+	fz_try(ctx)
+	{
+		dev->ht = fz_default_halftone(ctx, 1);
+		dev->ht_plane = fz_get_halftone_plane(ctx, dev->ht, dest->x, dest->w, &dev->ht_h);
+		dev->row = fz_malloc(ctx, (dest->w + 7) >> 3);
+		dev->draw = fz_new_draw_device(ctx, transform, dest);
+		fz_clear_bitmap(ctx, bit);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_device(ctx, &dev->super);
+		fz_rethrow(ctx);
+	}
+
+	return &dev->super;
+}
@@ -1,10 +1,15 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "fitz-imp.h"
 
 #include <string.h>
 #include <math.h>
 #include <assert.h>
 
+#if FZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
 /* PDF 1.4 blend modes. These are slow. */
 
 /* Define PARANOID_PREMULTIPLY to check premultiplied values are
@@ -327,7 +332,7 @@ fz_blend_separable(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp,
 			{
 				memcpy(bp, sp, n1 + (sal && bal));
 				if (bal && !sal)
-					bp[n1+1] = 255;
+					bp[n1] = 255;
 			}
 			else
 			{
@@ -426,7 +431,7 @@ fz_blend_nonseparable_gray(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTR
 			{
 				memcpy(bp, sp, n + (sal && bal));
 				if (bal && !sal)
-					bp [n + 1] = 255;
+					bp[n] = 255;
 			}
 			else
 			{
@@ -445,10 +450,10 @@ fz_blend_nonseparable_gray(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTR
 				case FZ_BLEND_HUE:
 				case FZ_BLEND_SATURATION:
 				case FZ_BLEND_COLOR:
-					bp[0] = fz_mul255(bp[n], bg);
+					bp[0] = fz_mul255(ba, bg);
 					break;
 				case FZ_BLEND_LUMINOSITY:
-					bp[0] = fz_mul255(bp[n], sg);
+					bp[0] = fz_mul255(ba, sg);
 					break;
 				}
 
@@ -483,7 +488,7 @@ fz_blend_nonseparable(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT s
 			{
 				memcpy(bp, sp, n + (sal && bal));
 				if (bal && !sal)
-					bp [n + 1] = 255;
+					bp[n] = 255;
 			}
 			else
 			{
@@ -549,10 +554,10 @@ fz_blend_nonseparable(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT s
 					case FZ_BLEND_HUE:
 					case FZ_BLEND_SATURATION:
 					case FZ_BLEND_COLOR:
-						bp[3] = fz_mul255(bp[n], bk);
+						bp[3] = fz_mul255(ba, bk);
 						break;
 					case FZ_BLEND_LUMINOSITY:
-						bp[3] = fz_mul255(bp[n], sk);
+						bp[3] = fz_mul255(ba, sk);
 						break;
 					}
 				}
@@ -789,7 +794,7 @@ fz_blend_nonseparable_nonisolated_gray(byte * FZ_RESTRICT bp, int bal, const byt
 			{
 				memcpy(bp, sp, n + (sal && bal));
 				if (bal && !sal)
-					bp[n+1] = 255;
+					bp[n] = 255;
 			}
 			else
 			{
@@ -1039,6 +1044,211 @@ fz_blend_nonseparable_nonisolated(byte * FZ_RESTRICT bp, int bal, const byte * F
 	while (--w);
 }
 
+#if FZ_SIMD_X86
+
+/*
+	AVX2 versions of the commonest separable blends: rgba over rgba,
+	8 pixels at a time with one pixel in each 32 bit lane. They follow
+	the C code above step for step and give bit identical results.
+	Color dodge, color burn and soft light are left to the C code.
+*/
+
+static int
+blendmode_has_simd(int blendmode)
+{
+	switch (blendmode)
+	{
+	case FZ_BLEND_NORMAL:
+	case FZ_BLEND_MULTIPLY:
+	case FZ_BLEND_SCREEN:
+	case FZ_BLEND_OVERLAY:
+	case FZ_BLEND_DARKEN:
+	case FZ_BLEND_LIGHTEN:
+	case FZ_BLEND_HARD_LIGHT:
+	case FZ_BLEND_DIFFERENCE:
+	case FZ_BLEND_EXCLUSION:
+		return 1;
+	}
+	return 0;
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+mul255_avx2(__m256i a, __m256i b)
+{
+	__m256i x = _mm256_add_epi32(_mm256_mullo_epi32(a, b), _mm256_set1_epi32(128));
+	x = _mm256_add_epi32(x, _mm256_srai_epi32(x, 8));
+	return _mm256_srai_epi32(x, 8);
+}
+
+/* Integer division for 0 <= a < 1<<24 and b > 0. The float quotient is
+ * always closer to the true one than to the next integer, so truncating
+ * it gives the same answer as the integer division. */
+FZ_TARGET_AVX2 static inline __m256i
+div_avx2(__m256i a, __m256i b)
+{
+	return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(b)));
+}
+
+/* 255 * 256 / a, or 0 where a is 0. */
+FZ_TARGET_AVX2 static inline __m256i
+inv255_avx2(__m256i a)
+{
+	__m256i q = div_avx2(_mm256_set1_epi32(255 * 256), _mm256_max_epi32(a, _mm256_set1_epi32(1)));
+	return _mm256_andnot_si256(_mm256_cmpeq_epi32(a, _mm256_setzero_si256()), q);
+}
+
+/* Byte k of each pixel. */
+FZ_TARGET_AVX2 static inline __m256i
+channel_avx2(__m256i v, int k)
+{
+	return _mm256_and_si256(_mm256_srli_epi32(v, 8 * k), _mm256_set1_epi32(255));
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+screen_avx2(__m256i b, __m256i s)
+{
+	return _mm256_sub_epi32(_mm256_add_epi32(b, s), mul255_avx2(b, s));
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+hard_light_avx2(__m256i b, __m256i s)
+{
+	__m256i s2 = _mm256_slli_epi32(s, 1);
+	__m256i lo = mul255_avx2(b, s2);
+	__m256i hi = screen_avx2(b, _mm256_sub_epi32(s2, _mm256_set1_epi32(255)));
+	return _mm256_blendv_epi8(lo, hi, _mm256_cmpgt_epi32(s, _mm256_set1_epi32(127)));
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+blend_avx2(int blendmode, __m256i b, __m256i s)
+{
+	switch (blendmode)
+	{
+	default:
+	case FZ_BLEND_NORMAL: return s;
+	case FZ_BLEND_MULTIPLY: return mul255_avx2(b, s);
+	case FZ_BLEND_SCREEN: return screen_avx2(b, s);
+	case FZ_BLEND_OVERLAY: return hard_light_avx2(s, b);
+	case FZ_BLEND_DARKEN: return _mm256_min_epi32(b, s);
+	case FZ_BLEND_LIGHTEN: return _mm256_max_epi32(b, s);
+	case FZ_BLEND_HARD_LIGHT: return hard_light_avx2(b, s);
+	case FZ_BLEND_DIFFERENCE: return _mm256_abs_epi32(_mm256_sub_epi32(b, s));
+	case FZ_BLEND_EXCLUSION: return _mm256_sub_epi32(_mm256_add_epi32(b, s), _mm256_slli_epi32(mul255_avx2(b, s), 1));
+	}
+}
+
+FZ_TARGET_AVX2 static void
+fz_blend_separable_rgba_avx2(byte * FZ_RESTRICT bp, const byte * FZ_RESTRICT sp, int w, int blendmode)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i k255 = _mm256_set1_epi32(255);
+	int k;
+
+	for (; w >= 8; w -= 8, sp += 32, bp += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i b = _mm256_loadu_si256((const __m256i *)bp);
+		__m256i sa = _mm256_srli_epi32(s, 24);
+		__m256i ba = _mm256_srli_epi32(b, 24);
+		__m256i saba, invsa, invba, r;
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, zero)) == -1)
+			continue;
+
+		saba = mul255_avx2(sa, ba);
+		invsa = inv255_avx2(sa);
+		invba = inv255_avx2(ba);
+		r = _mm256_slli_epi32(_mm256_sub_epi32(_mm256_add_epi32(ba, sa), saba), 24);
+		for (k = 0; k < 3; k++)
+		{
+			__m256i s0 = channel_avx2(s, k);
+			__m256i b0 = channel_avx2(b, k);
+			__m256i sc = _mm256_srli_epi32(_mm256_mullo_epi32(s0, invsa), 8);
+			__m256i bc = _mm256_srli_epi32(_mm256_mullo_epi32(b0, invba), 8);
+			__m256i rc = blend_avx2(blendmode, bc, sc);
+
+			rc = _mm256_add_epi32(_mm256_add_epi32(
+				mul255_avx2(_mm256_sub_epi32(k255, sa), b0),
+				mul255_avx2(_mm256_sub_epi32(k255, ba), s0)),
+				mul255_avx2(saba, rc));
+			r = _mm256_or_si256(r, _mm256_slli_epi32(_mm256_and_si256(rc, k255), 8 * k));
+		}
+
+		/* Where ba == 0 the source is copied, where sa == 0 nothing changes. */
+		r = _mm256_blendv_epi8(r, s, _mm256_cmpeq_epi32(ba, zero));
+		r = _mm256_blendv_epi8(r, b, _mm256_cmpeq_epi32(sa, zero));
+		_mm256_storeu_si256((__m256i *)bp, r);
+	}
+	if (w)
+		fz_blend_separable(bp, 1, sp, 1, 3, w, blendmode, 0, 3);
+}
+
+FZ_TARGET_AVX2 static void
+fz_blend_separable_nonisolated_rgba_avx2(byte * FZ_RESTRICT bp, const byte * FZ_RESTRICT sp, int w, int blendmode, const byte * FZ_RESTRICT hp, int alpha)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i k255 = _mm256_set1_epi32(255);
+	__m256i valpha = _mm256_set1_epi32(alpha);
+	int k;
+
+	for (; w >= 8; w -= 8, sp += 32, bp += 32, hp += 8)
+	{
+		__m256i ha = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)hp));
+		__m256i haa = mul255_avx2(ha, valpha);
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i b = _mm256_loadu_si256((const __m256i *)bp);
+		__m256i sa = _mm256_srli_epi32(s, 24);
+		__m256i ba = _mm256_srli_epi32(b, 24);
+		__m256i unchanged = _mm256_or_si256(_mm256_cmpeq_epi32(haa, zero), _mm256_cmpeq_epi32(sa, zero));
+		__m256i invsa, invba, scale, bahaa, ra0, ra, t, r, c;
+
+		if (_mm256_movemask_epi8(unchanged) == -1)
+			continue;
+
+		invsa = inv255_avx2(sa);
+		invba = inv255_avx2(ba);
+		scale = div_avx2(
+			_mm256_add_epi32(_mm256_slli_epi32(ba, 9), ha),
+			_mm256_max_epi32(_mm256_slli_epi32(ha, 1), _mm256_set1_epi32(1)));
+		scale = _mm256_sub_epi32(scale, _mm256_add_epi32(ba, _mm256_srli_epi32(ba, 7)));
+		bahaa = mul255_avx2(ba, haa);
+		ra0 = _mm256_sub_epi32(ba, bahaa);
+		ra = _mm256_add_epi32(ra0, haa);
+		t = mul255_avx2(_mm256_sub_epi32(k255, ba), haa);
+
+		r = _mm256_slli_epi32(ra, 24);
+		c = _mm256_slli_epi32(haa, 24);
+		for (k = 0; k < 3; k++)
+		{
+			__m256i s0 = _mm256_srli_epi32(_mm256_mullo_epi32(channel_avx2(s, k), invsa), 8);
+			__m256i bc = _mm256_srli_epi32(_mm256_mullo_epi32(channel_avx2(b, k), invba), 8);
+			__m256i sc, rc;
+
+			/* The copy used where ba == 0. */
+			c = _mm256_or_si256(c, _mm256_slli_epi32(_mm256_and_si256(mul255_avx2(s0, haa), k255), 8 * k));
+
+			/* Uncomposite */
+			sc = _mm256_add_epi32(s0, _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(s0, bc), scale), 8));
+			sc = _mm256_min_epi32(_mm256_max_epi32(sc, zero), k255);
+
+			rc = blend_avx2(blendmode, bc, sc);
+			rc = _mm256_blendv_epi8(mul255_avx2(bahaa, rc), rc, _mm256_cmpeq_epi32(bahaa, k255));
+			rc = _mm256_add_epi32(rc, mul255_avx2(t, sc));
+			rc = _mm256_add_epi32(rc, mul255_avx2(ra0, bc));
+			rc = _mm256_min_epi32(_mm256_max_epi32(rc, zero), ra);
+			r = _mm256_or_si256(r, _mm256_slli_epi32(_mm256_and_si256(rc, k255), 8 * k));
+		}
+
+		r = _mm256_blendv_epi8(r, c, _mm256_cmpeq_epi32(ba, zero));
+		r = _mm256_blendv_epi8(r, b, unchanged);
+		_mm256_storeu_si256((__m256i *)bp, r);
+	}
+	if (w)
+		fz_blend_separable_nonisolated(bp, 1, sp, 1, 3, w, blendmode, 0, hp, alpha, 3);
+}
+
+#endif /* FZ_SIMD_X86 */
+
 #ifdef PARANOID_PREMULTIPLY
 static void
 verify_premultiply(fz_context *ctx, const fz_pixmap * FZ_RESTRICT dst)
@@ -1074,6 +1284,9 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 	int x, y, w, h, n;
 	int da, sa;
 	int complement;
+#if FZ_SIMD_X86
+	int simd;
+#endif
 
 	/* TODO: fix this hack! */
 	if (isolated && alpha < 255)
@@ -1122,12 +1335,26 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 	n -= sa;
 	assert(n == dst->n - da);
 
+	/* A group drawn into a soft mask has no colour components for a
+	 * non-separable blend mode to work on; only its alpha matters. */
+	if (n == 0 && blendmode >= FZ_BLEND_HUE)
+		blendmode = FZ_BLEND_NORMAL;
+
+#if FZ_SIMD_X86
+	simd = (n == 3 && da && sa && !complement && blendmode_has_simd(blendmode) && (fz_cpu_features() & FZ_CPU_AVX2));
+#endif /* FZ_SIMD_X86 */
+
 	if (!isolated)
 	{
 		const unsigned char *hp = shape->samples + (unsigned int)((y - shape->y) * shape->stride + (x - shape->x));
 
 		while (h--)
 		{
+#if FZ_SIMD_X86
+			if (simd)
+				fz_blend_separable_nonisolated_rgba_avx2(dp, sp, w, blendmode, hp, alpha);
+			else
+#endif /* FZ_SIMD_X86 */
 			if (blendmode >= FZ_BLEND_HUE)
 			{
 				if (complement || src->s > 0)
@@ -1184,6 +1411,11 @@ fz_blend_pixmap(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RES
 	{
 		while (h--)
 		{
+#if FZ_SIMD_X86
+			if (simd)
+				fz_blend_separable_rgba_avx2(dp, sp, w, blendmode);
+			else
+#endif /* FZ_SIMD_X86 */
 			if (blendmode >= FZ_BLEND_HUE)
 			{
 				if (complement || src->s > 0)
@@ -1288,6 +1520,50 @@ fz_blend_knockout(byte * FZ_RESTRICT bp, int bal, const byte * FZ_RESTRICT sp, i
 	while (--w);
 }
 
+#if FZ_SIMD_X86
+FZ_TARGET_AVX2 static void
+fz_blend_knockout_rgba_avx2(byte * FZ_RESTRICT bp, const byte * FZ_RESTRICT sp, int w, const byte * FZ_RESTRICT hp)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i k255 = _mm256_set1_epi32(255);
+	int k;
+
+	for (; w >= 8; w -= 8, sp += 32, bp += 32, hp += 8)
+	{
+		__m256i ha = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)hp));
+		__m256i s, b, sa, ba, hasa, invsa, invba, ra, r, copy;
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(ha, zero)) == -1)
+			continue;
+
+		s = _mm256_loadu_si256((const __m256i *)sp);
+		b = _mm256_loadu_si256((const __m256i *)bp);
+		sa = _mm256_srli_epi32(s, 24);
+		ba = _mm256_srli_epi32(b, 24);
+		hasa = mul255_avx2(ha, sa);
+		invsa = inv255_avx2(sa);
+		invba = inv255_avx2(ba);
+		ra = _mm256_add_epi32(hasa, mul255_avx2(_mm256_sub_epi32(k255, ha), ba));
+
+		r = _mm256_slli_epi32(ra, 24);
+		for (k = 0; k < 3; k++)
+		{
+			__m256i sc = _mm256_srli_epi32(_mm256_mullo_epi32(channel_avx2(s, k), invsa), 8);
+			__m256i bc = _mm256_srli_epi32(_mm256_mullo_epi32(channel_avx2(b, k), invba), 8);
+			__m256i rc = _mm256_add_epi32(mul255_avx2(_mm256_sub_epi32(k255, ha), bc), mul255_avx2(ha, sc));
+			r = _mm256_or_si256(r, _mm256_slli_epi32(_mm256_and_si256(mul255_avx2(ra, rc), k255), 8 * k));
+		}
+
+		copy = _mm256_and_si256(_mm256_cmpeq_epi32(ba, zero), _mm256_cmpeq_epi32(ha, k255));
+		r = _mm256_blendv_epi8(r, s, copy);
+		r = _mm256_blendv_epi8(r, b, _mm256_cmpeq_epi32(ha, zero));
+		_mm256_storeu_si256((__m256i *)bp, r);
+	}
+	if (w)
+		fz_blend_knockout(bp, 1, sp, 1, 3, w, hp);
+}
+#endif /* FZ_SIMD_X86 */
+
 void
 fz_blend_pixmap_knockout(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap * FZ_RESTRICT src, const fz_pixmap * FZ_RESTRICT shape)
 {
@@ -1297,6 +1573,9 @@ fz_blend_pixmap_knockout(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap
 	int x, y, w, h, n;
 	int da, sa;
 	const unsigned char *hp;
+#if FZ_SIMD_X86
+	int simd;
+#endif
 
 	dbox = fz_pixmap_bbox_no_ctx(dst);
 	sbox = fz_pixmap_bbox_no_ctx(src);
@@ -1327,8 +1606,17 @@ fz_blend_pixmap_knockout(fz_context *ctx, fz_pixmap * FZ_RESTRICT dst, fz_pixmap
 	n -= sa;
 	assert(n == dst->n - da);
 
+#if FZ_SIMD_X86
+	simd = (n == 3 && da && sa && (fz_cpu_features() & FZ_CPU_AVX2));
+#endif /* FZ_SIMD_X86 */
+
 	while (h--)
 	{
+#if FZ_SIMD_X86
+		if (simd)
+			fz_blend_knockout_rgba_avx2(dp, sp, w, hp);
+		else
+#endif /* FZ_SIMD_X86 */
 		fz_blend_knockout(dp, da, sp, sa, n, w, hp);
 		sp += src->stride;
 		dp += dst->stride;
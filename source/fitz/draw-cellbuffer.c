@@ -0,0 +1,500 @@
+#include "mupdf/fitz.h"
+#include "draw-imp.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Cell buffer -- analytic coverage scan conversion.
+ *
+ * Rather than sampling the path on a grid of sub-pixels, we walk each
+ * edge through the pixel grid, and for every pixel ('cell') it passes
+ * through we record two values:
+ *
+ *	cover: the signed height of the edge within the cell.
+ *	area: cover multiplied by the mean x offset of the edge within
+ *		the cell.
+ *
+ * An edge contributes (cover - area) to the winding of the pixel it
+ * is in, and cover to the winding of every pixel to the right of that
+ * on the same scanline. So once we have sorted the cells for a scanline
+ * by x, a single sweep gives us the exact area coverage of every pixel;
+ * between cells the coverage is constant, and we fill runs.
+ *
+ * Only the cells that edges actually pass through are stored, so the
+ * memory needed is proportional to the length of the path rather than
+ * its area. This is the same technique as used by font rasterizers
+ * such as FreeType's.
+ */
+
+typedef struct
+{
+	int x, y;
+	float cover;
+	float area;
+} fz_cell;
+
+typedef struct fz_cellbuffer_s
+{
+	fz_rasterizer super;
+	int len, cap;
+	fz_cell *cells;
+	int sorted_cap;
+	fz_cell *sorted;
+	int index_cap;
+	int *index;
+	int alphas_cap;
+	unsigned char *alphas;
+} fz_cellbuffer;
+
+static void
+fz_drop_cellbuffer(fz_context *ctx, fz_rasterizer *r)
+{
+	fz_cellbuffer *cb = (fz_cellbuffer *)r;
+
+	if (cb)
+	{
+		fz_free(ctx, cb->cells);
+		fz_free(ctx, cb->sorted);
+		fz_free(ctx, cb->index);
+		fz_free(ctx, cb->alphas);
+	}
+	fz_free(ctx, cb);
+}
+
+static int
+fz_reset_cellbuffer(fz_context *ctx, fz_rasterizer *r)
+{
+	fz_cellbuffer *cb = (fz_cellbuffer *)r;
+
+	cb->len = 0;
+
+	return 0;
+}
+
+static void
+add_cell(fz_context *ctx, fz_cellbuffer *cb, int x, int y, float cover, float area)
+{
+	fz_cell *cell;
+
+	if (cover == 0)
+		return;
+
+	/* Consecutive contributions are very often to the same cell. */
+	if (cb->len > 0)
+	{
+		cell = &cb->cells[cb->len-1];
+		if (cell->x == x && cell->y == y)
+		{
+			cell->cover += cover;
+			cell->area += area;
+			return;
+		}
+	}
+
+	if (cb->len == cb->cap)
+	{
+		int new_cap = cb->cap * 2;
+		cb->cells = fz_resize_array(ctx, cb->cells, new_cap, sizeof(fz_cell));
+		cb->cap = new_cap;
+	}
+
+	cell = &cb->cells[cb->len++];
+	cell->x = x;
+	cell->y = y;
+	cell->cover = cover;
+	cell->area = area;
+}
+
+/* Add the part of an edge that lies within scanline y, from (xa,ya)
+ * to (xb,yb), ya <= yb, with winding direction dir. */
+static void
+add_scanline(fz_context *ctx, fz_cellbuffer *cb, int y, float xa, float ya, float xb, float yb, float dir)
+{
+	int ixa = (int)floorf(xa);
+	int ixb = (int)floorf(xb);
+	float x, yy, nx, ny, dy, slope;
+	int ix;
+
+	if (ixa == ixb)
+	{
+		dy = (yb - ya) * dir;
+		add_cell(ctx, cb, ixa, y, dy, dy * ((xa + xb) * 0.5f - ixa));
+		return;
+	}
+
+	slope = (yb - ya) / (xb - xa);
+	x = xa;
+	yy = ya;
+	if (xb > xa)
+	{
+		for (ix = ixa; ix < ixb; ix++)
+		{
+			nx = ix + 1;
+			ny = ya + (nx - xa) * slope;
+			dy = (ny - yy) * dir;
+			add_cell(ctx, cb, ix, y, dy, dy * ((x + nx) * 0.5f - ix));
+			x = nx;
+			yy = ny;
+		}
+	}
+	else
+	{
+		for (ix = ixa; ix > ixb; ix--)
+		{
+			nx = ix;
+			ny = ya + (nx - xa) * slope;
+			dy = (ny - yy) * dir;
+			add_cell(ctx, cb, ix, y, dy, dy * ((x + nx) * 0.5f - ix));
+			x = nx;
+			yy = ny;
+		}
+	}
+	dy = (yb - yy) * dir;
+	add_cell(ctx, cb, ixb, y, dy, dy * ((x + xb) * 0.5f - ixb));
+}
+
+/* Add an edge that lies entirely within the clip rectangle. */
+static void
+add_edge(fz_context *ctx, fz_cellbuffer *cb, float x0, float y0, float x1, float y1)
+{
+	float dir, tmp, slope, xa, ya, xb, yb;
+	int y, iy0, iy1;
+
+	if (y0 == y1)
+		return;
+
+	if (y0 > y1)
+	{
+		dir = -1;
+		tmp = x0; x0 = x1; x1 = tmp;
+		tmp = y0; y0 = y1; y1 = tmp;
+	}
+	else
+		dir = 1;
+
+	if (floorf(fz_min(x0, x1)) < cb->super.bbox.x0) cb->super.bbox.x0 = (int)floorf(fz_min(x0, x1));
+	if (ceilf(fz_max(x0, x1)) > cb->super.bbox.x1) cb->super.bbox.x1 = (int)ceilf(fz_max(x0, x1));
+	if (floorf(y0) < cb->super.bbox.y0) cb->super.bbox.y0 = (int)floorf(y0);
+	if (ceilf(y1) > cb->super.bbox.y1) cb->super.bbox.y1 = (int)ceilf(y1);
+
+	slope = (x1 - x0) / (y1 - y0);
+	iy0 = (int)floorf(y0);
+	iy1 = (int)ceilf(y1);
+	xa = x0;
+	ya = y0;
+	for (y = iy0; y < iy1; y++)
+	{
+		if (y + 1 < y1)
+		{
+			yb = y + 1;
+			xb = x0 + (yb - y0) * slope;
+		}
+		else
+		{
+			yb = y1;
+			xb = x1;
+		}
+		add_scanline(ctx, cb, y, xa, ya - y, xb, yb - y, dir);
+		xa = xb;
+		ya = yb;
+	}
+}
+
+static void
+fz_insert_cellbuffer(fz_context *ctx, fz_rasterizer *ras, float x0, float y0, float x1, float y1, int rev)
+{
+	fz_cellbuffer *cb = (fz_cellbuffer *)ras;
+	float cx0 = ras->clip.x0;
+	float cy0 = ras->clip.y0;
+	float cx1 = ras->clip.x1;
+	float cy1 = ras->clip.y1;
+	float v;
+
+	x0 = fz_clamp(x0, BBOX_MIN, BBOX_MAX);
+	y0 = fz_clamp(y0, BBOX_MIN, BBOX_MAX);
+	x1 = fz_clamp(x1, BBOX_MIN, BBOX_MAX);
+	y1 = fz_clamp(y1, BBOX_MIN, BBOX_MAX);
+
+	if (y0 == y1)
+		return;
+
+	/* Clip to the top and bottom of the clip rectangle. */
+	if ((y0 <= cy0 && y1 <= cy0) || (y0 >= cy1 && y1 >= cy1))
+		return;
+	if (y0 < cy0)
+	{
+		x0 += (x1 - x0) * (cy0 - y0) / (y1 - y0);
+		y0 = cy0;
+	}
+	else if (y1 < cy0)
+	{
+		x1 += (x0 - x1) * (cy0 - y1) / (y0 - y1);
+		y1 = cy0;
+	}
+	if (y0 > cy1)
+	{
+		x0 += (x1 - x0) * (cy1 - y0) / (y1 - y0);
+		y0 = cy1;
+	}
+	else if (y1 > cy1)
+	{
+		x1 += (x0 - x1) * (cy1 - y1) / (y0 - y1);
+		y1 = cy1;
+	}
+
+	/* Edges to the right of the clip rectangle have no effect on the
+	 * pixels within it, so we can drop them. */
+	if (x0 >= cx1 && x1 >= cx1)
+		return;
+	if (x0 > cx1)
+	{
+		y0 += (y1 - y0) * (cx1 - x0) / (x1 - x0);
+		x0 = cx1;
+	}
+	else if (x1 > cx1)
+	{
+		y1 += (y0 - y1) * (cx1 - x1) / (x0 - x1);
+		x1 = cx1;
+	}
+
+	/* Edges to the left of it still change the winding of every pixel
+	 * within it, so we move them onto the left hand side. */
+	if (x0 <= cx0 && x1 <= cx0)
+	{
+		x0 = x1 = cx0;
+	}
+	else if (x0 < cx0)
+	{
+		v = y0 + (y1 - y0) * (cx0 - x0) / (x1 - x0);
+		add_edge(ctx, cb, cx0, y0, cx0, v);
+		x0 = cx0;
+		y0 = v;
+	}
+	else if (x1 < cx0)
+	{
+		v = y1 + (y0 - y1) * (cx0 - x1) / (x0 - x1);
+		add_edge(ctx, cb, cx0, v, cx0, y1);
+		x1 = cx0;
+		y1 = v;
+	}
+
+	add_edge(ctx, cb, x0, y0, x1, y1);
+}
+
+static int
+cmpcell(const void *a, const void *b)
+{
+	return ((const fz_cell *)a)->x - ((const fz_cell *)b)->x;
+}
+
+static void
+sort_cells(fz_cell *cells, int n)
+{
+	int i, j;
+	fz_cell t;
+
+	if (n > 16)
+	{
+		qsort(cells, n, sizeof(fz_cell), cmpcell);
+		return;
+	}
+
+	for (i = 1; i < n; i++)
+	{
+		t = cells[i];
+		for (j = i; j > 0 && cells[j-1].x > t.x; j--)
+			cells[j] = cells[j-1];
+		cells[j] = t;
+	}
+}
+
+static inline int
+coverage(float v, int eofill)
+{
+	if (v < 0)
+		v = -v;
+	if (eofill)
+	{
+		v = fmodf(v, 2);
+		if (v > 1)
+			v = 2 - v;
+	}
+	else if (v > 1)
+		v = 1;
+	return (int)(v * 255 + 0.5f);
+}
+
+static void
+fz_convert_cellbuffer(fz_context *ctx, fz_rasterizer *ras, int eofill, const fz_irect *clip, fz_pixmap *dst, unsigned char *color, fz_overprint *eop)
+{
+	fz_cellbuffer *cb = (fz_cellbuffer *)ras;
+	int rows = clip->y1 - clip->y0;
+	int width = clip->x1 - clip->x0;
+	int *index;
+	fz_cell *cells;
+	unsigned char *alphas;
+	void *fn;
+	int i, y;
+
+	if (cb->len == 0)
+		return;
+
+	if (color)
+		fn = (void *)fz_get_span_color_painter(dst->n, dst->alpha, color, eop);
+	else
+		fn = (void *)fz_get_span_painter(dst->alpha, 1, 0, 255, eop);
+	assert(fn);
+	if (fn == NULL)
+		return;
+
+	if (cb->index_cap < rows + 1)
+	{
+		cb->index = fz_resize_array(ctx, cb->index, rows + 1, sizeof(int));
+		cb->index_cap = rows + 1;
+	}
+	if (cb->sorted_cap < cb->len)
+	{
+		cb->sorted = fz_resize_array(ctx, cb->sorted, cb->len, sizeof(fz_cell));
+		cb->sorted_cap = cb->len;
+	}
+	if (cb->alphas_cap < width)
+	{
+		cb->alphas = fz_resize_array(ctx, cb->alphas, width, 1);
+		cb->alphas_cap = width;
+	}
+	index = cb->index;
+	cells = cb->sorted;
+	alphas = cb->alphas;
+
+	/* Bucket the cells by scanline, then sort each scanline by x. We
+	 * leave the cells themselves untouched so that we can be converted
+	 * again (for a shape or group alpha plane). */
+	memset(index, 0, (rows + 1) * sizeof(int));
+	for (i = 0; i < cb->len; i++)
+	{
+		y = cb->cells[i].y - clip->y0;
+		if (y >= 0 && y < rows)
+			index[y + 1]++;
+	}
+	for (y = 0; y < rows; y++)
+		index[y + 1] += index[y];
+	for (i = 0; i < cb->len; i++)
+	{
+		y = cb->cells[i].y - clip->y0;
+		if (y >= 0 && y < rows)
+			cells[index[y]++] = cb->cells[i];
+	}
+	for (y = rows; y > 0; y--)
+		index[y] = index[y - 1];
+	index[0] = 0;
+
+	for (y = 0; y < rows; y++)
+	{
+		fz_cell *cell = &cells[index[y]];
+		fz_cell *end = &cells[index[y + 1]];
+		int lo = width;
+		int hi = 0;
+		float acc = 0;
+
+		if (cell == end)
+			continue;
+
+		sort_cells(cell, end - cell);
+
+		while (cell < end)
+		{
+			int x = cell->x;
+			float cover = 0;
+			float area = 0;
+			int nx, a;
+
+			do
+			{
+				cover += cell->cover;
+				area += cell->area;
+				cell++;
+			}
+			while (cell < end && cell->x == x);
+
+			/* The pixel containing the edges. */
+			x -= clip->x0;
+			if (x >= width)
+				break;
+			if (x >= 0)
+			{
+				alphas[x] = coverage(acc + cover - area, eofill);
+				if (x < lo)
+					lo = x;
+				hi = x + 1;
+			}
+			acc += cover;
+
+			/* The run up to the next cell. */
+			nx = (cell < end ? cell->x - clip->x0 : width);
+			if (nx > width)
+				nx = width;
+			x = fz_maxi(x + 1, 0);
+			if (x < nx)
+			{
+				a = coverage(acc, eofill);
+				if (a == 0 && cell == end)
+					break;
+				memset(alphas + x, a, nx - x);
+				if (x < lo)
+					lo = x;
+				hi = nx;
+			}
+		}
+
+		if (lo < hi)
+		{
+			unsigned char *dp = dst->samples + (unsigned int)((clip->y0 + y - dst->y) * dst->stride + (clip->x0 + lo - dst->x) * dst->n);
+			if (color)
+				(*(fz_span_color_painter_t *)fn)(dp, alphas + lo, dst->n, hi - lo, color, dst->alpha, eop);
+			else
+				(*(fz_span_painter_t *)fn)(dp, dst->alpha, alphas + lo, 1, 0, hi - lo, 255, eop);
+		}
+	}
+}
+
+static int
+fz_is_rect_cellbuffer(fz_context *ctx, fz_rasterizer *r)
+{
+	return 0;
+}
+
+static const fz_rasterizer_fns cellbuffer_rasterizer =
+{
+	fz_drop_cellbuffer,
+	fz_reset_cellbuffer,
+	NULL, /* postindex */
+	fz_insert_cellbuffer,
+	NULL, /* rect */
+	NULL, /* gap */
+	fz_convert_cellbuffer,
+	fz_is_rect_cellbuffer,
+	1 /* Reusable */
+};
+
+fz_rasterizer *
+fz_new_cellbuffer(fz_context *ctx)
+{
+	fz_cellbuffer *cb;
+
+	cb = fz_new_derived_rasterizer(ctx, fz_cellbuffer, &cellbuffer_rasterizer);
+	fz_try(ctx)
+	{
+		cb->cap = 512;
+		cb->cells = fz_malloc_array(ctx, cb->cap, sizeof(fz_cell));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, cb);
+		fz_rethrow(ctx);
+	}
+
+	return &cb->super;
+}
@@ -26,6 +26,12 @@ enum {
 
 typedef struct fz_draw_state_s fz_draw_state;
 
+typedef struct
+{
+	fz_pixmap *pix;
+	size_t size;
+} fz_draw_pooled_pixmap;
+
 struct fz_draw_state_s {
 	fz_irect scissor;
 	fz_pixmap *dest;
@@ -55,6 +61,9 @@ struct fz_draw_device_s
 	fz_draw_state *stack;
 	int stack_cap;
 	fz_draw_state init_stack[STACK_SIZE];
+	int pool_len;
+	size_t pool_size;
+	fz_draw_pooled_pixmap pool[FZ_DRAW_POOL_COUNT > 0 ? FZ_DRAW_POOL_COUNT : 1];
 };
 
 #ifdef DUMP_GROUP_BLENDS
@@ -179,16 +188,154 @@ push_stack(fz_context *ctx, fz_draw_device *dev)
 	return state;
 }
 
+/* The pixmaps that groups, masks, clips and knockouts draw into are
+ * given back to a pool in the device when they are popped, and taken
+ * from it again when the same kind of pixmap is next pushed. Nested
+ * transparency would otherwise allocate and free a buffer as big as
+ * the area it covers for every level, every time. */
+static fz_pixmap *
+fz_draw_new_pixmap(fz_context *ctx, fz_draw_device *dev, fz_colorspace *colorspace, fz_irect bbox, fz_separations *seps, int alpha)
+{
+	fz_pixmap *pix;
+	size_t size;
+	int i, best = -1;
+	int w = bbox.x1 - bbox.x0;
+	int h = bbox.y1 - bbox.y0;
+	int n = fz_colorspace_n(ctx, colorspace) + fz_count_active_separations(ctx, seps) + !!alpha;
+
+	if (w <= 0 || h <= 0)
+		return fz_new_pixmap_with_bbox(ctx, colorspace, bbox, seps, alpha);
+
+	/* Take the pixmap closest in size to the one needed. Successive
+	 * clips and groups are rarely exactly the same size, so allow
+	 * anything from an eighth smaller to twice as big, and resize
+	 * the samples to fit; the allocator can usually do that in place
+	 * and it keeps the pool's accounting exact. */
+	size = (size_t)w * h * n;
+	for (i = 0; i < dev->pool_len; i++)
+	{
+		fz_draw_pooled_pixmap *p = &dev->pool[i];
+		size_t d, best_d;
+		if (p->pix->colorspace != colorspace || p->pix->seps != seps || p->pix->alpha != !!alpha)
+			continue;
+		if (p->size + p->size / 8 < size || p->size / 2 > size)
+			continue;
+		d = p->size > size ? p->size - size : size - p->size;
+		if (best >= 0)
+		{
+			best_d = dev->pool[best].size > size ? dev->pool[best].size - size : size - dev->pool[best].size;
+			if (d >= best_d)
+				continue;
+		}
+		best = i;
+	}
+	if (best < 0)
+		return fz_new_pixmap_with_bbox(ctx, colorspace, bbox, seps, alpha);
+
+	pix = dev->pool[best].pix;
+	if (dev->pool[best].size != size)
+	{
+		unsigned char *samples = fz_resize_array_no_throw(ctx, pix->samples, size, 1);
+		if (!samples)
+		{
+			/* Growing failed; the pixmap is still intact in the pool. */
+			if (dev->pool[best].size < size)
+				return fz_new_pixmap_with_bbox(ctx, colorspace, bbox, seps, alpha);
+		}
+		else
+			pix->samples = samples;
+	}
+	dev->pool_size -= dev->pool[best].size;
+	dev->pool_len--;
+	memmove(&dev->pool[best], &dev->pool[best + 1], (dev->pool_len - best) * sizeof(*dev->pool));
+
+	pix->x = bbox.x0;
+	pix->y = bbox.y0;
+	pix->w = w;
+	pix->h = h;
+	pix->stride = (ptrdiff_t)w * n;
+	pix->flags = FZ_PIXMAP_FLAG_INTERPOLATE | FZ_PIXMAP_FLAG_FREE_SAMPLES;
+	pix->xres = 96;
+	pix->yres = 96;
+	return pix;
+}
+
+/* Give a pixmap back to the pool, if nothing else holds it, dropping
+ * the oldest pixmaps in the pool to make room. */
+static void
+fz_draw_drop_pixmap(fz_context *ctx, fz_draw_device *dev, fz_pixmap *pix)
+{
+	size_t size;
+
+	if (pix == NULL)
+		return;
+
+	size = (size_t)pix->h * pix->stride;
+	if (FZ_DRAW_POOL_COUNT <= 0 || pix->storable.refs != 1 || pix->underlying ||
+		!(pix->flags & FZ_PIXMAP_FLAG_FREE_SAMPLES) || pix->stride <= 0 ||
+		size == 0 || size > FZ_DRAW_POOL_BYTES)
+	{
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	while (dev->pool_len > 0 && (dev->pool_len == FZ_DRAW_POOL_COUNT || dev->pool_size + size > FZ_DRAW_POOL_BYTES))
+	{
+		dev->pool_size -= dev->pool[0].size;
+		fz_drop_pixmap(ctx, dev->pool[0].pix);
+		dev->pool_len--;
+		memmove(&dev->pool[0], &dev->pool[1], dev->pool_len * sizeof(*dev->pool));
+	}
+
+	dev->pool[dev->pool_len].pix = pix;
+	dev->pool[dev->pool_len].size = size;
+	dev->pool_len++;
+	dev->pool_size += size;
+}
+
+/* As fz_alpha_from_gray, but with the alpha plane from the pool. */
+static fz_pixmap *
+fz_draw_alpha_from_gray(fz_context *ctx, fz_draw_device *dev, fz_pixmap *gray)
+{
+	fz_pixmap *alpha;
+	unsigned char *sp, *dp;
+	int w, h;
+
+	assert(gray->n == 1);
+
+	alpha = fz_draw_new_pixmap(ctx, dev, NULL, fz_pixmap_bbox(ctx, gray), NULL, 1);
+	dp = alpha->samples;
+	sp = gray->samples;
+	h = gray->h;
+	w = gray->w;
+	while (h--)
+	{
+		memcpy(dp, sp, w);
+		sp += gray->stride;
+		dp += alpha->stride;
+	}
+
+	return alpha;
+}
+
+static void
+fz_draw_empty_pool(fz_context *ctx, fz_draw_device *dev)
+{
+	while (dev->pool_len > 0)
+		fz_drop_pixmap(ctx, dev->pool[--dev->pool_len].pix);
+	dev->pool_size = 0;
+}
+
 static void emergency_pop_stack(fz_context *ctx, fz_draw_device *dev, fz_draw_state *state)
 {
 	if (state[1].mask != state[0].mask)
-		fz_drop_pixmap(ctx, state[1].mask);
+		fz_draw_drop_pixmap(ctx, dev, state[1].mask);
 	if (state[1].dest != state[0].dest)
-		fz_drop_pixmap(ctx, state[1].dest);
+		fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 	if (state[1].shape != state[0].shape)
-		fz_drop_pixmap(ctx, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	if (state[1].group_alpha != state[0].group_alpha)
-		fz_drop_pixmap(ctx, state[1].group_alpha);
+		fz_draw_drop_pixmap(ctx, dev, state[1].group_alpha);
 	dev->top--;
 	STACK_POPPED("emergency");
 	fz_rethrow(ctx);
@@ -211,12 +358,12 @@ fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 	{
 		bbox = fz_pixmap_bbox(ctx, state->dest);
 		bbox = fz_intersect_irect(bbox, state->scissor);
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
 		if (state[0].group_alpha)
 		{
 			ga_bbox = fz_pixmap_bbox(ctx, state->group_alpha);
 			ga_bbox = fz_intersect_irect(ga_bbox, state->scissor);
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, state->group_alpha->colorspace, ga_bbox, state->group_alpha->seps, state->group_alpha->alpha);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, state->group_alpha->colorspace, ga_bbox, state->group_alpha->seps, state->group_alpha->alpha);
 		}
 
 		if (isolated)
@@ -256,7 +403,7 @@ fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 		}
 
 		/* Knockout groups (and only knockout groups) rely on shape */
-		state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].shape);
 #ifdef DUMP_GROUP_BLENDS
 		dump_spaces(dev->top-1, "");
@@ -320,18 +467,18 @@ static void fz_knockout_end(fz_context *ctx, fz_draw_device *dev)
 	 * errors can cause the stack to get out of sync, and this saves our
 	 * bacon. */
 	if (state[0].dest != state[1].dest)
-		fz_drop_pixmap(ctx, state[1].dest);
+		fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 	if (state[1].group_alpha && state[0].group_alpha != state[1].group_alpha)
 	{
 		if (state[0].group_alpha)
 			fz_blend_pixmap_knockout(ctx, state[0].group_alpha, state[1].group_alpha, state[1].shape);
-		fz_drop_pixmap(ctx, state[1].group_alpha);
+		fz_draw_drop_pixmap(ctx, dev, state[1].group_alpha);
 	}
 	if (state[0].shape != state[1].shape)
 	{
 		if (state[0].shape)
 			fz_paint_pixmap(state[0].shape, state[1].shape, 255);
-		fz_drop_pixmap(ctx, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	}
 #ifdef DUMP_GROUP_BLENDS
 	fz_dump_blend(ctx, " to get ", state[0].dest);
@@ -735,6 +882,60 @@ fz_draw_stroke_path(fz_context *ctx, fz_device *devp, const fz_path *path, const
 		fz_knockout_end(ctx, dev);
 }
 
+/* Flatten a clip path into the rasterizer, and find the area it will
+ * clip to. Returns non-zero if that area is all there is to it, so
+ * the clip can be done by narrowing the scissor. */
+static int
+flatten_clip_path(fz_context *ctx, fz_draw_device *dev, const fz_path *path, fz_matrix ctm, fz_rect scissor, fz_irect *bbox)
+{
+	fz_draw_state *state = &dev->stack[dev->top];
+	fz_rasterizer *rast = dev->rast;
+	float expansion = fz_matrix_expansion(ctm);
+	float flatness = 0.3f / expansion;
+
+	if (flatness < 0.001f)
+		flatness = 0.001f;
+
+	if (!fz_is_infinite_rect(scissor))
+	{
+		*bbox = fz_irect_from_rect(fz_transform_rect(scissor, dev->transform));
+		*bbox = fz_intersect_irect(*bbox, fz_pixmap_bbox(ctx, state->dest));
+		*bbox = fz_intersect_irect(*bbox, state->scissor);
+	}
+	else
+	{
+		*bbox = fz_intersect_irect(fz_pixmap_bbox(ctx, state->dest), state->scissor);
+	}
+
+	return fz_flatten_fill_path(ctx, rast, path, ctm, flatness, bbox, bbox) || fz_is_rect_rasterizer(ctx, rast);
+}
+
+/*
+	Check whether clipping to a path on a draw device would only
+	narrow its scissor, rather than needing a mask.
+*/
+int
+fz_draw_clip_path_is_rect(fz_context *ctx, fz_device *devp, const fz_path *path, fz_matrix in_ctm, fz_rect scissor)
+{
+	fz_draw_device *dev = (fz_draw_device*)devp;
+	fz_irect bbox;
+
+	if (dev->top == 0 && dev->resolve_spots)
+		return 0;
+	return flatten_clip_path(ctx, dev, path, fz_concat(in_ctm, dev->transform), scissor, &bbox);
+}
+
+/*
+	Get the area of its destination that a draw device is currently
+	clipped to.
+*/
+fz_irect
+fz_draw_device_scissor(fz_context *ctx, fz_device *devp)
+{
+	fz_draw_device *dev = (fz_draw_device*)devp;
+	return dev->stack[dev->top].scissor;
+}
+
 static void
 fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int even_odd, fz_matrix in_ctm, fz_rect scissor)
 {
@@ -742,8 +943,6 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int eve
 	fz_matrix ctm = fz_concat(in_ctm, dev->transform);
 	fz_rasterizer *rast = dev->rast;
 
-	float expansion = fz_matrix_expansion(ctm);
-	float flatness = 0.3f / expansion;
 	fz_irect bbox;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model;
@@ -751,25 +950,11 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int eve
 	if (dev->top == 0 && dev->resolve_spots)
 		(void)push_group_for_separations(ctx, dev, fz_default_color_params(ctx)/* FIXME */, dev->default_cs);
 
-	if (flatness < 0.001f)
-		flatness = 0.001f;
-
 	state = push_stack(ctx, dev);
 	STACK_PUSHED("clip path");
 	model = state->dest->colorspace;
 
-	if (!fz_is_infinite_rect(scissor))
-	{
-		bbox = fz_irect_from_rect(fz_transform_rect(scissor, dev->transform));
-		bbox = fz_intersect_irect(bbox, fz_pixmap_bbox(ctx, state->dest));
-		bbox = fz_intersect_irect(bbox, state->scissor);
-	}
-	else
-	{
-		bbox = fz_intersect_irect(fz_pixmap_bbox(ctx, state->dest), state->scissor);
-	}
-
-	if (fz_flatten_fill_path(ctx, rast, path, ctm, flatness, &bbox, &bbox) || fz_is_rect_rasterizer(ctx, rast))
+	if (flatten_clip_path(ctx, dev, path, ctm, scissor, &bbox))
 	{
 		state[1].scissor = bbox;
 		state[1].mask = NULL;
@@ -781,18 +966,18 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, const fz_path *path, int eve
 
 	fz_try(ctx)
 	{
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].mask);
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 		fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 		if (state[1].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		if (state[1].group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 
@@ -862,25 +1047,25 @@ fz_draw_clip_stroke_path(fz_context *ctx, fz_device *devp, const fz_path *path,
 
 	fz_try(ctx)
 	{
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].mask);
 		/* When there is no alpha in the current destination (state[0].dest->alpha == 0)
 		 * we have a choice. We can either create the new destination WITH alpha, or
 		 * we can copy the old pixmap contents in. We opt for the latter here, but
 		 * may want to revisit this decision in the future. */
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 		if (state[0].dest->alpha)
 			fz_clear_pixmap(ctx, state[1].dest);
 		else
 			fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 		if (state->shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		if (state->group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 
@@ -1175,27 +1360,27 @@ fz_draw_clip_text(fz_context *ctx, fz_device *devp, const fz_text *text, fz_matr
 
 	fz_try(ctx)
 	{
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].mask);
 		/* When there is no alpha in the current destination (state[0].dest->alpha == 0)
 		 * we have a choice. We can either create the new destination WITH alpha, or
 		 * we can copy the old pixmap contents in. We opt for the latter here, but
 		 * may want to revisit this decision in the future. */
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 		if (state[0].dest->alpha)
 			fz_clear_pixmap(ctx, state[1].dest);
 		else
 			fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 		if (state->shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		else
 			state[1].shape = NULL;
 		if (state->group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 		else
@@ -1307,27 +1492,27 @@ fz_draw_clip_stroke_text(fz_context *ctx, fz_device *devp, const fz_text *text,
 
 	fz_try(ctx)
 	{
-		state[1].mask = mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].mask = mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, mask);
 		/* When there is no alpha in the current destination (state[0].dest->alpha == 0)
 		 * we have a choice. We can either create the new destination WITH alpha, or
 		 * we can copy the old pixmap contents in. We opt for the latter here, but
 		 * may want to revisit this decision in the future. */
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 		if (state[0].dest->alpha)
 			fz_clear_pixmap(ctx, state[1].dest);
 		else
 			fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 		if (state->shape)
 		{
-			state[1].shape = shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, shape);
 		}
 		else
 			shape = state->shape;
 		if (state->group_alpha)
 		{
-			state[1].group_alpha = group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, group_alpha);
 		}
 		else
@@ -1450,19 +1635,19 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, fz_matrix
 
 	if (alpha < 1)
 	{
-		dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
+		dest = fz_draw_new_pixmap(ctx, dev, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
 		if (state->dest->alpha)
 			fz_clear_pixmap(ctx, dest);
 		else
 			fz_copy_pixmap_rect(ctx, dest, state[0].dest, bbox, dev->default_cs);
 		if (shape)
 		{
-			shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, shape);
 		}
 		if (group_alpha)
 		{
-			group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, group_alpha);
 		}
 	}
@@ -1561,16 +1746,16 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, fz_matrix
 	{
 		/* FIXME: eop */
 		fz_paint_pixmap(state->dest, dest, alpha * 255);
-		fz_drop_pixmap(ctx, dest);
+		fz_draw_drop_pixmap(ctx, dev, dest);
 		if (shape)
 		{
 			fz_paint_pixmap(state->shape, shape, 255);
-			fz_drop_pixmap(ctx, shape);
+			fz_draw_drop_pixmap(ctx, dev, shape);
 		}
 		if (group_alpha)
 		{
 			fz_paint_pixmap(state->group_alpha, group_alpha, alpha * 255);
-			fz_drop_pixmap(ctx, group_alpha);
+			fz_draw_drop_pixmap(ctx, dev, group_alpha);
 		}
 	}
 
@@ -1680,6 +1865,52 @@ convert_pixmap_for_painting(fz_context *ctx, fz_pixmap *pixmap, fz_colorspace *m
 	return converted;
 }
 
+/*
+	Find the area of an image that is needed to draw the part of it
+	that falls within clip. Returns 0 if none of it is needed.
+*/
+static int
+image_src_area(fz_image *image, fz_matrix local_ctm, fz_irect clip, fz_irect *src_area)
+{
+	fz_matrix inverse;
+
+	/* ctm maps the image (expressed as the unit square) onto the
+	 * destination device. Reverse that to get a mapping from
+	 * the destination device to the source pixels. */
+	if (fz_try_invert_matrix(&inverse, local_ctm))
+	{
+		/* Not invertible. Could just bail? Use the whole image
+		 * for now. */
+		src_area->x0 = 0;
+		src_area->x1 = image->w;
+		src_area->y0 = 0;
+		src_area->y1 = image->h;
+	}
+	else
+	{
+		float exp;
+		fz_rect rect;
+		fz_irect sane;
+		/* We want to scale from image coords, not from unit square */
+		inverse = fz_post_scale(inverse, image->w, image->h);
+		/* Are we scaling up or down? exp < 1 means scaling down. */
+		exp = fz_matrix_max_expansion(inverse);
+		rect = fz_rect_from_irect(clip);
+		rect = fz_transform_rect(rect, inverse);
+		/* Allow for support requirements for scalers. */
+		rect = fz_expand_rect(rect, fz_max(exp, 1) * 4);
+		*src_area = fz_irect_from_rect(rect);
+		sane.x0 = 0;
+		sane.y0 = 0;
+		sane.x1 = image->w;
+		sane.y1 = image->h;
+		*src_area = fz_intersect_irect(*src_area, sane);
+		if (fz_is_empty_irect(*src_area))
+			return 0;
+	}
+	return 1;
+}
+
 static void
 fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix in_ctm, float alpha, const fz_color_params *color_params)
 {
@@ -1691,7 +1922,6 @@ fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model;
 	fz_irect clip;
-	fz_matrix inverse;
 	fz_irect src_area;
 	fz_colorspace *src_cs;
 	fz_overprint op = { { 0 } };
@@ -1712,40 +1942,8 @@ fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, fz_matrix
 	if (!color_params || color_params->op == 0)
 		eop = NULL;
 
-	/* ctm maps the image (expressed as the unit square) onto the
-	 * destination device. Reverse that to get a mapping from
-	 * the destination device to the source pixels. */
-	if (fz_try_invert_matrix(&inverse, local_ctm))
-	{
-		/* Not invertible. Could just bail? Use the whole image
-		 * for now. */
-		src_area.x0 = 0;
-		src_area.x1 = image->w;
-		src_area.y0 = 0;
-		src_area.y1 = image->h;
-	}
-	else
-	{
-		float exp;
-		fz_rect rect;
-		fz_irect sane;
-		/* We want to scale from image coords, not from unit square */
-		inverse = fz_post_scale(inverse, image->w, image->h);
-		/* Are we scaling up or down? exp < 1 means scaling down. */
-		exp = fz_matrix_max_expansion(inverse);
-		rect = fz_rect_from_irect(clip);
-		rect = fz_transform_rect(rect, inverse);
-		/* Allow for support requirements for scalers. */
-		rect = fz_expand_rect(rect, fz_max(exp, 1) * 4);
-		src_area = fz_irect_from_rect(rect);
-		sane.x0 = 0;
-		sane.y0 = 0;
-		sane.x1 = image->w;
-		sane.y1 = image->h;
-		src_area = fz_intersect_irect(src_area, sane);
-		if (fz_is_empty_irect(src_area))
-			return;
-	}
+	if (!image_src_area(image, local_ctm, clip, &src_area))
+		return;
 
 	pixmap = fz_get_pixmap_from_image(ctx, image, &src_area, &local_ctm, &dx, &dy);
 	src_cs = fz_default_colorspace(ctx, dev->default_cs, pixmap->colorspace);
@@ -1839,7 +2037,6 @@ fz_draw_fill_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_ma
 	int dx, dy;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_irect clip;
-	fz_matrix inverse;
 	fz_irect src_area;
 	fz_colorspace *colorspace = NULL;
 	fz_overprint op = { { 0 } };
@@ -1860,40 +2057,8 @@ fz_draw_fill_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_ma
 	if (image->w == 0 || image->h == 0)
 		return;
 
-	/* ctm maps the image (expressed as the unit square) onto the
-	 * destination device. Reverse that to get a mapping from
-	 * the destination device to the source pixels. */
-	if (fz_try_invert_matrix(&inverse, local_ctm))
-	{
-		/* Not invertible. Could just bail? Use the whole image
-		 * for now. */
-		src_area.x0 = 0;
-		src_area.x1 = image->w;
-		src_area.y0 = 0;
-		src_area.y1 = image->h;
-	}
-	else
-	{
-		float exp;
-		fz_rect rect;
-		fz_irect sane;
-		/* We want to scale from image coords, not from unit square */
-		inverse = fz_post_scale(inverse, image->w, image->h);
-		/* Are we scaling up or down? exp < 1 means scaling down. */
-		exp = fz_matrix_max_expansion(inverse);
-		rect = fz_rect_from_irect(clip);
-		rect = fz_transform_rect(rect, inverse);
-		/* Allow for support requirements for scalers. */
-		rect = fz_expand_rect(rect, fz_max(exp, 1) * 4);
-		src_area = fz_irect_from_rect(rect);
-		sane.x0 = 0;
-		sane.y0 = 0;
-		sane.x1 = image->w;
-		sane.y1 = image->h;
-		src_area = fz_intersect_irect(src_area, sane);
-		if (fz_is_empty_irect(src_area))
-			return;
-	}
+	if (!image_src_area(image, local_ctm, clip, &src_area))
+		return;
 
 	pixmap = fz_get_pixmap_from_image(ctx, image, &src_area, &local_ctm, &dx, &dy);
 
@@ -1984,19 +2149,19 @@ fz_draw_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, fz_ma
 	{
 		pixmap = fz_get_pixmap_from_image(ctx, image, NULL, &local_ctm, &dx, &dy);
 
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+		state[1].mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		fz_clear_pixmap(ctx, state[1].mask);
 
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha);
 		fz_copy_pixmap_rect(ctx, state[1].dest, state[0].dest, bbox, dev->default_cs);
 		if (state[0].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		if (state[0].group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 
@@ -2083,20 +2248,20 @@ fz_draw_pop_clip(fz_context *ctx, fz_device *devp)
 		if (state[0].shape != state[1].shape)
 		{
 			fz_paint_pixmap_with_mask(state[0].shape, state[1].shape, state[1].mask);
-			fz_drop_pixmap(ctx, state[1].shape);
+			fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 		}
 		if (state[0].group_alpha != state[1].group_alpha)
 		{
 			fz_paint_pixmap_with_mask(state[0].group_alpha, state[1].group_alpha, state[1].mask);
-			fz_drop_pixmap(ctx, state[1].group_alpha);
+			fz_draw_drop_pixmap(ctx, dev, state[1].group_alpha);
 		}
 		/* The following tests should not be required, but just occasionally
 		 * errors can cause the stack to get out of sync, and this might save
 		 * our bacon. */
 		if (state[0].mask != state[1].mask)
-			fz_drop_pixmap(ctx, state[1].mask);
+			fz_draw_drop_pixmap(ctx, dev, state[1].mask);
 		if (state[0].dest != state[1].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+			fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 #ifdef DUMP_GROUP_BLENDS
 		fz_dump_blend(ctx, " to get ", state[0].dest);
 		if (state[0].shape)
@@ -2149,9 +2314,9 @@ fz_draw_begin_mask(fz_context *ctx, fz_device *devp, fz_rect area, int luminosit
 		 * If !luminosity, then we generate a mask from the alpha value of the shapes.
 		 */
 		if (luminosity)
-			state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), bbox, NULL, 0);
+			state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, fz_device_gray(ctx), bbox, NULL, 0);
 		else
-			state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 		if (state->shape)
 		{
 			/* FIXME: If we ever want to support AIS true, then
@@ -2226,18 +2391,18 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 	fz_try(ctx)
 	{
 		/* convert to alpha mask */
-		temp = fz_alpha_from_gray(ctx, state[1].dest);
+		temp = fz_draw_alpha_from_gray(ctx, dev, state[1].dest);
 		if (state[1].mask != state[0].mask)
-			fz_drop_pixmap(ctx, state[1].mask);
+			fz_draw_drop_pixmap(ctx, dev, state[1].mask);
 		state[1].mask = temp;
 		if (state[1].dest != state[0].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+			fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 		state[1].dest = NULL;
 		if (state[1].shape != state[0].shape)
-			fz_drop_pixmap(ctx, state[1].shape);
+			fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 		state[1].shape = NULL;
 		if (state[1].group_alpha != state[0].group_alpha)
-			fz_drop_pixmap(ctx, state[1].group_alpha);
+			fz_draw_drop_pixmap(ctx, dev, state[1].group_alpha);
 		state[1].group_alpha = NULL;
 
 #ifdef DUMP_GROUP_BLENDS
@@ -2247,7 +2412,7 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 
 		/* create new dest scratch buffer */
 		bbox = fz_pixmap_bbox(ctx, temp);
-		dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
+		dest = fz_draw_new_pixmap(ctx, dev, state->dest->colorspace, bbox, state->dest->seps, state->dest->alpha);
 		fz_copy_pixmap_rect(ctx, dest, state->dest, bbox, dev->default_cs);
 
 		/* push soft mask as clip mask */
@@ -2257,12 +2422,12 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 		 * clip mask when we pop. So create a new shape now. */
 		if (state[0].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		if (state[0].group_alpha)
 		{
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 		state[1].scissor = bbox;
@@ -2304,7 +2469,7 @@ fz_draw_begin_group(fz_context *ctx, fz_device *devp, fz_rect area, fz_colorspac
 		isolated = 1;
 #endif
 
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, state[0].dest->alpha || isolated);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, state[0].dest->alpha || isolated);
 
 		if (isolated)
 		{
@@ -2314,7 +2479,7 @@ fz_draw_begin_group(fz_context *ctx, fz_device *devp, fz_rect area, fz_colorspac
 		else
 		{
 			fz_copy_pixmap_rect(ctx, dest, state[0].dest, bbox, dev->default_cs);
-			state[1].group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, state[1].group_alpha);
 		}
 
@@ -2401,7 +2566,7 @@ fz_draw_end_group(fz_context *ctx, fz_device *devp)
 		if (state[0].dest->colorspace != state[1].dest->colorspace)
 		{
 			fz_pixmap *converted = fz_convert_pixmap(ctx, state[1].dest, state[0].dest->colorspace, NULL, dev->default_cs, fz_default_color_params(ctx), 1);
-			fz_drop_pixmap(ctx, state[1].dest);
+			fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 			state[1].dest = converted;
 		}
 
@@ -2449,13 +2614,13 @@ fz_draw_end_group(fz_context *ctx, fz_device *devp)
 	fz_always(ctx)
 	{
 		if (state[0].shape != state[1].shape)
-			fz_drop_pixmap(ctx, state[1].shape);
-		fz_drop_pixmap(ctx, state[1].group_alpha);
+			fz_draw_drop_pixmap(ctx, dev, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].group_alpha);
 		/* The following test should not be required, but just occasionally
 		 * errors can cause the stack to get out of sync, and this might save
 		 * our bacon. */
 		if (state[0].dest != state[1].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+			fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 
 		if (state[0].blendmode & FZ_BLEND_KNOCKOUT)
 			fz_knockout_end(ctx, dev);
@@ -2542,7 +2707,8 @@ static const fz_store_type fz_tile_store_type =
 	fz_drop_tile_key,
 	fz_cmp_tile_key,
 	fz_format_tile_key,
-	NULL
+	NULL,
+	"tile"
 };
 
 static void
@@ -2651,18 +2817,18 @@ fz_draw_begin_tile(fz_context *ctx, fz_device *devp, fz_rect area, fz_rect view,
 	fz_try(ctx)
 	{
 		/* Patterns can be transparent, so we need to have an alpha here. */
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, bbox, state[0].dest->seps, 1);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, model, bbox, state[0].dest->seps, 1);
 		fz_clear_pixmap(ctx, dest);
 		shape = state[0].shape;
 		if (shape)
 		{
-			state[1].shape = shape = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].shape = shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, shape);
 		}
 		group_alpha = state[0].group_alpha;
 		if (group_alpha)
 		{
-			state[1].group_alpha = group_alpha = fz_new_pixmap_with_bbox(ctx, NULL, bbox, NULL, 1);
+			state[1].group_alpha = group_alpha = fz_draw_new_pixmap(ctx, dev, NULL, bbox, NULL, 1);
 			fz_clear_pixmap(ctx, group_alpha);
 		}
 		state[1].blendmode |= FZ_BLEND_ISOLATED;
@@ -2870,11 +3036,11 @@ fz_draw_end_tile(fz_context *ctx, fz_device *devp)
 	 * errors can cause the stack to get out of sync, and this might save
 	 * our bacon. */
 	if (state[0].dest != state[1].dest)
-		fz_drop_pixmap(ctx, state[1].dest);
+		fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 	if (state[0].shape != state[1].shape)
-		fz_drop_pixmap(ctx, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	if (state[0].group_alpha != state[1].group_alpha)
-		fz_drop_pixmap(ctx, state[1].group_alpha);
+		fz_draw_drop_pixmap(ctx, dev, state[1].group_alpha);
 #ifdef DUMP_GROUP_BLENDS
 	fz_dump_blend(ctx, " to get ", state[0].dest);
 	if (state[0].shape)
@@ -2940,6 +3106,8 @@ fz_draw_close_device(fz_context *ctx, fz_device *devp)
 		fz_catch(ctx)
 			fz_rethrow(ctx);
 	}
+
+	fz_draw_empty_pool(ctx, dev);
 }
 
 static void
@@ -2974,6 +3142,7 @@ fz_draw_drop_device(fz_context *ctx, fz_device *devp)
 	 */
 	if (dev->stack != &dev->init_stack[0])
 		fz_free(ctx, dev->stack);
+	fz_draw_empty_pool(ctx, dev);
 	fz_drop_scale_cache(ctx, dev->cache_x);
 	fz_drop_scale_cache(ctx, dev->cache_y);
 	fz_drop_rasterizer(ctx, rast);
@@ -3345,3 +3514,184 @@ fz_new_draw_device_with_options(fz_context *ctx, const fz_draw_options *opts, fz
 	}
 	return dev;
 }
+
+typedef struct
+{
+	fz_image *image;
+	fz_matrix ctm;
+	fz_irect area;
+	int whole;
+} fz_prefetch_item;
+
+typedef struct
+{
+	fz_device super;
+	fz_irect clip;
+	int band_height;
+	int tile;
+	int len, max;
+	fz_prefetch_item *items;
+} fz_prefetch_device;
+
+static void
+prefetch_add(fz_context *ctx, fz_prefetch_device *dev, fz_image *image, fz_matrix ctm, int whole)
+{
+	fz_prefetch_item *item;
+	fz_irect area;
+	int i;
+
+	if (image->w == 0 || image->h == 0 || image->decoded || image->scalable)
+		return;
+
+	/* Inside tiles, and for clipping masks, the draw device asks for
+	 * the whole image. Elsewhere it asks for the part within the
+	 * clip, which will be found even when that is all of it. */
+	if (dev->tile || whole)
+		area = fz_make_irect(0, 0, image->w, image->h);
+	else if (!image_src_area(image, ctm, dev->clip, &area))
+		return;
+	else if (dev->band_height > 0)
+	{
+		/* Each band asks for a different part of an image that
+		 * reaches across bands, and none of them would be the part
+		 * decoded here; so decode all of it, which they all find. */
+		fz_irect ib = fz_intersect_irect(fz_round_rect(fz_transform_rect(fz_unit_rect, ctm)), dev->clip);
+		if ((ib.y0 - dev->clip.y0) / dev->band_height != (ib.y1 - 1 - dev->clip.y0) / dev->band_height)
+			area = fz_make_irect(0, 0, image->w, image->h);
+	}
+	whole = (area.x0 == 0 && area.y0 == 0 && area.x1 == image->w && area.y1 == image->h);
+
+	for (i = 0; i < dev->len; i++)
+	{
+		item = &dev->items[i];
+		if (item->image == image &&
+			item->area.x0 == area.x0 && item->area.y0 == area.y0 && item->area.x1 == area.x1 && item->area.y1 == area.y1 &&
+			item->ctm.a == ctm.a && item->ctm.b == ctm.b && item->ctm.c == ctm.c && item->ctm.d == ctm.d)
+			return;
+	}
+
+	if (dev->len == dev->max)
+	{
+		int newmax = dev->max ? dev->max * 2 : 16;
+		dev->items = fz_resize_array(ctx, dev->items, newmax, sizeof(*dev->items));
+		dev->max = newmax;
+	}
+	item = &dev->items[dev->len++];
+	item->image = fz_keep_image(ctx, image);
+	item->ctm = ctm;
+	item->area = area;
+	item->whole = whole;
+}
+
+static void
+prefetch_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, const fz_color_params *color_params)
+{
+	if (alpha != 0)
+		prefetch_add(ctx, (fz_prefetch_device *)dev, image, ctm, 0);
+}
+
+static void
+prefetch_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	if (alpha != 0)
+		prefetch_add(ctx, (fz_prefetch_device *)dev, image, ctm, 0);
+}
+
+static void
+prefetch_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+	prefetch_add(ctx, (fz_prefetch_device *)dev, image, ctm, 1);
+}
+
+static int
+prefetch_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+	((fz_prefetch_device *)dev)->tile++;
+	return 0;
+}
+
+static void
+prefetch_end_tile(fz_context *ctx, fz_device *dev)
+{
+	((fz_prefetch_device *)dev)->tile--;
+}
+
+static void
+prefetch_drop_device(fz_context *ctx, fz_device *dev_)
+{
+	fz_prefetch_device *dev = (fz_prefetch_device *)dev_;
+	int i;
+
+	for (i = 0; i < dev->len; i++)
+		fz_drop_image(ctx, dev->items[i].image);
+	fz_free(ctx, dev->items);
+}
+
+static void
+prefetch_image_job(fz_context *ctx, void *arg, int i)
+{
+	fz_prefetch_item *item = &((fz_prefetch_item *)arg)[i];
+	fz_matrix ctm = item->ctm;
+	fz_pixmap *pix = NULL;
+
+	fz_var(pix);
+
+	/* The tile stays in the store for the draw device to find. */
+	fz_try(ctx)
+		pix = fz_get_pixmap_from_image(ctx, item->image, item->whole ? NULL : &item->area, &ctm, NULL, NULL);
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+	{
+		/* Leave it to the draw device to try again and report. */
+	}
+}
+
+/*
+	Decode the images in a display list ahead of drawing it, so that
+	the draw device finds them ready in the store. The images are
+	decoded with the runner set by fz_tune_parallel, so several can
+	be decoded at once; without one they are decoded in turn.
+
+	list: The display list to be drawn.
+
+	ctm: The transform it will be drawn with.
+
+	bbox: The area of the page (in device pixels) that will be drawn.
+	Only the parts of images within it are decoded, as the draw
+	device would. Images clipped by anything else will be decoded
+	again when drawn, unless all of them was decoded.
+
+	band_height: The height of the bands bbox will be drawn in, from
+	its top, or 0 if it is drawn in one go. Images that reach across
+	a band boundary are decoded whole, so that every band finds them.
+
+	cookie: Optional, as for fz_run_display_list.
+*/
+void
+fz_prefetch_display_list_images(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_irect bbox, int band_height, fz_cookie *cookie)
+{
+	fz_prefetch_device *dev = fz_new_derived_device(ctx, fz_prefetch_device);
+
+	dev->super.drop_device = prefetch_drop_device;
+	dev->super.fill_image = prefetch_fill_image;
+	dev->super.fill_image_mask = prefetch_fill_image_mask;
+	dev->super.clip_image_mask = prefetch_clip_image_mask;
+	dev->super.begin_tile = prefetch_begin_tile;
+	dev->super.end_tile = prefetch_end_tile;
+	dev->clip = bbox;
+	dev->band_height = band_height;
+
+	fz_try(ctx)
+	{
+		fz_run_display_list(ctx, list, &dev->super, ctm, fz_rect_from_irect(bbox), cookie);
+		fz_close_device(ctx, &dev->super);
+		if (dev->len > 0 && !(cookie && cookie->abort))
+			ctx->tuning->parallel(ctx->tuning->parallel_arg, ctx, dev->len, prefetch_image_job, dev->items);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, &dev->super);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
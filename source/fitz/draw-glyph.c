@@ -4,6 +4,7 @@
 #include "fitz-imp.h"
 
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 
 #define MAX_GLYPH_SIZE 256
@@ -11,12 +12,21 @@
 
 #define GLYPH_HASH_LEN 509
 
+/* Small RLE glyphs are packed into pages along with their cache entries */
+#define GLYPH_ATLAS_PAGE_SIZE 16384
+#define GLYPH_ATLAS_MAX_GLYPH 1024
+#define GLYPH_ATLAS_ALIGN(x) (((x) + 15) & ~(size_t)15)
+#define GLYPH_ATLAS_ENTRY_SIZE GLYPH_ATLAS_ALIGN(sizeof(fz_glyph_cache_entry))
+
+typedef struct fz_glyph_atlas_page_s fz_glyph_atlas_page;
 typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
 typedef struct fz_glyph_key_s fz_glyph_key;
 
 struct fz_glyph_key_s
 {
 	fz_font *font;
+	unsigned char digest[16];
+	int variant;
 	int a, b;
 	int c, d;
 	unsigned short gid;
@@ -28,24 +38,66 @@ struct fz_glyph_cache_entry_s
 {
 	fz_glyph_key key;
 	unsigned hash;
+	int referenced;
 	fz_glyph_cache_entry *lru_prev;
 	fz_glyph_cache_entry *lru_next;
 	fz_glyph_cache_entry *bucket_next;
 	fz_glyph_cache_entry *bucket_prev;
 	fz_glyph *val;
+	fz_glyph_atlas_page *page;
 };
 
-struct fz_glyph_cache_s
+/*
+	An atlas page holds a sequence of slots, each of which is a cache
+	entry immediately followed by its glyph. Slots are bump allocated,
+	and never freed individually; when the entry of any slot is evicted,
+	all the entries in the page are evicted together.
+
+	The page is freed once every entry and glyph within it has been
+	dropped (glyphs may still be held by callers after eviction). refs
+	counts those, plus one while the page is being filled, and is
+	protected by the alloc lock.
+*/
+struct fz_glyph_atlas_page_s
 {
 	int refs;
+	size_t used;
+	unsigned char data[1];
+};
+
+/*
+	The glyph cache is split into FZ_GLYPH_CACHE_SHARDS shards, so that
+	threads rendering text do not all serialize on a single lock. Hash
+	bucket i belongs to shard i % FZ_GLYPH_CACHE_SHARDS, which is
+	protected by lock FZ_LOCK_GLYPHCACHE + i % FZ_GLYPH_CACHE_SHARDS.
+
+	Each shard is limited to an equal part of MAX_CACHE_SIZE, and
+	evicts using the CLOCK (second chance) algorithm: a hit only marks
+	the entry as referenced, rather than moving it in the list. When
+	space is needed, referenced entries at the tail are given a second
+	chance by clearing the mark and moving them to the head.
+*/
+typedef struct fz_glyph_cache_shard_s
+{
 	size_t total;
-#ifndef NDEBUG
-	int num_evictions;
-	ptrdiff_t evicted;
-#endif
-	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
+	size_t high_water;
+	size_t lookups;
+	size_t hits;
+	size_t inserts;
+	size_t num_evictions;
+	size_t evicted;
 	fz_glyph_cache_entry *lru_head;
 	fz_glyph_cache_entry *lru_tail;
+	fz_glyph_atlas_page *atlas;
+} fz_glyph_cache_shard;
+
+struct fz_glyph_cache_s
+{
+	/* refs is protected by the lock of shard 0 */
+	int refs;
+	int digest_keys;
+	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
+	fz_glyph_cache_shard shard[FZ_GLYPH_CACHE_SHARDS];
 };
 
 void
@@ -54,75 +106,206 @@ fz_new_glyph_cache_context(fz_context *ctx)
 	fz_glyph_cache *cache;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
 static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+drop_atlas_page(fz_context *ctx, fz_glyph_atlas_page *page)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
+	if (fz_drop_imp(ctx, page, &page->refs))
+		fz_free(ctx, page);
+}
+
+static void
+drop_atlas_glyph(fz_context *ctx, fz_storable *glyph)
+{
+	fz_glyph_cache_entry *entry = (fz_glyph_cache_entry *)((unsigned char *)glyph - GLYPH_ATLAS_ENTRY_SIZE);
+	drop_atlas_page(ctx, entry->page);
+}
+
+/* The shard lock is held when this function is called. Returns a new
+ * entry in an atlas page holding a copy of glyph. */
+static fz_glyph_cache_entry *
+new_atlas_entry(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph *glyph)
+{
+	fz_glyph_atlas_page *page = shard->atlas;
+	fz_glyph_cache_entry *entry;
+	fz_glyph *copy;
+	size_t len = sizeof(fz_glyph) + glyph->size;
+	size_t slot = GLYPH_ATLAS_ENTRY_SIZE + GLYPH_ATLAS_ALIGN(len);
+
+	if (page == NULL || page->used + slot > GLYPH_ATLAS_PAGE_SIZE)
+	{
+		page = fz_malloc(ctx, offsetof(fz_glyph_atlas_page, data) + GLYPH_ATLAS_PAGE_SIZE);
+		page->refs = 1;
+		page->used = 0;
+		if (shard->atlas)
+			drop_atlas_page(ctx, shard->atlas);
+		shard->atlas = page;
+	}
+
+	entry = (fz_glyph_cache_entry *)(page->data + page->used);
+	copy = (fz_glyph *)((unsigned char *)entry + GLYPH_ATLAS_ENTRY_SIZE);
+	page->used += slot;
+
+	memset(entry, 0, sizeof *entry);
+	entry->page = page;
+	memcpy(copy, glyph, len);
+	FZ_INIT_STORABLE(copy, 1, drop_atlas_glyph);
+	entry->val = copy;
+
+	/* One reference for the entry, and one for the glyph */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	page->refs += 2;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return entry;
+}
+
+static void
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+{
+	fz_glyph_cache_shard *shard = &cache->shard[entry->hash % FZ_GLYPH_CACHE_SHARDS];
+	fz_glyph_atlas_page *page = entry->page;
+	fz_glyph *val = entry->val;
 
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	if (entry->lru_prev)
 		entry->lru_prev->lru_next = entry->lru_next;
 	else
-		cache->lru_head = entry->lru_next;
-	cache->total -= fz_glyph_size(ctx, entry->val);
+		shard->lru_head = entry->lru_next;
+	shard->total -= fz_glyph_size(ctx, entry->val);
 	if (entry->bucket_next)
 		entry->bucket_next->bucket_prev = entry->bucket_prev;
 	if (entry->bucket_prev)
 		entry->bucket_prev->bucket_next = entry->bucket_next;
 	else
 		cache->entry[entry->hash] = entry->bucket_next;
-	fz_drop_font(ctx, entry->key.font);
-	fz_drop_glyph(ctx, entry->val);
-	fz_free(ctx, entry);
+	if (entry->key.font)
+		fz_drop_font(ctx, entry->key.font);
+	if (page)
+	{
+		/* Mark the slot as unused for evict_atlas_page */
+		entry->val = NULL;
+		fz_drop_glyph(ctx, val);
+		drop_atlas_page(ctx, page);
+	}
+	else
+	{
+		fz_drop_glyph(ctx, val);
+		fz_free(ctx, entry);
+	}
 }
 
-/* The glyph cache lock is always held when this function is called. */
+/* The shard lock is held when this function is called. */
 static void
-do_purge(fz_context *ctx)
+evict_atlas_page(fz_context *ctx, fz_glyph_cache *cache, fz_glyph_cache_shard *shard, fz_glyph_atlas_page *page)
+{
+	size_t pos, slot;
+
+	/* Hold the page while we walk it */
+	fz_keep_imp(ctx, page, &page->refs);
+	for (pos = 0; pos < page->used; pos += slot)
+	{
+		fz_glyph_cache_entry *entry = (fz_glyph_cache_entry *)(page->data + pos);
+		fz_glyph *glyph = (fz_glyph *)((unsigned char *)entry + GLYPH_ATLAS_ENTRY_SIZE);
+
+		slot = GLYPH_ATLAS_ENTRY_SIZE + GLYPH_ATLAS_ALIGN(sizeof(fz_glyph) + glyph->size);
+		if (entry->val == NULL)
+			continue;
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, glyph);
+		drop_glyph_cache_entry(ctx, cache, entry);
+	}
+	if (shard->atlas == page)
+	{
+		shard->atlas = NULL;
+		drop_atlas_page(ctx, page);
+	}
+	drop_atlas_page(ctx, page);
+}
+
+/* The lock for the shard is held when this function is called, unless
+ * nobody else can be using the cache. */
+static void
+do_purge(fz_context *ctx, fz_glyph_cache *cache, int n)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
 	int i;
 
-	for (i = 0; i < GLYPH_HASH_LEN; i++)
+	for (i = n; i < GLYPH_HASH_LEN; i += FZ_GLYPH_CACHE_SHARDS)
 	{
 		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+			drop_glyph_cache_entry(ctx, cache, cache->entry[i]);
 	}
 
-	cache->total = 0;
+	if (cache->shard[n].atlas)
+	{
+		drop_atlas_page(ctx, cache->shard[n].atlas);
+		cache->shard[n].atlas = NULL;
+	}
+
+	cache->shard[n].total = 0;
 }
 
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	int i;
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		do_purge(ctx, ctx->glyph_cache, i);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
+	fz_glyph_cache *cache;
+	int i, drop;
+
 	if (!ctx || !ctx->glyph_cache)
 		return;
 
+	cache = ctx->glyph_cache;
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	drop = --cache->refs == 0;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache = NULL;
+
+	if (drop)
 	{
-		do_purge(ctx);
-		fz_free(ctx, ctx->glyph_cache);
-		ctx->glyph_cache = NULL;
+		for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+			do_purge(ctx, cache, i);
+		fz_free(ctx, cache);
 	}
+}
+
+/*
+	Choose whether glyphs are cached by font content rather than by
+	fz_font.
+
+	By default, cached glyphs are keyed on the fz_font they were
+	rendered from, and keep that font alive. With digest keys enabled,
+	glyphs from fonts that are identified by their file (see
+	fz_font_glyph_digest) are keyed on the digest of that file instead.
+	Those glyphs then outlive the document they came from, and are
+	reused by any later document that embeds the same font.
+
+	This should be set before any glyphs are rendered.
+*/
+void
+fz_set_glyph_cache_digest_keys(fz_context *ctx, int enable)
+{
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache->digest_keys = !!enable;
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
 
@@ -226,7 +409,7 @@ static unsigned do_hash(unsigned char *s, int len)
 }
 
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -236,25 +419,52 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	/* Relink */
-	entry->lru_next = cache->lru_head;
+	entry->lru_next = shard->lru_head;
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry;
-	cache->lru_head = entry;
+	shard->lru_head = entry;
 	entry->lru_prev = NULL;
 }
 
+/* The shard lock is held when this function is called. */
+static void
+evict_from_shard(fz_context *ctx, fz_glyph_cache *cache, fz_glyph_cache_shard *shard)
+{
+	fz_glyph_cache_entry *entry;
+
+	while (shard->total > MAX_CACHE_SIZE / FZ_GLYPH_CACHE_SHARDS && (entry = shard->lru_tail) != NULL)
+	{
+		if (entry->referenced)
+		{
+			/* Give it a second chance */
+			entry->referenced = 0;
+			move_to_front(shard, entry);
+			continue;
+		}
+		if (entry->page)
+		{
+			evict_atlas_page(ctx, cache, shard, entry->page);
+			continue;
+		}
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, entry->val);
+		drop_glyph_cache_entry(ctx, cache, entry);
+	}
+}
+
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor, int alpha, int aa)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *shard;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
 	float size;
 	fz_glyph *val;
-	int do_cache, locked, caching;
+	int do_cache, locked, caching, lock;
 	fz_glyph_cache_entry *entry;
 	unsigned hash;
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
@@ -285,6 +495,17 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	cache = ctx->glyph_cache;
 
 	key.font = font;
+	if (cache->digest_keys && is_ft_font)
+	{
+		key.variant = fz_font_glyph_digest(ctx, font, key.digest);
+		if (key.variant >= 0)
+			key.font = NULL;
+		else
+		{
+			key.variant = 0;
+			memset(key.digest, 0, sizeof key.digest);
+		}
+	}
 	key.gid = gid;
 	key.a = subpix_ctm.a * 65536;
 	key.b = subpix_ctm.b * 65536;
@@ -293,15 +514,19 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.aa = aa;
 
 	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	shard = &cache->shard[hash % FZ_GLYPH_CACHE_SHARDS];
+	lock = FZ_LOCK_GLYPHCACHE + hash % FZ_GLYPH_CACHE_SHARDS;
+	fz_lock(ctx, lock);
+	shard->lookups++;
 	entry = cache->entry[hash];
 	while (entry)
 	{
 		if (memcmp(&entry->key, &key, sizeof(key)) == 0)
 		{
-			move_to_front(cache, entry);
+			shard->hits++;
+			entry->referenced = 1;
 			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 			return val;
 		}
 		entry = entry->bucket_next;
@@ -328,10 +553,10 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 			 * we insert ours to find one already there, we
 			 * abandon ours, and use the one there already.
 			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 			locked = 0;
 			val = fz_render_t3_glyph(ctx, font, gid, subpix_ctm, model, scissor, aa);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_lock(ctx, lock);
 			locked = 1;
 		}
 		else
@@ -355,7 +580,7 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
 						{
 							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
+							entry->referenced = 1;
 							val = fz_keep_glyph(ctx, entry->val);
 							goto unlock_and_return_val;
 						}
@@ -363,32 +588,38 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 					}
 				}
 
-				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
+				if (val->pixmap == NULL && fz_glyph_size(ctx, val) <= GLYPH_ATLAS_MAX_GLYPH)
+				{
+					entry = new_atlas_entry(ctx, shard, val);
+					fz_drop_glyph(ctx, val);
+					val = fz_keep_glyph(ctx, entry->val);
+				}
+				else
+				{
+					entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
+					entry->val = fz_keep_glyph(ctx, val);
+				}
 				entry->key = key;
 				entry->hash = hash;
 				entry->bucket_next = cache->entry[hash];
 				if (entry->bucket_next)
 					entry->bucket_next->bucket_prev = entry;
 				cache->entry[hash] = entry;
-				entry->val = fz_keep_glyph(ctx, val);
-				fz_keep_font(ctx, key.font);
+				if (key.font)
+					fz_keep_font(ctx, key.font);
 
-				entry->lru_next = cache->lru_head;
+				entry->lru_next = shard->lru_head;
 				if (entry->lru_next)
 					entry->lru_next->lru_prev = entry;
 				else
-					cache->lru_tail = entry;
-				cache->lru_head = entry;
-
-				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
+					shard->lru_tail = entry;
+				shard->lru_head = entry;
+
+				shard->inserts++;
+				shard->total += fz_glyph_size(ctx, val);
+				evict_from_shard(ctx, cache, shard);
+				if (shard->total > shard->high_water)
+					shard->high_water = shard->total;
 			}
 		}
 unlock_and_return_val:
@@ -398,7 +629,7 @@ unlock_and_return_val:
 	fz_always(ctx)
 	{
 		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 	}
 	fz_catch(ctx)
 	{
@@ -447,13 +678,43 @@ fz_render_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm,
 	return val;
 }
 
+/*
+	Read the usage statistics of the glyph cache.
+*/
 void
-fz_dump_glyph_cache_stats(fz_context *ctx)
+fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	memset(stats, 0, sizeof *stats);
+	stats->max = MAX_CACHE_SIZE;
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		stats->lookups += shard->lookups;
+		stats->hits += shard->hits;
+		stats->inserts += shard->inserts;
+		stats->evictions += shard->num_evictions;
+		stats->evicted += shard->evicted;
+		stats->size += shard->total;
+		stats->high_water += shard->high_water;
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
+	stats->misses = stats->lookups - stats->hits;
+}
+
+void
+fz_dump_glyph_cache_stats(fz_context *ctx)
+{
+	fz_glyph_cache_stats stats;
+
+	fz_get_glyph_cache_stats(ctx, &stats);
 
-	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Size: %zu\n", cache->total);
-#ifndef NDEBUG
-	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Evictions: %d (%zu bytes)\n", cache->num_evictions, cache->evicted);
-#endif
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Size: %zu of %zu\n", stats.size, stats.max);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache High Water: %zu\n", stats.high_water);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache: lookups=%zu hits=%zu misses=%zu inserts=%zu\n", stats.lookups, stats.hits, stats.misses, stats.inserts);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Evictions: %zu (%zu bytes)\n", stats.evictions, stats.evicted);
 }
@@ -430,6 +430,8 @@ typedef enum
 
 fz_rasterizer *fz_new_edgebuffer(fz_context *ctx, fz_edgebuffer_rule rule);
 
+fz_rasterizer *fz_new_cellbuffer(fz_context *ctx);
+
 int fz_flatten_fill_path(fz_context *ctx, fz_rasterizer *rast, const fz_path *path, fz_matrix ctm, float flatness, const fz_irect *irect, fz_irect *bounds);
 int fz_flatten_stroke_path(fz_context *ctx, fz_rasterizer *rast, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth, const fz_irect *irect, fz_irect *bounds);
 
@@ -458,4 +460,7 @@ void fz_blend_pixmap_knockout(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, c
 
 void fz_paint_glyph(const unsigned char *colorbv, fz_pixmap *dst, unsigned char *dp, const fz_glyph *glyph, int w, int h, int skip_x, int skip_y, const fz_overprint *eop);
 
+int fz_draw_clip_path_is_rect(fz_context *ctx, fz_device *dev, const fz_path *path, fz_matrix ctm, fz_rect scissor);
+fz_irect fz_draw_device_scissor(fz_context *ctx, fz_device *dev);
+
 #endif
@@ -1,9 +1,14 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "fitz-imp.h"
 
 #include <string.h>
 #include <assert.h>
 
+#if FZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
 /*
 
 The functions in this file implement various flavours of Porter-Duff blending.
@@ -76,6 +81,268 @@ and stick to using the premultiplied form.
 
 typedef unsigned char byte;
 
+#if FZ_SIMD_X86
+
+/*
+	SIMD versions of the commonest painters.
+
+	All the arithmetic is done in 16 bit lanes, which hold the
+	intermediate values of FZ_BLEND, FZ_COMBINE and FZ_EXPAND exactly,
+	so these give bit identical results to the C versions. Each one
+	comes in an SSE2 flavour (always present on x86-64) and an AVX2
+	flavour; the painter lookups pick between them and the C versions
+	according to fz_cpu_features().
+*/
+
+static inline __m128i
+blend_sse2(__m128i c, __m128i d, __m128i a)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_slli_epi16(d, 8), _mm_mullo_epi16(_mm_sub_epi16(c, d), a)), 8);
+}
+
+static inline __m128i
+combine_sse2(__m128i a, __m128i b)
+{
+	return _mm_srli_epi16(_mm_mullo_epi16(a, b), 8);
+}
+
+static inline __m128i
+expand_sse2(__m128i a)
+{
+	return _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+}
+
+/* Load the mask values for 16 bytes worth of n byte pixels, with each
+ * value repeated across the bytes of its pixel. */
+static inline __m128i
+load_mask_sse2(const byte * FZ_RESTRICT mp, int n)
+{
+	__m128i m;
+	int32_t v;
+
+	if (n == 1)
+		return _mm_loadu_si128((const __m128i *)mp);
+	if (n == 2)
+	{
+		m = _mm_loadl_epi64((const __m128i *)mp);
+		return _mm_unpacklo_epi8(m, m);
+	}
+	memcpy(&v, mp, 4);
+	m = _mm_cvtsi32_si128(v);
+	m = _mm_unpacklo_epi8(m, m);
+	return _mm_unpacklo_epi16(m, m);
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+blend_avx2(__m256i c, __m256i d, __m256i a)
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_slli_epi16(d, 8), _mm256_mullo_epi16(_mm256_sub_epi16(c, d), a)), 8);
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+combine_avx2(__m256i a, __m256i b)
+{
+	return _mm256_srli_epi16(_mm256_mullo_epi16(a, b), 8);
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+expand_avx2(__m256i a)
+{
+	return _mm256_add_epi16(a, _mm256_srli_epi16(a, 7));
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+load_mask_avx2(const byte * FZ_RESTRICT mp, int n)
+{
+	__m256i m;
+
+	if (n == 1)
+		return _mm256_loadu_si256((const __m256i *)mp);
+	if (n == 2)
+	{
+		m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)mp));
+		return _mm256_or_si256(m, _mm256_slli_epi16(m, 8));
+	}
+	m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)mp));
+	return _mm256_mullo_epi32(m, _mm256_set1_epi32(0x01010101));
+}
+
+/* The color of an n byte pixel (n = 1, 2 or 4), with an opaque alpha
+ * if da, repeated to fill 4 bytes. */
+static inline int32_t
+color_pattern(int n, const byte * FZ_RESTRICT color, int da)
+{
+	union { int32_t w; byte b[4]; } u;
+	int n1 = n - da;
+	int k;
+
+	for (k = 0; k < n1; k++)
+		u.b[k] = color[k];
+	if (da)
+		u.b[n1] = 255;
+	for (k = n; k < 4; k++)
+		u.b[k] = u.b[k - n];
+	return u.w;
+}
+
+static void
+paint_solid_color_sse2(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int sa = FZ_EXPAND(color[n - da]);
+	int32_t pat = color_pattern(n, color, da);
+	const byte *pb = (const byte *)&pat;
+	__m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_set1_epi32(pat);
+	__m128i c16 = _mm_unpacklo_epi8(c, zero);
+	__m128i a = _mm_set1_epi16(sa);
+	int len = n * w;
+	int i;
+
+	TRACK_FN();
+	if (sa == 0)
+		return;
+	if (sa == 256)
+	{
+		for (; len >= 16; len -= 16, dp += 16)
+			_mm_storeu_si128((__m128i *)dp, c);
+		for (i = 0; i < len; i++)
+			dp[i] = pb[i & 3];
+		return;
+	}
+	for (; len >= 16; len -= 16, dp += 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i lo = blend_sse2(c16, _mm_unpacklo_epi8(d, zero), a);
+		__m128i hi = blend_sse2(c16, _mm_unpackhi_epi8(d, zero), a);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	for (i = 0; i < len; i++)
+		dp[i] = FZ_BLEND(pb[i & 3], dp[i], sa);
+}
+
+FZ_TARGET_AVX2 static void
+paint_solid_color_avx2(byte * FZ_RESTRICT dp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int sa = FZ_EXPAND(color[n - da]);
+	int32_t pat = color_pattern(n, color, da);
+	const byte *pb = (const byte *)&pat;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i c = _mm256_set1_epi32(pat);
+	__m256i c16 = _mm256_unpacklo_epi8(c, zero);
+	__m256i a = _mm256_set1_epi16(sa);
+	int len = n * w;
+	int i;
+
+	TRACK_FN();
+	if (sa == 0)
+		return;
+	if (sa == 256)
+	{
+		for (; len >= 32; len -= 32, dp += 32)
+			_mm256_storeu_si256((__m256i *)dp, c);
+		for (i = 0; i < len; i++)
+			dp[i] = pb[i & 3];
+		return;
+	}
+	for (; len >= 32; len -= 32, dp += 32)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)dp);
+		__m256i lo = blend_avx2(c16, _mm256_unpacklo_epi8(d, zero), a);
+		__m256i hi = blend_avx2(c16, _mm256_unpackhi_epi8(d, zero), a);
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+	}
+	for (i = 0; i < len; i++)
+		dp[i] = FZ_BLEND(pb[i & 3], dp[i], sa);
+}
+
+static void
+paint_span_with_color_sse2(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int sa = FZ_EXPAND(color[n - da]);
+	int32_t pat = color_pattern(n, color, da);
+	const byte *pb = (const byte *)&pat;
+	__m128i zero = _mm_setzero_si128();
+	__m128i c16 = _mm_unpacklo_epi8(_mm_set1_epi32(pat), zero);
+	__m128i a = _mm_set1_epi16(sa);
+	int step = 16 / n;
+	int i, ma;
+
+	TRACK_FN();
+	if (sa == 0)
+		return;
+	for (; w >= step; w -= step, dp += 16, mp += step)
+	{
+		__m128i m = load_mask_sse2(mp, n);
+		__m128i d, mlo, mhi;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) == 0xFFFF)
+			continue;
+		d = _mm_loadu_si128((const __m128i *)dp);
+		mlo = expand_sse2(_mm_unpacklo_epi8(m, zero));
+		mhi = expand_sse2(_mm_unpackhi_epi8(m, zero));
+		if (sa != 256)
+		{
+			mlo = combine_sse2(mlo, a);
+			mhi = combine_sse2(mhi, a);
+		}
+		mlo = blend_sse2(c16, _mm_unpacklo_epi8(d, zero), mlo);
+		mhi = blend_sse2(c16, _mm_unpackhi_epi8(d, zero), mhi);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(mlo, mhi));
+	}
+	for (i = 0; i < w * n; i++)
+	{
+		ma = FZ_EXPAND(mp[i / n]);
+		if (sa != 256)
+			ma = FZ_COMBINE(ma, sa);
+		dp[i] = FZ_BLEND(pb[i & 3], dp[i], ma);
+	}
+}
+
+FZ_TARGET_AVX2 static void
+paint_span_with_color_avx2(byte * FZ_RESTRICT dp, const byte * FZ_RESTRICT mp, int n, int w, const byte * FZ_RESTRICT color, int da, const fz_overprint * FZ_RESTRICT eop)
+{
+	int sa = FZ_EXPAND(color[n - da]);
+	int32_t pat = color_pattern(n, color, da);
+	const byte *pb = (const byte *)&pat;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i c16 = _mm256_unpacklo_epi8(_mm256_set1_epi32(pat), zero);
+	__m256i a = _mm256_set1_epi16(sa);
+	int step = 32 / n;
+	int i, ma;
+
+	TRACK_FN();
+	if (sa == 0)
+		return;
+	for (; w >= step; w -= step, dp += 32, mp += step)
+	{
+		__m256i m = load_mask_avx2(mp, n);
+		__m256i d, mlo, mhi;
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero)) == -1)
+			continue;
+		d = _mm256_loadu_si256((const __m256i *)dp);
+		mlo = expand_avx2(_mm256_unpacklo_epi8(m, zero));
+		mhi = expand_avx2(_mm256_unpackhi_epi8(m, zero));
+		if (sa != 256)
+		{
+			mlo = combine_avx2(mlo, a);
+			mhi = combine_avx2(mhi, a);
+		}
+		mlo = blend_avx2(c16, _mm256_unpacklo_epi8(d, zero), mlo);
+		mhi = blend_avx2(c16, _mm256_unpackhi_epi8(d, zero), mhi);
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(mlo, mhi));
+	}
+	for (i = 0; i < w * n; i++)
+	{
+		ma = FZ_EXPAND(mp[i / n]);
+		if (sa != 256)
+			ma = FZ_COMBINE(ma, sa);
+		dp[i] = FZ_BLEND(pb[i & 3], dp[i], ma);
+	}
+}
+
+#endif /* FZ_SIMD_X86 */
+
 /* These are used by the non-aa scan converter */
 
 static inline void
@@ -582,6 +849,12 @@ fz_get_solid_color_painter(int n, const byte * FZ_RESTRICT color, int da, const
 			return paint_solid_color_N_alpha_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+#if FZ_SIMD_X86
+	/* An opaque gray fill is a memset, which is as fast as it gets. */
+	if ((fz_cpu_features() & FZ_CPU_SSE2) &&
+		((FZ_PLOTTERS_G && n-da == 1 && (da || color[1] != 255)) || (FZ_PLOTTERS_RGB && n == 4 && da) || (FZ_PLOTTERS_CMYK && n == 4 && !da)))
+		return (fz_cpu_features() & FZ_CPU_AVX2) ? paint_solid_color_avx2 : paint_solid_color_sse2;
+#endif /* FZ_SIMD_X86 */
 	switch (n-da)
 	{
 		case 0:
@@ -1020,6 +1293,11 @@ fz_get_span_color_painter(int n, int da, const byte * FZ_RESTRICT color, const f
 		return da ? paint_span_with_color_N_da_op : paint_span_with_color_N_op;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+#if FZ_SIMD_X86
+	if ((fz_cpu_features() & FZ_CPU_SSE2) &&
+		((n-da == 1) || (FZ_PLOTTERS_RGB && n == 4 && da) || (FZ_PLOTTERS_CMYK && n == 4 && !da)))
+		return (fz_cpu_features() & FZ_CPU_AVX2) ? paint_span_with_color_avx2 : paint_span_with_color_sse2;
+#endif /* FZ_SIMD_X86 */
 	switch(n-da)
 	{
 	case 0: return da ? paint_span_with_color_0_da : NULL;
@@ -1992,6 +2270,219 @@ paint_span_N_general_alpha_op(byte * FZ_RESTRICT dp, int da, const byte * FZ_RES
 }
 #endif /* FZ_ENABLE_SPOT_RENDERING */
 
+#if FZ_SIMD_X86
+
+/* Two premultiplied rgba pixels in 16 bit lanes: s over d. */
+static inline __m128i
+over_rgba_sse2(__m128i s, __m128i d)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+	__m128i t = _mm_sub_epi16(_mm_set1_epi16(256), expand_sse2(sa));
+	__m128i r = _mm_and_si128(_mm_add_epi16(s, combine_sse2(d, t)), _mm_set1_epi16(255));
+	__m128i skip = _mm_cmpeq_epi16(sa, zero);
+	return _mm_or_si128(_mm_and_si128(skip, d), _mm_andnot_si128(skip, r));
+}
+
+/* Two premultiplied rgba pixels in 16 bit lanes: s (scaled by the
+ * expanded alpha a) over d. */
+static inline __m128i
+over_rgba_alpha_sse2(__m128i s, __m128i d, __m128i a)
+{
+	__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+	__m128i t = expand_sse2(_mm_sub_epi16(_mm_set1_epi16(255), combine_sse2(sa, a)));
+	return _mm_and_si128(_mm_add_epi16(combine_sse2(s, a), combine_sse2(d, t)), _mm_set1_epi16(255));
+}
+
+static void
+paint_span_3_da_sa_sse2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i amask = _mm_set1_epi32(0xFF000000);
+
+	TRACK_FN();
+	for (; w >= 4; w -= 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d, as, lo, hi;
+
+		as = _mm_and_si128(s, amask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(as, zero)) == 0xFFFF)
+			continue;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(as, amask)) == 0xFFFF)
+		{
+			_mm_storeu_si128((__m128i *)dp, s);
+			continue;
+		}
+		d = _mm_loadu_si128((const __m128i *)dp);
+		lo = over_rgba_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+		hi = over_rgba_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	if (w)
+		template_span_3_general(dp, 1, sp, 1, w);
+}
+
+static void
+paint_span_3_da_sa_alpha_sse2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(FZ_EXPAND(alpha));
+
+	TRACK_FN();
+	for (; w >= 4; w -= 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i lo = over_rgba_alpha_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), a);
+		__m128i hi = over_rgba_alpha_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), a);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	if (w)
+		template_span_3_with_alpha_general(dp, 1, sp, 1, w, alpha);
+}
+
+/* Without alpha planes every byte is treated the same, whatever n. */
+static void
+paint_span_alpha_sse2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	int t = FZ_EXPAND(255 - alpha);
+	__m128i zero = _mm_setzero_si128();
+	__m128i va = _mm_set1_epi16(alpha);
+	__m128i vt = _mm_set1_epi16(t);
+	__m128i k255 = _mm_set1_epi16(255);
+	int len = n * w;
+	int i;
+
+	TRACK_FN();
+	for (; len >= 16; len -= 16, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i lo = _mm_add_epi16(combine_sse2(_mm_unpacklo_epi8(s, zero), va), combine_sse2(_mm_unpacklo_epi8(d, zero), vt));
+		__m128i hi = _mm_add_epi16(combine_sse2(_mm_unpackhi_epi8(s, zero), va), combine_sse2(_mm_unpackhi_epi8(d, zero), vt));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(_mm_and_si128(lo, k255), _mm_and_si128(hi, k255)));
+	}
+	for (i = 0; i < len; i++)
+		dp[i] = FZ_COMBINE(sp[i], alpha) + FZ_COMBINE(dp[i], t);
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+over_rgba_avx2(__m256i s, __m256i d)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+	__m256i t = _mm256_sub_epi16(_mm256_set1_epi16(256), expand_avx2(sa));
+	__m256i r = _mm256_and_si256(_mm256_add_epi16(s, combine_avx2(d, t)), _mm256_set1_epi16(255));
+	return _mm256_blendv_epi8(r, d, _mm256_cmpeq_epi16(sa, zero));
+}
+
+FZ_TARGET_AVX2 static inline __m256i
+over_rgba_alpha_avx2(__m256i s, __m256i d, __m256i a)
+{
+	__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+	__m256i t = expand_avx2(_mm256_sub_epi16(_mm256_set1_epi16(255), combine_avx2(sa, a)));
+	return _mm256_and_si256(_mm256_add_epi16(combine_avx2(s, a), combine_avx2(d, t)), _mm256_set1_epi16(255));
+}
+
+FZ_TARGET_AVX2 static void
+paint_span_3_da_sa_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i amask = _mm256_set1_epi32(0xFF000000);
+
+	TRACK_FN();
+	for (; w >= 8; w -= 8, dp += 32, sp += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i d, as, lo, hi;
+
+		as = _mm256_and_si256(s, amask);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(as, zero)) == -1)
+			continue;
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(as, amask)) == -1)
+		{
+			_mm256_storeu_si256((__m256i *)dp, s);
+			continue;
+		}
+		d = _mm256_loadu_si256((const __m256i *)dp);
+		lo = over_rgba_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+		hi = over_rgba_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+	}
+	if (w)
+		template_span_3_general(dp, 1, sp, 1, w);
+}
+
+FZ_TARGET_AVX2 static void
+paint_span_3_da_sa_alpha_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_set1_epi16(FZ_EXPAND(alpha));
+
+	TRACK_FN();
+	for (; w >= 8; w -= 8, dp += 32, sp += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i d = _mm256_loadu_si256((const __m256i *)dp);
+		__m256i lo = over_rgba_alpha_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), a);
+		__m256i hi = over_rgba_alpha_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), a);
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+	}
+	if (w)
+		template_span_3_with_alpha_general(dp, 1, sp, 1, w, alpha);
+}
+
+FZ_TARGET_AVX2 static void
+paint_span_alpha_avx2(byte * FZ_RESTRICT dp, int da, const byte * FZ_RESTRICT sp, int sa, int n, int w, int alpha, const fz_overprint * FZ_RESTRICT eop)
+{
+	int t = FZ_EXPAND(255 - alpha);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i va = _mm256_set1_epi16(alpha);
+	__m256i vt = _mm256_set1_epi16(t);
+	__m256i k255 = _mm256_set1_epi16(255);
+	int len = n * w;
+	int i;
+
+	TRACK_FN();
+	for (; len >= 32; len -= 32, dp += 32, sp += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i d = _mm256_loadu_si256((const __m256i *)dp);
+		__m256i lo = _mm256_add_epi16(combine_avx2(_mm256_unpacklo_epi8(s, zero), va), combine_avx2(_mm256_unpacklo_epi8(d, zero), vt));
+		__m256i hi = _mm256_add_epi16(combine_avx2(_mm256_unpackhi_epi8(s, zero), va), combine_avx2(_mm256_unpackhi_epi8(d, zero), vt));
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(_mm256_and_si256(lo, k255), _mm256_and_si256(hi, k255)));
+	}
+	for (i = 0; i < len; i++)
+		dp[i] = FZ_COMBINE(sp[i], alpha) + FZ_COMBINE(dp[i], t);
+}
+
+static fz_span_painter_t *
+simd_span_painter(int da, int sa, int n, int alpha)
+{
+	int features = fz_cpu_features();
+	int avx2 = features & FZ_CPU_AVX2;
+
+	if (!(features & FZ_CPU_SSE2) || alpha <= 0 || da != sa)
+		return NULL;
+	if (da)
+	{
+		if (!FZ_PLOTTERS_RGB || n != 3)
+			return NULL;
+		if (alpha == 255)
+			return avx2 ? paint_span_3_da_sa_avx2 : paint_span_3_da_sa_sse2;
+		return avx2 ? paint_span_3_da_sa_alpha_avx2 : paint_span_3_da_sa_alpha_sse2;
+	}
+	/* An opaque copy is left to the C versions. */
+	if (alpha == 255)
+		return NULL;
+	if ((FZ_PLOTTERS_G && n == 1) || (FZ_PLOTTERS_RGB && n == 3) || (FZ_PLOTTERS_CMYK && n == 4))
+		return avx2 ? paint_span_alpha_avx2 : paint_span_alpha_sse2;
+	return NULL;
+}
+
+#endif /* FZ_SIMD_X86 */
+
 fz_span_painter_t *
 fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RESTRICT eop)
 {
@@ -2006,6 +2497,13 @@ fz_get_span_painter(int da, int sa, int n, int alpha, const fz_overprint * FZ_RE
 			return NULL;
 	}
 #endif /* FZ_ENABLE_SPOT_RENDERING */
+#if FZ_SIMD_X86
+	{
+		fz_span_painter_t *simd = simd_span_painter(da, sa, n, alpha);
+		if (simd)
+			return simd;
+	}
+#endif /* FZ_SIMD_X86 */
 	switch (n)
 	{
 	case 0:
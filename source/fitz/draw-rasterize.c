@@ -87,7 +87,9 @@ fz_set_rasterizer_text_aa_level(fz_context *ctx, fz_aa_context *aa, int level)
 			fz_warn(ctx, "Only the %d bit anti-aliasing rasterizer was compiled in", fz_aa_bits);
 	}
 #else
-	if (level > 8)
+	if (level == 11)
+		aa->text_bits = 8;
+	else if (level > 8)
 		aa->text_bits = 0;
 	else if (level > 6)
 		aa->text_bits = 8;
@@ -116,7 +118,7 @@ fz_set_rasterizer_graphics_aa_level(fz_context *ctx, fz_aa_context *aa, int leve
 			fz_warn(ctx, "Only the %d bit anti-aliasing rasterizer was compiled in", fz_aa_bits);
 	}
 #else
-	if (level == 9 || level == 10)
+	if (level == 9 || level == 10 || level == 11)
 	{
 		aa->hscale = 1;
 		aa->vscale = 1;
@@ -332,7 +334,9 @@ fz_rasterizer *fz_new_rasterizer(fz_context *ctx, const fz_aa_context *aa)
 		aa = ctx->aa;
 	bits = aa->bits;
 #endif
-	if (bits == 10)
+	if (bits == 11)
+		r = fz_new_cellbuffer(ctx);
+	else if (bits == 10)
 		r = fz_new_edgebuffer(ctx, FZ_EDGEBUFFER_ANY_PART_OF_PIXEL);
 	else if (bits == 9)
 		r = fz_new_edgebuffer(ctx, FZ_EDGEBUFFER_CENTER_OF_PIXEL);
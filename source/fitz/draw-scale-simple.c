@@ -12,12 +12,17 @@ intermediate results rather than ints.
 
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "fitz-imp.h"
 
 #include <math.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
 
+#if FZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
 /* Do we special case handling of single pixel high/wide images? The
  * 'purest' handling is given by not special casing them, but certain
  * files that use such images 'stack' them to give full images. Not
@@ -1259,6 +1264,273 @@ scale_row_from_temp_alpha(unsigned char * FZ_RESTRICT dst, const unsigned char *
 }
 #endif
 
+#if FZ_SIMD_X86
+
+/*
+	SIMD versions of the weight application. The weights are at most
+	a few hundred, so each source sample times weight product fits in
+	a signed 16 bit lane, and pmaddwd sums pairs of them into 32 bit
+	lanes exactly. The results are therefore identical to those of the
+	C versions above, including the truncation to unsigned char.
+*/
+
+/* Check whether every weight in the table fits in a signed 16 bit lane. */
+static int
+weights_fit_short(const fz_weights *weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int i, len;
+
+	for (i = weights->count; i > 0; i--)
+	{
+		contrib++; /* Skip min */
+		len = *contrib++;
+		while (len-- > 0)
+		{
+			int c = *contrib++;
+			if (c < -32768 || c > 32767)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	Horizontal scaling reads len source pixels for each output pixel,
+	so we rearrange the weights into pairs, one pair per 32 bit word
+	(first weight in the low half), to be multiplied against two
+	interleaved source pixels at a time. An odd final weight is paired
+	with 0. Returns NULL if the table cannot be represented (or we fail
+	to allocate it), in which case the C version should be used.
+*/
+static int *
+pack_weight_pairs(fz_context *ctx, const fz_weights *weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int *pairs, *p;
+	size_t size = 0;
+	int i, len;
+
+	if (!weights_fit_short(weights))
+		return NULL;
+
+	for (i = weights->count; i > 0; i--)
+	{
+		len = contrib[1];
+		size += (len+1)>>1;
+		contrib += 2 + len;
+	}
+
+	p = pairs = fz_malloc_array_no_throw(ctx, size + 1, sizeof(int));
+	if (!pairs)
+		return NULL;
+
+	contrib = &weights->index[weights->index[0]];
+	for (i = weights->count; i > 0; i--)
+	{
+		contrib++; /* Skip min */
+		len = *contrib++;
+		for (; len >= 2; len -= 2, contrib += 2)
+			*p++ = (int)(((unsigned int)contrib[0] & 0xffff) | ((unsigned int)contrib[1] << 16));
+		if (len)
+			*p++ = (int)((unsigned int)*contrib++ & 0xffff);
+	}
+
+	return pairs;
+}
+
+static inline unsigned int
+load_u32(const unsigned char *s)
+{
+	unsigned int v;
+	memcpy(&v, s, 4);
+	return v;
+}
+
+/* Reduce the 4 32 bit sums in acc to bytes, as (unsigned char)(acc>>8). */
+static inline unsigned int
+sums_to_bytes_sse2(__m128i acc)
+{
+	__m128i v = _mm_and_si128(_mm_srai_epi32(acc, 8), _mm_set1_epi32(0xff));
+	v = _mm_packs_epi32(v, v);
+	return (unsigned int)_mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+}
+
+/* Multiply two source pixels (held in the low and high 32 bits of px)
+ * by a pair of weights, adding the channel sums into acc. */
+static inline __m128i
+madd_pixels_sse2(__m128i acc, __m128i px, int pair)
+{
+	__m128i zero = _mm_setzero_si128();
+	px = _mm_unpacklo_epi8(px, _mm_srli_si128(px, 4));
+	px = _mm_unpacklo_epi8(px, zero);
+	return _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(pair)));
+}
+
+static inline void
+scale_row_to_temp_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, const int * FZ_RESTRICT pairs, const int n)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int len, i, step;
+	const unsigned char *min;
+
+	assert(weights->n == n);
+	step = n;
+	if (weights->flip)
+	{
+		dst += n*(weights->count-1);
+		step = -n;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = _mm_set1_epi32(128);
+		unsigned int v;
+		min = &src[n * *contrib++];
+		len = *contrib++;
+		contrib += len;
+		for (; len >= 2; len -= 2, min += 2*n)
+		{
+			__m128i px;
+			if (n == 4)
+				px = _mm_loadl_epi64((const __m128i *)min);
+			else
+				/* The second pixel is read from the 4 bytes ending
+				 * with it, so as not to read beyond the row. */
+				px = _mm_unpacklo_epi32(_mm_cvtsi32_si128(load_u32(min)), _mm_cvtsi32_si128(load_u32(min+2)>>8));
+			acc = madd_pixels_sse2(acc, px, *pairs++);
+		}
+		if (len)
+		{
+			if (n == 4)
+				v = load_u32(min);
+			else
+				v = min[0] | (min[1]<<8) | (min[2]<<16);
+			acc = madd_pixels_sse2(acc, _mm_cvtsi32_si128(v), *pairs++);
+		}
+		v = sums_to_bytes_sse2(acc);
+		if (n == 4)
+			memcpy(dst, &v, 4);
+		else
+		{
+			dst[0] = (unsigned char)v;
+			dst[1] = (unsigned char)(v>>8);
+			dst[2] = (unsigned char)(v>>16);
+		}
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp3_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, const int * FZ_RESTRICT pairs)
+{
+	scale_row_to_temp_sse2(dst, src, weights, pairs, 3);
+}
+
+static void
+scale_row_to_temp4_sse2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, const int * FZ_RESTRICT pairs)
+{
+	scale_row_to_temp_sse2(dst, src, weights, pairs, 4);
+}
+
+/*
+	Vertical scaling applies the same len weights down each column of
+	the temporary buffer, so here we work 16 bytes across the row at a
+	time, with one pair of weights broadcast for each pair of rows.
+	Calculates bytes x..x+count-1 of the output row.
+*/
+FZ_TARGET_AVX2 static void
+weigh_rows_avx2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const int * FZ_RESTRICT contrib, int len, int width, int x, int count)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i round = _mm256_set1_epi32(128);
+	__m256i mask = _mm256_set1_epi32(0xff);
+	int end = x + count;
+
+	for (; x + 16 <= end; x += 16)
+	{
+		const unsigned char *s = src + x;
+		__m256i lo = round;
+		__m256i hi = round;
+		__m256i a, b, w;
+		__m128i out;
+		int k;
+
+		for (k = 0; k + 1 < len; k += 2, s += 2*width)
+		{
+			a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)s));
+			b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(s + width)));
+			w = _mm256_set1_epi32((int)(((unsigned int)contrib[k] & 0xffff) | ((unsigned int)contrib[k+1] << 16)));
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+		}
+		if (k < len)
+		{
+			a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)s));
+			w = _mm256_set1_epi32(contrib[k] & 0xffff);
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), w));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), w));
+		}
+		/* The unpacks and packs both work within 128 bit lanes, so
+		 * the bytes come out in order. */
+		lo = _mm256_and_si256(_mm256_srai_epi32(lo, 8), mask);
+		hi = _mm256_and_si256(_mm256_srai_epi32(hi, 8), mask);
+		lo = _mm256_packus_epi32(lo, hi);
+		out = _mm_packus_epi16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+		_mm_storeu_si128((__m128i *)dst, out);
+		dst += 16;
+	}
+	for (; x < end; x++)
+	{
+		const unsigned char *s = src + x;
+		int val = 128;
+		int k;
+
+		for (k = 0; k < len; k++, s += width)
+			val += *s * contrib[k];
+		*dst++ = (unsigned char)(val>>8);
+	}
+}
+
+FZ_TARGET_AVX2 static void
+scale_row_from_temp_avx2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int len;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	weigh_rows_avx2(dst, src, contrib, len, w * n, 0, w * n);
+}
+
+FZ_TARGET_AVX2 static void
+scale_row_from_temp_alpha_avx2(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	unsigned char buf[1024];
+	int chunk = (sizeof(buf) / n) * n;
+	int width = w * n;
+	int len, x;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	for (x = 0; x < width; x += chunk)
+	{
+		const unsigned char *s = buf;
+		int count = fz_mini(chunk, width - x);
+		int i, nn;
+
+		weigh_rows_avx2(buf, src, contrib, len, width, x, count);
+		for (i = count / n; i > 0; i--)
+		{
+			for (nn = n; nn > 0; nn--)
+				*dst++ = *s++;
+			*dst++ = 255;
+		}
+	}
+}
+
+#endif /* FZ_SIMD_X86 */
+
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
 duplicate_single_pixel(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, int n, int forcealpha, int w, int h, int stride)
@@ -1753,6 +2025,10 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	{
 		void (*row_scale_in)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights);
 		void (*row_scale_out)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, int w, int n, int row);
+#if FZ_SIMD_X86
+		void (*row_scale_in_simd)(unsigned char * FZ_RESTRICT dst, const unsigned char * FZ_RESTRICT src, const fz_weights * FZ_RESTRICT weights, const int * FZ_RESTRICT pairs) = NULL;
+		int *pairs = NULL;
+#endif
 
 		temp_span = contrib_cols->count * src->n;
 		temp_rows = contrib_rows->max_len;
@@ -1790,6 +2066,16 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			break;
 		}
 		row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
+#if FZ_SIMD_X86
+		if ((fz_cpu_features() & FZ_CPU_SSE2) && (src->n == 3 || src->n == 4))
+		{
+			pairs = pack_weight_pairs(ctx, contrib_cols);
+			if (pairs)
+				row_scale_in_simd = src->n == 3 ? scale_row_to_temp3_sse2 : scale_row_to_temp4_sse2;
+		}
+		if ((fz_cpu_features() & FZ_CPU_AVX2) && weights_fit_short(contrib_rows))
+			row_scale_out = forcealpha ? scale_row_from_temp_alpha_avx2 : scale_row_from_temp_avx2;
+#endif
 		max_row = contrib_rows->index[contrib_rows->index[0]];
 		for (row = 0; row < contrib_rows->count; row++)
 		{
@@ -1805,6 +2091,11 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			{
 				/* Scale another row */
 				assert(max_row < src->h);
+#if FZ_SIMD_X86
+				if (row_scale_in_simd)
+					(*row_scale_in_simd)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols, pairs);
+				else
+#endif
 				(*row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols);
 				max_row++;
 			}
@@ -1812,6 +2103,9 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			(*row_scale_out)(&output->samples[row*output->stride], temp, contrib_rows, contrib_cols->count, src->n, row);
 		}
 		fz_free(ctx, temp);
+#if FZ_SIMD_X86
+		fz_free(ctx, pairs);
+#endif
 
 		if (forcealpha)
 			adjust_alpha_edges(output, contrib_rows, contrib_cols);
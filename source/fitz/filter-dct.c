@@ -1,8 +1,17 @@
-#include "mupdf/fitz.h"
+#include "fitz-imp.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <jpeglib.h>
 
+/* libjpeg-turbo can skip scanlines without running the IDCT on them,
+ * and crop scanlines to a range of iMCU columns. */
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define FZ_DCTD_CAN_SKIP 1
+#else
+#define FZ_DCTD_CAN_SKIP 0
+#endif
+
 #ifndef SHARE_JPEG
 typedef void * backing_store_ptr;
 #include "jmemcust.h"
@@ -20,6 +29,9 @@ struct fz_dctd_s
 	int init;
 	int stride;
 	int l2factor;
+	int crop;
+	fz_irect area;
+	int l_skip, out_stride;
 	unsigned char *scanline;
 	unsigned char *rp, *wp;
 	struct jpeg_decompress_struct cinfo;
@@ -151,6 +163,53 @@ static void skip_input_data_dct(j_decompress_ptr cinfo, long num_bytes)
 	}
 }
 
+/* Set the decoder up to produce state->area (in output pixels) only. */
+static void
+start_crop_dctd(fz_context *ctx, fz_dctd *state)
+{
+	j_decompress_ptr cinfo = &state->cinfo;
+	int comps = cinfo->output_components;
+	int x0, y0;
+
+	state->area = fz_intersect_irect(state->area, fz_make_irect(0, 0, cinfo->output_width, cinfo->output_height));
+	if (fz_is_empty_irect(state->area))
+		state->area = fz_make_irect(0, 0, 0, 0);
+	x0 = state->area.x0;
+	y0 = state->area.y0;
+
+#if FZ_DCTD_CAN_SKIP
+	if (state->area.x1 - state->area.x0 < (int)cinfo->output_width)
+	{
+		/* This widens the columns to whole iMCUs, and changes
+		 * output_width to match. Ask for a pixel more on either
+		 * side, as upsampled chroma at the edges of the decoded
+		 * columns lacks its neighbours. */
+		JDIMENSION xoffset = fz_maxi(state->area.x0 - 1, 0);
+		JDIMENSION width = fz_mini(state->area.x1 + 1, cinfo->output_width) - xoffset;
+		jpeg_crop_scanline(cinfo, &xoffset, &width);
+		x0 -= xoffset;
+	}
+	if (y0 > 0)
+		y0 -= jpeg_skip_scanlines(cinfo, y0);
+#endif
+
+	state->l_skip = x0 * comps;
+	state->out_stride = (state->area.x1 - state->area.x0) * comps;
+
+	/* Without skipping support, decode and discard the rows above. */
+	if (y0 > 0)
+	{
+		unsigned char *row = fz_malloc(ctx, cinfo->output_width * comps);
+		fz_try(ctx)
+			while ((int)cinfo->output_scanline < state->area.y0)
+				jpeg_read_scanlines(cinfo, &row, 1);
+		fz_always(ctx)
+			fz_free(ctx, row);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+}
+
 static int
 next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
 {
@@ -233,12 +292,39 @@ next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
 
 			jpeg_start_decompress(cinfo);
 
+			if (state->crop)
+				start_crop_dctd(ctx, state);
+			else
+			{
+				state->area.x0 = 0;
+				state->area.y0 = 0;
+				state->area.x1 = cinfo->output_width;
+				state->area.y1 = cinfo->output_height;
+			}
+
 			state->stride = cinfo->output_width * cinfo->output_components;
 			state->scanline = fz_malloc(ctx, state->stride);
 			state->rp = state->scanline;
 			state->wp = state->scanline;
 		}
 
+		if (state->crop)
+		{
+			/* Every row goes through the scanline buffer to lose
+			 * the columns either side of the area. */
+			while (p < ep)
+			{
+				while (state->rp < state->wp && p < ep)
+					*p++ = *state->rp++;
+				if (p == ep || (int)cinfo->output_scanline >= state->area.y1)
+					break;
+				jpeg_read_scanlines(cinfo, &state->scanline, 1);
+				state->rp = state->scanline + state->l_skip;
+				state->wp = state->rp + state->out_stride;
+			}
+			goto done;
+		}
+
 		while (state->rp < state->wp && p < ep)
 			*p++ = *state->rp++;
 
@@ -262,6 +348,7 @@ next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
 			while (state->rp < state->wp && p < ep)
 				*p++ = *state->rp++;
 		}
+done:
 		stm->rp = state->buffer;
 		stm->wp = p;
 		stm->pos += (p - state->buffer);
@@ -343,3 +430,255 @@ fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2facto
 
 	return fz_new_stream(ctx, state, next_dctd, close_dctd);
 }
+
+/*
+	Open a DCT decode filter that produces only part of the image.
+
+	area: The rows and columns to produce, in pixels of the (l2factor
+	scaled) output. The filter produces the rows of the area, each
+	cut down to the columns of the area. Where the JPEG library allows
+	it, rows above the area are skipped without being decoded, and
+	only the blocks covering the columns are decoded; rows below the
+	area are never decoded.
+*/
+fz_stream *
+fz_open_dctd_subarea(fz_context *ctx, fz_stream *chain, int color_transform, int l2factor, fz_stream *jpegtables, fz_irect area)
+{
+	fz_stream *stm = fz_open_dctd(ctx, chain, color_transform, l2factor, jpegtables);
+	fz_dctd *state = stm->state;
+
+	state->crop = 1;
+	state->area = area;
+
+	return stm;
+}
+
+static int
+jpeg_u16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static int
+jpeg_gcd(int a, int b)
+{
+	while (b)
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+	Index the restart markers of a JPEG file, so that it can be
+	decoded in strips (see fz_open_dctd_strips).
+
+	Only baseline and extended Huffman JPEGs with all the components
+	in a single scan can be cut up. Strips start at an MCU row that
+	is also the start of a restart interval.
+
+	Returns an index, which has a count of less than 2 if the image
+	cannot be cut up.
+*/
+fz_jpeg_index *
+fz_new_jpeg_index(fz_context *ctx, const unsigned char *data, size_t len)
+{
+	fz_jpeg_index *index = NULL;
+	const unsigned char *p, *e;
+	size_t pos = 2, seglen;
+	int w = 0, h = 0, nf = 0, maxh = 1, maxv = 1, ri = 0, height_offset = 0;
+	int mcu_w, mcu_h, mcus_per_row, mcu_rows, step, per_strip, count, i, k;
+	int64_t intervals;
+
+	if (len < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		goto none;
+
+	/* Read the markers up to the start of the scan. */
+	while (1)
+	{
+		int marker;
+
+		while (pos + 1 < len && data[pos] == 0xFF && data[pos+1] == 0xFF)
+			pos++;
+		if (pos + 4 > len || data[pos] != 0xFF)
+			goto none;
+		marker = data[pos+1];
+		seglen = jpeg_u16(data + pos + 2);
+		if (seglen < 2 || pos + 2 + seglen > len)
+			goto none;
+
+		if (marker == 0xC0 || marker == 0xC1)
+		{
+			const unsigned char *sof = data + pos + 4;
+			if (seglen < 8)
+				goto none;
+			height_offset = pos + 5;
+			h = jpeg_u16(sof + 1);
+			w = jpeg_u16(sof + 3);
+			nf = sof[5];
+			if (nf < 1 || seglen < 8 + 3 * (size_t)nf)
+				goto none;
+			for (i = 0; i < nf; i++)
+			{
+				maxh = fz_maxi(maxh, sof[7 + 3*i] >> 4);
+				maxv = fz_maxi(maxv, sof[7 + 3*i] & 15);
+			}
+		}
+		else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4)
+		{
+			/* Progressive, lossless or arithmetic coded. */
+			goto none;
+		}
+		else if (marker == 0xDD)
+		{
+			if (seglen < 4)
+				goto none;
+			ri = jpeg_u16(data + pos + 4);
+		}
+		else if (marker == 0xDA)
+		{
+			/* Components in separate scans cannot be cut up. */
+			if (data[pos+4] != nf)
+				goto none;
+			pos += 2 + seglen;
+			break;
+		}
+		pos += 2 + seglen;
+	}
+
+	if (w == 0 || h == 0 || nf == 0 || ri == 0)
+		goto none;
+
+	if (nf == 1)
+		mcu_w = mcu_h = 8;
+	else
+	{
+		mcu_w = 8 * maxh;
+		mcu_h = 8 * maxv;
+	}
+	mcus_per_row = (w + mcu_w - 1) / mcu_w;
+	mcu_rows = (h + mcu_h - 1) / mcu_h;
+	intervals = ((int64_t)mcus_per_row * mcu_rows + ri - 1) / ri;
+
+	/* The fewest MCU rows that span a whole number of intervals. */
+	step = ri / jpeg_gcd(ri, mcus_per_row);
+	per_strip = step * mcus_per_row / ri;
+	count = (mcu_rows + step - 1) / step;
+	if (count < 2)
+		goto none;
+
+	index = fz_malloc(ctx, sizeof(*index) + count * sizeof(size_t));
+	index->offset[0] = pos;
+
+	/* Find the restart markers that start each strip. */
+	k = 0;
+	p = data + pos;
+	e = data + len;
+	while (1)
+	{
+		p = memchr(p, 0xFF, e - p);
+		if (p == NULL || p + 1 >= e)
+			goto none;
+		if (p[1] == 0x00)
+			p += 2;
+		else if (p[1] == 0xFF)
+			p++;
+		else if (p[1] >= 0xD0 && p[1] <= 0xD7)
+		{
+			k++;
+			if (k % per_strip == 0)
+			{
+				if (k / per_strip >= count)
+					goto none;
+				index->offset[k / per_strip] = p + 2 - data;
+			}
+			p += 2;
+		}
+		else
+			break;
+	}
+	if (k != intervals - 1)
+		goto none;
+	index->offset[count] = p - data;
+
+	index->header_len = (int)index->offset[0];
+	index->height_offset = height_offset;
+	index->w = w;
+	index->h = h;
+	index->strip_h = step * mcu_h;
+	index->context = (nf > 1 && maxv > 1);
+	index->count = count;
+	return index;
+
+none:
+	fz_free(ctx, index);
+	return fz_malloc_struct(ctx, fz_jpeg_index);
+}
+
+/*
+	Open a DCT decode filter for strips first to last-1 of an indexed
+	JPEG (see fz_new_jpeg_index), as if they were an image on their
+	own.
+
+	area: The part of the strips to produce, as for
+	fz_open_dctd_subarea, relative to the top of strip first.
+
+	The data for the strips is copied out with the header of the
+	image, the height changed, and the restart markers renumbered.
+*/
+fz_stream *
+fz_open_dctd_strips(fz_context *ctx, fz_buffer *jpeg, fz_jpeg_index *index, int first, int last, int color_transform, int l2factor, fz_irect area)
+{
+	size_t start = index->offset[first];
+	size_t end = index->offset[last];
+	int h = fz_mini(last * index->strip_h, index->h) - first * index->strip_h;
+	fz_buffer *buf;
+	fz_stream *mem = NULL;
+	fz_stream *stm = NULL;
+	unsigned char *p, *e;
+	int n = 0;
+
+	/* Leave out the restart marker that starts the next strip. */
+	if (last < index->count)
+		end -= 2;
+
+	buf = fz_new_buffer(ctx, index->header_len + (end - start) + 2);
+
+	fz_var(mem);
+
+	fz_try(ctx)
+	{
+		fz_append_data(ctx, buf, jpeg->data, index->header_len);
+		buf->data[index->height_offset] = (h >> 8) & 0xFF;
+		buf->data[index->height_offset + 1] = h & 0xFF;
+
+		fz_append_data(ctx, buf, jpeg->data + start, end - start);
+		p = buf->data + index->header_len;
+		e = buf->data + buf->len;
+		while ((p = memchr(p, 0xFF, e - p)) != NULL && p + 1 < e)
+		{
+			if (p[1] >= 0xD0 && p[1] <= 0xD7)
+				p[1] = 0xD0 + (n++ & 7);
+			if (p[1] == 0xFF)
+				p++;
+			else
+				p += 2;
+		}
+		fz_append_byte(ctx, buf, 0xFF);
+		fz_append_byte(ctx, buf, 0xD9);
+
+		mem = fz_open_buffer(ctx, buf);
+		stm = fz_open_dctd_subarea(ctx, mem, color_transform, l2factor, NULL, area);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, mem);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return stm;
+}
@@ -44,6 +44,14 @@ void fz_new_font_context(fz_context *ctx);
 fz_font_context *fz_keep_font_context(fz_context *ctx);
 void fz_drop_font_context(fz_context *ctx);
 
+int fz_font_glyph_digest(fz_context *ctx, fz_font *font, unsigned char digest[16]);
+int fz_font_ft_face_index(fz_context *ctx, fz_font *font);
+
+int fz_packed_path_size_within(const fz_path *path, int max);
+int fz_packed_path_open_data(const fz_path *path, const unsigned char **cmds, int *cmd_len, const float **coords, int *coord_len);
+void fz_detach_packed_path(fz_path *path);
+void fz_attach_open_path_data(fz_context *ctx, fz_path *path, const unsigned char *cmds, int cmd_len, const float *coords, int coord_len);
+
 struct fz_tuning_context_s
 {
 	int refs;
@@ -51,13 +59,76 @@ struct fz_tuning_context_s
 	void *image_decode_arg;
 	fz_tune_image_scale_fn *image_scale;
 	void *image_scale_arg;
+	fz_tune_parallel_fn *parallel;
+	void *parallel_arg;
+	int image_digests;
 };
 
 void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *subarea);
 int fz_default_image_scale(void *arg, int dst_w, int dst_h, int src_w, int src_h);
+void fz_default_parallel(void *arg, fz_context *ctx, int n, fz_parallel_job_fn *job, void *job_arg);
+
+/*
+	Where a baseline JPEG has restart markers at the start of MCU
+	rows, the image can be cut into strips that decode independently.
+	strip_h is the height of each strip (the last may be shorter),
+	and offset[i] is where the entropy coded data for strip i starts
+	in the file, just after the restart marker. offset[count] is the
+	end of the data. An index with count < 2 means the image cannot
+	be cut up.
+*/
+struct fz_jpeg_index_s
+{
+	int header_len;
+	int height_offset;
+	int w, h;
+	int strip_h;
+	int context; /* Chroma is upsampled vertically across strips */
+	int count;
+	size_t offset[1];
+};
+
+fz_jpeg_index *fz_new_jpeg_index(fz_context *ctx, const unsigned char *data, size_t len);
+fz_stream *fz_open_dctd_strips(fz_context *ctx, fz_buffer *jpeg, fz_jpeg_index *index, int first, int last, int color_transform, int l2factor, fz_irect area);
 
 fz_context *fz_clone_context_internal(fz_context *ctx);
 
+int fz_new_alloc_cache(fz_context *ctx, fz_context *parent);
+void fz_drop_alloc_cache(fz_context *ctx);
+
+unsigned char *fz_get_halftone_plane(fz_context *ctx, fz_halftone *ht, int x, int w, int *h);
+void fz_release_halftone_plane(fz_context *ctx, fz_halftone *ht, unsigned char *plane);
+void fz_threshold_bytes(const unsigned char *ht_line, const unsigned char *src, unsigned char *bits, int len, int ge);
+
+/*
+	SIMD support. FZ_SIMD_X86 is set when the x86 SIMD kernels are
+	built; the functions using the wider instruction sets are marked
+	with FZ_TARGET_... and must only be called when fz_cpu_features
+	reports them as available.
+*/
+enum
+{
+	FZ_CPU_SSE2 = 1,
+	FZ_CPU_SSE41 = 2,
+	FZ_CPU_AVX2 = 4
+};
+
+int fz_cpu_features(void);
+void fz_mask_cpu_features(int mask);
+
+#if FZ_ENABLE_SIMD && defined(ARCH_X86_64)
+#define FZ_SIMD_X86 1
+#if defined(__GNUC__)
+#define FZ_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define FZ_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FZ_TARGET_SSE41
+#define FZ_TARGET_AVX2
+#endif
+#else
+#define FZ_SIMD_X86 0
+#endif
+
 void fz_new_aa_context(fz_context *ctx);
 void fz_drop_aa_context(fz_context *ctx);
 void fz_copy_aa_context(fz_context *dst, fz_context *src);
@@ -2188,3 +2188,47 @@ void fz_font_digest(fz_context *ctx, fz_font *font, unsigned char digest[16])
 	}
 	memcpy(digest, font->digest, 16);
 }
+
+/*
+	Identify the glyphs that a font renders, independently of the
+	fz_font they were loaded through, so that glyphs can be shared
+	between documents that embed the same font program.
+
+	The digest of the font file is returned in digest, and the return
+	value distinguishes between renderings of the same file (face
+	index and synthesized styles). Returns -1 if the rendering of the
+	font depends on more than its file, for instance on widths taken
+	from a PDF, or if it has no file.
+*/
+int fz_font_glyph_digest(fz_context *ctx, fz_font *font, unsigned char digest[16])
+{
+	FT_Face face = font->ft_face;
+
+	if (!face || !font->buffer || font->flags.ft_stretch)
+		return -1;
+
+	/* The digest is computed by whichever thread first asks for it,
+	 * so both it and has_digest are only looked at under the lock. */
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_try(ctx)
+		fz_font_digest(ctx, font, digest);
+	fz_always(ctx)
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_catch(ctx)
+		return -1;
+
+	return (int)(face->face_index & 0xffff) << 2 | font->flags.fake_bold << 1 | font->flags.fake_italic;
+}
+
+/*
+	Return the index of the face within the font file for a
+	FreeType font, or -1 for a font without a FreeType face.
+*/
+int fz_font_ft_face_index(fz_context *ctx, fz_font *font)
+{
+	FT_Face face = font->ft_face;
+
+	if (!face)
+		return -1;
+	return (int)face->face_index;
+}
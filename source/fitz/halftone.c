@@ -2,11 +2,26 @@
 #include "fitz-imp.h"
 
 #include <assert.h>
+#include <string.h>
+
+#if FZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* How many threshold planes (see get_ht_plane) a halftone keeps. */
+#define HT_MAX_PLANES 4
+
+typedef struct
+{
+	int x, w;
+	unsigned char *samples;
+} fz_halftone_plane;
 
 struct fz_halftone_s
 {
 	int refs;
 	int n;
+	fz_halftone_plane plane[HT_MAX_PLANES];
 	fz_pixmap *comp[1];
 };
 
@@ -19,6 +34,7 @@ fz_new_halftone(fz_context *ctx, int comps)
 	ht = fz_malloc(ctx, sizeof(fz_halftone) + (comps-1)*sizeof(fz_pixmap *));
 	ht->refs = 1;
 	ht->n = comps;
+	memset(ht->plane, 0, sizeof ht->plane);
 	for (i = 0; i < comps; i++)
 		ht->comp[i] = NULL;
 
@@ -39,6 +55,8 @@ fz_drop_halftone(fz_context *ctx, fz_halftone *ht)
 	{
 		for (i = 0; i < ht->n; i++)
 			fz_drop_pixmap(ctx, ht->comp[i]);
+		for (i = 0; i < HT_MAX_PLANES; i++)
+			fz_free(ctx, ht->plane[i].samples);
 		fz_free(ctx, ht);
 	}
 }
@@ -161,6 +179,105 @@ static void make_ht_line(unsigned char *buf, fz_halftone *ht, int x, int y, int
 	}
 }
 
+/* TAOCP, vol 2, p337 */
+static int gcd(int u, int v)
+{
+	int r;
+
+	do
+	{
+		if (v == 0)
+			return u;
+		r = u % v;
+		u = v;
+		v = r;
+	}
+	while (1);
+}
+
+/* The number of rows after which the thresholds of all the
+ * components repeat. */
+static int
+ht_plane_height(fz_halftone *ht)
+{
+	int i, h, lcm = 1;
+
+	for (i = 0; i < ht->n; i++)
+	{
+		h = ht->comp[i]->h;
+		lcm = lcm / gcd(lcm, h) * h;
+	}
+	return lcm;
+}
+
+/*
+	Get the thresholds for rows of w pixels starting at column x,
+	for all the rows of the halftone at once, so that halftoning a
+	row is a straight comparison of the pixels with one row of the
+	plane. Returns the number of rows in *h; row y of a pixmap uses
+	row y % *h. Each row is ((w + 7) & ~7) * ht->n bytes.
+
+	Planes are kept with the halftone (up to HT_MAX_PLANES of them),
+	so that the bands of a page, and the pages of a document, share
+	them. Release the plane with fz_release_halftone_plane.
+*/
+unsigned char *
+fz_get_halftone_plane(fz_context *ctx, fz_halftone *ht, int x, int w, int *h)
+{
+	unsigned char *samples, *found = NULL;
+	size_t stride;
+	int i, y;
+
+	*h = ht_plane_height(ht);
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < HT_MAX_PLANES && ht->plane[i].samples; i++)
+		if (ht->plane[i].x == x && ht->plane[i].w == w)
+			found = ht->plane[i].samples;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (found)
+		return found;
+
+	stride = (size_t)((w + 7) & ~7) * ht->n;
+	samples = fz_malloc(ctx, *h * stride);
+	for (y = 0; y < *h; y++)
+		make_ht_line(samples + y * stride, ht, x, y, (w + 7) & ~7);
+
+	/* Keep it, unless another thread has made the same plane
+	 * meanwhile, or there is no room. */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < HT_MAX_PLANES && ht->plane[i].samples; i++)
+		if (ht->plane[i].x == x && ht->plane[i].w == w)
+			found = ht->plane[i].samples;
+	if (!found && i < HT_MAX_PLANES)
+	{
+		ht->plane[i].x = x;
+		ht->plane[i].w = w;
+		ht->plane[i].samples = found = samples;
+		samples = NULL;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (!found)
+		return samples;
+	fz_free(ctx, samples);
+	return found;
+}
+
+void
+fz_release_halftone_plane(fz_context *ctx, fz_halftone *ht, unsigned char *plane)
+{
+	int i, kept = 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < HT_MAX_PLANES; i++)
+		if (ht->plane[i].samples == plane)
+			kept = 1;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (!kept)
+		fz_free(ctx, plane);
+}
+
 /* Inner mono thresholding code */
 typedef void (threshold_fn)(const unsigned char *ht_line, const unsigned char *pixmap, unsigned char *out, int w, int ht_len);
 
@@ -508,6 +625,131 @@ static void do_threshold_4(const unsigned char * FZ_RESTRICT ht_line, const unsi
 }
 #endif
 
+/*
+	With the thresholds taken from a plane there is no wrapping
+	within a row, so both of the above are the same loop over bytes,
+	8 of them to each output byte (8 gray pixels, or 2 cmyk ones),
+	with the first byte in the top bit. Gray pixels set their bit
+	when below the threshold, cmyk ones when at or above it.
+*/
+static void
+threshold_bytes_c(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int len, int ge)
+{
+	int i, h;
+
+	for (; len > 0; len -= 8)
+	{
+		h = 0;
+		for (i = 0; i < 8 && i < len; i++)
+			if ((pixmap[i] >= ht_line[i]) == ge)
+				h |= 0x80 >> i;
+		*out++ = h;
+		pixmap += 8;
+		ht_line += 8;
+	}
+}
+
+#if FZ_SIMD_X86
+
+/* Bit reversed bytes, to turn movemask order (first byte in the
+ * bottom bit) into bitmap order. */
+static const unsigned char reverse_bits[256] =
+{
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4 ), R4(n + 1*4 ), R4(n + 3*4 )
+	R6(0), R6(2), R6(1), R6(3)
+#undef R2
+#undef R4
+#undef R6
+};
+
+static void
+threshold_bytes_sse2(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int len, int ge)
+{
+	int flip = ge ? 0 : 0xFFFF;
+
+	for (; len >= 16; len -= 16)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)pixmap);
+		__m128i t = _mm_loadu_si128((const __m128i *)ht_line);
+		/* p >= t exactly when max(p, t) == p. */
+		int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(p, t), p)) ^ flip;
+		out[0] = reverse_bits[bits & 0xFF];
+		out[1] = reverse_bits[bits >> 8];
+		out += 2;
+		pixmap += 16;
+		ht_line += 16;
+	}
+	threshold_bytes_c(ht_line, pixmap, out, len, ge);
+}
+
+FZ_TARGET_AVX2 static void
+threshold_bytes_avx2(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int len, int ge)
+{
+	const __m256i reverse = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	unsigned int flip = ge ? 0 : 0xFFFFFFFF;
+
+	for (; len >= 32; len -= 32)
+	{
+		__m256i p = _mm256_loadu_si256((const __m256i *)pixmap);
+		__m256i t = _mm256_loadu_si256((const __m256i *)ht_line);
+		__m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(p, t), p);
+		unsigned int bits = (unsigned int)_mm256_movemask_epi8(_mm256_shuffle_epi8(m, reverse)) ^ flip;
+		/* Little endian, so the first 8 bytes land in out[0]. */
+		memcpy(out, &bits, 4);
+		out += 4;
+		pixmap += 32;
+		ht_line += 32;
+	}
+	threshold_bytes_sse2(ht_line, pixmap, out, len, ge);
+}
+
+static void
+do_threshold_1_sse2(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int w, int ht_len)
+{
+	threshold_bytes_sse2(ht_line, pixmap, out, w, 0);
+}
+
+static void
+do_threshold_4_sse2(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int w, int ht_len)
+{
+	threshold_bytes_sse2(ht_line, pixmap, out, w * 4, 1);
+}
+
+FZ_TARGET_AVX2 static void
+do_threshold_1_avx2(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int w, int ht_len)
+{
+	threshold_bytes_avx2(ht_line, pixmap, out, w, 0);
+}
+
+FZ_TARGET_AVX2 static void
+do_threshold_4_avx2(const unsigned char * FZ_RESTRICT ht_line, const unsigned char * FZ_RESTRICT pixmap, unsigned char * FZ_RESTRICT out, int w, int ht_len)
+{
+	threshold_bytes_avx2(ht_line, pixmap, out, w * 4, 1);
+}
+
+#endif /* FZ_SIMD_X86 */
+
+/*
+	Threshold len bytes of src against ht_line into bits, as the
+	gray (ge == 0) or cmyk (ge != 0) halftoning does.
+*/
+void
+fz_threshold_bytes(const unsigned char *ht_line, const unsigned char *src, unsigned char *bits, int len, int ge)
+{
+#if FZ_SIMD_X86
+	if (fz_cpu_features() & FZ_CPU_AVX2)
+		threshold_bytes_avx2(ht_line, src, bits, len, ge);
+	else
+		threshold_bytes_sse2(ht_line, src, bits, len, ge);
+#else
+	threshold_bytes_c(ht_line, src, bits, len, ge);
+#endif
+}
+
 /*
 	Make a bitmap from a pixmap and a halftone.
 
@@ -524,22 +766,6 @@ fz_bitmap *fz_new_bitmap_from_pixmap(fz_context *ctx, fz_pixmap *pix, fz_halfton
 	return fz_new_bitmap_from_pixmap_band(ctx, pix, ht, 0);
 }
 
-/* TAOCP, vol 2, p337 */
-static int gcd(int u, int v)
-{
-	int r;
-
-	do
-	{
-		if (v == 0)
-			return u;
-		r = u % v;
-		u = v;
-		v = r;
-	}
-	while (1);
-}
-
 /*
 	Make a bitmap from a pixmap and a
 	halftone, allowing for the position of the pixmap within an
@@ -558,81 +784,111 @@ static int gcd(int u, int v)
 */
 fz_bitmap *fz_new_bitmap_from_pixmap_band(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht, int band_start)
 {
-	fz_bitmap *out = NULL;
-	unsigned char *ht_line = NULL;
+	fz_bitmap *out;
+
+	if (!pix)
+		return NULL;
+
+	if (pix->alpha != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap may not have alpha channel to convert to bitmap");
+	if (pix->n != 1 && pix->n != 4)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or CMYK to convert to bitmap");
+
+	out = fz_new_bitmap(ctx, pix->w, pix->h, pix->n, pix->xres, pix->yres);
+	fz_try(ctx)
+		fz_fill_bitmap_from_pixmap_band(ctx, out, pix, ht, band_start, 0, pix->h);
+	fz_catch(ctx)
+	{
+		fz_drop_bitmap(ctx, out);
+		fz_rethrow(ctx);
+	}
+
+	return out;
+}
+
+/*
+	Halftone rows y0 to y1-1 of a pixmap into a bitmap, as
+	fz_new_bitmap_from_pixmap_band would, but into an existing
+	bitmap of the same size as the pixmap. Different rows of the
+	same pixmap may be done at the same time on different threads
+	(each with its own cloned context).
+
+	bit: The bitmap to fill in. Must have as many components as
+	pix, and be of the same size.
+
+	pix, ht, band_start: As for fz_new_bitmap_from_pixmap_band.
+
+	y0, y1: The rows to do, relative to the top of pix.
+*/
+void fz_fill_bitmap_from_pixmap_band(fz_context *ctx, fz_bitmap *bit, fz_pixmap *pix, fz_halftone *ht, int band_start, int y0, int y1)
+{
+	unsigned char *plane = NULL;
 	unsigned char *o, *p;
-	int w, h, x, y, n, pstride, ostride, lcm, i;
+	int n, w, y, py, ph;
+	size_t plane_stride;
 	fz_halftone *ht_ = NULL;
 	threshold_fn *thresh;
 
-	fz_var(ht_line);
-
-	if (!pix)
-		return NULL;
+	fz_var(plane);
 
 	if (pix->alpha != 0)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap may not have alpha channel to convert to bitmap");
 
 	n = pix->n;
-
 	switch(n)
 	{
 	case 1:
 		thresh = do_threshold_1;
+#if FZ_SIMD_X86
+		thresh = (fz_cpu_features() & FZ_CPU_AVX2) ? do_threshold_1_avx2 : do_threshold_1_sse2;
+#endif
 		break;
 	case 4:
 		thresh = do_threshold_4;
+#if FZ_SIMD_X86
+		thresh = (fz_cpu_features() & FZ_CPU_AVX2) ? do_threshold_4_avx2 : do_threshold_4_sse2;
+#endif
 		break;
 	default:
 		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or CMYK to convert to bitmap");
-		return NULL;
+		return;
 	}
 
+	if (bit->n != n || bit->w != pix->w || bit->h != pix->h)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bitmap does not match pixmap");
+
+	y0 = fz_maxi(y0, 0);
+	y1 = fz_mini(y1, pix->h);
+	if (y0 >= y1)
+		return;
+
 	if (ht == NULL)
 		ht_ = ht = fz_default_halftone(ctx, n);
 
-	/* Find the minimum length for the halftone line. This
-	 * is the LCM of the halftone lengths and 8. (We need a
-	 * multiple of 8 for the unrolled threshold routines - if
-	 * we ever use SSE, we may need longer.) We use the fact
-	 * that LCM(a,b) = a * b / GCD(a,b) and use euclids
-	 * algorithm.
-	 */
-	lcm = 8;
-	for (i = 0; i < ht->n; i++)
-	{
-		w = ht->comp[i]->w;
-		lcm = lcm / gcd(lcm, w) * w;
-	}
-
 	fz_try(ctx)
 	{
-		ht_line = fz_malloc(ctx, lcm * n);
-		out = fz_new_bitmap(ctx, pix->w, pix->h, n, pix->xres, pix->yres);
-		o = out->samples;
-		p = pix->samples;
-
-		h = pix->h;
-		x = pix->x;
-		y = pix->y + band_start;
 		w = pix->w;
-		ostride = out->stride;
-		pstride = pix->stride;
-		while (h--)
+		plane = fz_get_halftone_plane(ctx, ht, pix->x, w, &ph);
+		plane_stride = (size_t)((w + 7) & ~7) * n;
+
+		o = bit->samples + y0 * (size_t)bit->stride;
+		p = pix->samples + y0 * (size_t)pix->stride;
+		for (y = y0; y < y1; y++)
 		{
-			make_ht_line(ht_line, ht, x, y++, lcm);
-			thresh(ht_line, p, o, w, lcm);
-			o += ostride;
-			p += pstride;
+			py = (pix->y + band_start + y) % ph;
+			if (py < 0)
+				py += ph;
+			thresh(plane + py * plane_stride, p, o, w, (w + 7) & ~7);
+			o += bit->stride;
+			p += pix->stride;
 		}
 	}
 	fz_always(ctx)
 	{
+		if (plane)
+			fz_release_halftone_plane(ctx, ht, plane);
 		fz_drop_halftone(ctx, ht_);
-		fz_free(ctx, ht_line);
 	}
 	fz_catch(ctx)
 		fz_rethrow(ctx);
-
-	return out;
 }
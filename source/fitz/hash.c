@@ -133,8 +133,17 @@ do_hash_insert(fz_context *ctx, fz_hash_table *table, const void *key, void *val
 	}
 }
 
+/* The alloc lock and the store shard locks have to be dropped around
+ * allocations, as the allocator may need to scavenge the store. */
+static int
+unlock_for_alloc(int lock)
+{
+	return lock == FZ_LOCK_ALLOC || (lock >= FZ_LOCK_STORE && lock < FZ_LOCK_STORE + FZ_STORE_MAX_SHARDS);
+}
+
 /* Entered with the lock taken, held throughout and at exit, UNLESS the lock
- * is the alloc lock in which case it may be momentarily dropped. */
+ * is the alloc lock or a store lock in which case it may be momentarily
+ * dropped. */
 static void
 fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 {
@@ -150,20 +159,20 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		return;
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (unlock_for_alloc(table->lock))
 		fz_unlock(ctx, table->lock);
 	newents = fz_malloc_array_no_throw(ctx, newsize, sizeof(fz_hash_entry));
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (unlock_for_alloc(table->lock))
 		fz_lock(ctx, table->lock);
 	if (table->lock >= 0)
 	{
 		if (table->size >= newsize)
 		{
 			/* Someone else fixed it before we could lock! */
-			if (table->lock == FZ_LOCK_ALLOC)
+			if (unlock_for_alloc(table->lock))
 				fz_unlock(ctx, table->lock);
 			fz_free(ctx, newents);
-			if (table->lock == FZ_LOCK_ALLOC)
+			if (unlock_for_alloc(table->lock))
 				fz_lock(ctx, table->lock);
 			return;
 		}
@@ -183,10 +192,10 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		}
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (unlock_for_alloc(table->lock))
 		fz_unlock(ctx, table->lock);
 	fz_free(ctx, oldents);
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (unlock_for_alloc(table->lock))
 		fz_lock(ctx, table->lock);
 }
 
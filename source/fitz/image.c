@@ -1,4 +1,5 @@
 #include "fitz-imp.h"
+#include "colorspace-imp.h"
 
 #include <string.h>
 #include <math.h>
@@ -21,6 +22,8 @@ struct fz_compressed_image_s
 	fz_image super;
 	fz_pixmap *tile;
 	fz_compressed_buffer *buffer;
+	int digested; /* 0 = not yet, 1 = digest is valid, -1 = cannot share */
+	unsigned char digest[16];
 };
 
 struct fz_pixmap_image_s
@@ -114,7 +117,84 @@ static const fz_store_type fz_image_store_type =
 	fz_drop_image_key,
 	fz_cmp_image_key,
 	fz_format_image_key,
-	fz_needs_reap_image_key
+	fz_needs_reap_image_key,
+	"image"
+};
+
+/* Tiles of images that can be shared between documents are keyed on
+ * a digest of the image instead; see fz_tune_image_digests. Unless it
+ * is ICC based, the digest includes the address of the colorspace,
+ * which the key holds on to so that it cannot be reused. */
+typedef struct fz_image_digest_key_s fz_image_digest_key;
+
+struct fz_image_digest_key_s {
+	int refs;
+	unsigned char digest[16];
+	fz_colorspace *colorspace;
+	int l2factor;
+	fz_irect rect;
+};
+
+static int
+fz_make_hash_image_digest_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_image_digest_key *key = (fz_image_digest_key *)key_;
+	memcpy(hash->u.dir.digest, key->digest, 16);
+	hash->u.dir.i = key->l2factor;
+	hash->u.dir.r = key->rect;
+	return 1;
+}
+
+static void *
+fz_keep_image_digest_key(fz_context *ctx, void *key_)
+{
+	fz_image_digest_key *key = (fz_image_digest_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_image_digest_key(fz_context *ctx, void *key_)
+{
+	fz_image_digest_key *key = (fz_image_digest_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+	{
+		fz_drop_colorspace_store_key(ctx, key->colorspace);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_image_digest_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_image_digest_key *k0 = (fz_image_digest_key *)k0_;
+	fz_image_digest_key *k1 = (fz_image_digest_key *)k1_;
+	return memcmp(k0->digest, k1->digest, 16) || k0->l2factor != k1->l2factor || k0->rect.x0 != k1->rect.x0 || k0->rect.y0 != k1->rect.y0 || k0->rect.x1 != k1->rect.x1 || k0->rect.y1 != k1->rect.y1;
+}
+
+static void
+fz_format_image_digest_key(fz_context *ctx, char *s, int n, void *key_)
+{
+	fz_image_digest_key *key = (fz_image_digest_key *)key_;
+	fz_snprintf(s, n, "(image digest %02x%02x%02x%02x sf=%d)", key->digest[0], key->digest[1], key->digest[2], key->digest[3], key->l2factor);
+}
+
+static int
+fz_needs_reap_image_digest_key(fz_context *ctx, void *key_)
+{
+	fz_image_digest_key *key = (fz_image_digest_key *)key_;
+
+	return key->colorspace && fz_key_storable_needs_reaping(ctx, &key->colorspace->key_storable);
+}
+
+static const fz_store_type fz_image_digest_store_type =
+{
+	fz_make_hash_image_digest_key,
+	fz_keep_image_digest_key,
+	fz_drop_image_digest_key,
+	fz_cmp_image_digest_key,
+	fz_format_image_digest_key,
+	fz_needs_reap_image_digest_key,
+	"image digest"
 };
 
 void
@@ -315,8 +395,10 @@ static void fz_compute_image_key(fz_context *ctx, fz_image *image, fz_matrix *ct
 		key->l2factor = 0;
 }
 
-fz_pixmap *
-fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int l2factor)
+/* As fz_decomp_image_from_stream, but if cropped is set the stream
+ * produces only the (adjusted) subarea rather than the whole image. */
+static fz_pixmap *
+decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int l2factor, int cropped)
 {
 	fz_image *image = &cimg->super;
 	fz_pixmap *tile = NULL;
@@ -364,7 +446,7 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 
 		samples = fz_malloc_array(ctx, h, stride);
 
-		if (subarea)
+		if (subarea && !cropped)
 		{
 			int hh;
 			unsigned char *s = samples;
@@ -373,11 +455,9 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 			int l_margin = subarea->x0 >> l2factor;
 			int t_margin = subarea->y0 >> l2factor;
 			int r_margin = (image->w + f - 1 - subarea->x1) >> l2factor;
-			int b_margin = (image->h + f - 1 - subarea->y1) >> l2factor;
 			int l_skip = (l_margin * image->n * image->bpc)/8;
 			int r_skip = (r_margin * image->n * image->bpc + 7)/8;
 			size_t t_skip = t_margin * stream_stride + l_skip;
-			size_t b_skip = b_margin * stream_stride + r_skip;
 			size_t l = fz_skip(ctx, stm, t_skip);
 			len = 0;
 			if (l == t_skip)
@@ -397,7 +477,6 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 						break;
 				}
 				while (1);
-				(void)fz_skip(ctx, stm, r_skip + b_skip);
 			}
 		}
 		else
@@ -458,6 +537,208 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 	return tile;
 }
 
+fz_pixmap *
+fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int l2factor)
+{
+	return decomp_image_from_stream(ctx, stm, cimg, subarea, indexed, l2factor, 0);
+}
+
+/* When decoding a JPEG in strips as parallel jobs, give each job
+ * at least this many rows. */
+#define JPEG_JOB_ROWS 512
+
+typedef struct
+{
+	fz_compressed_image *image;
+	fz_jpeg_index *index;
+	int l2factor;
+	fz_irect area;
+	int first, last, per_job;
+	unsigned char *samples;
+	size_t stride;
+	char *failed;
+} jpeg_strips_job;
+
+static void
+decode_jpeg_strips_job(fz_context *ctx, void *arg, int i)
+{
+	jpeg_strips_job *job = (jpeg_strips_job *)arg;
+	fz_jpeg_index *index = job->index;
+	int f = 1<<job->l2factor;
+	int a = job->first + i * job->per_job;
+	int b = fz_mini(a + job->per_job, job->last);
+	int y0, y1, top;
+	fz_stream *stm = NULL;
+
+	/* The rows of the area within strips a to b-1. */
+	y0 = fz_maxi(job->area.y0, (a * index->strip_h) >> job->l2factor);
+	y1 = fz_mini(job->area.y1, (fz_mini(b * index->strip_h, index->h) + f - 1) >> job->l2factor);
+	if (y0 >= y1)
+		return;
+
+	/* Upsampled chroma at the top and bottom of a strip needs the
+	 * rows either side, so decode a strip more each way. */
+	if (index->context)
+	{
+		a = fz_maxi(a - 1, 0);
+		b = fz_mini(b + 1, index->count);
+	}
+	top = (a * index->strip_h) >> job->l2factor;
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		size_t len = (y1 - y0) * job->stride;
+		stm = fz_open_dctd_strips(ctx, job->image->buffer->buffer, index, a, b,
+			job->image->buffer->params.u.jpeg.color_transform, job->l2factor,
+			fz_make_irect(job->area.x0, y0 - top, job->area.x1, y1 - top));
+		if (fz_read(ctx, stm, job->samples + (y0 - job->area.y0) * job->stride, len) != len)
+			job->failed[i] = 1;
+	}
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+		job->failed[i] = 1;
+}
+
+/* Decode area (in output pixels) of an indexed JPEG as a number of
+ * strip jobs, and return a stream of the samples. Returns NULL if any
+ * strip fails to decode, so that the caller can try the usual way. */
+static fz_stream *
+decode_jpeg_strips(fz_context *ctx, fz_compressed_image *image, fz_jpeg_index *index, int l2factor, fz_irect area, int parallel)
+{
+	jpeg_strips_job job = { 0 };
+	fz_buffer *buf;
+	fz_stream *stm = NULL;
+	int i, n;
+
+	job.image = image;
+	job.index = index;
+	job.l2factor = l2factor;
+	job.area = area;
+	job.first = (area.y0 << l2factor) / index->strip_h;
+	job.last = fz_mini(((area.y1 << l2factor) + index->strip_h - 1) / index->strip_h, index->count);
+	if (parallel)
+		job.per_job = fz_maxi(1, JPEG_JOB_ROWS / index->strip_h);
+	else
+		job.per_job = job.last - job.first;
+	n = (job.last - job.first + job.per_job - 1) / job.per_job;
+	job.stride = (size_t)(area.x1 - area.x0) * image->super.n;
+
+	buf = fz_new_buffer(ctx, job.stride * (area.y1 - area.y0));
+
+	fz_var(job.failed);
+
+	fz_try(ctx)
+	{
+		buf->len = job.stride * (area.y1 - area.y0);
+		job.samples = buf->data;
+		job.failed = fz_calloc(ctx, n, 1);
+		ctx->tuning->parallel(ctx->tuning->parallel_arg, ctx, n, decode_jpeg_strips_job, &job);
+		for (i = 0; i < n; i++)
+			if (job.failed[i])
+				break;
+		if (i == n)
+			stm = fz_open_buffer(ctx, buf);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, job.failed);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return stm;
+}
+
+static fz_jpeg_index *
+jpeg_index(fz_context *ctx, fz_compressed_buffer *buffer)
+{
+	fz_jpeg_index *index;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	index = buffer->jpeg_index;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (index)
+		return index;
+
+	index = fz_new_jpeg_index(ctx, buffer->buffer->data, buffer->buffer->len);
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (buffer->jpeg_index == NULL)
+	{
+		buffer->jpeg_index = index;
+		index = NULL;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_free(ctx, index);
+
+	return buffer->jpeg_index;
+}
+
+/* Open a JPEG image so that the decoder only produces the subarea,
+ * rather than decoding everything for us to throw most of it away.
+ * If the image has restart markers, start at the strip holding the
+ * subarea, and decode strips in parallel if we can. Takes the DCT
+ * scaling out of l2factor as fz_open_image_decomp_stream would. */
+static fz_stream *
+open_jpeg(fz_context *ctx, fz_compressed_image *image, fz_irect *subarea, int *l2factor)
+{
+	fz_compressed_buffer *buffer = image->buffer;
+	int color_transform = buffer->params.u.jpeg.color_transform;
+	int parallel = (ctx->tuning->parallel != fz_default_parallel);
+	fz_jpeg_index *index;
+	fz_stream *head, *tail;
+	int our_l2factor = 0;
+	int f;
+	fz_irect area;
+
+	if (l2factor)
+	{
+		our_l2factor = *l2factor;
+		if (our_l2factor > 3)
+			our_l2factor = 3;
+		*l2factor -= our_l2factor;
+	}
+	f = 1<<our_l2factor;
+
+	if (subarea)
+	{
+		fz_adjust_image_subarea(ctx, &image->super, subarea, our_l2factor);
+		area.x0 = subarea->x0 >> our_l2factor;
+		area.y0 = subarea->y0 >> our_l2factor;
+		area.x1 = area.x0 + ((subarea->x1 - subarea->x0 + f - 1) >> our_l2factor);
+		area.y1 = area.y0 + ((subarea->y1 - subarea->y0 + f - 1) >> our_l2factor);
+	}
+	else
+		area = fz_make_irect(0, 0, (image->super.w + f - 1) >> our_l2factor, (image->super.h + f - 1) >> our_l2factor);
+
+	index = jpeg_index(ctx, buffer);
+	if (index->count >= 2 && index->w == image->super.w && index->h == image->super.h &&
+		(parallel || (area.y0 << our_l2factor) >= index->strip_h))
+	{
+		head = decode_jpeg_strips(ctx, image, index, our_l2factor, area, parallel);
+		if (head)
+			return head;
+	}
+
+	tail = fz_open_buffer(ctx, buffer->buffer);
+	fz_try(ctx)
+	{
+		if (subarea)
+			head = fz_open_dctd_subarea(ctx, tail, color_transform, our_l2factor, NULL, area);
+		else
+			head = fz_open_dctd(ctx, tail, color_transform, our_l2factor, NULL);
+	}
+	fz_always(ctx)
+		fz_drop_stream(ctx, tail);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return head;
+}
+
 void
 fz_drop_image_base(fz_context *ctx, fz_image *image)
 {
@@ -501,6 +782,7 @@ compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea
 	int indexed;
 	fz_pixmap *tile;
 	int can_sub = 0;
+	int cropped;
 	int local_l2factor;
 
 	/* If we are using matte, then the decode code requires both image and tile sizes
@@ -558,14 +840,18 @@ compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea
 
 	default:
 		native_l2factor = l2factor ? *l2factor : 0;
-		stm = fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
+		cropped = (subarea && image->buffer->params.type == FZ_IMAGE_JPEG);
+		if (image->buffer->params.type == FZ_IMAGE_JPEG)
+			stm = open_jpeg(ctx, image, subarea, l2factor);
+		else
+			stm = fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
 		fz_try(ctx)
 		{
 			if (l2factor)
 				native_l2factor -= *l2factor;
 			indexed = fz_colorspace_is_indexed(ctx, image->super.colorspace);
 			can_sub = 1;
-			tile = fz_decomp_image_from_stream(ctx, stm, image, subarea, indexed, native_l2factor);
+			tile = decomp_image_from_stream(ctx, stm, image, subarea, indexed, native_l2factor, cropped);
 		}
 		fz_always(ctx)
 			fz_drop_stream(ctx, stm);
@@ -651,13 +937,120 @@ void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *su
 	}
 }
 
+void fz_default_parallel(void *arg, fz_context *ctx, int n, fz_parallel_job_fn *job, void *job_arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < n; i++)
+		job(ctx, job_arg, i);
+}
+
+/*
+	Work out a digest of everything that goes into decoding an image:
+	its compressed data, how that is compressed, and the parts of the
+	image that the decoder looks at. Images with the same digest
+	decode to the same tiles, whichever document they come from.
+
+	Returns 0 if digests are not in use, or the image cannot be
+	shared like this.
+*/
+static int
+image_digest(fz_context *ctx, fz_image *image, unsigned char digest[16])
+{
+	fz_compressed_image *cimg = (fz_compressed_image *)image;
+	fz_compressed_buffer *buffer;
+	unsigned char d[16];
+	int digested;
+
+	if (!ctx->tuning->image_digests || image->get_pixmap != compressed_image_get_pixmap)
+		return 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	digested = cimg->digested;
+	memcpy(d, cimg->digest, 16);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (digested == 0)
+	{
+		buffer = cimg->buffer;
+
+		/* Matte images are decoded against their masks, and JBIG2
+		 * global segments are held outside the buffer. */
+		if (!buffer || !buffer->buffer || (image->use_colorkey && image->mask) ||
+			(buffer->params.type == FZ_IMAGE_JBIG2 && buffer->params.u.jbig2.globals))
+		{
+			digested = -1;
+		}
+		else
+		{
+			fz_md5 md5;
+			int info[9];
+
+			info[0] = image->w;
+			info[1] = image->h;
+			info[2] = image->n;
+			info[3] = image->bpc;
+			info[4] = image->imagemask;
+			info[5] = image->use_colorkey;
+			info[6] = image->use_decode;
+			info[7] = image->invert_cmyk_jpeg;
+			info[8] = buffer->params.type;
+
+			fz_md5_init(&md5);
+			fz_md5_update(&md5, (unsigned char *)info, sizeof info);
+			fz_md5_update(&md5, (unsigned char *)&buffer->params.u, sizeof buffer->params.u);
+			fz_md5_update(&md5, (unsigned char *)image->decode, sizeof(float) * image->n * 2);
+			if (image->use_colorkey)
+				fz_md5_update(&md5, (unsigned char *)image->colorkey, sizeof(int) * image->n * 2);
+			/* An ICC colorspace is hashed by its profile, so that the
+			 * same profile embedded in different documents matches.
+			 * Any other colorspace is hashed by its address. */
+			if (fz_colorspace_is_icc(ctx, image->colorspace))
+			{
+				fz_iccprofile *profile = image->colorspace->data;
+				fz_md5_update(&md5, (unsigned char *)&image->colorspace->type, sizeof image->colorspace->type);
+				fz_md5_update(&md5, profile->md5, 16);
+			}
+			else
+				fz_md5_update(&md5, (unsigned char *)&image->colorspace, sizeof image->colorspace);
+			fz_md5_update(&md5, buffer->buffer->data, buffer->buffer->len);
+			fz_md5_final(&md5, d);
+			digested = 1;
+		}
+
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		cimg->digested = digested;
+		memcpy(cimg->digest, d, 16);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+
+	if (digested < 0)
+		return 0;
+	memcpy(digest, d, 16);
+	return 1;
+}
+
 static fz_pixmap *
 fz_find_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matrix *ctm)
 {
+	fz_image_digest_key dkey;
+	int digested = image_digest(ctx, image, dkey.digest);
 	fz_pixmap *tile;
+
+	dkey.refs = 1;
+	dkey.colorspace = image->colorspace;
 	do
 	{
-		tile = fz_find_item(ctx, fz_drop_pixmap_imp, key, &fz_image_store_type);
+		if (digested)
+		{
+			dkey.l2factor = key->l2factor;
+			dkey.rect = key->rect;
+			tile = fz_find_item(ctx, fz_drop_pixmap_imp, &dkey, &fz_image_digest_store_type);
+		}
+		else
+			tile = fz_find_item(ctx, fz_drop_pixmap_imp, key, &fz_image_store_type);
 		if (tile)
 		{
 			update_ctm_for_subarea(ctm, &key->rect, image->w, image->h);
@@ -669,6 +1062,49 @@ fz_find_image_tile(fz_context *ctx, fz_image *image, fz_image_key *key, fz_matri
 	return NULL;
 }
 
+/*
+	Estimate the cost of decoding a tile again should it be evicted from
+	the store, for the benefit of cost aware eviction policies. This is
+	the number of bytes in the full resolution tile, scaled by a rough
+	per-byte weight for the decoder involved.
+*/
+static size_t
+image_tile_cost(fz_context *ctx, fz_image *image, fz_pixmap *tile, int l2factor)
+{
+	fz_compressed_buffer *buffer = fz_compressed_image_buffer(ctx, image);
+	size_t cost = fz_pixmap_size(ctx, tile) << (2 * l2factor);
+	int weight = 1;
+
+	if (buffer)
+	{
+		switch (buffer->params.type)
+		{
+		case FZ_IMAGE_JPX:
+			weight = 16;
+			break;
+		case FZ_IMAGE_JBIG2:
+			weight = 8;
+			break;
+		case FZ_IMAGE_JPEG:
+		case FZ_IMAGE_JXR:
+			weight = 4;
+			break;
+		case FZ_IMAGE_FAX:
+		case FZ_IMAGE_FLATE:
+		case FZ_IMAGE_LZW:
+		case FZ_IMAGE_PNG:
+		case FZ_IMAGE_TIFF:
+		case FZ_IMAGE_GIF:
+			weight = 2;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return cost * weight;
+}
+
 /*
 	Called to get a handle to a pixmap from an image.
 
@@ -698,7 +1134,9 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	fz_pixmap *tile;
 	int l2factor, l2factor_remaining;
 	fz_image_key key;
-	fz_image_key *keyp;
+	void *keyp;
+	const fz_store_type *type;
+	unsigned char digest[16];
 	int w;
 	int h;
 
@@ -798,14 +1236,31 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 
 	/* Now we try to cache the pixmap. Any failure here will just result
 	 * in us not caching. */
-	keyp = fz_malloc_struct(ctx, fz_image_key);
-	keyp->refs = 1;
-	keyp->image = fz_keep_image_store_key(ctx, image);
-	keyp->l2factor = l2factor;
-	keyp->rect = key.rect;
+	if (image_digest(ctx, image, digest))
+	{
+		fz_image_digest_key *dkeyp = fz_malloc_struct(ctx, fz_image_digest_key);
+		dkeyp->refs = 1;
+		memcpy(dkeyp->digest, digest, 16);
+		dkeyp->colorspace = fz_keep_colorspace_store_key(ctx, image->colorspace);
+		dkeyp->l2factor = l2factor;
+		dkeyp->rect = key.rect;
+		keyp = dkeyp;
+		type = &fz_image_digest_store_type;
+	}
+	else
+	{
+		fz_image_key *ikeyp = fz_malloc_struct(ctx, fz_image_key);
+		ikeyp->refs = 1;
+		ikeyp->image = fz_keep_image_store_key(ctx, image);
+		ikeyp->l2factor = l2factor;
+		ikeyp->rect = key.rect;
+		keyp = ikeyp;
+		type = &fz_image_store_type;
+	}
 	fz_try(ctx)
 	{
-		fz_pixmap *existing_tile = fz_store_item(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type);
+		fz_pixmap *existing_tile = fz_store_item_with_cost(ctx, keyp, tile, fz_pixmap_size(ctx, tile),
+			image_tile_cost(ctx, image, tile, l2factor), type);
 		if (existing_tile)
 		{
 			/* We already have a tile. This must have been produced by a
@@ -816,7 +1271,7 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	}
 	fz_always(ctx)
 	{
-		fz_drop_image_key(ctx, keyp);
+		type->drop_key(ctx, keyp);
 	}
 	fz_catch(ctx)
 	{
@@ -1082,6 +1537,9 @@ void fz_set_compressed_image_buffer(fz_context *ctx, fz_compressed_image *image,
 {
 	assert(image != NULL && image->super.get_pixmap == compressed_image_get_pixmap);
 	((fz_compressed_image *)image)->buffer = buf; /* Note: compressed buffers are not reference counted */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	((fz_compressed_image *)image)->digested = 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 fz_pixmap *fz_compressed_image_tile(fz_context *ctx, fz_compressed_image *image)
@@ -1,4 +1,7 @@
 #include "mupdf/fitz.h"
+#include "fitz-imp.h"
+#include "colorspace-imp.h"
+#include "font-imp.h"
 
 #include <assert.h>
 #include <string.h>
@@ -115,6 +118,8 @@ enum {
 	MAX_NODE_SIZE = (1<<9)-sizeof(fz_display_node)
 };
 
+typedef struct fz_display_index_s fz_display_index;
+
 struct fz_display_list_s
 {
 	fz_storable storable;
@@ -122,6 +127,7 @@ struct fz_display_list_s
 	fz_rect mediabox;
 	int max;
 	int len;
+	fz_display_index *index;
 };
 
 struct fz_list_device_s
@@ -182,10 +188,12 @@ fz_append_display_node(
 	int ctm_off = 0;
 	int stroke_off = 0;
 	int rect_for_updates = 0;
+	int contents_for_updates = 0;
 	int private_off = 0;
 	fz_path *my_path = NULL;
 	fz_stroke_state *my_stroke = NULL;
 	fz_rect local_rect;
+	const fz_rect *contents = NULL;
 	int path_size = 0;
 
 	switch (cmd)
@@ -202,14 +210,25 @@ fz_append_display_node(
 		}
 		writer->top++;
 		break;
-	case FZ_CMD_END_MASK:
+	case FZ_CMD_BEGIN_GROUP:
+	case FZ_CMD_BEGIN_MASK:
+		/* Groups, and alpha masks, are transparent outside of what
+		 * is drawn into them, so record that area for playback to
+		 * size their buffers by. The draw device clips what is drawn
+		 * through a mask to the mask's area, and the rasterizer steps
+		 * an edge differently once it has been clipped, so a mask's
+		 * area must take in that content too. The entry is kept until
+		 * the pop to collect both. */
 		if (writer->top < STACK_SIZE)
 		{
+			contents_for_updates = (private_data != NULL);
 			writer->stack[writer->top].update = NULL;
 			writer->stack[writer->top].rect = fz_empty_rect;
 		}
 		writer->top++;
 		break;
+	case FZ_CMD_END_MASK:
+		break;
 	case FZ_CMD_BEGIN_TILE:
 		writer->tiled++;
 		if (writer->top > 0 && writer->top <= STACK_SIZE)
@@ -220,9 +239,8 @@ fz_append_display_node(
 	case FZ_CMD_END_TILE:
 		writer->tiled--;
 		break;
-	case FZ_CMD_END_GROUP:
-		break;
 	case FZ_CMD_POP_CLIP:
+	case FZ_CMD_END_GROUP:
 		if (writer->top > STACK_SIZE)
 		{
 			writer->top--;
@@ -235,6 +253,10 @@ fz_append_display_node(
 			update = writer->stack[writer->top].update;
 			if (writer->tiled == 0)
 			{
+				/* The parent takes all that was drawn, not just
+				 * what lies within the clip; a pixel can be drawn
+				 * by both even where their rects do not meet. */
+				contents = &writer->stack[writer->top].rect;
 				if (update)
 				{
 					*update = fz_intersect_rect(*update, writer->stack[writer->top].rect);
@@ -250,7 +272,11 @@ fz_append_display_node(
 		/* fallthrough */
 	default:
 		if (writer->top > 0 && writer->tiled == 0 && writer->top <= STACK_SIZE && rect)
-			writer->stack[writer->top-1].rect = fz_union_rect(writer->stack[writer->top-1].rect, *rect);
+		{
+			if (contents == NULL)
+				contents = rect;
+			writer->stack[writer->top-1].rect = fz_union_rect(writer->stack[writer->top-1].rect, *contents);
+		}
 		break;
 	}
 
@@ -629,6 +655,8 @@ fz_append_display_node(
 	{
 		char *out_private = (char *)(void *)(&node_ptr[private_off]);
 		memcpy(out_private, private_data, private_data_len);
+		if (contents_for_updates)
+			writer->stack[writer->top-1].update = (fz_rect *)(void *)(out_private + private_data_len - sizeof(fz_rect));
 	}
 	list->len += size;
 }
@@ -1030,9 +1058,24 @@ fz_list_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_mat
 	}
 }
 
+/* The area drawn into a group or alpha mask, filled in as the list is
+ * recorded. It starts infinite, so that a group whose contents are not
+ * tracked (inside a tile, say) is played back at its full size. */
+typedef struct fz_list_group_data_s fz_list_group_data;
+
+struct fz_list_group_data_s
+{
+	fz_colorspace *colorspace;
+	fz_rect contents;
+};
+
 static void
 fz_list_begin_mask(fz_context *ctx, fz_device *dev, fz_rect rect, int luminosity, fz_colorspace *colorspace, const float *color, const fz_color_params *color_params)
 {
+	fz_rect contents = fz_infinite_rect;
+
+	/* A luminosity mask is the backdrop colour outside of what is
+	 * drawn into it, so it cannot shrink. */
 	fz_append_display_node(
 		ctx,
 		dev,
@@ -1045,8 +1088,8 @@ fz_list_begin_mask(fz_context *ctx, fz_device *dev, fz_rect rect, int luminosity
 		NULL, /* alpha */
 		NULL, /* ctm */
 		NULL, /* stroke */
-		NULL, /* private_data */
-		0); /* private_data_len */
+		luminosity ? NULL : &contents, /* private_data */
+		luminosity ? 0 : sizeof(contents)); /* private_data_len */
 }
 
 static void
@@ -1071,9 +1114,11 @@ fz_list_end_mask(fz_context *ctx, fz_device *dev)
 static void
 fz_list_begin_group(fz_context *ctx, fz_device *dev, fz_rect rect, fz_colorspace *colorspace, int isolated, int knockout, int blendmode, float alpha)
 {
+	fz_list_group_data data;
 	int flags;
 
-	colorspace = fz_keep_colorspace(ctx, colorspace);
+	data.colorspace = fz_keep_colorspace(ctx, colorspace);
+	data.contents = fz_infinite_rect;
 
 	flags = (blendmode<<2);
 	if (isolated)
@@ -1095,12 +1140,12 @@ fz_list_begin_group(fz_context *ctx, fz_device *dev, fz_rect rect, fz_colorspace
 			&alpha, /* alpha */
 			NULL, /* ctm */
 			NULL, /* stroke */
-			&colorspace, /* private_data */
-			sizeof(colorspace)); /* private_data_len */
+			&data, /* private_data */
+			sizeof(data)); /* private_data_len */
 	}
 	fz_catch(ctx)
 	{
-		fz_drop_colorspace(ctx, colorspace);
+		fz_drop_colorspace(ctx, data.colorspace);
 		fz_rethrow(ctx);
 	}
 }
@@ -1346,12 +1391,587 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 	return &dev->super;
 }
 
+/*
+	Display list index.
+
+	Big lists (maps, CAD drawings) are often run with a scissor that
+	covers only a small part of the page, by a viewer showing a zoomed
+	in tile or by a banded renderer. Checking every node against the
+	scissor is then most of the work. The index groups runs of
+	neighbouring nodes into chunks with a bounding box, so that whole
+	chunks can be skipped at once.
+
+	Within each clip, mask or group, the nodes (with any nested clip,
+	mask or group counting as one node) are gathered into chunks of
+	INDEX_FANOUT, and those chunks into chunks of INDEX_FANOUT again,
+	and so on, so a chunk never starts or ends part way through a
+	clip. The bounds of a nested clip are those of the node that
+	starts it, which is what fz_run_display_list culls on anyway.
+	Tiles, layers and the other nodes that are always passed to the
+	device have infinite bounds, and the inside of tiles is not
+	indexed at all.
+
+	As the graphics state is stored as changes from node to node,
+	each chunk also records the state after its last node, to pick
+	up from when the chunk is skipped.
+*/
+
+enum
+{
+	INDEX_FANOUT = 16,
+	INDEX_LEVELS = 6,
+	/* Lists shorter than this are quick enough to run without. */
+	INDEX_MIN_LEN = 16384,
+	/* Only use the index when the scissor is at most this fraction
+	 * of the page. */
+	INDEX_MAX_SCISSOR = 4
+};
+
+typedef struct
+{
+	fz_rect rect;
+	fz_matrix ctm;
+	float alpha;
+	int cs;
+	fz_colorspace *other; /* Owned by the list, for CS_OTHER_0 */
+	int color; /* Offset of the color values, or -1 for the default */
+	fz_stroke_state *stroke; /* Owned by the list */
+	int path; /* Offset of the packed path, or -1 for none */
+} fz_display_state;
+
+typedef struct
+{
+	int start; /* Offset of the first node */
+	int end; /* Offset after the last node */
+	int next; /* The first chunk starting at or after end */
+	fz_rect bounds;
+	fz_display_state state; /* The state after the last node */
+} fz_display_chunk;
+
+struct fz_display_index_s
+{
+	int len; /* The list length when the index was made */
+	int count;
+	int max;
+	fz_display_chunk *chunks;
+};
+
+typedef struct
+{
+	int start;
+	int end;
+	int count;
+	int scope;
+	fz_rect bounds;
+} fz_index_run;
+
+typedef struct
+{
+	int start;
+	fz_rect bounds;
+	fz_index_run run[INDEX_LEVELS];
+} fz_index_scope;
+
+typedef struct
+{
+	fz_display_list *list;
+	fz_display_index *index;
+	fz_display_state state;
+	int depth;
+	int max_depth;
+	fz_index_scope *scopes;
+} fz_index_builder;
+
+static void
+fz_drop_display_index(fz_context *ctx, fz_display_index *index)
+{
+	if (index)
+	{
+		fz_free(ctx, index->chunks);
+		fz_free(ctx, index);
+	}
+}
+
+/* Unlike fz_union_rect, keep zero area rectangles; a line can still
+ * cover pixels once the list is drawn rotated. */
+static fz_rect
+fz_index_union(fz_rect a, fz_rect b)
+{
+	if (fz_is_infinite_rect(a) || fz_is_infinite_rect(b))
+		return fz_infinite_rect;
+	a.x0 = fz_min(a.x0, b.x0);
+	a.y0 = fz_min(a.y0, b.y0);
+	a.x1 = fz_max(a.x1, b.x1);
+	a.y1 = fz_max(a.y1, b.y1);
+	return a;
+}
+
 static void
-fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
+fz_index_add_chunk(fz_context *ctx, fz_index_builder *b, fz_index_run *run)
 {
-	fz_display_list *list = (fz_display_list *)list_;
-	fz_display_node *node = list->list;
-	fz_display_node *node_end = list->list + list->len;
+	fz_display_index *index = b->index;
+	fz_display_chunk *chunk;
+
+	if (index->count == index->max)
+	{
+		int max = index->max ? index->max * 2 : 256;
+		index->chunks = fz_resize_array(ctx, index->chunks, max, sizeof(*index->chunks));
+		index->max = max;
+	}
+	chunk = &index->chunks[index->count++];
+	chunk->start = run->start;
+	chunk->end = run->end;
+	chunk->next = 0;
+	chunk->bounds = run->bounds;
+	chunk->state = b->state;
+}
+
+static void fz_index_flush_run(fz_context *ctx, fz_index_builder *b, int level);
+
+static void
+fz_index_add_item(fz_context *ctx, fz_index_builder *b, int level, int start, int end, fz_rect bounds, int scope)
+{
+	fz_index_run *run = &b->scopes[b->depth].run[level];
+
+	if (run->count == 0)
+	{
+		run->start = start;
+		run->bounds = bounds;
+	}
+	else
+		run->bounds = fz_index_union(run->bounds, bounds);
+	run->end = end;
+	run->scope = scope;
+	run->count++;
+
+	if (run->count == INDEX_FANOUT)
+		fz_index_flush_run(ctx, b, level);
+}
+
+static void
+fz_index_flush_run(fz_context *ctx, fz_index_builder *b, int level)
+{
+	fz_index_run run = b->scopes[b->depth].run[level];
+
+	b->scopes[b->depth].run[level].count = 0;
+
+	/* A chunk holding a single node is no better than the node
+	 * itself, unless that node starts a clip. */
+	if (run.count > 1 || (level == 0 && run.scope))
+		fz_index_add_chunk(ctx, b, &run);
+	if (level + 1 < INDEX_LEVELS)
+		fz_index_add_item(ctx, b, level + 1, run.start, run.end, run.bounds, 0);
+}
+
+static void
+fz_index_flush_scope(fz_context *ctx, fz_index_builder *b)
+{
+	int level;
+
+	for (level = 0; level < INDEX_LEVELS; level++)
+		if (b->scopes[b->depth].run[level].count > 0)
+			fz_index_flush_run(ctx, b, level);
+}
+
+static void
+fz_index_push_scope(fz_context *ctx, fz_index_builder *b, int start)
+{
+	fz_index_scope *scope;
+
+	if (b->depth + 1 == b->max_depth)
+	{
+		int max = b->max_depth * 2;
+		b->scopes = fz_resize_array(ctx, b->scopes, max, sizeof(*b->scopes));
+		b->max_depth = max;
+	}
+	scope = &b->scopes[++b->depth];
+	memset(scope, 0, sizeof(*scope));
+	scope->start = start;
+	scope->bounds = b->state.rect;
+}
+
+static void
+fz_index_pop_scope(fz_context *ctx, fz_index_builder *b, int end)
+{
+	fz_index_scope *scope = &b->scopes[b->depth--];
+
+	fz_index_add_item(ctx, b, 0, scope->start, end, scope->bounds, 1);
+}
+
+static int
+fz_display_state_n(fz_context *ctx, const fz_display_state *state)
+{
+	switch (state->cs)
+	{
+	default:
+	case CS_GRAY_0:
+	case CS_GRAY_1:
+		return 1;
+	case CS_RGB_0:
+	case CS_RGB_1:
+		return 3;
+	case CS_CMYK_0:
+	case CS_CMYK_1:
+		return 4;
+	case CS_OTHER_0:
+		return fz_colorspace_n(ctx, state->other);
+	}
+}
+
+/* Update state to what it is after the node at offset off, following
+ * the same packing as fz_run_display_list unpacks. */
+static void
+fz_index_update_state(fz_context *ctx, fz_display_list *list, fz_display_state *state, int off)
+{
+	fz_display_node *node = &list->list[off];
+	fz_display_node n = *node;
+
+	node++;
+	if (n.rect)
+	{
+		state->rect = *(fz_rect *)node;
+		node += SIZE_IN_NODES(sizeof(fz_rect));
+	}
+	if (n.cs)
+	{
+		state->cs = n.cs;
+		state->other = NULL;
+		state->color = -1;
+		if (n.cs == CS_OTHER_0)
+		{
+			state->other = *(fz_colorspace **)node;
+			node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+		}
+	}
+	if (n.color)
+	{
+		state->color = node - list->list;
+		node += SIZE_IN_NODES(fz_display_state_n(ctx, state) * sizeof(float));
+	}
+	if (n.alpha)
+	{
+		switch (n.alpha)
+		{
+		default:
+		case ALPHA_0:
+			state->alpha = 0.0f;
+			break;
+		case ALPHA_1:
+			state->alpha = 1.0f;
+			break;
+		case ALPHA_PRESENT:
+			state->alpha = *(float *)node;
+			node += SIZE_IN_NODES(sizeof(float));
+			break;
+		}
+	}
+	if (n.ctm != 0)
+	{
+		float *packed_ctm = (float *)node;
+		if (n.ctm & CTM_CHANGE_AD)
+		{
+			state->ctm.a = *packed_ctm++;
+			state->ctm.d = *packed_ctm++;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (n.ctm & CTM_CHANGE_BC)
+		{
+			state->ctm.b = *packed_ctm++;
+			state->ctm.c = *packed_ctm++;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (n.ctm & CTM_CHANGE_EF)
+		{
+			state->ctm.e = *packed_ctm++;
+			state->ctm.f = *packed_ctm;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+	}
+	if (n.stroke)
+	{
+		state->stroke = *(fz_stroke_state **)node;
+		node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+	}
+	if (n.path)
+		state->path = node - list->list;
+}
+
+static void
+fz_index_nodes(fz_context *ctx, fz_index_builder *b)
+{
+	fz_display_list *list = b->list;
+	int off, next;
+	int tile_start = 0;
+	int tile_depth = 0;
+
+	for (off = 0; off < list->len; off = next)
+	{
+		fz_display_node n = list->list[off];
+
+		next = off + n.size;
+
+		/* The chunks inside a clip end before the node that pops it. */
+		if (tile_depth == 0 && b->depth > 0 && (n.cmd == FZ_CMD_POP_CLIP || n.cmd == FZ_CMD_END_GROUP))
+			fz_index_flush_scope(ctx, b);
+
+		fz_index_update_state(ctx, list, &b->state, off);
+
+		if (tile_depth > 0)
+		{
+			if (n.cmd == FZ_CMD_BEGIN_TILE)
+				tile_depth++;
+			else if (n.cmd == FZ_CMD_END_TILE && --tile_depth == 0)
+				fz_index_add_item(ctx, b, 0, tile_start, next, fz_infinite_rect, 0);
+			continue;
+		}
+
+		switch (n.cmd)
+		{
+		case FZ_CMD_CLIP_PATH:
+		case FZ_CMD_CLIP_STROKE_PATH:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+		case FZ_CMD_BEGIN_MASK:
+		case FZ_CMD_BEGIN_GROUP:
+			fz_index_push_scope(ctx, b, off);
+			break;
+		case FZ_CMD_POP_CLIP:
+		case FZ_CMD_END_GROUP:
+			if (b->depth > 0)
+				fz_index_pop_scope(ctx, b, next);
+			else
+				fz_index_add_item(ctx, b, 0, off, next, fz_infinite_rect, 0);
+			break;
+		case FZ_CMD_BEGIN_TILE:
+			tile_start = off;
+			tile_depth = 1;
+			break;
+		case FZ_CMD_END_MASK:
+		case FZ_CMD_END_TILE:
+		case FZ_CMD_RENDER_FLAGS:
+		case FZ_CMD_DEFAULT_COLORSPACES:
+		case FZ_CMD_BEGIN_LAYER:
+		case FZ_CMD_END_LAYER:
+			fz_index_add_item(ctx, b, 0, off, next, fz_infinite_rect, 0);
+			break;
+		default:
+			fz_index_add_item(ctx, b, 0, off, next, b->state.rect, 0);
+			break;
+		}
+	}
+
+	/* Close anything left open at the end of the list. */
+	if (tile_depth > 0)
+		fz_index_add_item(ctx, b, 0, tile_start, list->len, fz_infinite_rect, 0);
+	while (b->depth > 0)
+	{
+		fz_index_flush_scope(ctx, b);
+		fz_index_pop_scope(ctx, b, list->len);
+	}
+	fz_index_flush_scope(ctx, b);
+}
+
+static int
+fz_cmp_display_chunk(const void *a_, const void *b_)
+{
+	const fz_display_chunk *a = a_;
+	const fz_display_chunk *b = b_;
+
+	/* In list order, with outer chunks before the chunks they hold. */
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	if (a->end != b->end)
+		return a->end > b->end ? -1 : 1;
+	return 0;
+}
+
+static fz_display_index *
+fz_new_display_index(fz_context *ctx, fz_display_list *list)
+{
+	fz_index_builder b = { 0 };
+	fz_display_index *index;
+	int i;
+
+	b.list = list;
+	b.state.ctm = fz_identity;
+	b.state.alpha = 1.0f;
+	b.state.cs = CS_GRAY_0;
+	b.state.color = -1;
+	b.state.path = -1;
+
+	index = b.index = fz_malloc_struct(ctx, fz_display_index);
+	index->len = list->len;
+
+	fz_try(ctx)
+	{
+		b.max_depth = 16;
+		b.scopes = fz_malloc_array(ctx, b.max_depth, sizeof(*b.scopes));
+		memset(&b.scopes[0], 0, sizeof(b.scopes[0]));
+		fz_index_nodes(ctx, &b);
+	}
+	fz_always(ctx)
+		fz_free(ctx, b.scopes);
+	fz_catch(ctx)
+	{
+		fz_drop_display_index(ctx, index);
+		fz_rethrow(ctx);
+	}
+
+	qsort(index->chunks, index->count, sizeof(*index->chunks), fz_cmp_display_chunk);
+
+	for (i = 0; i < index->count; i++)
+	{
+		int lo = i + 1;
+		int hi = index->count;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) >> 1;
+			if (index->chunks[mid].start < index->chunks[i].end)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		index->chunks[i].next = lo;
+	}
+
+	return index;
+}
+
+static float
+fz_rect_area(fz_rect r)
+{
+	return (r.x1 - r.x0) * (r.y1 - r.y0);
+}
+
+/* Return the index to use for running the list with the given
+ * scissor, making it if need be, or NULL to run the list without. */
+static fz_display_index *
+fz_display_list_index(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_rect scissor)
+{
+	fz_display_index *index, *old;
+	fz_rect page;
+
+	if (!FZ_ENABLE_DISPLAY_LIST_INDEX || list->len < INDEX_MIN_LEN || fz_is_infinite_rect(scissor))
+		return NULL;
+
+	page = fz_transform_rect(list->mediabox, ctm);
+	if (!fz_is_infinite_rect(page) && !fz_is_empty_rect(page))
+	{
+		scissor = fz_intersect_rect(scissor, page);
+		if (fz_rect_area(scissor) * INDEX_MAX_SCISSOR > fz_rect_area(page))
+			return NULL;
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	index = list->index;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (index && index->len == list->len)
+		return index;
+
+	fz_try(ctx)
+		index = fz_new_display_index(ctx, list);
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot index display list");
+		return NULL;
+	}
+
+	/* Another thread may have beaten us to it. */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	old = list->index;
+	if (old && old->len == list->len)
+	{
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_drop_display_index(ctx, index);
+		return old;
+	}
+	list->index = index;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_drop_display_index(ctx, old);
+
+	return index;
+}
+
+/* Return a new reference to the colorspace for a CS_* value, and set
+ * color to its default. */
+static fz_colorspace *
+fz_unpack_colorspace(fz_context *ctx, int cs, fz_colorspace *other, float *color)
+{
+	int i, n;
+
+	switch (cs)
+	{
+	default:
+	case CS_GRAY_0:
+		color[0] = 0.0f;
+		return fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	case CS_GRAY_1:
+		color[0] = 1.0f;
+		return fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	case CS_RGB_0:
+		color[0] = 0.0f;
+		color[1] = 0.0f;
+		color[2] = 0.0f;
+		return fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+	case CS_RGB_1:
+		color[0] = 1.0f;
+		color[1] = 1.0f;
+		color[2] = 1.0f;
+		return fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+	case CS_CMYK_0:
+		color[0] = 0.0f;
+		color[1] = 0.0f;
+		color[2] = 0.0f;
+		color[3] = 0.0f;
+		return fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
+	case CS_CMYK_1:
+		color[0] = 0.0f;
+		color[1] = 0.0f;
+		color[2] = 0.0f;
+		color[3] = 1.0f;
+		return fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
+	case CS_OTHER_0:
+		n = fz_colorspace_n(ctx, other);
+		for (i = 0; i < n; i++)
+			color[i] = 0.0f;
+		return fz_keep_colorspace(ctx, other);
+	}
+}
+
+/* Set the graphics state of fz_run_display_list to that recorded in
+ * an index chunk. */
+static void
+fz_restore_display_state(fz_context *ctx, fz_display_list *list, const fz_display_state *state,
+	fz_rect *rect, fz_matrix *ctm, float *alpha, fz_colorspace **colorspace, float *color,
+	fz_stroke_state **stroke, fz_path **path)
+{
+	*rect = state->rect;
+	*ctm = state->ctm;
+	*alpha = state->alpha;
+
+	fz_drop_colorspace(ctx, *colorspace);
+	*colorspace = fz_unpack_colorspace(ctx, state->cs, state->other, color);
+	if (state->color >= 0)
+		memcpy(color, &list->list[state->color], fz_colorspace_n(ctx, *colorspace) * sizeof(float));
+
+	if (*stroke != state->stroke)
+	{
+		fz_drop_stroke_state(ctx, *stroke);
+		*stroke = fz_keep_stroke_state(ctx, state->stroke);
+	}
+
+	fz_drop_path(ctx, *path);
+	*path = NULL;
+	if (state->path >= 0)
+		*path = fz_keep_path(ctx, (fz_path *)&list->list[state->path]);
+}
+
+/* Drop the references held by an array of len nodes. */
+static void
+fz_drop_display_nodes(fz_context *ctx, fz_display_node *node, int len)
+{
+	fz_display_node *node_end = node + len;
 	int cs_n = 1;
 	fz_colorspace *cs;
 
@@ -1440,6 +2060,15 @@ fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 		}
 		node = next;
 	}
+}
+
+static void
+fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
+{
+	fz_display_list *list = (fz_display_list *)list_;
+
+	fz_drop_display_nodes(ctx, list->list, list->len);
+	fz_drop_display_index(ctx, list->index);
 	fz_free(ctx, list->list);
 	fz_free(ctx, list);
 }
@@ -1461,6 +2090,7 @@ fz_new_display_list(fz_context *ctx, fz_rect mediabox)
 	list->mediabox = mediabox;
 	list->max = 0;
 	list->len = 0;
+	list->index = NULL;
 	return list;
 }
 
@@ -1499,6 +2129,40 @@ int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list)
 	return !list || list->len == 0;
 }
 
+/* Shrink the device space area of a group or alpha mask node to what was
+ * drawn into it. Images are grid fitted out to whole pixels, and thin
+ * strokes widened beyond their bounds, so allow for those. Lists loaded
+ * from before the contents were recorded lack them. */
+static fz_rect
+fz_list_contents_area(fz_context *ctx, fz_display_node n, fz_display_node *node, fz_display_node *next_node, fz_rect area, fz_matrix top_ctm)
+{
+	fz_rect contents;
+	float pad;
+
+	if (n.cmd == FZ_CMD_BEGIN_MASK && (n.flags & 1))
+		return area;
+	if (n.cmd == FZ_CMD_BEGIN_GROUP)
+	{
+		if (node + SIZE_IN_NODES(sizeof(fz_list_group_data)) > next_node)
+			return area;
+		contents = ((fz_list_group_data *)node)->contents;
+	}
+	else
+	{
+		if (node + SIZE_IN_NODES(sizeof(fz_rect)) > next_node)
+			return area;
+		contents = *(fz_rect *)node;
+	}
+	if (fz_is_infinite_rect(contents))
+		return area;
+	if (fz_is_empty_rect(contents))
+		return fz_empty_rect;
+
+	pad = 1 + fz_graphics_min_line_width(ctx) / 2;
+	contents = fz_expand_rect(fz_transform_rect(contents, top_ctm), pad);
+	return fz_intersect_rect(area, contents);
+}
+
 /*
 	(Re)-run a display list through a device.
 
@@ -1547,6 +2211,9 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 	fz_matrix trans_ctm;
 	int tile_skip_depth = 0;
 
+	fz_display_index *index;
+	int chunk = 0;
+
 	fz_var(colorspace);
 
 	if (cookie)
@@ -1557,6 +2224,8 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 
 	color_params = *fz_default_color_params(ctx);
 
+	index = fz_display_list_index(ctx, list, top_ctm, scissor);
+
 	node = list->list;
 	node_end = &list->list[list->len];
 	for (; node != node_end ; node = next_node)
@@ -1566,6 +2235,30 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 
 		next_node = node + n.size;
 
+		/* Skip whole chunks of the list that are out of view, or
+		 * inside a clip that is. */
+		if (index)
+		{
+			int off = node - list->list;
+			int skipped = 0;
+			while (chunk < index->count && index->chunks[chunk].start <= off)
+			{
+				fz_display_chunk *c = &index->chunks[chunk];
+				if (c->start == off && (clipped || fz_is_empty_rect(fz_intersect_rect(fz_transform_rect(c->bounds, top_ctm), scissor))))
+				{
+					fz_restore_display_state(ctx, list, &c->state, &rect, &ctm, &alpha, &colorspace, color, &stroke, &path);
+					progress += c->end - off;
+					next_node = &list->list[c->end];
+					chunk = c->next;
+					skipped = 1;
+					break;
+				}
+				chunk++;
+			}
+			if (skipped)
+				continue;
+		}
+
 		/* Check the cookie for aborting */
 		if (cookie)
 		{
@@ -1583,54 +2276,14 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 		}
 		if (n.cs)
 		{
-			int i, en;
-
-			fz_drop_colorspace(ctx, colorspace);
-			switch (n.cs)
+			fz_colorspace *other = NULL;
+			if (n.cs == CS_OTHER_0)
 			{
-			default:
-			case CS_GRAY_0:
-				colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
-				color[0] = 0.0f;
-				break;
-			case CS_GRAY_1:
-				colorspace = fz_keep_colorspace(ctx, fz_device_gray(ctx));
-				color[0] = 1.0f;
-				break;
-			case CS_RGB_0:
-				colorspace = fz_keep_colorspace(ctx, fz_device_rgb(ctx));
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				break;
-			case CS_RGB_1:
-				colorspace = fz_keep_colorspace(ctx, fz_device_rgb(ctx));
-				color[0] = 1.0f;
-				color[1] = 1.0f;
-				color[2] = 1.0f;
-				break;
-			case CS_CMYK_0:
-				colorspace = fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 0.0f;
-				break;
-			case CS_CMYK_1:
-				colorspace = fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 1.0f;
-				break;
-			case CS_OTHER_0:
-				colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
+				other = *(fz_colorspace **)(node);
 				node += SIZE_IN_NODES(sizeof(fz_colorspace *));
-				en = fz_colorspace_n(ctx, colorspace);
-				for (i = 0; i < en; i++)
-					color[i] = 0.0f;
-				break;
 			}
+			fz_drop_colorspace(ctx, colorspace);
+			colorspace = fz_unpack_colorspace(ctx, n.cs, other, color);
 		}
 		if (n.color)
 		{
@@ -1701,6 +2354,8 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, fz_m
 		}
 
 		trans_rect = fz_transform_rect(rect, top_ctm);
+		if (n.cmd == FZ_CMD_BEGIN_GROUP || n.cmd == FZ_CMD_BEGIN_MASK)
+			trans_rect = fz_list_contents_area(ctx, n, node, next_node, trans_rect, top_ctm);
 
 		/* cull objects to draw using a quick visibility test */
 
@@ -1862,3 +2517,2258 @@ visible:
 	if (cookie)
 		cookie->progress = progress;
 }
+
+/* Saved display lists.
+ *
+ * A saved display list is a header followed by a sequence of records,
+ * each holding one object: a buffer, colorspace, font, text object,
+ * stroke state, image, shade, set of default colorspaces, or display
+ * list. Records are numbered from 1 in the order they appear, and only
+ * refer to earlier records, by number (0 for none). The last record is
+ * the display list that was saved.
+ *
+ * The nodes of a list are written out as they are held in memory, with
+ * the pointers in them replaced by record numbers, so loading a list is
+ * a copy and a fix up of those pointers rather than a rerun of the
+ * page. The data of paths too big to be packed flat follows the nodes.
+ * The format is therefore tied to the layout of these structures; the
+ * header describes it, and files with a different layout are rejected.
+ *
+ * Buffers (font files, compressed image data, ICC profiles) are shared
+ * by content, so a resource that a document embeds many times is only
+ * stored once. Other objects are shared by identity.
+ */
+
+enum
+{
+	DL_VERSION = 1,
+
+	DL_BUFFER = 1,
+	DL_COLORSPACE,
+	DL_FONT,
+	DL_TEXT,
+	DL_STROKE,
+	DL_IMAGE,
+	DL_SHADE,
+	DL_DEFAULT_CS,
+	DL_LIST,
+
+	DL_CS_DEVICE = 0,
+	DL_CS_ICC,
+	DL_CS_CAL,
+	DL_CS_INDEXED,
+	DL_CS_SAMPLED,
+
+	DL_FONT_FT = 0,
+	DL_FONT_TYPE3,
+
+	DL_IMAGE_COMPRESSED = 0,
+	DL_IMAGE_PIXMAP,
+
+	/* Colorspaces that we can only save by sampling their conversion
+	 * are limited to this many components, and this many samples. */
+	DL_MAX_SAMPLED_N = 8,
+	DL_MAX_SAMPLES = 65536
+};
+
+typedef struct
+{
+	char magic[4];
+	int version;
+	int endian;
+	float one;
+	fz_display_node probe;
+	unsigned short size[10];
+} fz_dl_header;
+
+typedef struct
+{
+	int w, h, bpc;
+	int xres, yres;
+	int imagemask, interpolate, use_colorkey, use_decode, invert_cmyk_jpeg, scalable;
+	int colorkey[FZ_MAX_COLORS * 2];
+	float decode[FZ_MAX_COLORS * 2];
+} fz_dl_image_info;
+
+/* The pointers held in a display list node, and where its private
+ * data starts. */
+typedef struct
+{
+	void **colorspace;
+	void **stroke;
+	fz_path *path;
+	fz_display_node *data;
+	int data_kind;
+} fz_dl_slots;
+
+typedef struct
+{
+	fz_output *out;
+	fz_hash_table *objects;
+	fz_hash_table *digests;
+	int count;
+} fz_dl_writer;
+
+typedef struct
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	int count;
+	int max;
+	int *kinds;
+	void **objs;
+} fz_dl_reader;
+
+static void
+dl_make_header(fz_dl_header *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, "MUDL", 4);
+	header->version = DL_VERSION;
+	header->endian = 0x01020304;
+	header->one = 1.0f;
+	header->probe.cmd = FZ_CMD_END_LAYER;
+	header->probe.size = 300;
+	header->probe.rect = 1;
+	header->probe.cs = CS_CMYK_0;
+	header->probe.alpha = ALPHA_0;
+	header->probe.ctm = CTM_CHANGE_BC | CTM_CHANGE_EF;
+	header->probe.stroke = 1;
+	header->probe.flags = 42;
+	header->size[0] = sizeof(void *);
+	header->size[1] = sizeof(int);
+	header->size[2] = sizeof(size_t);
+	header->size[3] = sizeof(fz_display_node);
+	header->size[4] = sizeof(fz_shade);
+	header->size[5] = sizeof(fz_compression_params);
+	header->size[6] = sizeof(fz_font_flags_t);
+	header->size[7] = sizeof(fz_text_item);
+	header->size[8] = sizeof(fz_dl_image_info);
+	header->size[9] = sizeof(fz_list_tile_data);
+}
+
+static int
+dl_node_data_kind(int cmd)
+{
+	switch (cmd)
+	{
+	case FZ_CMD_FILL_TEXT:
+	case FZ_CMD_STROKE_TEXT:
+	case FZ_CMD_CLIP_TEXT:
+	case FZ_CMD_CLIP_STROKE_TEXT:
+	case FZ_CMD_IGNORE_TEXT:
+		return DL_TEXT;
+	case FZ_CMD_FILL_SHADE:
+		return DL_SHADE;
+	case FZ_CMD_FILL_IMAGE:
+	case FZ_CMD_FILL_IMAGE_MASK:
+	case FZ_CMD_CLIP_IMAGE_MASK:
+		return DL_IMAGE;
+	case FZ_CMD_BEGIN_GROUP:
+		return DL_COLORSPACE;
+	case FZ_CMD_DEFAULT_COLORSPACES:
+		return DL_DEFAULT_CS;
+	}
+	return 0;
+}
+
+/* The number of color components after a node whose colorspace is not
+ * CS_OTHER_0. */
+static int
+dl_node_cs_n(fz_display_node n, int cs_n)
+{
+	switch (n.cs)
+	{
+	case CS_GRAY_0:
+	case CS_GRAY_1:
+		return 1;
+	case CS_RGB_0:
+	case CS_RGB_1:
+		return 3;
+	case CS_CMYK_0:
+	case CS_CMYK_1:
+		return 4;
+	}
+	return cs_n;
+}
+
+/* Find the colorspace pointer in a node, if it has one. */
+static void **
+dl_colorspace_slot(fz_display_node *node)
+{
+	fz_display_node n = *node++;
+
+	if (n.cs != CS_OTHER_0 || n.size < 1 + n.rect * SIZE_IN_NODES(sizeof(fz_rect)) + SIZE_IN_NODES(sizeof(fz_colorspace *)))
+		return NULL;
+	if (n.rect)
+		node += SIZE_IN_NODES(sizeof(fz_rect));
+	return (void **)node;
+}
+
+/* Find the pointers in a node, given the number of components of its
+ * colorspace. Returns 0 if the node is too short to hold them. */
+static int
+dl_node_slots(fz_display_node *node, int cs_n, fz_dl_slots *s)
+{
+	fz_display_node n = *node;
+	fz_display_node *end = node + n.size;
+
+	memset(s, 0, sizeof(*s));
+	node++;
+	if (n.rect)
+		node += SIZE_IN_NODES(sizeof(fz_rect));
+	if (n.cs == CS_OTHER_0)
+	{
+		s->colorspace = (void **)node;
+		node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+	}
+	if (n.color)
+		node += SIZE_IN_NODES(cs_n * sizeof(float));
+	if (n.alpha == ALPHA_PRESENT)
+		node += SIZE_IN_NODES(sizeof(float));
+	if (n.ctm & CTM_CHANGE_AD)
+		node += SIZE_IN_NODES(2*sizeof(float));
+	if (n.ctm & CTM_CHANGE_BC)
+		node += SIZE_IN_NODES(2*sizeof(float));
+	if (n.ctm & CTM_CHANGE_EF)
+		node += SIZE_IN_NODES(2*sizeof(float));
+	if (n.stroke)
+	{
+		s->stroke = (void **)node;
+		node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+	}
+	if (node > end)
+		return 0;
+	if (n.path)
+	{
+		int path_size = fz_packed_path_size_within((fz_path *)node, (end - node) * sizeof(fz_display_node));
+		if (path_size < 0)
+			return 0;
+		s->path = (fz_path *)node;
+		node += SIZE_IN_NODES(path_size);
+	}
+	s->data = node;
+	s->data_kind = dl_node_data_kind(n.cmd);
+	if (s->data_kind && node + SIZE_IN_NODES(sizeof(void *)) > end)
+		return 0;
+	if (n.cmd == FZ_CMD_BEGIN_TILE && node + SIZE_IN_NODES(sizeof(fz_list_tile_data)) > end)
+		return 0;
+	if (n.cmd == FZ_CMD_BEGIN_LAYER && (node == end || !memchr(node, 0, (end - node) * sizeof(fz_display_node))))
+		return 0;
+	return 1;
+}
+
+/* Writing */
+
+static void
+dl_write(fz_context *ctx, fz_dl_writer *w, const void *data, size_t len)
+{
+	fz_write_data(ctx, w->out, data, len);
+}
+
+static void
+dl_write_int(fz_context *ctx, fz_dl_writer *w, int x)
+{
+	dl_write(ctx, w, &x, sizeof(x));
+}
+
+static void
+dl_write_string(fz_context *ctx, fz_dl_writer *w, const char *str)
+{
+	int len = str ? (int)strlen(str) + 1 : 0;
+	dl_write_int(ctx, w, len);
+	dl_write(ctx, w, str, len);
+}
+
+/* Find the record number an object was saved as, 0 if it has not been
+ * saved, or -1 if it is being saved. */
+static int
+dl_find(fz_context *ctx, fz_dl_writer *w, const void *obj)
+{
+	return (int)(intptr_t)fz_hash_find(ctx, w->objects, &obj);
+}
+
+/* Start the record for an object, once everything it refers to has been
+ * written. */
+static int
+dl_begin_record(fz_context *ctx, fz_dl_writer *w, int kind, const void *obj)
+{
+	dl_write_int(ctx, w, kind);
+	w->count++;
+	if (obj)
+		fz_hash_insert(ctx, w->objects, &obj, (void *)(intptr_t)w->count);
+	return w->count;
+}
+
+static int dl_save_list(fz_context *ctx, fz_dl_writer *w, fz_display_list *list);
+
+static int
+dl_save_buffer(fz_context *ctx, fz_dl_writer *w, fz_buffer *buf)
+{
+	unsigned char digest[16];
+	unsigned char *data;
+	size_t len;
+	int ref;
+
+	if (!buf)
+		return 0;
+	ref = dl_find(ctx, w, buf);
+	if (ref)
+		return ref;
+
+	fz_md5_buffer(ctx, buf, digest);
+	ref = (int)(intptr_t)fz_hash_find(ctx, w->digests, digest);
+	if (!ref)
+	{
+		len = fz_buffer_storage(ctx, buf, &data);
+		ref = dl_begin_record(ctx, w, DL_BUFFER, NULL);
+		dl_write(ctx, w, &len, sizeof(len));
+		dl_write(ctx, w, data, len);
+		fz_hash_insert(ctx, w->digests, digest, (void *)(intptr_t)ref);
+	}
+	fz_hash_insert(ctx, w->objects, &buf, (void *)(intptr_t)ref);
+	return ref;
+}
+
+/* Pick the largest grid that samples an n component colorspace with no
+ * more than DL_MAX_SAMPLES points. */
+static int
+dl_sample_grid(int n, int *count)
+{
+	int grid, i;
+
+	for (grid = 256; grid > 2; grid--)
+	{
+		*count = 1;
+		for (i = 0; i < n && *count <= DL_MAX_SAMPLES; i++)
+			*count *= grid;
+		if (*count <= DL_MAX_SAMPLES)
+			return grid;
+	}
+	*count = 1 << n;
+	return 2;
+}
+
+static int dl_save_colorspace(fz_context *ctx, fz_dl_writer *w, fz_colorspace *cs);
+
+/* Colorspaces defined by a function of their components, such as
+ * Separation and DeviceN, are saved as a grid of samples of that
+ * function. With an ICC engine, colors are converted through the base
+ * colorspace, so that is what we sample; without, they are converted
+ * straight to RGB. */
+static int
+dl_save_sampled_colorspace(fz_context *ctx, fz_dl_writer *w, fz_colorspace *cs)
+{
+	fz_colorspace *base = fz_colorspace_base(ctx, cs);
+	fz_colorspace *out;
+	float src[FZ_MAX_COLORS];
+	float dst[FZ_MAX_COLORS];
+	int use_base, base_ref, out_ref, ref;
+	int n = cs->n;
+	int grid, count, i, k;
+
+	if (!base || !cs->to_ccs)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save colorspace '%s'", cs->name);
+	if (n > DL_MAX_SAMPLED_N)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save colorspace '%s' with %d components", cs->name, n);
+
+	use_base = fz_colorspace_is_icc(ctx, fz_device_rgb(ctx));
+	out = use_base ? base : fz_device_rgb(ctx);
+	grid = dl_sample_grid(n, &count);
+
+	base_ref = dl_save_colorspace(ctx, w, base);
+	out_ref = dl_save_colorspace(ctx, w, out);
+
+	ref = dl_begin_record(ctx, w, DL_COLORSPACE, cs);
+	dl_write_int(ctx, w, DL_CS_SAMPLED);
+	dl_write_int(ctx, w, cs->type);
+	dl_write_int(ctx, w, n);
+	dl_write_string(ctx, w, cs->name);
+	for (k = 0; k < n; k++)
+		dl_write_string(ctx, w, cs->colorant[k]);
+	dl_write_int(ctx, w, base_ref);
+	dl_write_int(ctx, w, out_ref);
+	dl_write_int(ctx, w, grid);
+	for (i = 0; i < count; i++)
+	{
+		int v = i;
+		for (k = 0; k < n; k++)
+		{
+			src[k] = (float)(v % grid) / (grid - 1);
+			v /= grid;
+		}
+		if (use_base)
+			cs->to_ccs(ctx, cs, src, dst);
+		else
+			fz_convert_color(ctx, fz_default_color_params(ctx), NULL, out, dst, cs, src);
+		dl_write(ctx, w, dst, out->n * sizeof(float));
+	}
+	return ref;
+}
+
+static int
+dl_save_colorspace(fz_context *ctx, fz_dl_writer *w, fz_colorspace *cs)
+{
+	fz_colorspace *device[5];
+	int ref, i;
+
+	if (!cs)
+		return 0;
+	ref = dl_find(ctx, w, cs);
+	if (ref)
+		return ref;
+
+	device[0] = fz_device_gray(ctx);
+	device[1] = fz_device_rgb(ctx);
+	device[2] = fz_device_bgr(ctx);
+	device[3] = fz_device_cmyk(ctx);
+	device[4] = fz_device_lab(ctx);
+	for (i = 0; i < nelem(device); i++)
+	{
+		if (cs == device[i])
+		{
+			ref = dl_begin_record(ctx, w, DL_COLORSPACE, cs);
+			dl_write_int(ctx, w, DL_CS_DEVICE);
+			dl_write_int(ctx, w, i);
+			return ref;
+		}
+	}
+
+	if (fz_colorspace_is_icc(ctx, cs))
+	{
+		int buf = dl_save_buffer(ctx, w, fz_icc_data_from_icc_colorspace(ctx, cs));
+		int alt = dl_save_colorspace(ctx, w, fz_alternate_colorspace(ctx, cs));
+		ref = dl_begin_record(ctx, w, DL_COLORSPACE, cs);
+		dl_write_int(ctx, w, DL_CS_ICC);
+		dl_write_int(ctx, w, cs->type);
+		dl_write_int(ctx, w, buf);
+		dl_write_int(ctx, w, alt);
+	}
+	else if (fz_colorspace_is_cal(ctx, cs))
+	{
+		fz_cal_colorspace *cal = cs->data;
+		ref = dl_begin_record(ctx, w, DL_COLORSPACE, cs);
+		dl_write_int(ctx, w, DL_CS_CAL);
+		dl_write_string(ctx, w, cs->name);
+		dl_write(ctx, w, cal->wp, sizeof(cal->wp));
+		dl_write(ctx, w, cal->bp, sizeof(cal->bp));
+		dl_write(ctx, w, cal->gamma, sizeof(cal->gamma));
+		dl_write(ctx, w, cal->matrix, sizeof(cal->matrix));
+		dl_write_int(ctx, w, cal->n);
+	}
+	else if (fz_colorspace_is_indexed(ctx, cs))
+	{
+		fz_colorspace *base = fz_colorspace_base(ctx, cs);
+		int high;
+		unsigned char *lookup = fz_indexed_colorspace_palette(ctx, cs, &high);
+		int base_ref = dl_save_colorspace(ctx, w, base);
+		ref = dl_begin_record(ctx, w, DL_COLORSPACE, cs);
+		dl_write_int(ctx, w, DL_CS_INDEXED);
+		dl_write_int(ctx, w, base_ref);
+		dl_write_int(ctx, w, high);
+		dl_write(ctx, w, lookup, base->n * (high + 1));
+	}
+	else
+		ref = dl_save_sampled_colorspace(ctx, w, cs);
+
+	return ref;
+}
+
+static void
+dl_write_font_info(fz_context *ctx, fz_dl_writer *w, fz_font *font, int kind)
+{
+	dl_write_int(ctx, w, kind);
+	dl_write_string(ctx, w, font->name);
+	dl_write(ctx, w, &font->flags, sizeof(font->flags));
+	dl_write(ctx, w, &font->bbox, sizeof(font->bbox));
+}
+
+static int
+dl_save_font(fz_context *ctx, fz_dl_writer *w, fz_font *font)
+{
+	int ref, i;
+
+	ref = dl_find(ctx, w, font);
+	if (ref < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save type3 font '%s' that uses itself", font->name);
+	if (ref)
+		return ref;
+
+	if (font->t3lists)
+	{
+		/* Type3 fonts are saved as the display lists of their
+		 * glyphs. Glyphs that depend on the graphics state they are
+		 * drawn in are never drawn from these, but are run straight
+		 * into the page as it is interpreted. */
+		int lists[256];
+
+		fz_hash_insert(ctx, w->objects, &font, (void *)(intptr_t)-1);
+		for (i = 0; i < 256; i++)
+			lists[i] = dl_save_list(ctx, w, font->t3lists[i]);
+		fz_hash_remove(ctx, w->objects, &font);
+
+		ref = dl_begin_record(ctx, w, DL_FONT, font);
+		dl_write_font_info(ctx, w, font, DL_FONT_TYPE3);
+		dl_write(ctx, w, &font->t3matrix, sizeof(font->t3matrix));
+		dl_write(ctx, w, font->t3widths, 256 * sizeof(float));
+		dl_write(ctx, w, font->t3flags, 256 * sizeof(unsigned short));
+		dl_write(ctx, w, lists, sizeof(lists));
+	}
+	else
+	{
+		int index = fz_font_ft_face_index(ctx, font);
+		int buf, width_count;
+
+		if (index < 0 || !font->buffer)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save font '%s' without its font file", font->name);
+		buf = dl_save_buffer(ctx, w, font->buffer);
+		width_count = font->width_table ? font->width_count : 0;
+
+		ref = dl_begin_record(ctx, w, DL_FONT, font);
+		dl_write_font_info(ctx, w, font, DL_FONT_FT);
+		dl_write_int(ctx, w, buf);
+		dl_write_int(ctx, w, index);
+		dl_write_int(ctx, w, font->bbox_table != NULL);
+		dl_write_int(ctx, w, font->width_default);
+		dl_write_int(ctx, w, width_count);
+		dl_write(ctx, w, font->width_table, width_count * sizeof(short));
+	}
+	return ref;
+}
+
+static int
+dl_save_text(fz_context *ctx, fz_dl_writer *w, const fz_text *text)
+{
+	fz_text_span *span;
+	int ref, count = 0;
+
+	ref = dl_find(ctx, w, text);
+	if (ref)
+		return ref;
+
+	for (span = text->head; span; span = span->next)
+	{
+		dl_save_font(ctx, w, span->font);
+		count++;
+	}
+
+	ref = dl_begin_record(ctx, w, DL_TEXT, text);
+	dl_write_int(ctx, w, count);
+	for (span = text->head; span; span = span->next)
+	{
+		dl_write_int(ctx, w, dl_find(ctx, w, span->font));
+		dl_write(ctx, w, &span->trm, sizeof(span->trm));
+		dl_write_int(ctx, w, span->wmode);
+		dl_write_int(ctx, w, span->bidi_level);
+		dl_write_int(ctx, w, span->markup_dir);
+		dl_write_int(ctx, w, span->language);
+		dl_write_int(ctx, w, span->len);
+		dl_write(ctx, w, span->items, span->len * sizeof(fz_text_item));
+	}
+	return ref;
+}
+
+static int
+dl_save_stroke(fz_context *ctx, fz_dl_writer *w, const fz_stroke_state *stroke)
+{
+	int ref;
+
+	ref = dl_find(ctx, w, stroke);
+	if (ref)
+		return ref;
+
+	ref = dl_begin_record(ctx, w, DL_STROKE, stroke);
+	dl_write_int(ctx, w, stroke->start_cap);
+	dl_write_int(ctx, w, stroke->dash_cap);
+	dl_write_int(ctx, w, stroke->end_cap);
+	dl_write_int(ctx, w, stroke->linejoin);
+	dl_write(ctx, w, &stroke->linewidth, sizeof(float));
+	dl_write(ctx, w, &stroke->miterlimit, sizeof(float));
+	dl_write(ctx, w, &stroke->dash_phase, sizeof(float));
+	dl_write_int(ctx, w, stroke->dash_len);
+	dl_write(ctx, w, stroke->dash_list, stroke->dash_len * sizeof(float));
+	return ref;
+}
+
+static void
+dl_write_image_info(fz_context *ctx, fz_dl_writer *w, fz_image *image, fz_pixmap *pix)
+{
+	fz_dl_image_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.w = image->w;
+	info.h = image->h;
+	info.bpc = image->bpc;
+	info.xres = image->xres;
+	info.yres = image->yres;
+	info.imagemask = image->imagemask;
+	info.interpolate = image->interpolate;
+	info.invert_cmyk_jpeg = image->invert_cmyk_jpeg;
+	info.scalable = image->scalable;
+	if (!pix)
+	{
+		/* Only the compressed data needs decoding. */
+		info.use_colorkey = image->use_colorkey;
+		info.use_decode = image->use_decode;
+		memcpy(info.colorkey, image->colorkey, sizeof(info.colorkey));
+		memcpy(info.decode, image->decode, sizeof(info.decode));
+	}
+	else if (pix != fz_pixmap_image_tile(ctx, (fz_pixmap_image *)image))
+	{
+		/* A pixmap we decoded ourselves is already complete. */
+		info.w = pix->w;
+		info.h = pix->h;
+		info.bpc = 8;
+	}
+	dl_write(ctx, w, &info, sizeof(info));
+}
+
+static int dl_save_image(fz_context *ctx, fz_dl_writer *w, fz_image *image);
+
+static int
+dl_save_pixmap_image(fz_context *ctx, fz_dl_writer *w, fz_image *image, fz_pixmap *pix)
+{
+	int mask, cs, ref, y;
+	unsigned char *s;
+
+	if (pix->s)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save image with spot colors");
+
+	mask = dl_save_image(ctx, w, image->mask);
+	cs = dl_save_colorspace(ctx, w, pix->colorspace);
+
+	ref = dl_begin_record(ctx, w, DL_IMAGE, image);
+	dl_write_int(ctx, w, DL_IMAGE_PIXMAP);
+	dl_write_int(ctx, w, mask);
+	dl_write_image_info(ctx, w, image, pix);
+	dl_write_int(ctx, w, cs);
+	dl_write_int(ctx, w, pix->x);
+	dl_write_int(ctx, w, pix->y);
+	dl_write_int(ctx, w, pix->w);
+	dl_write_int(ctx, w, pix->h);
+	dl_write_int(ctx, w, pix->n);
+	dl_write_int(ctx, w, pix->alpha);
+	dl_write_int(ctx, w, pix->flags & FZ_PIXMAP_FLAG_INTERPOLATE);
+	dl_write_int(ctx, w, pix->xres);
+	dl_write_int(ctx, w, pix->yres);
+	s = pix->samples;
+	for (y = 0; y < pix->h; y++)
+	{
+		dl_write(ctx, w, s, (size_t)pix->w * pix->n);
+		s += pix->stride;
+	}
+	return ref;
+}
+
+static int
+dl_save_image(fz_context *ctx, fz_dl_writer *w, fz_image *image)
+{
+	fz_compressed_buffer *cbuf;
+	fz_pixmap *pix;
+	int ref;
+
+	if (!image)
+		return 0;
+	ref = dl_find(ctx, w, image);
+	if (ref)
+		return ref;
+
+	cbuf = fz_compressed_image_buffer(ctx, image);
+	pix = fz_pixmap_image_tile(ctx, (fz_pixmap_image *)image);
+
+	if (cbuf && cbuf->buffer && !(cbuf->params.type == FZ_IMAGE_JBIG2 && cbuf->params.u.jbig2.globals))
+	{
+		fz_compression_params params = cbuf->params;
+		int mask = dl_save_image(ctx, w, image->mask);
+		int cs = dl_save_colorspace(ctx, w, image->colorspace);
+		int buf = dl_save_buffer(ctx, w, cbuf->buffer);
+
+		if (params.type == FZ_IMAGE_JBIG2)
+			params.u.jbig2.globals = NULL;
+		ref = dl_begin_record(ctx, w, DL_IMAGE, image);
+		dl_write_int(ctx, w, DL_IMAGE_COMPRESSED);
+		dl_write_int(ctx, w, mask);
+		dl_write_image_info(ctx, w, image, NULL);
+		dl_write_int(ctx, w, cs);
+		dl_write(ctx, w, &params, sizeof(params));
+		dl_write_int(ctx, w, buf);
+	}
+	else if (pix)
+		ref = dl_save_pixmap_image(ctx, w, image, pix);
+	else
+	{
+		/* Any other kind of image (or one that needs JBIG2 globals)
+		 * is decoded, and saved as a pixmap. */
+		pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+		fz_try(ctx)
+			ref = dl_save_pixmap_image(ctx, w, image, pix);
+		fz_always(ctx)
+			fz_drop_pixmap(ctx, pix);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+	return ref;
+}
+
+static int
+dl_save_shade(fz_context *ctx, fz_dl_writer *w, fz_shade *shade)
+{
+	fz_shade copy;
+	int ref, cs, buf = 0, count = 0;
+
+	ref = dl_find(ctx, w, shade);
+	if (ref)
+		return ref;
+
+	if (shade->buffer && shade->buffer->params.type == FZ_IMAGE_JBIG2)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save JBIG2 compressed shading");
+	cs = dl_save_colorspace(ctx, w, shade->colorspace);
+	if (shade->buffer)
+		buf = dl_save_buffer(ctx, w, shade->buffer->buffer);
+
+	copy = *shade;
+	memset(&copy.storable, 0, sizeof(copy.storable));
+	copy.colorspace = NULL;
+	copy.buffer = NULL;
+	if (shade->type == FZ_FUNCTION_BASED)
+	{
+		copy.u.f.fn_vals = NULL;
+		count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * shade->colorspace->n;
+	}
+
+	ref = dl_begin_record(ctx, w, DL_SHADE, shade);
+	dl_write(ctx, w, &copy, sizeof(copy));
+	dl_write_int(ctx, w, cs);
+	dl_write_int(ctx, w, count);
+	dl_write(ctx, w, shade->u.f.fn_vals, count * sizeof(float));
+	dl_write_int(ctx, w, shade->buffer != NULL);
+	if (shade->buffer)
+	{
+		dl_write(ctx, w, &shade->buffer->params, sizeof(shade->buffer->params));
+		dl_write_int(ctx, w, buf);
+	}
+	return ref;
+}
+
+static int
+dl_save_default_colorspaces(fz_context *ctx, fz_dl_writer *w, fz_default_colorspaces *dcs)
+{
+	int ref, gray, rgb, cmyk, oi;
+
+	ref = dl_find(ctx, w, dcs);
+	if (ref)
+		return ref;
+
+	gray = dl_save_colorspace(ctx, w, dcs->gray);
+	rgb = dl_save_colorspace(ctx, w, dcs->rgb);
+	cmyk = dl_save_colorspace(ctx, w, dcs->cmyk);
+	oi = dl_save_colorspace(ctx, w, dcs->oi);
+
+	ref = dl_begin_record(ctx, w, DL_DEFAULT_CS, dcs);
+	dl_write_int(ctx, w, gray);
+	dl_write_int(ctx, w, rgb);
+	dl_write_int(ctx, w, cmyk);
+	dl_write_int(ctx, w, oi);
+	return ref;
+}
+
+/* Save everything a list refers to, replacing the pointers in a copy of
+ * its nodes with record numbers, and collecting the data of any open
+ * packed paths. */
+static void
+dl_save_nodes(fz_context *ctx, fz_dl_writer *w, fz_display_node *nodes, int len, fz_buffer *paths)
+{
+	fz_display_node *node = nodes;
+	fz_display_node *node_end = nodes + len;
+	int cs_n = 1;
+
+	while (node != node_end)
+	{
+		fz_display_node n = *node;
+		void **slot = dl_colorspace_slot(node);
+		fz_dl_slots s;
+		intptr_t ref = 0;
+
+		if (slot)
+		{
+			fz_colorspace *cs = *slot;
+			cs_n = cs->n;
+			*slot = (void *)(intptr_t)dl_save_colorspace(ctx, w, cs);
+		}
+		else
+			cs_n = dl_node_cs_n(n, cs_n);
+
+		(void)dl_node_slots(node, cs_n, &s);
+		if (s.stroke)
+			*s.stroke = (void *)(intptr_t)dl_save_stroke(ctx, w, *s.stroke);
+		if (s.path)
+		{
+			const unsigned char *cmds;
+			const float *coords;
+			int cmd_len, coord_len;
+
+			if (fz_packed_path_open_data(s.path, &cmds, &cmd_len, &coords, &coord_len) > 0)
+			{
+				fz_append_data(ctx, paths, &cmd_len, sizeof(cmd_len));
+				fz_append_data(ctx, paths, &coord_len, sizeof(coord_len));
+				fz_append_data(ctx, paths, cmds, cmd_len);
+				fz_append_data(ctx, paths, coords, coord_len * sizeof(float));
+			}
+			fz_detach_packed_path(s.path);
+		}
+		if (s.data_kind)
+		{
+			void *obj = *(void **)s.data;
+			switch (s.data_kind)
+			{
+			case DL_TEXT:
+				ref = dl_save_text(ctx, w, obj);
+				break;
+			case DL_SHADE:
+				ref = dl_save_shade(ctx, w, obj);
+				break;
+			case DL_IMAGE:
+				ref = dl_save_image(ctx, w, obj);
+				break;
+			case DL_COLORSPACE:
+				ref = dl_save_colorspace(ctx, w, obj);
+				break;
+			case DL_DEFAULT_CS:
+				ref = dl_save_default_colorspaces(ctx, w, obj);
+				break;
+			}
+			*(void **)s.data = (void *)ref;
+		}
+		node += n.size;
+	}
+}
+
+static int
+dl_save_list(fz_context *ctx, fz_dl_writer *w, fz_display_list *list)
+{
+	fz_display_node *nodes;
+	fz_buffer *paths = NULL;
+	unsigned char *data;
+	size_t len;
+	int ref;
+
+	if (!list)
+		return 0;
+	ref = dl_find(ctx, w, list);
+	if (ref)
+		return ref;
+
+	nodes = fz_malloc_array(ctx, list->len, sizeof(fz_display_node));
+	fz_var(paths);
+	fz_try(ctx)
+	{
+		memcpy(nodes, list->list, list->len * sizeof(fz_display_node));
+		paths = fz_new_buffer(ctx, 0);
+		dl_save_nodes(ctx, w, nodes, list->len, paths);
+
+		ref = dl_begin_record(ctx, w, DL_LIST, list);
+		dl_write(ctx, w, &list->mediabox, sizeof(list->mediabox));
+		dl_write_int(ctx, w, list->len);
+		dl_write(ctx, w, nodes, list->len * sizeof(fz_display_node));
+		len = fz_buffer_storage(ctx, paths, &data);
+		dl_write(ctx, w, data, len);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, paths);
+		fz_free(ctx, nodes);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return ref;
+}
+
+/*
+	Write a display list to an output stream, in a form that
+	fz_new_display_list_from_buffer can load back without running
+	the page again.
+
+	Everything the list refers to (fonts, images, shadings,
+	colorspaces) is written out with it. Saved lists can only be
+	loaded by a build of the library with the same structure layout
+	as the one that saved them.
+
+	Throws an exception if the list refers to something that cannot
+	be saved, such as a font without a font file.
+*/
+void
+fz_write_display_list(fz_context *ctx, fz_output *out, fz_display_list *list)
+{
+	fz_dl_writer w = { 0 };
+	fz_dl_header header;
+
+	w.out = out;
+
+	fz_try(ctx)
+	{
+		w.objects = fz_new_hash_table(ctx, 256, sizeof(void *), -1, NULL);
+		w.digests = fz_new_hash_table(ctx, 64, 16, -1, NULL);
+		dl_make_header(&header);
+		dl_write(ctx, &w, &header, sizeof(header));
+		dl_save_list(ctx, &w, list);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_hash_table(ctx, w.digests);
+		fz_drop_hash_table(ctx, w.objects);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+	Save a display list to a file. See fz_write_display_list.
+*/
+void
+fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_output *out = fz_new_output_with_path(ctx, filename, 0);
+	fz_try(ctx)
+	{
+		fz_write_display_list(ctx, out, list);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Reading */
+
+static const void *
+dl_read(fz_context *ctx, fz_dl_reader *r, size_t len)
+{
+	const void *data = r->p;
+	if (len > (size_t)(r->end - r->p))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list");
+	r->p += len;
+	return data;
+}
+
+static int
+dl_read_int(fz_context *ctx, fz_dl_reader *r)
+{
+	int x;
+	memcpy(&x, dl_read(ctx, r, sizeof(x)), sizeof(x));
+	return x;
+}
+
+static void
+dl_read_data(fz_context *ctx, fz_dl_reader *r, void *data, size_t len)
+{
+	memcpy(data, dl_read(ctx, r, len), len);
+}
+
+/* Read a count of n items of the given size, checking that they are
+ * all in the file. */
+static int
+dl_read_count(fz_context *ctx, fz_dl_reader *r, size_t size)
+{
+	int n = dl_read_int(ctx, r);
+	if (n < 0 || (size && (size_t)n > (size_t)(r->end - r->p) / size))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	return n;
+}
+
+static const char *
+dl_read_string(fz_context *ctx, fz_dl_reader *r)
+{
+	int len = dl_read_count(ctx, r, 1);
+	const char *str = dl_read(ctx, r, len);
+	if (len == 0)
+		return NULL;
+	if (str[len - 1] != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	return str;
+}
+
+/* Look up a record that has already been loaded, without taking a
+ * reference to it. */
+static void *
+dl_lookup(fz_context *ctx, fz_dl_reader *r, int ref, int kind)
+{
+	if (ref == 0)
+		return NULL;
+	if (ref < 0 || ref > r->count || r->kinds[ref - 1] != kind)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	return r->objs[ref - 1];
+}
+
+static void *
+dl_read_ref(fz_context *ctx, fz_dl_reader *r, int kind, int required)
+{
+	void *obj = dl_lookup(ctx, r, dl_read_int(ctx, r), kind);
+	if (!obj && required)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	return obj;
+}
+
+static void *
+dl_keep(fz_context *ctx, int kind, void *obj)
+{
+	switch (kind)
+	{
+	case DL_BUFFER: return fz_keep_buffer(ctx, obj);
+	case DL_COLORSPACE: return fz_keep_colorspace(ctx, obj);
+	case DL_FONT: return fz_keep_font(ctx, obj);
+	case DL_TEXT: return fz_keep_text(ctx, obj);
+	case DL_STROKE: return fz_keep_stroke_state(ctx, obj);
+	case DL_IMAGE: return fz_keep_image(ctx, obj);
+	case DL_SHADE: return fz_keep_shade(ctx, obj);
+	case DL_DEFAULT_CS: return fz_keep_default_colorspaces(ctx, obj);
+	case DL_LIST: return fz_keep_display_list(ctx, obj);
+	}
+	return NULL;
+}
+
+static void
+dl_drop(fz_context *ctx, int kind, void *obj)
+{
+	switch (kind)
+	{
+	case DL_BUFFER: fz_drop_buffer(ctx, obj); break;
+	case DL_COLORSPACE: fz_drop_colorspace(ctx, obj); break;
+	case DL_FONT: fz_drop_font(ctx, obj); break;
+	case DL_TEXT: fz_drop_text(ctx, obj); break;
+	case DL_STROKE: fz_drop_stroke_state(ctx, obj); break;
+	case DL_IMAGE: fz_drop_image(ctx, obj); break;
+	case DL_SHADE: fz_drop_shade(ctx, obj); break;
+	case DL_DEFAULT_CS: fz_drop_default_colorspaces(ctx, obj); break;
+	case DL_LIST: fz_drop_display_list(ctx, obj); break;
+	}
+}
+
+static fz_buffer *
+dl_load_buffer(fz_context *ctx, fz_dl_reader *r)
+{
+	size_t len;
+
+	dl_read_data(ctx, r, &len, sizeof(len));
+	return fz_new_buffer_from_copied_data(ctx, dl_read(ctx, r, len), len);
+}
+
+typedef struct
+{
+	fz_colorspace *base;
+	fz_colorspace *out;
+	int grid;
+	float *samples;
+} fz_dl_sampled;
+
+static void
+dl_sampled_to_ccs(fz_context *ctx, fz_colorspace *cs, const float *src, float *dst)
+{
+	fz_dl_sampled *sampled = cs->data;
+	fz_colorspace *target = fz_colorspace_is_icc(ctx, fz_device_rgb(ctx)) ? sampled->base : fz_device_rgb(ctx);
+	int n = cs->n;
+	int out_n = sampled->out->n;
+	int grid = sampled->grid;
+	float frac[FZ_MAX_COLORS];
+	int stride[FZ_MAX_COLORS];
+	float tmp[FZ_MAX_COLORS];
+	int k, j, corner, offset = 0, step = 1;
+
+	for (k = 0; k < n; k++)
+	{
+		float v = fz_clamp(src[k], 0, 1) * (grid - 1);
+		int i = fz_mini((int)v, grid - 2);
+		frac[k] = v - i;
+		stride[k] = step;
+		offset += i * step;
+		step *= grid;
+	}
+
+	/* Interpolate between the samples at the corners of the cell
+	 * holding src. */
+	memset(tmp, 0, out_n * sizeof(float));
+	for (corner = 0; corner < (1 << n); corner++)
+	{
+		float weight = 1;
+		const float *sample;
+		int off = offset;
+
+		for (k = 0; k < n; k++)
+		{
+			if (corner & (1 << k))
+			{
+				weight *= frac[k];
+				off += stride[k];
+			}
+			else
+				weight *= 1 - frac[k];
+		}
+		if (weight == 0)
+			continue;
+		sample = sampled->samples + off * out_n;
+		for (j = 0; j < out_n; j++)
+			tmp[j] += weight * sample[j];
+	}
+
+	if (target == sampled->out)
+		memcpy(dst, tmp, out_n * sizeof(float));
+	else
+		fz_convert_color(ctx, fz_default_color_params(ctx), NULL, target, dst, sampled->out, tmp);
+}
+
+static fz_colorspace *
+dl_sampled_base(fz_colorspace *cs)
+{
+	fz_dl_sampled *sampled = cs->data;
+	return sampled->base;
+}
+
+static void
+dl_drop_sampled(fz_context *ctx, fz_colorspace *cs)
+{
+	fz_dl_sampled *sampled = cs->data;
+	fz_drop_colorspace(ctx, sampled->base);
+	fz_drop_colorspace(ctx, sampled->out);
+	fz_free(ctx, sampled->samples);
+	fz_free(ctx, sampled);
+}
+
+static fz_colorspace *
+dl_load_sampled_colorspace(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_dl_sampled *sampled;
+	fz_colorspace *cs = NULL;
+	fz_colorspace *base, *out;
+	const char *colorant[DL_MAX_SAMPLED_N];
+	const char *name;
+	const void *samples;
+	int type, n, grid, count, k;
+
+	type = dl_read_int(ctx, r);
+	n = dl_read_int(ctx, r);
+	if (n < 1 || n > DL_MAX_SAMPLED_N)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	name = dl_read_string(ctx, r);
+	for (k = 0; k < n; k++)
+		colorant[k] = dl_read_string(ctx, r);
+	base = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+	out = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+	grid = dl_read_int(ctx, r);
+	if (grid != dl_sample_grid(n, &count))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	samples = dl_read(ctx, r, (size_t)count * out->n * sizeof(float));
+
+	sampled = fz_malloc_struct(ctx, fz_dl_sampled);
+	fz_try(ctx)
+	{
+		sampled->samples = fz_malloc_array(ctx, count * out->n, sizeof(float));
+		memcpy(sampled->samples, samples, (size_t)count * out->n * sizeof(float));
+		sampled->grid = grid;
+		sampled->base = fz_keep_colorspace(ctx, base);
+		sampled->out = fz_keep_colorspace(ctx, out);
+		cs = fz_new_colorspace(ctx, name, type, 0, n, dl_sampled_to_ccs, NULL, dl_sampled_base, NULL, dl_drop_sampled, sampled, sizeof(*sampled) + (size_t)count * out->n * sizeof(float));
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_colorspace(ctx, sampled->base);
+		fz_drop_colorspace(ctx, sampled->out);
+		fz_free(ctx, sampled->samples);
+		fz_free(ctx, sampled);
+		fz_rethrow(ctx);
+	}
+
+	fz_try(ctx)
+	{
+		for (k = 0; k < n; k++)
+			if (colorant[k])
+				fz_colorspace_name_colorant(ctx, cs, k, colorant[k]);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_colorspace(ctx, cs);
+		fz_rethrow(ctx);
+	}
+	return cs;
+}
+
+static fz_colorspace *
+dl_load_colorspace(fz_context *ctx, fz_dl_reader *r)
+{
+	int kind = dl_read_int(ctx, r);
+
+	switch (kind)
+	{
+	case DL_CS_DEVICE:
+		switch (dl_read_int(ctx, r))
+		{
+		case 0: return fz_keep_colorspace(ctx, fz_device_gray(ctx));
+		case 1: return fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+		case 2: return fz_keep_colorspace(ctx, fz_device_bgr(ctx));
+		case 3: return fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
+		case 4: return fz_keep_colorspace(ctx, fz_device_lab(ctx));
+		}
+		break;
+	case DL_CS_ICC:
+	{
+		int type = dl_read_int(ctx, r);
+		fz_buffer *buf = dl_read_ref(ctx, r, DL_BUFFER, 1);
+		fz_colorspace *alt = dl_read_ref(ctx, r, DL_COLORSPACE, 0);
+		return fz_new_icc_colorspace(ctx, type, buf, alt);
+	}
+	case DL_CS_CAL:
+	{
+		float wp[3], bp[3], gamma[3], matrix[9];
+		const char *name = dl_read_string(ctx, r);
+		int n;
+		dl_read_data(ctx, r, wp, sizeof(wp));
+		dl_read_data(ctx, r, bp, sizeof(bp));
+		dl_read_data(ctx, r, gamma, sizeof(gamma));
+		dl_read_data(ctx, r, matrix, sizeof(matrix));
+		n = dl_read_int(ctx, r);
+		return fz_new_cal_colorspace(ctx, name, wp, bp, gamma, n == 3 ? matrix : NULL);
+	}
+	case DL_CS_INDEXED:
+	{
+		fz_colorspace *base = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+		fz_colorspace *cs = NULL;
+		int high = dl_read_int(ctx, r);
+		unsigned char *lookup;
+		if (high < 0 || high > 255)
+			break;
+		lookup = fz_malloc(ctx, base->n * (high + 1));
+		fz_try(ctx)
+		{
+			dl_read_data(ctx, r, lookup, base->n * (high + 1));
+			cs = fz_new_indexed_colorspace(ctx, base, high, lookup);
+		}
+		fz_catch(ctx)
+		{
+			fz_free(ctx, lookup);
+			fz_rethrow(ctx);
+		}
+		return cs;
+	}
+	case DL_CS_SAMPLED:
+		return dl_load_sampled_colorspace(ctx, r);
+	}
+	fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+}
+
+static fz_font *
+dl_load_font(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_font *font = NULL;
+	fz_font_flags_t flags;
+	fz_rect bbox;
+	const char *name;
+	int kind, i;
+
+	kind = dl_read_int(ctx, r);
+	name = dl_read_string(ctx, r);
+	dl_read_data(ctx, r, &flags, sizeof(flags));
+	dl_read_data(ctx, r, &bbox, sizeof(bbox));
+
+	if (kind == DL_FONT_TYPE3)
+	{
+		fz_display_list *lists[256];
+		fz_matrix matrix;
+		const void *widths, *t3flags;
+
+		dl_read_data(ctx, r, &matrix, sizeof(matrix));
+		widths = dl_read(ctx, r, 256 * sizeof(float));
+		t3flags = dl_read(ctx, r, 256 * sizeof(unsigned short));
+		for (i = 0; i < 256; i++)
+			lists[i] = dl_read_ref(ctx, r, DL_LIST, 0);
+
+		/* The font has no glyph procedures to run, just the
+		 * display lists they made. */
+		font = fz_new_type3_font(ctx, name, matrix);
+		memcpy(font->t3widths, widths, 256 * sizeof(float));
+		memcpy(font->t3flags, t3flags, 256 * sizeof(unsigned short));
+		for (i = 0; i < 256; i++)
+			font->t3lists[i] = lists[i] ? fz_keep_display_list(ctx, lists[i]) : NULL;
+	}
+	else if (kind == DL_FONT_FT)
+	{
+		fz_buffer *buf = dl_read_ref(ctx, r, DL_BUFFER, 1);
+		int index = dl_read_int(ctx, r);
+		int use_glyph_bbox = dl_read_int(ctx, r);
+		int width_default = dl_read_int(ctx, r);
+		int width_count = dl_read_count(ctx, r, sizeof(short));
+		const void *widths = dl_read(ctx, r, width_count * sizeof(short));
+
+		font = fz_new_font_from_buffer(ctx, name, buf, index, use_glyph_bbox);
+		if (width_count > 0)
+		{
+			fz_try(ctx)
+				font->width_table = fz_malloc_array(ctx, width_count, sizeof(short));
+			fz_catch(ctx)
+			{
+				fz_drop_font(ctx, font);
+				fz_rethrow(ctx);
+			}
+			memcpy(font->width_table, widths, width_count * sizeof(short));
+			font->width_count = width_count;
+		}
+		font->width_default = width_default;
+	}
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+
+	font->flags = flags;
+	font->bbox = bbox;
+	return font;
+}
+
+static fz_text *
+dl_load_text(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_text *text = fz_new_text(ctx);
+	int count, i;
+
+	fz_try(ctx)
+	{
+		count = dl_read_count(ctx, r, 0);
+		for (i = 0; i < count; i++)
+		{
+			fz_font *font = dl_read_ref(ctx, r, DL_FONT, 1);
+			fz_text_span *span = fz_malloc_struct(ctx, fz_text_span);
+			int len;
+
+			span->font = fz_keep_font(ctx, font);
+			if (!text->tail)
+				text->head = text->tail = span;
+			else
+				text->tail = text->tail->next = span;
+
+			dl_read_data(ctx, r, &span->trm, sizeof(span->trm));
+			span->wmode = dl_read_int(ctx, r);
+			span->bidi_level = dl_read_int(ctx, r);
+			span->markup_dir = dl_read_int(ctx, r);
+			span->language = dl_read_int(ctx, r);
+			len = dl_read_count(ctx, r, sizeof(fz_text_item));
+			span->items = fz_malloc_array(ctx, len, sizeof(fz_text_item));
+			dl_read_data(ctx, r, span->items, len * sizeof(fz_text_item));
+			span->len = span->cap = len;
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+static fz_stroke_state *
+dl_load_stroke(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_stroke_state *stroke;
+	int caps[4], dash_len;
+	float widths[3];
+
+	dl_read_data(ctx, r, caps, sizeof(caps));
+	dl_read_data(ctx, r, widths, sizeof(widths));
+	dash_len = dl_read_count(ctx, r, sizeof(float));
+
+	stroke = fz_new_stroke_state_with_dash_len(ctx, dash_len);
+	stroke->start_cap = caps[0];
+	stroke->dash_cap = caps[1];
+	stroke->end_cap = caps[2];
+	stroke->linejoin = caps[3];
+	stroke->linewidth = widths[0];
+	stroke->miterlimit = widths[1];
+	stroke->dash_phase = widths[2];
+	stroke->dash_len = dash_len;
+	dl_read_data(ctx, r, stroke->dash_list, dash_len * sizeof(float));
+	return stroke;
+}
+
+static fz_image *
+dl_load_pixmap_image(fz_context *ctx, fz_dl_reader *r, fz_image *mask)
+{
+	fz_colorspace *cs = dl_read_ref(ctx, r, DL_COLORSPACE, 0);
+	fz_pixmap *pix;
+	fz_image *image = NULL;
+	const unsigned char *samples;
+	int x, y, w, h, n, alpha, interpolate, xres, yres;
+
+	x = dl_read_int(ctx, r);
+	y = dl_read_int(ctx, r);
+	w = dl_read_int(ctx, r);
+	h = dl_read_int(ctx, r);
+	n = dl_read_int(ctx, r);
+	alpha = dl_read_int(ctx, r);
+	interpolate = dl_read_int(ctx, r);
+	xres = dl_read_int(ctx, r);
+	yres = dl_read_int(ctx, r);
+
+	pix = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+	fz_try(ctx)
+	{
+		if (pix->n != n)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+		samples = dl_read(ctx, r, (size_t)w * n * h);
+		for (y = 0; y < h; y++)
+			memcpy(pix->samples + y * pix->stride, samples + (size_t)y * w * n, (size_t)w * n);
+		pix->x = x;
+		pix->y = y;
+		pix->xres = xres;
+		pix->yres = yres;
+		if (interpolate)
+			pix->flags |= FZ_PIXMAP_FLAG_INTERPOLATE;
+		image = fz_new_image_from_pixmap(ctx, pix, mask);
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return image;
+}
+
+static fz_image *
+dl_load_image(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_image *image;
+	fz_image *mask;
+	fz_dl_image_info info;
+	int kind;
+
+	kind = dl_read_int(ctx, r);
+	mask = dl_read_ref(ctx, r, DL_IMAGE, 0);
+	dl_read_data(ctx, r, &info, sizeof(info));
+
+	if (kind == DL_IMAGE_COMPRESSED)
+	{
+		fz_colorspace *cs = dl_read_ref(ctx, r, DL_COLORSPACE, 0);
+		fz_compression_params params;
+		fz_compressed_buffer *cbuf;
+		fz_buffer *buf;
+
+		dl_read_data(ctx, r, &params, sizeof(params));
+		if (params.type == FZ_IMAGE_JBIG2)
+			params.u.jbig2.globals = NULL;
+		buf = dl_read_ref(ctx, r, DL_BUFFER, 1);
+
+		cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+		cbuf->params = params;
+		cbuf->buffer = fz_keep_buffer(ctx, buf);
+		image = fz_new_image_from_compressed_buffer(ctx, info.w, info.h, info.bpc, cs,
+			info.xres, info.yres, info.interpolate, info.imagemask, NULL, NULL, cbuf, mask);
+	}
+	else if (kind == DL_IMAGE_PIXMAP)
+		image = dl_load_pixmap_image(ctx, r, mask);
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+
+	/* Set the decoding parameters directly, as the constructors
+	 * adjust the ones they are given for some colorspaces. */
+	image->w = info.w;
+	image->h = info.h;
+	image->bpc = info.bpc;
+	image->xres = info.xres;
+	image->yres = info.yres;
+	image->imagemask = info.imagemask;
+	image->interpolate = info.interpolate;
+	image->invert_cmyk_jpeg = info.invert_cmyk_jpeg;
+	image->scalable = info.scalable;
+	image->use_colorkey = info.use_colorkey;
+	image->use_decode = info.use_decode;
+	if (info.use_colorkey)
+		memcpy(image->colorkey, info.colorkey, sizeof(info.colorkey));
+	if (info.use_decode)
+		memcpy(image->decode, info.decode, sizeof(info.decode));
+	return image;
+}
+
+static fz_shade *
+dl_load_shade(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_shade *shade;
+	const void *data = dl_read(ctx, r, sizeof(fz_shade));
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	memcpy(shade, data, sizeof(*shade));
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	shade->colorspace = NULL;
+	shade->buffer = NULL;
+	if (shade->type == FZ_FUNCTION_BASED)
+		shade->u.f.fn_vals = NULL;
+
+	fz_try(ctx)
+	{
+		fz_colorspace *cs = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+		int count;
+
+		shade->colorspace = fz_keep_colorspace(ctx, cs);
+		count = dl_read_count(ctx, r, sizeof(float));
+		if (shade->type == FZ_FUNCTION_BASED)
+		{
+			if (shade->u.f.xdivs < 0 || shade->u.f.ydivs < 0 ||
+				count / cs->n / (shade->u.f.ydivs + 1) != shade->u.f.xdivs + 1 ||
+				count != (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * cs->n)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			shade->u.f.fn_vals = fz_malloc_array(ctx, count, sizeof(float));
+			dl_read_data(ctx, r, shade->u.f.fn_vals, count * sizeof(float));
+		}
+		else if (count != 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+
+		if (dl_read_int(ctx, r))
+		{
+			fz_compression_params params;
+			fz_buffer *buf;
+
+			dl_read_data(ctx, r, &params, sizeof(params));
+			if (params.type == FZ_IMAGE_JBIG2)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			buf = dl_read_ref(ctx, r, DL_BUFFER, 1);
+			shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+			shade->buffer->params = params;
+			shade->buffer->buffer = fz_keep_buffer(ctx, buf);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+	return shade;
+}
+
+static fz_default_colorspaces *
+dl_load_default_colorspaces(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_default_colorspaces *dcs;
+	fz_colorspace *gray = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+	fz_colorspace *rgb = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+	fz_colorspace *cmyk = dl_read_ref(ctx, r, DL_COLORSPACE, 1);
+	fz_colorspace *oi = dl_read_ref(ctx, r, DL_COLORSPACE, 0);
+
+	dcs = fz_malloc_struct(ctx, fz_default_colorspaces);
+	dcs->refs = 1;
+	dcs->gray = fz_keep_colorspace(ctx, gray);
+	dcs->rgb = fz_keep_colorspace(ctx, rgb);
+	dcs->cmyk = fz_keep_colorspace(ctx, cmyk);
+	dcs->oi = fz_keep_colorspace(ctx, oi);
+	return dcs;
+}
+
+/* Swap the record numbers in the nodes of a loaded list for the objects
+ * they refer to, checking the nodes as we go. list->len only covers the
+ * nodes that have been fixed up, so that the list can be dropped if a
+ * later node turns out to be corrupt. */
+static void
+dl_fix_nodes(fz_context *ctx, fz_dl_reader *r, fz_display_list *list, int len)
+{
+	int off = 0;
+	int cs_n = 1;
+	int have_path = 0;
+	int have_stroke = 0;
+
+	while (off < len)
+	{
+		fz_display_node *node = &list->list[off];
+		fz_display_node n = *node;
+		void **slot = NULL;
+		fz_colorspace *cs = NULL;
+		fz_stroke_state *stroke = NULL;
+		void *data = NULL;
+		const unsigned char *cmds = NULL;
+		const void *coords = NULL;
+		int cmd_len = 0, coord_len = 0;
+		int open = 0;
+		fz_dl_slots s;
+
+		if (n.size == 0 || n.size > len - off || n.cmd > FZ_CMD_END_LAYER)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+
+		if (n.cs == CS_OTHER_0)
+		{
+			slot = dl_colorspace_slot(node);
+			if (!slot)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			cs = dl_lookup(ctx, r, (int)(intptr_t)*slot, DL_COLORSPACE);
+			if (!cs)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			cs_n = cs->n;
+		}
+		else
+			cs_n = dl_node_cs_n(n, cs_n);
+
+		if (!dl_node_slots(node, cs_n, &s))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+		if (s.stroke)
+		{
+			stroke = dl_lookup(ctx, r, (int)(intptr_t)*s.stroke, DL_STROKE);
+			if (!stroke)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			have_stroke = 1;
+		}
+		if (s.path)
+		{
+			const unsigned char *unused_cmds;
+			const float *unused_coords;
+
+			open = fz_packed_path_open_data(s.path, &unused_cmds, &cmd_len, &unused_coords, &coord_len) > 0;
+			if (open)
+			{
+				cmd_len = dl_read_count(ctx, r, 1);
+				coord_len = dl_read_count(ctx, r, sizeof(float));
+				cmds = dl_read(ctx, r, cmd_len);
+				coords = dl_read(ctx, r, coord_len * sizeof(float));
+			}
+			have_path = 1;
+		}
+		if (s.data_kind)
+		{
+			data = dl_lookup(ctx, r, (int)(intptr_t)*(void **)s.data, s.data_kind);
+			if (!data && s.data_kind != DL_COLORSPACE)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+		}
+
+		switch (n.cmd)
+		{
+		case FZ_CMD_FILL_PATH:
+		case FZ_CMD_CLIP_PATH:
+			if (!have_path)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			break;
+		case FZ_CMD_STROKE_PATH:
+		case FZ_CMD_CLIP_STROKE_PATH:
+			if (!have_path || !have_stroke)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			break;
+		case FZ_CMD_STROKE_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+			if (!have_stroke)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			break;
+		}
+
+		/* The node is good; only copying the data of an open path can
+		 * fail from here on. */
+		if (open)
+			fz_attach_open_path_data(ctx, s.path, cmds, cmd_len, coords, coord_len);
+		if (slot)
+			*slot = fz_keep_colorspace(ctx, cs);
+		if (s.stroke)
+			*s.stroke = fz_keep_stroke_state(ctx, stroke);
+		if (s.data_kind)
+			*(void **)s.data = dl_keep(ctx, s.data_kind, data);
+
+		off += n.size;
+		list->len = off;
+	}
+}
+
+static fz_display_list *
+dl_load_list(fz_context *ctx, fz_dl_reader *r)
+{
+	fz_display_list *list;
+	fz_rect mediabox;
+	const void *nodes;
+	int len;
+
+	dl_read_data(ctx, r, &mediabox, sizeof(mediabox));
+	len = dl_read_count(ctx, r, sizeof(fz_display_node));
+	nodes = dl_read(ctx, r, len * sizeof(fz_display_node));
+
+	list = fz_new_display_list(ctx, mediabox);
+	fz_try(ctx)
+	{
+		list->list = fz_malloc_array(ctx, len, sizeof(fz_display_node));
+		list->max = len;
+		memcpy(list->list, nodes, len * sizeof(fz_display_node));
+		dl_fix_nodes(ctx, r, list, len);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	return list;
+}
+
+static void *
+dl_load_object(fz_context *ctx, fz_dl_reader *r, int kind)
+{
+	switch (kind)
+	{
+	case DL_BUFFER: return dl_load_buffer(ctx, r);
+	case DL_COLORSPACE: return dl_load_colorspace(ctx, r);
+	case DL_FONT: return dl_load_font(ctx, r);
+	case DL_TEXT: return dl_load_text(ctx, r);
+	case DL_STROKE: return dl_load_stroke(ctx, r);
+	case DL_IMAGE: return dl_load_image(ctx, r);
+	case DL_SHADE: return dl_load_shade(ctx, r);
+	case DL_DEFAULT_CS: return dl_load_default_colorspaces(ctx, r);
+	case DL_LIST: return dl_load_list(ctx, r);
+	}
+	fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+}
+
+static void
+dl_add_object(fz_context *ctx, fz_dl_reader *r, int kind, void *obj)
+{
+	if (r->count == r->max)
+	{
+		int max = r->max ? r->max * 2 : 64;
+		fz_try(ctx)
+		{
+			r->kinds = fz_resize_array(ctx, r->kinds, max, sizeof(int));
+			r->objs = fz_resize_array(ctx, r->objs, max, sizeof(void *));
+		}
+		fz_catch(ctx)
+		{
+			dl_drop(ctx, kind, obj);
+			fz_rethrow(ctx);
+		}
+		r->max = max;
+	}
+	r->kinds[r->count] = kind;
+	r->objs[r->count] = obj;
+	r->count++;
+}
+
+/*
+	Load a display list saved by fz_write_display_list from a
+	buffer.
+
+	Throws an exception if the buffer does not hold a saved display
+	list, or holds one saved by an incompatible build.
+*/
+fz_display_list *
+fz_new_display_list_from_buffer(fz_context *ctx, fz_buffer *buf)
+{
+	fz_dl_reader r = { 0 };
+	fz_dl_header header;
+	fz_display_list *list = NULL;
+	unsigned char *data;
+	size_t len;
+	int i;
+
+	len = fz_buffer_storage(ctx, buf, &data);
+	r.p = data;
+	r.end = data + len;
+
+	dl_make_header(&header);
+	if (len < sizeof(header) || memcmp(data, header.magic, sizeof(header.magic)))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not a saved display list");
+	if (memcmp(data, &header, sizeof(header)))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "display list was saved by an incompatible build");
+	r.p += sizeof(header);
+
+	fz_try(ctx)
+	{
+		while (r.p < r.end)
+		{
+			int kind = dl_read_int(ctx, &r);
+			dl_add_object(ctx, &r, kind, dl_load_object(ctx, &r, kind));
+		}
+		if (r.count == 0 || r.kinds[r.count - 1] != DL_LIST)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list");
+		list = fz_keep_display_list(ctx, r.objs[r.count - 1]);
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < r.count; i++)
+			dl_drop(ctx, r.kinds[i], r.objs[i]);
+		fz_free(ctx, r.kinds);
+		fz_free(ctx, r.objs);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return list;
+}
+
+/*
+	Load a display list from a file saved by fz_save_display_list.
+*/
+fz_display_list *
+fz_load_display_list(fz_context *ctx, const char *filename)
+{
+	fz_display_list *list = NULL;
+	fz_buffer *buf = fz_read_file(ctx, filename);
+	fz_try(ctx)
+		list = fz_new_display_list_from_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return list;
+}
+
+/* Display list optimisation.
+ *
+ * We look for nodes that can make no difference to what the list
+ * draws: fills of paths that collapse to a point, clips and soft masks
+ * that nothing is drawn through, and groups that have nothing in them
+ * and would be composited back unchanged. The list is then encoded
+ * again without them. As a node only records the parts of the graphics
+ * state that differ from the node before it, the nodes that remain are
+ * given any changes to the state that the removed nodes made.
+ */
+
+typedef struct
+{
+	int start; /* The node that opened the scope */
+	int removable;
+	int live; /* Set once anything inside the scope is kept */
+} fz_optimize_scope;
+
+typedef struct
+{
+	fz_display_node *list;
+	int len;
+	int max;
+	fz_display_state state; /* The path offset refers to the old list */
+	float color[FZ_MAX_COLORS];
+} fz_optimize_writer;
+
+static void
+fz_init_display_state(fz_display_state *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->ctm = fz_identity;
+	state->alpha = 1.0f;
+	state->cs = CS_GRAY_0;
+	state->color = -1;
+	state->path = -1;
+}
+
+/* Get the color values of a state. */
+static void
+fz_display_state_color(fz_context *ctx, fz_display_list *list, const fz_display_state *state, float *color)
+{
+	fz_drop_colorspace(ctx, fz_unpack_colorspace(ctx, state->cs, state->other, color));
+	if (state->color >= 0)
+		memcpy(color, &list->list[state->color], fz_display_state_n(ctx, state) * sizeof(float));
+}
+
+static int
+fz_optimize_group_is_removable(fz_context *ctx, fz_display_list *list, int off, const fz_display_state *state)
+{
+	fz_display_node n = list->list[off];
+	fz_dl_slots s;
+
+	if (state->alpha != 1.0f || (n.flags>>2) != FZ_BLEND_NORMAL || (n.flags & KNOCKOUT))
+		return 0;
+	if (!dl_node_slots(&list->list[off], fz_display_state_n(ctx, state), &s))
+		return 0;
+	/* A group with a colorspace of its own is converted back. */
+	return *(fz_colorspace **)s.data == NULL;
+}
+
+/* Mark the nodes that can be removed, and return how many there are. */
+static int
+fz_optimize_mark_nodes(fz_context *ctx, fz_display_list *list, const int *offs, int count, unsigned char *dead)
+{
+	fz_optimize_scope *stack = NULL;
+	fz_display_state state;
+	int top = 0;
+	int max = 0;
+	int removed = 0;
+	int i, j;
+
+	/* Paths that collapse to a point draw nothing under any transform,
+	 * except with the any-part-of-a-pixel rasterizer, which marks the
+	 * pixel that the point is in. Thinner paths that are not points
+	 * can leave slivers of coverage once transformed, as their edges
+	 * are rounded differently. */
+	int zero_area = (fz_graphics_aa_level(ctx) != 10);
+
+	fz_init_display_state(&state);
+
+	fz_var(stack);
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < count; i++)
+		{
+			fz_display_node n = list->list[offs[i]];
+			fz_optimize_scope scope;
+			int opener;
+
+			fz_index_update_state(ctx, list, &state, offs[i]);
+
+			switch (n.cmd)
+			{
+			case FZ_CMD_FILL_PATH:
+				if (zero_area && state.path >= 0)
+				{
+					fz_rect r = fz_bound_path(ctx, (fz_path *)&list->list[state.path], NULL, fz_identity);
+					if (r.x0 == r.x1 && r.y0 == r.y1)
+					{
+						dead[i] = 1;
+						removed++;
+						continue;
+					}
+				}
+				break;
+
+			case FZ_CMD_CLIP_PATH:
+			case FZ_CMD_CLIP_STROKE_PATH:
+			case FZ_CMD_CLIP_TEXT:
+			case FZ_CMD_CLIP_STROKE_TEXT:
+			case FZ_CMD_CLIP_IMAGE_MASK:
+			case FZ_CMD_BEGIN_MASK:
+			case FZ_CMD_BEGIN_GROUP:
+			case FZ_CMD_BEGIN_TILE:
+				if (top == max)
+				{
+					int new_max = fz_maxi(16, max * 2);
+					stack = fz_resize_array(ctx, stack, new_max, sizeof(*stack));
+					max = new_max;
+				}
+				stack[top].start = i;
+				stack[top].live = 0;
+				if (n.cmd == FZ_CMD_BEGIN_GROUP)
+					stack[top].removable = fz_optimize_group_is_removable(ctx, list, offs[i], &state);
+				else
+					stack[top].removable = (n.cmd != FZ_CMD_BEGIN_TILE);
+				top++;
+				continue;
+
+			case FZ_CMD_END_MASK:
+				/* What is drawn into the mask does not count; the
+				 * scope now covers what is drawn through it. */
+				if (top > 0 && list->list[offs[stack[top-1].start]].cmd == FZ_CMD_BEGIN_MASK)
+				{
+					stack[top-1].live = 0;
+					continue;
+				}
+				break;
+
+			case FZ_CMD_POP_CLIP:
+			case FZ_CMD_END_GROUP:
+			case FZ_CMD_END_TILE:
+				if (top == 0)
+					break;
+				scope = stack[--top];
+				opener = list->list[offs[scope.start]].cmd;
+				if (n.cmd == FZ_CMD_END_GROUP)
+					scope.removable &= (opener == FZ_CMD_BEGIN_GROUP);
+				else if (n.cmd == FZ_CMD_END_TILE)
+					scope.removable = 0;
+				else
+					scope.removable &= (opener != FZ_CMD_BEGIN_GROUP && opener != FZ_CMD_BEGIN_TILE);
+				if (scope.removable && !scope.live)
+				{
+					for (j = scope.start; j <= i; j++)
+					{
+						if (!dead[j])
+						{
+							dead[j] = 1;
+							removed++;
+						}
+					}
+					continue;
+				}
+				break;
+
+			case FZ_CMD_RENDER_FLAGS:
+			case FZ_CMD_DEFAULT_COLORSPACES:
+			case FZ_CMD_BEGIN_LAYER:
+			case FZ_CMD_END_LAYER:
+				/* These affect what follows the scopes they are in,
+				 * even if they are in the content of a mask. */
+				for (j = 0; j < top; j++)
+					stack[j].removable = 0;
+				break;
+			}
+
+			if (top > 0)
+				stack[top-1].live = 1;
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, stack);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return removed;
+}
+
+/* Append the node at offset off of the old list, where state is the
+ * state after it, so that the state in the new list matches it. */
+static void
+fz_optimize_write_node(fz_context *ctx, fz_optimize_writer *w, fz_display_list *list, int off, const fz_display_state *state)
+{
+	fz_display_node n = list->list[off];
+	fz_display_node node = { 0 };
+	fz_display_node *out;
+	fz_path *path = NULL;
+	fz_dl_slots s;
+	float color[FZ_MAX_COLORS];
+	int uses_state, uses_path;
+	int cs_n = fz_display_state_n(ctx, state);
+	int size = 1;
+	int data_len, path_size = 0;
+
+	if (!dl_node_slots(&list->list[off], cs_n, &s))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	data_len = &list->list[off + n.size] - s.data;
+
+	/* Only the nodes that read the state are brought up to date. */
+	switch (n.cmd)
+	{
+	case FZ_CMD_RENDER_FLAGS:
+	case FZ_CMD_DEFAULT_COLORSPACES:
+	case FZ_CMD_BEGIN_LAYER:
+	case FZ_CMD_END_LAYER:
+		uses_state = 0;
+		break;
+	default:
+		uses_state = 1;
+		break;
+	}
+	uses_path = (n.cmd <= FZ_CMD_CLIP_STROKE_PATH);
+
+	node.cmd = n.cmd;
+	node.flags = n.flags;
+	fz_display_state_color(ctx, list, state, color);
+	if (uses_state)
+	{
+		if (memcmp(&state->rect, &w->state.rect, sizeof(fz_rect)))
+		{
+			node.rect = 1;
+			size += SIZE_IN_NODES(sizeof(fz_rect));
+		}
+		if (state->cs != w->state.cs || state->other != w->state.other)
+		{
+			node.cs = state->cs;
+			if (node.cs == CS_OTHER_0)
+				size += SIZE_IN_NODES(sizeof(fz_colorspace *));
+			fz_drop_colorspace(ctx, fz_unpack_colorspace(ctx, state->cs, state->other, w->color));
+		}
+		if (memcmp(color, w->color, cs_n * sizeof(float)))
+		{
+			node.color = 1;
+			size += SIZE_IN_NODES(cs_n * sizeof(float));
+		}
+		if (state->alpha != w->state.alpha)
+		{
+			if (state->alpha == 1.0f)
+				node.alpha = ALPHA_1;
+			else if (state->alpha == 0.0f)
+				node.alpha = ALPHA_0;
+			else
+			{
+				node.alpha = ALPHA_PRESENT;
+				size += SIZE_IN_NODES(sizeof(float));
+			}
+		}
+		if (state->ctm.a != w->state.ctm.a || state->ctm.d != w->state.ctm.d)
+			node.ctm |= CTM_CHANGE_AD;
+		if (state->ctm.b != w->state.ctm.b || state->ctm.c != w->state.ctm.c)
+			node.ctm |= CTM_CHANGE_BC;
+		if (state->ctm.e != w->state.ctm.e || state->ctm.f != w->state.ctm.f)
+			node.ctm |= CTM_CHANGE_EF;
+		if (node.ctm & CTM_CHANGE_AD)
+			size += SIZE_IN_NODES(2*sizeof(float));
+		if (node.ctm & CTM_CHANGE_BC)
+			size += SIZE_IN_NODES(2*sizeof(float));
+		if (node.ctm & CTM_CHANGE_EF)
+			size += SIZE_IN_NODES(2*sizeof(float));
+		if (state->stroke != w->state.stroke)
+		{
+			node.stroke = 1;
+			size += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+		}
+	}
+	if (uses_path && state->path >= 0 && state->path != w->state.path)
+	{
+		node.path = 1;
+		path_size = SIZE_IN_NODES(fz_packed_path_size((fz_path *)&list->list[state->path]));
+		size += path_size;
+	}
+	size += data_len;
+	assert(size < (1<<9));
+	node.size = size;
+
+	if (w->len + size > w->max)
+	{
+		int new_max = fz_maxi(256, w->max * 2);
+		while (w->len + size > new_max)
+			new_max *= 2;
+		w->list = fz_resize_array(ctx, w->list, new_max, sizeof(fz_display_node));
+		w->max = new_max;
+	}
+	out = &w->list[w->len];
+	*out++ = node;
+
+	/* Copy the path first, as it is the only thing that can fail. */
+	if (node.path)
+	{
+		fz_path *old = (fz_path *)&list->list[state->path];
+		const unsigned char *cmds;
+		const float *coords;
+		int cmd_len, coord_len;
+
+		path = (fz_path *)(out + size - 1 - path_size - data_len);
+		memcpy(path, old, fz_packed_path_size(old));
+		fz_detach_packed_path(path);
+		if (fz_packed_path_open_data(old, &cmds, &cmd_len, &coords, &coord_len) > 0)
+			fz_attach_open_path_data(ctx, path, cmds, cmd_len, coords, coord_len);
+	}
+
+	if (node.rect)
+	{
+		memcpy(out, &state->rect, sizeof(fz_rect));
+		out += SIZE_IN_NODES(sizeof(fz_rect));
+	}
+	if (node.cs == CS_OTHER_0)
+	{
+		*(fz_colorspace **)out = fz_keep_colorspace(ctx, state->other);
+		out += SIZE_IN_NODES(sizeof(fz_colorspace *));
+	}
+	if (node.color)
+	{
+		memcpy(out, color, cs_n * sizeof(float));
+		out += SIZE_IN_NODES(cs_n * sizeof(float));
+	}
+	if (node.alpha == ALPHA_PRESENT)
+	{
+		*(float *)out = state->alpha;
+		out += SIZE_IN_NODES(sizeof(float));
+	}
+	if (node.ctm)
+	{
+		float *packed_ctm = (float *)out;
+		if (node.ctm & CTM_CHANGE_AD)
+		{
+			*packed_ctm++ = state->ctm.a;
+			*packed_ctm++ = state->ctm.d;
+			out += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (node.ctm & CTM_CHANGE_BC)
+		{
+			*packed_ctm++ = state->ctm.b;
+			*packed_ctm++ = state->ctm.c;
+			out += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (node.ctm & CTM_CHANGE_EF)
+		{
+			*packed_ctm++ = state->ctm.e;
+			*packed_ctm = state->ctm.f;
+			out += SIZE_IN_NODES(2*sizeof(float));
+		}
+	}
+	if (node.stroke)
+	{
+		*(fz_stroke_state **)out = fz_keep_stroke_state(ctx, state->stroke);
+		out += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+	}
+	out += path_size;
+	memcpy(out, s.data, data_len * sizeof(fz_display_node));
+	if (s.data_kind)
+		(void)dl_keep(ctx, s.data_kind, *(void **)out);
+
+	w->len += size;
+	if (uses_state)
+	{
+		fz_display_state old = w->state;
+		w->state = *state;
+		w->state.path = old.path;
+		memcpy(w->color, color, cs_n * sizeof(float));
+	}
+	if (node.path)
+		w->state.path = state->path;
+}
+
+/*
+	Remove the nodes of a display list that make no difference to
+	what it draws, and return the number of nodes removed.
+
+	This removes fills of paths that collapse to a single point, clips
+	and soft masks with nothing drawn through them, and groups with
+	nothing in them that are composited with an alpha of 1 and Normal
+	blending. Only nodes whose removal leaves the output of the draw
+	device identical are removed; fills hidden under later opaque
+	fills, and clips that could be merged, are left alone as removing
+	them changes the anti-aliasing at their edges.
+
+	Fills are kept if the context is set to use the any-part-of-a-pixel
+	rasterizer, as even a point marks a pixel with it.
+
+	The list must not be in use (being written to by a list device, or
+	being run) while it is optimized.
+*/
+int
+fz_optimize_display_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_optimize_writer w = { 0 };
+	fz_display_state state;
+	fz_display_index *index;
+	fz_display_node *old;
+	unsigned char *dead = NULL;
+	int *offs = NULL;
+	int count = 0;
+	int removed = 0;
+	int old_len, off, i;
+
+	if (list == NULL || list->len == 0)
+		return 0;
+
+	for (off = 0; off < list->len; off += list->list[off].size)
+		count++;
+
+	fz_var(dead);
+	fz_var(offs);
+	fz_var(w.list);
+
+	fz_try(ctx)
+	{
+		offs = fz_malloc_array(ctx, count, sizeof(int));
+		dead = fz_calloc(ctx, count, 1);
+		for (i = 0, off = 0; i < count; off += list->list[off].size)
+			offs[i++] = off;
+
+		removed = fz_optimize_mark_nodes(ctx, list, offs, count, dead);
+		if (removed > 0)
+		{
+			fz_init_display_state(&state);
+			fz_init_display_state(&w.state);
+			fz_display_state_color(ctx, list, &w.state, w.color);
+			for (i = 0; i < count; i++)
+			{
+				fz_index_update_state(ctx, list, &state, offs[i]);
+				if (!dead[i])
+					fz_optimize_write_node(ctx, &w, list, offs[i], &state);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, offs);
+		fz_free(ctx, dead);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_nodes(ctx, w.list, w.len);
+		fz_free(ctx, w.list);
+		fz_rethrow(ctx);
+	}
+
+	if (removed == 0)
+		return 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	index = list->index;
+	list->index = NULL;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	old = list->list;
+	old_len = list->len;
+	list->list = w.list;
+	list->len = w.len;
+	list->max = w.max;
+
+	fz_drop_display_nodes(ctx, old, old_len);
+	fz_free(ctx, old);
+	fz_drop_display_index(ctx, index);
+
+	return removed;
+}
@@ -1,6 +1,7 @@
 #include "mupdf/fitz.h"
 #include "fitz-imp.h"
 
+#include <assert.h>
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
@@ -12,26 +13,526 @@
 #undef FITZ_DEBUG_LOCKING_TIMES
 #endif
 
+static int release_cached_chunks(fz_context *ctx);
+
+/* Entered with the alloc lock held, which may be dropped momentarily.
+ * Frees memory for a failed allocation of size bytes to be retried:
+ * first from the store, then by handing any idle chunks of the
+ * allocation cache back to the allocator. */
+static int
+scavenge(fz_context *ctx, size_t size, int *phase)
+{
+	return fz_store_scavenge(ctx, size, phase) || release_cached_chunks(ctx);
+}
+
+/* Entered with the alloc lock held, which may be dropped momentarily
+ * while scavenging. */
 static void *
-do_scavenging_malloc(fz_context *ctx, size_t size)
+scavenging_malloc_locked(fz_context *ctx, size_t size)
 {
 	void *p;
 	int phase = 0;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	do {
 		p = ctx->alloc->malloc(ctx->alloc->user, size);
 		if (p != NULL)
+			return p;
+	} while (scavenge(ctx, size, &phase));
+
+	return NULL;
+}
+
+#if FZ_ENABLE_ALLOC_CACHE
+
+/*
+	The allocation cache.
+
+	Every block handed out is preceded by a header giving its size
+	class. Blocks of up to FZ_ALLOC_CACHE_MAX bytes are carved from
+	chunks obtained from the allocator, and recycled through per-context
+	free lists (magazines) that are used without taking any lock.
+	Magazines are refilled from, and overflow into, a depot shared
+	between a context and all its clones, which is protected by the
+	alloc lock. Each chunk holds blocks of a single size class. Chunks
+	are returned to the allocator when the last context sharing the
+	depot is dropped, or when an allocation fails even after scavenging
+	the store, in which case every chunk whose blocks are all free in
+	the depot is released.
+
+	Larger blocks go straight to the allocator, with a header marking
+	them as such.
+*/
+
+enum
+{
+	FZ_ALLOC_CACHE_QUANTUM = 16,
+	FZ_ALLOC_CACHE_CLASSES = 16,
+	FZ_ALLOC_CACHE_MAX = FZ_ALLOC_CACHE_QUANTUM * FZ_ALLOC_CACHE_CLASSES,
+	FZ_ALLOC_CACHE_MAGAZINE = 32,
+	FZ_ALLOC_CACHE_CHUNK = 16384
+};
+
+typedef union fz_alloc_header_s fz_alloc_header;
+
+union fz_alloc_header_s
+{
+	size_t cls; /* size class, or FZ_ALLOC_CACHE_CLASSES for large blocks */
+	fz_alloc_header *next; /* when on a free list, or linking chunks */
+	void *align_p;
+	double align_d;
+	long double align_ld;
+};
+
+typedef struct
+{
+	int refs;
+	fz_alloc_header *chunks[FZ_ALLOC_CACHE_CLASSES];
+	fz_alloc_header *free[FZ_ALLOC_CACHE_CLASSES];
+} fz_alloc_depot;
+
+struct fz_alloc_cache_s
+{
+	fz_alloc_depot *depot;
+	fz_alloc_header *free[FZ_ALLOC_CACHE_CLASSES];
+	int count[FZ_ALLOC_CACHE_CLASSES];
+};
+
+static size_t
+class_size(size_t cls)
+{
+	return (cls + 1) * FZ_ALLOC_CACHE_QUANTUM;
+}
+
+/* Entered with the alloc lock held. Moves up to n blocks of the given
+ * class from the depot to the magazine. */
+static void
+take_from_depot(fz_alloc_cache *cache, int cls, int n)
+{
+	fz_alloc_depot *depot = cache->depot;
+	fz_alloc_header *hdr;
+
+	while (n-- > 0 && (hdr = depot->free[cls]) != NULL)
+	{
+		depot->free[cls] = hdr->next;
+		hdr->next = cache->free[cls];
+		cache->free[cls] = hdr;
+		cache->count[cls]++;
+	}
+}
+
+/* Entered with the alloc lock held. Moves up to n blocks of the given
+ * class from the magazine to the depot. */
+static void
+give_to_depot(fz_alloc_cache *cache, int cls, int n)
+{
+	fz_alloc_depot *depot = cache->depot;
+	fz_alloc_header *hdr;
+
+	while (n-- > 0 && (hdr = cache->free[cls]) != NULL)
+	{
+		cache->free[cls] = hdr->next;
+		cache->count[cls]--;
+		hdr->next = depot->free[cls];
+		depot->free[cls] = hdr;
+	}
+}
+
+static int
+refill_magazine(fz_context *ctx, fz_alloc_cache *cache, int cls)
+{
+	fz_alloc_depot *depot = cache->depot;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (depot->free[cls] == NULL)
+	{
+		size_t block = sizeof(fz_alloc_header) + class_size(cls);
+		fz_alloc_header *chunk;
+		unsigned char *p, *end;
+
+		/* This may drop the lock while scavenging, during which
+		 * our magazine may be refilled by frees. */
+		chunk = scavenging_malloc_locked(ctx, FZ_ALLOC_CACHE_CHUNK);
+		if (chunk == NULL)
 		{
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			return cache->free[cls] != NULL;
+		}
+		chunk->next = depot->chunks[cls];
+		depot->chunks[cls] = chunk;
+
+		p = (unsigned char *)(chunk + 1);
+		end = (unsigned char *)chunk + FZ_ALLOC_CACHE_CHUNK;
+		for (; p + block <= end; p += block)
+		{
+			fz_alloc_header *hdr = (fz_alloc_header *)p;
+			hdr->next = depot->free[cls];
+			depot->free[cls] = hdr;
+		}
+	}
+	take_from_depot(cache, cls, FZ_ALLOC_CACHE_MAGAZINE / 2);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return 1;
+}
+
+static void *
+large_block(void *p)
+{
+	fz_alloc_header *hdr = p;
+
+	if (hdr == NULL)
+		return NULL;
+	hdr->cls = FZ_ALLOC_CACHE_CLASSES;
+	return hdr + 1;
+}
+
+static void *
+cached_malloc(fz_context *ctx, size_t size)
+{
+	fz_alloc_cache *cache = ctx->alloc_cache;
+	fz_alloc_header *hdr;
+	int cls = size > 0 ? (int)((size - 1) / FZ_ALLOC_CACHE_QUANTUM) : 0;
+
+	if (cache == NULL)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		hdr = scavenging_malloc_locked(ctx, sizeof(fz_alloc_header) + size);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		return large_block(hdr);
+	}
+
+	if (cache->free[cls] == NULL && !refill_magazine(ctx, cache, cls))
+		return NULL;
+
+	hdr = cache->free[cls];
+	cache->free[cls] = hdr->next;
+	cache->count[cls]--;
+	hdr->cls = cls;
+	return hdr + 1;
+}
+
+static void
+cached_free(fz_context *ctx, fz_alloc_header *hdr)
+{
+	fz_alloc_cache *cache = ctx->alloc_cache;
+	int cls = (int)hdr->cls;
+
+	/* A small block lives inside a chunk, so cannot be handed back to
+	 * the allocator on its own. Every context has a cache from when it
+	 * is created until it is dropped, so this is a block freed in a
+	 * context that is already gone. */
+	assert(cache != NULL);
+	if (cache == NULL)
+		return;
+
+	hdr->next = cache->free[cls];
+	cache->free[cls] = hdr;
+	if (++cache->count[cls] > FZ_ALLOC_CACHE_MAGAZINE)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		give_to_depot(cache, cls, FZ_ALLOC_CACHE_MAGAZINE / 2);
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+}
+
+/*
+	Create the allocation cache for a context, sharing the depot of
+	the parent context if there is one. Called before anything else
+	is allocated in the context.
+
+	Returns non-zero on failure.
+*/
+int
+fz_new_alloc_cache(fz_context *ctx, fz_context *parent)
+{
+	fz_alloc_cache *cache;
+
+	cache = ctx->alloc->malloc(ctx->alloc->user, sizeof(*cache));
+	if (cache == NULL)
+		return 1;
+	memset(cache, 0, sizeof(*cache));
+
+	if (parent && parent->alloc_cache)
+	{
+		cache->depot = parent->alloc_cache->depot;
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		cache->depot->refs++;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+	else
+	{
+		cache->depot = ctx->alloc->malloc(ctx->alloc->user, sizeof(fz_alloc_depot));
+		if (cache->depot == NULL)
+		{
+			ctx->alloc->free(ctx->alloc->user, cache);
+			return 1;
+		}
+		memset(cache->depot, 0, sizeof(fz_alloc_depot));
+		cache->depot->refs = 1;
+	}
+
+	ctx->alloc_cache = cache;
+	return 0;
+}
+
+/*
+	Drop the allocation cache for a context, returning its magazines
+	to the depot. If this is the last context using the depot, all the
+	chunks are returned to the allocator. Called once nothing else is
+	left to be freed in the context.
+*/
+void
+fz_drop_alloc_cache(fz_context *ctx)
+{
+	fz_alloc_cache *cache = ctx->alloc_cache;
+	fz_alloc_depot *depot;
+	int i, drop;
+
+	if (cache == NULL)
+		return;
+	depot = cache->depot;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < FZ_ALLOC_CACHE_CLASSES; i++)
+		give_to_depot(cache, i, cache->count[i]);
+	drop = --depot->refs == 0;
+	if (drop)
+	{
+		for (i = 0; i < FZ_ALLOC_CACHE_CLASSES; i++)
+		{
+			while (depot->chunks[i])
+			{
+				fz_alloc_header *chunk = depot->chunks[i];
+				depot->chunks[i] = chunk->next;
+				ctx->alloc->free(ctx->alloc->user, chunk);
+			}
+		}
+		ctx->alloc->free(ctx->alloc->user, depot);
+	}
+	ctx->alloc->free(ctx->alloc->user, cache);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	ctx->alloc_cache = NULL;
+}
+
+/* Sort a list of blocks (or chunks) into address order, by merging
+ * runs of doubling length. Allocates nothing, as it is used when
+ * memory has run out. */
+static fz_alloc_header *
+sort_blocks(fz_alloc_header *list)
+{
+	size_t run = 1;
+	int merges;
+
+	do
+	{
+		fz_alloc_header *a = list, *b, *tail = NULL;
+		size_t na, nb;
+
+		list = NULL;
+		merges = 0;
+		while (a)
+		{
+			merges++;
+			b = a;
+			for (na = 0; na < run && b; na++)
+				b = b->next;
+			nb = run;
+			while (na > 0 || (nb > 0 && b))
+			{
+				fz_alloc_header *e;
+
+				if (na == 0 || (nb > 0 && b && (char *)b < (char *)a))
+				{
+					e = b;
+					b = b->next;
+					nb--;
+				}
+				else
+				{
+					e = a;
+					a = a->next;
+					na--;
+				}
+				if (tail)
+					tail->next = e;
+				else
+					list = e;
+				tail = e;
+			}
+			a = b;
+		}
+		if (tail)
+			tail->next = NULL;
+		run *= 2;
+	}
+	while (merges > 1);
+
+	return list;
+}
+
+/* Entered with the alloc lock held. Releases every chunk of the given
+ * class whose blocks are all on the depot free list. Sorting both the
+ * chunks and the free blocks by address lets us count the free blocks
+ * of each chunk in a single pass. */
+static int
+release_class_chunks(fz_context *ctx, fz_alloc_depot *depot, int cls)
+{
+	size_t block = sizeof(fz_alloc_header) + class_size(cls);
+	size_t per_chunk = (FZ_ALLOC_CACHE_CHUNK - sizeof(fz_alloc_header)) / block;
+	fz_alloc_header **chunkp, **freep, *chunk;
+	int released = 0;
+
+	if (depot->free[cls] == NULL)
+		return 0;
+
+	depot->chunks[cls] = sort_blocks(depot->chunks[cls]);
+	depot->free[cls] = sort_blocks(depot->free[cls]);
+
+	chunkp = &depot->chunks[cls];
+	freep = &depot->free[cls];
+	while ((chunk = *chunkp) != NULL)
+	{
+		char *end = (char *)chunk + FZ_ALLOC_CACHE_CHUNK;
+		fz_alloc_header *hdr = *freep;
+		size_t n = 0;
+
+		while (hdr && (char *)hdr < end)
+		{
+			hdr = hdr->next;
+			n++;
+		}
+
+		if (n == per_chunk)
+		{
+			*freep = hdr;
+			*chunkp = chunk->next;
+			ctx->alloc->free(ctx->alloc->user, chunk);
+			released = 1;
+		}
+		else
+		{
+			while (n-- > 0)
+				freep = &(*freep)->next;
+			chunkp = &chunk->next;
+		}
+	}
+
+	return released;
+}
+
+/* Entered with the alloc lock held. Returns our own magazines to the
+ * depot, and then releases every chunk that is entirely free. Blocks
+ * held in the magazines of other contexts cannot be reached without
+ * their cooperation, so may keep their chunks alive. */
+static int
+release_cached_chunks(fz_context *ctx)
+{
+	fz_alloc_cache *cache = ctx->alloc_cache;
+	int i, released = 0;
+
+	if (cache == NULL)
+		return 0;
+
+	for (i = 0; i < FZ_ALLOC_CACHE_CLASSES; i++)
+	{
+		give_to_depot(cache, i, cache->count[i]);
+		released |= release_class_chunks(ctx, cache->depot, i);
+	}
+
+	return released;
+}
+
+static void *
+do_scavenging_malloc(fz_context *ctx, size_t size)
+{
+	void *p;
+
+	if (size <= FZ_ALLOC_CACHE_MAX)
+		return cached_malloc(ctx, size);
+	if (size > SIZE_MAX - sizeof(fz_alloc_header))
+		return NULL;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	p = scavenging_malloc_locked(ctx, sizeof(fz_alloc_header) + size);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return large_block(p);
+}
+
+static void *
+do_scavenging_realloc(fz_context *ctx, void *p, size_t size)
+{
+	fz_alloc_header *hdr;
+	void *q;
+	int phase = 0;
+
+	if (p == NULL)
+		return do_scavenging_malloc(ctx, size);
+
+	hdr = (fz_alloc_header *)p - 1;
+	if (hdr->cls < FZ_ALLOC_CACHE_CLASSES || size <= FZ_ALLOC_CACHE_MAX)
+	{
+		/* Moving into, out of, or between size classes. A large
+		 * block is always bigger than the new size here. */
+		size_t old = hdr->cls < FZ_ALLOC_CACHE_CLASSES ? class_size(hdr->cls) : size;
+		if (size <= old && hdr->cls < FZ_ALLOC_CACHE_CLASSES)
 			return p;
+		q = do_scavenging_malloc(ctx, size);
+		if (q == NULL)
+			return NULL;
+		memcpy(q, p, fz_minz(old, size));
+		fz_free(ctx, p);
+		return q;
+	}
+	if (size > SIZE_MAX - sizeof(fz_alloc_header))
+		return NULL;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	do {
+		q = ctx->alloc->realloc(ctx->alloc->user, hdr, sizeof(fz_alloc_header) + size);
+		if (q != NULL)
+		{
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			return (fz_alloc_header *)q + 1;
 		}
-	} while (fz_store_scavenge(ctx, size, &phase));
+	} while (scavenge(ctx, size, &phase));
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
 
+#else
+
+static int
+release_cached_chunks(fz_context *ctx)
+{
+	return 0;
+}
+
+int
+fz_new_alloc_cache(fz_context *ctx, fz_context *parent)
+{
+	return 0;
+}
+
+void
+fz_drop_alloc_cache(fz_context *ctx)
+{
+}
+
+static void *
+do_scavenging_malloc(fz_context *ctx, size_t size)
+{
+	void *p;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	p = scavenging_malloc_locked(ctx, size);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return p;
+}
+
 static void *
 do_scavenging_realloc(fz_context *ctx, void *p, size_t size)
 {
@@ -46,12 +547,14 @@ do_scavenging_realloc(fz_context *ctx, void *p, size_t size)
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
 			return q;
 		}
-	} while (fz_store_scavenge(ctx, size, &phase));
+	} while (scavenge(ctx, size, &phase));
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
 
+#endif /* FZ_ENABLE_ALLOC_CACHE */
+
 /*
 	Allocate a block of memory (with scavenging)
 
@@ -285,6 +788,15 @@ fz_free(fz_context *ctx, void *p)
 {
 	if (p)
 	{
+#if FZ_ENABLE_ALLOC_CACHE
+		fz_alloc_header *hdr = (fz_alloc_header *)p - 1;
+		if (hdr->cls < FZ_ALLOC_CACHE_CLASSES)
+		{
+			cached_free(ctx, hdr);
+			return;
+		}
+		p = hdr;
+#endif
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		ctx->alloc->free(ctx->alloc->user, p);
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
@@ -252,6 +252,103 @@ fz_pack_path(fz_context *ctx, uint8_t *pack_, int max, const fz_path *path)
 	}
 }
 
+/*
+	Internal functions used to copy packed paths in and out of
+	serialised display lists.
+
+	fz_packed_path_open_data: Returns -1 if path is not packed, 0 if
+	it is packed flat (so all its data lives within the packed block),
+	or 1 if it is packed open, in which case the separately allocated
+	commands and coordinates are returned.
+*/
+int
+fz_packed_path_open_data(const fz_path *path, const unsigned char **cmds, int *cmd_len, const float **coords, int *coord_len)
+{
+	switch (path->packed)
+	{
+	case FZ_PATH_PACKED_FLAT:
+		return 0;
+	case FZ_PATH_PACKED_OPEN:
+		*cmds = path->cmds;
+		*cmd_len = path->cmd_len;
+		*coords = path->coords;
+		*coord_len = path->coord_len;
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+/*
+	Return the size of the packed path at the start of a block of max
+	bytes, or -1 if the block does not start with a whole packed path.
+*/
+int
+fz_packed_path_size_within(const fz_path *path, int max)
+{
+	int size;
+
+	if (max < (int)sizeof(fz_packed_path))
+		return -1;
+	switch (path->packed)
+	{
+	case FZ_PATH_PACKED_FLAT:
+		size = fz_packed_path_size(path);
+		break;
+	case FZ_PATH_PACKED_OPEN:
+		size = sizeof(fz_path);
+		break;
+	default:
+		return -1;
+	}
+	return size <= max ? size : -1;
+}
+
+/*
+	Reset the reference count of a copied packed path, and forget
+	any data it points to, so that the copy can be written out.
+*/
+void
+fz_detach_packed_path(fz_path *path)
+{
+	path->refs = 1;
+	if (path->packed == FZ_PATH_PACKED_OPEN)
+	{
+		path->cmds = NULL;
+		path->coords = NULL;
+	}
+}
+
+/*
+	Give a path that was packed open (and then detached) new copies
+	of the given commands and coordinates.
+*/
+void
+fz_attach_open_path_data(fz_context *ctx, fz_path *path, const unsigned char *cmds, int cmd_len, const float *coords, int coord_len)
+{
+	unsigned char *new_cmds;
+
+	new_cmds = fz_malloc_array(ctx, cmd_len, sizeof(uint8_t));
+	fz_try(ctx)
+		path->coords = fz_malloc_array(ctx, coord_len, sizeof(float));
+	fz_catch(ctx)
+	{
+		fz_free(ctx, new_cmds);
+		fz_rethrow(ctx);
+	}
+	path->cmds = new_cmds;
+	memcpy(path->cmds, cmds, sizeof(uint8_t) * cmd_len);
+	memcpy(path->coords, coords, sizeof(float) * coord_len);
+	path->refs = 1;
+	path->packed = FZ_PATH_PACKED_OPEN;
+	path->cmd_len = path->cmd_cap = cmd_len;
+	path->coord_len = path->coord_cap = coord_len;
+	path->current.x = 0;
+	path->current.y = 0;
+	path->begin.x = 0;
+	path->begin.y = 0;
+}
+
 static void
 push_cmd(fz_context *ctx, fz_path *path, int cmd)
 {
@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef struct fz_item_s fz_item;
 
@@ -16,14 +18,45 @@ struct fz_item_s
 	fz_item *prev;
 	fz_store *store;
 	const fz_store_type *type;
+	size_t cost;
+	double priority;
+	int cost_class;
+	fz_item *class_next;
+	fz_item *class_prev;
 };
 
-/* Every entry in fz_store is protected by the alloc lock */
-struct fz_store_s
+/* For FZ_STORE_POLICY_GDS, every item is also kept in one of a number
+ * of LRU lists according to its cost per byte, rounded down to a power
+ * of two. As the priorities given by touch only ever increase, the
+ * tail of each list holds (near enough) its lowest priority item, so
+ * finding a victim means looking at one item per list rather than at
+ * every item in the shard. */
+enum { FZ_STORE_COST_CLASSES = 32 };
+
+/* Statistics for the items of a given type within a shard. The last
+ * slot collects everything that doesn't fit in the others. */
+typedef struct fz_store_type_slot_s
 {
-	int refs;
+	const fz_store_type *type;
+	fz_store_type_stats stats;
+} fz_store_type_slot;
+
+/*
+	The store is split into one or more shards, selected by the hash of
+	an item's key. Each shard has its own LRU list, hash table and size
+	accounting, protected by its own lock. By default there is a single
+	shard, protected by the alloc lock.
+
+	When a shard is protected by a lock other than the alloc lock, the
+	reference counts of the values within it are still only ever changed
+	with the alloc lock held (taken after the shard lock), as everyone
+	else who keeps or drops those values uses the alloc lock.
+*/
+typedef struct fz_store_shard_s
+{
+	int lock;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
+	/* Every item in the shard is kept in a doubly linked list, ordered
 	 * by usage (so LRU entries are at the end). */
 	fz_item *head;
 	fz_item *tail;
@@ -32,12 +65,40 @@ struct fz_store_s
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
 
-	/* We keep track of the size of the store, and keep it below max. */
+	/* The size of the items in this shard. */
+	size_t size;
+
+	/* The priority of the last item evicted, and the lists of items
+	 * by cost class, for FZ_STORE_POLICY_GDS. */
+	double inflation;
+	fz_item *class_head[FZ_STORE_COST_CLASSES];
+	fz_item *class_tail[FZ_STORE_COST_CLASSES];
+
+	/* Usage statistics, see fz_get_store_stats. */
+	fz_store_type_slot stats[FZ_STORE_STATS_MAX_TYPES];
+} fz_store_shard;
+
+/* The shared fields of fz_store are protected by the alloc lock */
+struct fz_store_s
+{
+	int refs;
+
+	int nshards;
+	int scavenge_start;
+	fz_store_shard shard[FZ_STORE_MAX_SHARDS];
+
+	int policy;
+
+	/* We keep track of the size of the store as a whole (the sum of
+	 * the sizes of the shards), and keep it below max. */
 	size_t max;
 	size_t size;
+	size_t high_water;
 
 	int defer_reap_count;
 	int needs_reaping;
+
+	size_t scavenges;
 };
 
 /*
@@ -53,7 +114,7 @@ fz_new_store_context(fz_context *ctx, size_t max)
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC, NULL);
+		store->shard[0].hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC, NULL);
 	}
 	fz_catch(ctx)
 	{
@@ -61,15 +122,290 @@ fz_new_store_context(fz_context *ctx, size_t max)
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
-	store->size = 0;
+	store->nshards = 1;
+	store->scavenge_start = 0;
+	store->shard[0].lock = FZ_LOCK_ALLOC;
+	store->shard[0].head = NULL;
+	store->shard[0].tail = NULL;
+	store->shard[0].size = 0;
+	store->shard[0].inflation = 0;
 	store->max = max;
+	store->size = 0;
+	store->high_water = 0;
+	store->policy = FZ_STORE_POLICY_LRU;
 	store->defer_reap_count = 0;
 	store->needs_reaping = 0;
 	ctx->store = store;
 }
 
+/*
+	Split the store into a number of independently locked shards.
+
+	Lookups and insertions in different shards can then proceed in
+	parallel, rather than all being serialized on the alloc lock. The
+	maximum size applies to the store as a whole, not to each shard;
+	when it is exceeded items are evicted from the shards in turn.
+
+	This must be called before anything has been placed into the store
+	and before any clones of the context are made; typically straight
+	after fz_new_context. Shard i is protected by lock FZ_LOCK_STORE+i.
+
+	nshards: The number of shards to use, from 1 to FZ_STORE_MAX_SHARDS.
+	1 restores the default behaviour of a single shard protected by the
+	alloc lock.
+*/
+void
+fz_set_store_shards(fz_context *ctx, int nshards)
+{
+	fz_store *store = ctx->store;
+	fz_hash_table *hash[FZ_STORE_MAX_SHARDS] = { NULL };
+	int i;
+
+	if (store == NULL)
+		return;
+	if (nshards < 1 || nshards > FZ_STORE_MAX_SHARDS)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "invalid number of store shards (%d)", nshards);
+
+	for (i = 0; i < store->nshards; i++)
+		if (store->shard[i].head)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot shard a store that is in use");
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < nshards; i++)
+			hash[i] = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), nshards == 1 ? FZ_LOCK_ALLOC : FZ_LOCK_STORE + i, NULL);
+	}
+	fz_catch(ctx)
+	{
+		for (i = 0; i < nshards; i++)
+			fz_drop_hash_table(ctx, hash[i]);
+		fz_rethrow(ctx);
+	}
+
+	for (i = 0; i < store->nshards; i++)
+		fz_drop_hash_table(ctx, store->shard[i].hash);
+
+	for (i = 0; i < nshards; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+		shard->lock = nshards == 1 ? FZ_LOCK_ALLOC : FZ_LOCK_STORE + i;
+		shard->head = NULL;
+		shard->tail = NULL;
+		shard->hash = hash[i];
+		shard->size = 0;
+		shard->inflation = 0;
+		memset(shard->stats, 0, sizeof shard->stats);
+		memset(shard->class_head, 0, sizeof shard->class_head);
+		memset(shard->class_tail, 0, sizeof shard->class_tail);
+	}
+	store->nshards = nshards;
+	store->scavenge_start = 0;
+}
+
+/*
+	Choose how the store picks items to evict when it needs space.
+
+	FZ_STORE_POLICY_LRU: Evict the least recently used items first.
+	This is the default.
+
+	FZ_STORE_POLICY_GDS: Evict using the GreedyDual-Size algorithm,
+	which weighs how recently an item was used against its recompute
+	cost per byte (see fz_store_item_with_cost). Items that are
+	expensive to recreate, such as decoded JPEG 2000 images, then
+	survive longer than cheap ones of the same size.
+*/
+void
+fz_set_store_policy(fz_context *ctx, int policy)
+{
+	if (ctx->store == NULL)
+		return;
+	if (policy != FZ_STORE_POLICY_LRU && policy != FZ_STORE_POLICY_GDS)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown store eviction policy (%d)", policy);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->store->policy = policy;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/* Entered with the shard lock held. Find the statistics for type. */
+static fz_store_type_stats *
+type_stats(fz_store_shard *shard, const fz_store_type *type)
+{
+	fz_store_type_slot *slot = shard->stats;
+	int i;
+
+	for (i = 0; i < FZ_STORE_STATS_MAX_TYPES - 1; i++, slot++)
+	{
+		if (slot->type == type)
+			return &slot->stats;
+		if (slot->type == NULL)
+		{
+			slot->type = type;
+			slot->stats.name = type->name ? type->name : "unnamed";
+			return &slot->stats;
+		}
+	}
+
+	slot->stats.name = "other";
+	return &slot->stats;
+}
+
+static fz_store_shard *
+find_shard(fz_store *store, const fz_store_hash *hash)
+{
+	const unsigned char *s = (const unsigned char *)hash;
+	unsigned int val = 0;
+	size_t i;
+
+	/* Unhashable keys can only be found by a linear search, so they
+	 * all live in the first shard. */
+	if (hash == NULL || store->nshards == 1)
+		return &store->shard[0];
+
+	for (i = 0; i < sizeof(*hash); i++)
+	{
+		val += s[i];
+		val += (val << 10);
+		val ^= (val >> 6);
+	}
+	val += (val << 3);
+	val ^= (val >> 11);
+	val += (val << 15);
+
+	return &store->shard[val % store->nshards];
+}
+
+/* Move from holding the alloc lock to holding the lock of the given shard. */
+static void
+enter_shard(fz_context *ctx, fz_store_shard *shard)
+{
+	if (shard->lock != FZ_LOCK_ALLOC)
+	{
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_lock(ctx, shard->lock);
+	}
+}
+
+/* Move from holding the lock of the given shard back to the alloc lock. */
+static void
+leave_shard(fz_context *ctx, fz_store_shard *shard)
+{
+	if (shard->lock != FZ_LOCK_ALLOC)
+	{
+		fz_unlock(ctx, shard->lock);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
+}
+
+/* Entered with the shard lock held. Takes a reference to val. */
+static void
+keep_val(fz_context *ctx, fz_store_shard *shard, fz_storable *val)
+{
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (val->refs > 0)
+	{
+		(void)Memento_takeRef(val);
+		val->refs++;
+	}
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/* Entered with the shard lock held. Drops a reference to val, returning
+ * non-zero if that was the last one and val should be freed. */
+static int
+drop_val(fz_context *ctx, fz_store_shard *shard, fz_storable *val)
+{
+	int drop;
+
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (val->refs > 0)
+		(void)Memento_dropRef(val);
+	drop = (val->refs > 0 && --val->refs == 0);
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return drop;
+}
+
+/* Entered with the shard lock held. Adds size to the shard, and to the
+ * store total (which is protected by the alloc lock). */
+static void
+grow_shard(fz_context *ctx, fz_store_shard *shard, size_t size)
+{
+	fz_store *store = ctx->store;
+
+	shard->size += size;
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->size += size;
+	if (store->size > store->high_water)
+		store->high_water = store->size;
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/* Entered with the shard lock held. The reverse of grow_shard. */
+static void
+shrink_shard(fz_context *ctx, fz_store_shard *shard, size_t size)
+{
+	fz_store *store = ctx->store;
+
+	shard->size -= size;
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->size -= size;
+	if (shard->lock != FZ_LOCK_ALLOC)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/* Entered with the shard lock held. Unlinks item from the list of its
+ * cost class. */
+static void
+unlink_class(fz_store_shard *shard, fz_item *item)
+{
+	int c = item->cost_class;
+
+	if (item->class_next)
+		item->class_next->class_prev = item->class_prev;
+	else
+		shard->class_tail[c] = item->class_prev;
+	if (item->class_prev)
+		item->class_prev->class_next = item->class_next;
+	else
+		shard->class_head[c] = item->class_next;
+}
+
+/* Entered with the shard lock held. Unlinks item from the LRU list and
+ * removes it from the hash table. */
+static void
+unlink_item(fz_context *ctx, fz_store_shard *shard, fz_item *item)
+{
+	shrink_shard(ctx, shard, item->size);
+	type_stats(shard, item->type)->size -= item->size;
+	unlink_class(shard, item);
+
+	/* Unlink from the linked list */
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		shard->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		shard->head = item->next;
+
+	/* Remove from the hash table */
+	if (item->type->make_hash_key)
+	{
+		fz_store_hash hash = { NULL };
+		hash.drop = item->val->drop;
+		if (item->type->make_hash_key(ctx, &hash, item->key))
+			fz_hash_remove(ctx, shard->hash, &hash);
+	}
+}
+
 void *
 fz_keep_storable(fz_context *ctx, const fz_storable *sc)
 {
@@ -112,6 +448,7 @@ do_reap(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
 	fz_item *item, *prev, *remove;
+	int i;
 
 	if (store == NULL)
 	{
@@ -125,43 +462,29 @@ do_reap(fz_context *ctx)
 
 	/* Reap the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < store->nshards; i++)
 	{
-		prev = item->prev;
+		fz_store_shard *shard = &store->shard[i];
 
-		if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
-			continue;
+		enter_shard(ctx, shard);
+		for (item = shard->tail; item; item = prev)
+		{
+			prev = item->prev;
 
-		/* We have to drop it */
-		store->size -= item->size;
+			if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
+				continue;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			/* We have to drop it */
+			unlink_item(ctx, shard, item);
 
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+			/* Store whether to drop this value or not in 'prev' */
+			item->prev = drop_val(ctx, shard, item->val) ? item : NULL;
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
+		}
+		leave_shard(ctx, shard);
 	}
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
@@ -249,16 +572,19 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_key_storable *s = (fz_key_storable *)sc;
-	int drop;
+	int drop = 0;
 
 	if (s == NULL)
 		return;
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	assert(s->store_key_refs > 0 && s->storable.refs >= s->store_key_refs);
-	(void)Memento_dropRef(s);
-	drop = --s->storable.refs == 0;
-	--s->store_key_refs;
+	if (s->storable.refs > 0)
+	{
+		assert(s->store_key_refs > 0 && s->storable.refs >= s->store_key_refs);
+		(void)Memento_dropRef(s);
+		drop = --s->storable.refs == 0;
+		--s->store_key_refs;
+	}
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	/*
 		If we are dropping the last reference to an object, then
@@ -271,60 +597,76 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		s->storable.drop(ctx, &s->storable);
 }
 
+/*
+	Entered with the shard lock held. Find the next item to evict,
+	searching back from item towards the head of the LRU list.
+
+	With the LRU policy this is simply the first item found that
+	nobody else holds a reference to. With the GDS policy it is the
+	unreferenced item with the lowest priority found by searching back
+	from the tail of the list of each cost class.
+*/
+static fz_item *
+find_victim(fz_store *store, fz_store_shard *shard, fz_item *item)
+{
+	fz_item *victim = NULL;
+	int c;
+
+	if (store->policy != FZ_STORE_POLICY_GDS)
+	{
+		for (; item; item = item->prev)
+			if (item->val->refs == 1)
+				return item;
+		return NULL;
+	}
+
+	for (c = 0; c < FZ_STORE_COST_CLASSES; c++)
+	{
+		for (item = shard->class_tail[c]; item; item = item->class_prev)
+			if (item->val->refs == 1)
+				break;
+		if (item && (victim == NULL || item->priority < victim->priority))
+			victim = item;
+	}
+
+	return victim;
+}
+
+/* Entered with the shard lock held. Drops then retakes it. */
 static void
-evict(fz_context *ctx, fz_item *item)
+evict(fz_context *ctx, fz_store_shard *shard, fz_item *item)
 {
-	fz_store *store = ctx->store;
 	int drop;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
+	unlink_item(ctx, shard, item);
 
 	/* Drop a reference to the value (freeing if required) */
-	if (item->val->refs > 0)
-		(void)Memento_dropRef(item->val);
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
+	drop = drop_val(ctx, shard, item->val);
 
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
-	{
-		fz_store_hash hash = { NULL };
-		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, shard->lock);
 	if (drop)
 		item->val->drop(ctx, item->val);
 
 	/* Always drops the key and drop the item */
 	item->type->drop_key(ctx, item->key);
 	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 }
 
 static size_t
-ensure_space(fz_context *ctx, size_t tofree)
+ensure_space(fz_context *ctx, fz_store_shard *shard, size_t tofree)
 {
+	fz_store *store = ctx->store;
 	fz_item *item, *prev;
 	size_t count;
-	fz_store *store = ctx->store;
 	fz_item *to_be_freed = NULL;
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	fz_assert_lock_held(ctx, shard->lock);
 
 	/* First check that we *can* free tofree; if not, we'd rather not
 	 * cache this. */
 	count = 0;
-	for (item = store->tail; item; item = item->prev)
+	for (item = shard->tail; item; item = item->prev)
 	{
 		if (item->val->refs == 1)
 		{
@@ -342,32 +684,16 @@ ensure_space(fz_context *ctx, size_t tofree)
 
 	/* Now move all the items to be freed onto 'to_be_freed' */
 	count = 0;
-	for (item = store->tail; item; item = prev)
+	for (item = find_victim(store, shard, shard->tail); item; item = find_victim(store, shard, prev))
 	{
-		prev = item->prev;
-		if (item->val->refs != 1)
-			continue;
-
-		store->size -= item->size;
+		fz_store_type_stats *stats = type_stats(shard, item->type);
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		prev = item->prev;
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+		stats->evictions++;
+		stats->evicted += item->size;
+		shard->inflation = item->priority;
+		unlink_item(ctx, shard, item);
 
 		/* Link into to_be_freed */
 		item->next = to_be_freed;
@@ -390,46 +716,167 @@ ensure_space(fz_context *ctx, size_t tofree)
 		to_be_freed = to_be_freed->next;
 
 		/* Drop a reference to the value (freeing if required) */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		drop = (item->val->refs > 0 && --item->val->refs == 0);
+		drop = drop_val(ctx, shard, item->val);
 
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 		if (drop)
 			item->val->drop(ctx, item->val);
 
 		/* Always drops the key and drop the item */
 		item->type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+		fz_lock(ctx, shard->lock);
 	}
 
 	return count;
 }
 
 static void
-touch(fz_store *store, fz_item *item)
+touch(fz_store_shard *shard, fz_item *item)
 {
+	int c = item->cost_class;
+
 	if (item->next != item)
 	{
 		/* Already in the list - unlink it */
 		if (item->next)
 			item->next->prev = item->prev;
 		else
-			store->tail = item->prev;
+			shard->tail = item->prev;
 		if (item->prev)
 			item->prev->next = item->next;
 		else
-			store->head = item->next;
+			shard->head = item->next;
+		unlink_class(shard, item);
 	}
 	/* Now relink it at the start of the LRU chain */
-	item->next = store->head;
+	item->next = shard->head;
 	if (item->next)
 		item->next->prev = item;
 	else
-		store->tail = item;
-	store->head = item;
+		shard->tail = item;
+	shard->head = item;
 	item->prev = NULL;
+
+	/* And of the chain for its cost class */
+	item->class_next = shard->class_head[c];
+	if (item->class_next)
+		item->class_next->class_prev = item;
+	else
+		shard->class_tail[c] = item;
+	shard->class_head[c] = item;
+	item->class_prev = NULL;
+
+	/* And refresh its priority for GreedyDual-Size eviction */
+	item->priority = shard->inflation + (double)item->cost / (item->size ? item->size : 1);
+}
+
+/* The cost class of an item is the binary exponent of its cost per
+ * byte, offset so that a cost equal to the size lands in the middle. */
+static int
+cost_class(size_t cost, size_t size)
+{
+	int e;
+
+	(void)frexp((double)cost / (size ? size : 1), &e);
+	e += FZ_STORE_COST_CLASSES / 2 - 1;
+	return fz_clampi(e, 0, FZ_STORE_COST_CLASSES - 1);
+}
+
+/* Entered with the shard lock held, which is dropped momentarily. */
+static void
+reap_from_shard(fz_context *ctx, fz_store_shard *shard)
+{
+	if (shard->lock != FZ_LOCK_ALLOC)
+	{
+		fz_unlock(ctx, shard->lock);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
+	do_reap(ctx); /* Drops alloc lock */
+	fz_lock(ctx, shard->lock);
+}
+
+/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
+ * actually managing to scavenge lots of blocks back. */
+static size_t
+scavenge_shard(fz_context *ctx, fz_store_shard *shard, size_t tofree)
+{
+	fz_store *store = ctx->store;
+	size_t count = 0;
+	fz_item *item;
+
+	/* Free the items. We have to restart the search each time, as
+	 * the list may have changed due to release of lock in evict. */
+	while ((item = find_victim(store, shard, shard->tail)) != NULL)
+	{
+		fz_store_type_stats *stats = type_stats(shard, item->type);
+
+		/* Free this item */
+		count += item->size;
+		stats->evictions++;
+		stats->evicted += item->size;
+		shard->inflation = item->priority;
+		evict(ctx, shard, item); /* Drops then retakes lock */
+
+		if (count >= tofree)
+			break;
+	}
+
+	return count;
+}
+
+/* Entered and exits with the alloc lock held, though it may be
+ * dropped momentarily. Shards are visited in rotation, so that
+ * repeated calls do not always empty the same one first. */
+static size_t
+evict_from_shards(fz_context *ctx, size_t tofree)
+{
+	fz_store *store = ctx->store;
+	size_t count = 0;
+	int i, n = store->nshards;
+	int start = store->scavenge_start;
+
+	store->scavenge_start = (start + 1) % n;
+	for (i = 0; i < n && count < tofree; i++)
+	{
+		fz_store_shard *shard = &store->shard[(start + i) % n];
+
+		enter_shard(ctx, shard);
+		count += scavenge_shard(ctx, shard, tofree - count);
+		leave_shard(ctx, shard);
+	}
+
+	return count;
+}
+
+/* Entered and exits with the alloc lock held, though it may be
+ * dropped momentarily. */
+static int
+scavenge(fz_context *ctx, size_t tofree)
+{
+	ctx->store->scavenges++;
+
+	/* Success is managing to evict any blocks */
+	return evict_from_shards(ctx, tofree) != 0;
+}
+
+/* Called with no locks held, after an item has been added to a store
+ * with several shards. Evicts from whichever shards have something to
+ * give until the store as a whole is back within its maximum size. */
+static void
+balance_shards(fz_context *ctx)
+{
+	fz_store *store = ctx->store;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (store->size > store->max && store->needs_reaping)
+	{
+		do_reap(ctx); /* Drops alloc lock */
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
+	if (store->size > store->max)
+		evict_from_shards(ctx, store->size - store->max);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 /*
@@ -451,13 +898,32 @@ touch(fz_store *store, fz_item *item)
 	type: Functions used to manipulate the key.
 */
 void *
-fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_store_type *type)
+fz_store_item(fz_context *ctx, void *key, void *val, size_t itemsize, const fz_store_type *type)
+{
+	return fz_store_item_with_cost(ctx, key, val, itemsize, itemsize, type);
+}
+
+/*
+	Add an item to the store, with an estimate of the cost of
+	recreating it should it be evicted.
+
+	As fz_store_item, with the addition of:
+
+	cost: The estimated cost of recreating the value, in the same units
+	as itemsize (i.e. the number of bytes that could be produced by the
+	same amount of work as recreating this value). fz_store_item uses a
+	cost equal to itemsize. Only used by FZ_STORE_POLICY_GDS.
+*/
+void *
+fz_store_item_with_cost(fz_context *ctx, void *key, void *val_, size_t itemsize, size_t cost, const fz_store_type *type)
 {
 	fz_item *item = NULL;
 	size_t size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
+	fz_store_type_stats *stats;
 	int use_hash = 0;
 
 	if (!store)
@@ -482,9 +948,10 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		hash.drop = val->drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, use_hash ? &hash : NULL);
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 
 	/* Fill out the item. To start with, we always set item->next == item
 	 * and item->prev == item. This is so that we can spot items that have
@@ -493,6 +960,8 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 	item->key = key;
 	item->val = val;
 	item->size = itemsize;
+	item->cost = cost;
+	item->cost_class = cost_class(cost, itemsize);
 	item->next = item;
 	item->prev = item;
 	item->type = type;
@@ -506,13 +975,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		fz_try(ctx)
 		{
 			/* May drop and retake the lock */
-			existing = fz_hash_insert(ctx, store->hash, &hash, item);
+			existing = fz_hash_insert(ctx, shard->hash, &hash, item);
 		}
 		fz_catch(ctx)
 		{
 			/* Any error here means that item never made it into the
 			 * hash - so no one else can have a reference. */
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return NULL;
@@ -521,13 +990,9 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 		{
 			/* There was one there already! Take a new reference
 			 * to the existing one, and drop our current one. */
-			touch(store, existing);
-			if (existing->val->refs > 0)
-			{
-				(void)Memento_takeRef(existing->val);
-				existing->val->refs++;
-			}
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			touch(shard, existing);
+			keep_val(ctx, shard, existing->val);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return existing->val;
@@ -535,14 +1000,12 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 	}
 
 	/* Now bump the ref */
-	if (val->refs > 0)
-	{
-		(void)Memento_takeRef(val);
-		val->refs++;
-	}
+	keep_val(ctx, shard, val);
 
-	/* If we haven't got an infinite store, check for space within it */
-	if (store->max != FZ_STORE_UNLIMITED)
+	/* If we haven't got an infinite store, check for space within it.
+	 * With several shards we make room once we have let go of this one,
+	 * as we may need to evict from the others too (see balance_shards). */
+	if (store->max != FZ_STORE_UNLIMITED && store->nshards == 1)
 	{
 		size = store->size + itemsize;
 		while (size > store->max)
@@ -551,16 +1014,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 
 			/* First, do any outstanding reaping, even if defer_reap_count > 0 */
 			if (store->needs_reaping)
-			{
-				do_reap(ctx); /* Drops alloc lock */
-				fz_lock(ctx, FZ_LOCK_ALLOC);
-			}
+				reap_from_shard(ctx, shard);
 			size = store->size + itemsize;
 			if (size <= store->max)
 				break;
 
 			/* ensure_space may drop, then retake the lock */
-			saved = ensure_space(ctx, size - store->max);
+			saved = ensure_space(ctx, shard, size - store->max);
 			size -= saved;
 			if (saved == 0)
 			{
@@ -578,11 +1038,17 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 			}
 		}
 	}
-	store->size += itemsize;
+	grow_shard(ctx, shard, itemsize);
+	stats = type_stats(shard, type);
+	stats->inserts++;
+	stats->size += itemsize;
 
 	/* Regardless of whether it's indexed, it goes into the linked list */
-	touch(store, item);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	touch(shard, item);
+	fz_unlock(ctx, shard->lock);
+
+	if (store->max != FZ_STORE_UNLIMITED && store->nshards > 1)
+		balance_shards(ctx);
 
 	return NULL;
 }
@@ -605,7 +1071,9 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
+	fz_store_type_stats *stats;
 	int use_hash = 0;
 
 	if (!store)
@@ -619,39 +1087,41 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, use_hash ? &hash : NULL);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 		{
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 		}
 	}
+	stats = type_stats(shard, type);
+	stats->lookups++;
 	if (item)
 	{
+		stats->hits++;
+
 		/* LRU the block. This also serves to ensure that any item
 		 * picked up from the hash before it has made it into the
 		 * linked list does not get whipped out again due to the
 		 * store being full. */
-		touch(store, item);
+		touch(shard, item);
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-		{
-			(void)Memento_takeRef(item->val);
-			item->val->refs++;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		keep_val(ctx, shard, item->val);
+		fz_unlock(ctx, shard->lock);
 		return (void *)item->val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	stats->misses++;
+	fz_unlock(ctx, shard->lock);
 
 	return NULL;
 }
@@ -673,6 +1143,7 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	int dodrop;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
@@ -682,19 +1153,20 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, use_hash ? &hash : NULL);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 	}
@@ -705,41 +1177,48 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 		 * such items by setting item->next == item. */
 		if (item->next != item)
 		{
+			shrink_shard(ctx, shard, item->size);
+			type_stats(shard, type)->size -= item->size;
+			unlink_class(shard, item);
 			if (item->next)
 				item->next->prev = item->prev;
 			else
-				store->tail = item->prev;
+				shard->tail = item->prev;
 			if (item->prev)
 				item->prev->next = item->next;
 			else
-				store->head = item->next;
+				shard->head = item->next;
 		}
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		dodrop = drop_val(ctx, shard, item->val);
+		fz_unlock(ctx, shard->lock);
 		if (dodrop)
 			item->val->drop(ctx, item->val);
 		type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
 	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	int i;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Run through all the items in the store */
-	while (store->head)
-		evict(ctx, store->head); /* Drops then retakes lock */
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < store->nshards; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
+
+		fz_lock(ctx, shard->lock);
+		while (shard->head)
+			evict(ctx, shard, shard->head); /* Drops then retakes lock */
+		fz_unlock(ctx, shard->lock);
+	}
 }
 
 fz_store *
@@ -753,12 +1232,15 @@ fz_keep_store_context(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
+	int i;
+
 	if (!ctx)
 		return;
 	if (fz_drop_imp(ctx, ctx->store, &ctx->store->refs))
 	{
 		fz_empty_store(ctx);
-		fz_drop_hash_table(ctx, ctx->store->hash);
+		for (i = 0; i < ctx->store->nshards; i++)
+			fz_drop_hash_table(ctx, ctx->store->shard[i].hash);
 		fz_free(ctx, ctx->store);
 		ctx->store = NULL;
 	}
@@ -767,13 +1249,14 @@ fz_drop_store_context(fz_context *ctx)
 static void
 fz_debug_store_item(fz_context *ctx, void *state, void *key_, int keylen, void *item_)
 {
+	fz_store_shard *shard = state;
 	unsigned char *key = key_;
 	fz_item *item = item_;
 	int i;
 	char buf[256];
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, shard->lock);
 	item->type->format_key(ctx, buf, sizeof buf, item->key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	printf("hash[");
 	for (i=0; i < keylen; ++i)
 		printf("%02x", key[i]);
@@ -786,31 +1269,38 @@ fz_debug_store_locked(fz_context *ctx)
 	fz_item *item, *next;
 	char buf[256];
 	fz_store *store = ctx->store;
+	int i;
 
-	printf("-- resource store contents --\n");
-
-	for (item = store->head; item; item = next)
+	for (i = 0; i < store->nshards; i++)
 	{
-		next = item->next;
-		if (next)
-		{
-			(void)Memento_takeRef(next->val);
-			next->val->refs++;
-		}
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		item->type->format_key(ctx, buf, sizeof buf, item->key);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		printf("store[*][refs=%d][size=%d] key=%s val=%p\n",
-				item->val->refs, (int)item->size, buf, item->val);
-		if (next)
+		fz_store_shard *shard = &store->shard[i];
+
+		enter_shard(ctx, shard);
+
+		if (store->nshards > 1)
+			printf("-- resource store shard %d contents --\n", i);
+		else
+			printf("-- resource store contents --\n");
+
+		for (item = shard->head; item; item = next)
 		{
-			(void)Memento_dropRef(next->val);
-			next->val->refs--;
+			next = item->next;
+			if (next)
+				keep_val(ctx, shard, next->val);
+			fz_unlock(ctx, shard->lock);
+			item->type->format_key(ctx, buf, sizeof buf, item->key);
+			fz_lock(ctx, shard->lock);
+			printf("store[*][refs=%d][size=%d] key=%s val=%p\n",
+					item->val->refs, (int)item->size, buf, item->val);
+			if (next)
+				(void)drop_val(ctx, shard, next->val);
 		}
-	}
 
-	printf("-- resource store hash contents --\n");
-	fz_hash_for_each(ctx, store->hash, NULL, fz_debug_store_item);
+		printf("-- resource store hash contents --\n");
+		fz_hash_for_each(ctx, shard->hash, shard, fz_debug_store_item);
+
+		leave_shard(ctx, shard);
+	}
 	printf("-- end --\n");
 }
 
@@ -822,35 +1312,123 @@ fz_debug_store(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
-static int
-scavenge(fz_context *ctx, size_t tofree)
+/*
+	Read the usage statistics of the store.
+
+	Counters are broken down by fz_store_type (by name), and are
+	accumulated from the creation of the store or the last call to
+	fz_reset_store_stats.
+
+	max, size and high_water are for the store as a whole, however
+	many shards it has: the limit, the current size and the peak size
+	that the total has reached.
+*/
+void
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
 {
 	fz_store *store = ctx->store;
-	size_t count = 0;
-	fz_item *item, *prev;
+	int i, j, k;
 
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
+	memset(stats, 0, sizeof *stats);
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	stats->max = store->max;
+	stats->size = store->size;
+	stats->high_water = store->high_water;
+	stats->scavenges = store->scavenges;
+	for (i = 0; i < store->nshards; i++)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
+		fz_store_shard *shard = &store->shard[i];
+
+		enter_shard(ctx, shard);
+		for (j = 0; j < FZ_STORE_STATS_MAX_TYPES; j++)
 		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
+			fz_store_type_stats *src = &shard->stats[j].stats;
+			fz_store_type_stats *dst;
+
+			if (src->name == NULL)
+				continue;
+			for (k = 0; k < stats->num_types; k++)
+				if (!strcmp(stats->type[k].name, src->name))
+					break;
+			if (k == stats->num_types)
+			{
+				if (k == FZ_STORE_STATS_MAX_TYPES)
+					continue;
+				stats->num_types++;
+				stats->type[k].name = src->name;
+			}
+			dst = &stats->type[k];
+			dst->lookups += src->lookups;
+			dst->hits += src->hits;
+			dst->misses += src->misses;
+			dst->inserts += src->inserts;
+			dst->evictions += src->evictions;
+			dst->evicted += src->evicted;
+			dst->size += src->size;
+		}
+		leave_shard(ctx, shard);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
 
-			if (count >= tofree)
-				break;
+/*
+	Zero the counters of the store statistics, and restart the high
+	water mark from the current size.
+*/
+void
+fz_reset_store_stats(fz_context *ctx)
+{
+	fz_store *store = ctx->store;
+	int i, j;
+
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->scavenges = 0;
+	store->high_water = store->size;
+	for (i = 0; i < store->nshards; i++)
+	{
+		fz_store_shard *shard = &store->shard[i];
 
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
+		enter_shard(ctx, shard);
+		for (j = 0; j < FZ_STORE_STATS_MAX_TYPES; j++)
+		{
+			fz_store_type_stats *st = &shard->stats[j].stats;
+			st->lookups = st->hits = st->misses = 0;
+			st->inserts = st->evictions = st->evicted = 0;
 		}
+		leave_shard(ctx, shard);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/*
+	Print the usage statistics of the store to out.
+*/
+void
+fz_print_store_stats(fz_context *ctx, fz_output *out)
+{
+	fz_store_stats stats;
+	int i;
+
+	fz_get_store_stats(ctx, &stats);
+
+	if (stats.max == FZ_STORE_UNLIMITED)
+		fz_write_printf(ctx, out, "Store Size: %zu (unlimited)\n", stats.size);
+	else
+		fz_write_printf(ctx, out, "Store Size: %zu of %zu\n", stats.size, stats.max);
+	fz_write_printf(ctx, out, "Store High Water: %zu\n", stats.high_water);
+	fz_write_printf(ctx, out, "Store Scavenges: %zu\n", stats.scavenges);
+	for (i = 0; i < stats.num_types; i++)
+	{
+		fz_store_type_stats *st = &stats.type[i];
+		fz_write_printf(ctx, out, "Store [%s]: lookups=%zu hits=%zu misses=%zu inserts=%zu evictions=%zu (%zu bytes) size=%zu\n",
+			st->name, st->lookups, st->hits, st->misses, st->inserts, st->evictions, st->evicted, st->size);
 	}
-	/* Success is managing to evict any blocks */
-	return count != 0;
 }
 
 /*
@@ -889,14 +1467,16 @@ int fz_store_scavenge_external(fz_context *ctx, size_t size, int *phase)
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 {
 	fz_store *store;
-	size_t max;
+	size_t max, store_total;
 
 	store = ctx->store;
 	if (store == NULL)
 		return 0;
 
+	store_total = store->size;
+
 #ifdef DEBUG_SCAVENGING
-	printf("Scavenging: store=" FZ_FMT_zu " size=" FZ_FMT_zu " phase=%d\n", store->size, size, *phase);
+	printf("Scavenging: store=" FZ_FMT_zu " size=" FZ_FMT_zu " phase=%d\n", store_total, size, *phase);
 	fz_debug_store_locked(ctx);
 	Memento_stats();
 #endif
@@ -910,22 +1490,22 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 		else if (store->max != FZ_STORE_UNLIMITED)
 			max = store->max / 16 * (16 - *phase);
 		else
-			max = store->size / (16 - *phase) * (15 - *phase);
+			max = store_total / (16 - *phase) * (15 - *phase);
 		(*phase)++;
 
 		/* Slightly baroque calculations to avoid overflow */
-		if (size > SIZE_MAX - store->size)
+		if (size > SIZE_MAX - store_total)
 			tofree = SIZE_MAX - max;
-		else if (size + store->size > max)
+		else if (size + store_total > max)
 			continue;
 		else
-			tofree = size + store->size - max;
+			tofree = size + store_total - max;
 
 		if (scavenge(ctx, tofree))
 		{
 #ifdef DEBUG_SCAVENGING
 			printf("scavenged: store=" FZ_FMT_zu "\n", store->size);
-			fz_debug_store(ctx);
+			fz_debug_store_locked(ctx);
 			Memento_stats();
 #endif
 			return 1;
@@ -935,7 +1515,7 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 
 #ifdef DEBUG_SCAVENGING
 	printf("scavenging failed\n");
-	fz_debug_store(ctx);
+	fz_debug_store_locked(ctx);
 	Memento_listBlocks();
 #endif
 	return 0;
@@ -955,7 +1535,7 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 {
 	int success;
 	fz_store *store;
-	size_t new_size;
+	size_t size, new_size;
 
 	if (percent >= 100)
 		return 1;
@@ -964,19 +1544,21 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	if (store == NULL)
 		return 0;
 
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	size = store->size;
 #ifdef DEBUG_SCAVENGING
-	printf("fz_shrink_store: " FZ_FMT_zu "\n", store->size/(1024*1024));
+	printf("fz_shrink_store: " FZ_FMT_zu "\n", size/(1024*1024));
 #endif
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 
-	new_size = (size_t)(((uint64_t)store->size * percent) / 100);
-	if (store->size > new_size)
-		scavenge(ctx, store->size - new_size);
+	new_size = (size_t)(((uint64_t)size * percent) / 100);
+	if (size > new_size)
+		scavenge(ctx, size - new_size);
 
-	success = (store->size <= new_size) ? 1 : 0;
+	size = store->size;
+	success = (size <= new_size) ? 1 : 0;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 #ifdef DEBUG_SCAVENGING
-	printf("fz_shrink_store after: " FZ_FMT_zu "\n", store->size/(1024*1024));
+	printf("fz_shrink_store after: " FZ_FMT_zu "\n", size/(1024*1024));
 #endif
 
 	return success;
@@ -986,56 +1568,40 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const f
 {
 	fz_store *store;
 	fz_item *item, *prev, *remove;
+	int i;
 
 	store = ctx->store;
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-
 	/* Filter the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < store->nshards; i++)
 	{
-		prev = item->prev;
-		if (item->type != type)
-			continue;
+		fz_store_shard *shard = &store->shard[i];
 
-		if (fn(ctx, arg, item->key) == 0)
-			continue;
+		fz_lock(ctx, shard->lock);
+		for (item = shard->tail; item; item = prev)
+		{
+			prev = item->prev;
+			if (item->type != type)
+				continue;
 
-		/* We have to drop it */
-		store->size -= item->size;
+			if (fn(ctx, arg, item->key) == 0)
+				continue;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			/* We have to drop it */
+			unlink_item(ctx, shard, item);
 
-		/* Store whether to drop this value or not in 'prev' */
-		if (item->val->refs > 0)
-			(void)Memento_dropRef(item->val);
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+			/* Store whether to drop this value or not in 'prev' */
+			item->prev = drop_val(ctx, shard, item->val) ? item : NULL;
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
+		}
+		fz_unlock(ctx, shard->lock);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	/* Now drop the remove chain */
 	for (item = remove; item != NULL; item = remove)
@@ -0,0 +1,440 @@
+#include "mupdf/helpers/mu-render.h"
+#include "mupdf/helpers/mu-threads.h"
+
+/* Largest and smallest tile edge we use, in pixels. */
+#define MAX_TILE_SIZE 256
+#define MIN_TILE_SIZE 64
+
+/* We aim for at least this many tiles per thread, so that there is
+ * something left to steal when the content is unevenly spread. */
+#define TILES_PER_THREAD 8
+
+typedef struct render_job_s render_job;
+
+typedef struct
+{
+	render_job *job;
+	int num;
+	fz_context *ctx;
+	fz_cookie cookie;
+	/* The tiles this thread has still to draw are next..end-1. */
+	int next;
+	int end;
+	mu_thread thread;
+} render_worker;
+
+struct render_job_s
+{
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *pix;
+	fz_colorspace *proof_cs;
+	int hints;
+	fz_cookie *cookie;
+	int tile_size;
+	int cols;
+	int count;
+	int num_workers;
+	render_worker *workers;
+	mu_mutex mutex;
+};
+
+static void
+render_area(fz_context *ctx, render_job *job, fz_irect bbox, fz_cookie *cookie)
+{
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		dev = fz_new_draw_device_with_bbox_proof(ctx, fz_identity, job->pix, &bbox, job->proof_cs);
+		if (job->hints)
+			fz_enable_device_hints(ctx, dev, job->hints);
+		fz_run_display_list(ctx, job->list, dev, job->ctm, fz_rect_from_irect(bbox), cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		if (cookie)
+			cookie->errors++;
+		fz_warn(ctx, "cannot render tile %d %d %d %d", bbox.x0, bbox.y0, bbox.x1, bbox.y1);
+	}
+}
+
+/* Take the next tile for worker me, stealing if it has none left.
+ * Returns -1 when there are no tiles left anywhere. */
+static int
+next_tile(render_job *job, render_worker *me)
+{
+	int tile = -1;
+
+	mu_lock_mutex(&job->mutex);
+	if (me->next >= me->end)
+	{
+		render_worker *victim = NULL;
+		int i, most = 0;
+
+		for (i = 0; i < job->num_workers; i++)
+		{
+			render_worker *w = &job->workers[i];
+			if (w->end - w->next > most)
+			{
+				most = w->end - w->next;
+				victim = w;
+			}
+		}
+		if (victim)
+		{
+			/* Take the back half, as that is furthest from
+			 * where the victim is working. Round up, so that
+			 * the tiles of a worker that never started still
+			 * get taken. */
+			me->end = victim->end;
+			victim->end -= (most + 1) / 2;
+			me->next = victim->end;
+		}
+	}
+	if (me->next < me->end)
+		tile = me->next++;
+	mu_unlock_mutex(&job->mutex);
+
+	return tile;
+}
+
+static void
+render_tiles(render_worker *me)
+{
+	render_job *job = me->job;
+	fz_pixmap *pix = job->pix;
+	int tile;
+
+	while ((tile = next_tile(job, me)) >= 0)
+	{
+		fz_irect bbox;
+
+		if (job->cookie && job->cookie->abort)
+			break;
+
+		bbox.x0 = pix->x + (tile % job->cols) * job->tile_size;
+		bbox.y0 = pix->y + (tile / job->cols) * job->tile_size;
+		bbox.x1 = fz_mini(bbox.x0 + job->tile_size, pix->x + pix->w);
+		bbox.y1 = fz_mini(bbox.y0 + job->tile_size, pix->y + pix->h);
+		render_area(me->ctx, job, bbox, &me->cookie);
+	}
+}
+
+static void
+render_thread(void *arg)
+{
+	render_tiles((render_worker *)arg);
+}
+
+void
+mu_render_display_list_parallel(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_pixmap *pix, fz_colorspace *proof_cs, int hints, int threads, fz_cookie *cookie)
+{
+	render_job job = { 0 };
+	int i, rows, per_worker;
+
+	job.list = list;
+	job.ctm = ctm;
+	job.pix = pix;
+	job.proof_cs = proof_cs;
+	job.hints = hints;
+	job.cookie = cookie;
+
+	if (threads < 2 || pix->w <= 0 || pix->h <= 0 || mu_create_mutex(&job.mutex))
+	{
+		render_area(ctx, &job, fz_pixmap_bbox(ctx, pix), cookie);
+		return;
+	}
+
+	job.tile_size = MAX_TILE_SIZE;
+	for (;;)
+	{
+		job.cols = (pix->w + job.tile_size - 1) / job.tile_size;
+		rows = (pix->h + job.tile_size - 1) / job.tile_size;
+		if (job.tile_size <= MIN_TILE_SIZE || job.cols * rows >= threads * TILES_PER_THREAD)
+			break;
+		job.tile_size >>= 1;
+	}
+	job.count = job.cols * rows;
+
+	fz_try(ctx)
+		job.workers = fz_calloc(ctx, threads, sizeof(*job.workers));
+	fz_catch(ctx)
+	{
+		mu_destroy_mutex(&job.mutex);
+		fz_rethrow(ctx);
+	}
+
+	/* Give each worker a run of neighbouring tiles to start with. The
+	 * calling thread is worker 0. */
+	job.num_workers = threads;
+	per_worker = (job.count + threads - 1) / threads;
+	for (i = 0; i < threads; i++)
+	{
+		render_worker *w = &job.workers[i];
+		w->job = &job;
+		w->num = i;
+		w->next = fz_mini(i * per_worker, job.count);
+		w->end = fz_mini(w->next + per_worker, job.count);
+	}
+	job.workers[0].ctx = ctx;
+
+	/* Any worker we fail to start simply has its tiles stolen. */
+	for (i = 1; i < threads; i++)
+	{
+		render_worker *w = &job.workers[i];
+		w->ctx = fz_clone_context(ctx);
+		if (w->ctx && mu_create_thread(&w->thread, render_thread, w))
+		{
+			fz_drop_context(w->ctx);
+			w->ctx = NULL;
+		}
+	}
+
+	render_tiles(&job.workers[0]);
+
+	for (i = 1; i < threads; i++)
+	{
+		render_worker *w = &job.workers[i];
+		if (w->ctx)
+		{
+			mu_destroy_thread(&w->thread);
+			fz_drop_context(w->ctx);
+		}
+	}
+
+	if (cookie)
+	{
+		for (i = 0; i < threads; i++)
+			cookie->errors += job.workers[i].cookie.errors;
+	}
+
+	fz_free(ctx, job.workers);
+	mu_destroy_mutex(&job.mutex);
+}
+
+/* Fewest rows worth giving a halftoning thread. */
+#define MIN_HALFTONE_ROWS 64
+
+typedef struct
+{
+	fz_context *ctx;
+	fz_bitmap *bit;
+	fz_pixmap *pix;
+	fz_halftone *ht;
+	int band_start;
+	int y0, y1;
+	int failed;
+	mu_thread thread;
+} halftone_worker;
+
+static void
+halftone_rows(halftone_worker *me)
+{
+	fz_try(me->ctx)
+		fz_fill_bitmap_from_pixmap_band(me->ctx, me->bit, me->pix, me->ht, me->band_start, me->y0, me->y1);
+	fz_catch(me->ctx)
+		me->failed = 1;
+}
+
+static void
+halftone_thread(void *arg)
+{
+	halftone_rows((halftone_worker *)arg);
+}
+
+fz_bitmap *
+mu_new_bitmap_from_pixmap_band_parallel(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht, int band_start, int threads)
+{
+	halftone_worker *workers = NULL;
+	fz_halftone *ht_ = NULL;
+	fz_bitmap *bit = NULL;
+	int i, rows, failed = 0;
+
+	threads = fz_mini(threads, pix->h / MIN_HALFTONE_ROWS);
+	if (threads < 2)
+		return fz_new_bitmap_from_pixmap_band(ctx, pix, ht, band_start);
+
+	if (pix->alpha != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap may not have alpha channel to convert to bitmap");
+	if (pix->n != 1 && pix->n != 4)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or CMYK to convert to bitmap");
+
+	fz_var(workers);
+	fz_var(ht_);
+	fz_var(bit);
+
+	fz_try(ctx)
+	{
+		/* Make the default halftone once, so that all the threads
+		 * share its threshold plane. */
+		if (ht == NULL)
+			ht_ = ht = fz_default_halftone(ctx, pix->n);
+		bit = fz_new_bitmap(ctx, pix->w, pix->h, pix->n, pix->xres, pix->yres);
+		workers = fz_calloc(ctx, threads, sizeof(*workers));
+
+		rows = (pix->h + threads - 1) / threads;
+		for (i = 0; i < threads; i++)
+		{
+			halftone_worker *w = &workers[i];
+			w->bit = bit;
+			w->pix = pix;
+			w->ht = ht;
+			w->band_start = band_start;
+			w->y0 = fz_mini(i * rows, pix->h);
+			w->y1 = fz_mini(w->y0 + rows, pix->h);
+		}
+		workers[0].ctx = ctx;
+
+		/* The rows of any worker we fail to start are done at the end. */
+		for (i = 1; i < threads; i++)
+		{
+			halftone_worker *w = &workers[i];
+			w->ctx = fz_clone_context(ctx);
+			if (w->ctx && mu_create_thread(&w->thread, halftone_thread, w))
+			{
+				fz_drop_context(w->ctx);
+				w->ctx = NULL;
+			}
+		}
+
+		halftone_rows(&workers[0]);
+
+		for (i = 1; i < threads; i++)
+		{
+			halftone_worker *w = &workers[i];
+			if (w->ctx)
+			{
+				mu_destroy_thread(&w->thread);
+				fz_drop_context(w->ctx);
+			}
+			else
+			{
+				w->ctx = ctx;
+				halftone_rows(w);
+			}
+		}
+		for (i = 0; i < threads; i++)
+			failed |= workers[i].failed;
+		if (failed)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot halftone pixmap");
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, workers);
+		fz_drop_halftone(ctx, ht_);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_bitmap(ctx, bit);
+		fz_rethrow(ctx);
+	}
+
+	return bit;
+}
+
+typedef struct
+{
+	fz_parallel_job_fn *job;
+	void *job_arg;
+	int n;
+	int next;
+	mu_mutex mutex;
+} job_queue;
+
+typedef struct
+{
+	job_queue *queue;
+	fz_context *ctx;
+	mu_thread thread;
+} job_worker;
+
+static void
+run_jobs(fz_context *ctx, job_queue *queue)
+{
+	int i;
+
+	while (1)
+	{
+		mu_lock_mutex(&queue->mutex);
+		i = queue->next;
+		if (i < queue->n)
+			queue->next++;
+		mu_unlock_mutex(&queue->mutex);
+		if (i >= queue->n)
+			break;
+		queue->job(ctx, queue->job_arg, i);
+	}
+}
+
+static void
+job_thread(void *arg)
+{
+	job_worker *me = (job_worker *)arg;
+	run_jobs(me->ctx, me->queue);
+}
+
+void
+mu_run_parallel(void *arg, fz_context *ctx, int n, fz_parallel_job_fn *job, void *job_arg)
+{
+	job_worker *workers = NULL;
+	job_queue queue = { 0 };
+	int threads = arg ? *(int *)arg : 1;
+	int i;
+
+	threads = fz_mini(threads, n);
+	if (threads < 2 || mu_create_mutex(&queue.mutex))
+	{
+		for (i = 0; i < n; i++)
+			job(ctx, job_arg, i);
+		return;
+	}
+
+	queue.job = job;
+	queue.job_arg = job_arg;
+	queue.n = n;
+
+	fz_var(workers);
+
+	fz_try(ctx)
+	{
+		workers = fz_calloc(ctx, threads - 1, sizeof(*workers));
+
+		/* Jobs are taken from the queue in turn, so if a thread
+		 * fails to start the others just do more of them. */
+		for (i = 0; i < threads - 1; i++)
+		{
+			job_worker *w = &workers[i];
+			w->queue = &queue;
+			w->ctx = fz_clone_context(ctx);
+			if (w->ctx && mu_create_thread(&w->thread, job_thread, w))
+			{
+				fz_drop_context(w->ctx);
+				w->ctx = NULL;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		/* Whatever happened, run what is left here and wait for
+		 * the threads that did start. */
+		run_jobs(ctx, &queue);
+		for (i = 0; workers && i < threads - 1; i++)
+		{
+			if (workers[i].ctx)
+			{
+				mu_destroy_thread(&workers[i].thread);
+				fz_drop_context(workers[i].ctx);
+			}
+		}
+		fz_free(ctx, workers);
+		mu_destroy_mutex(&queue.mutex);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
@@ -1331,7 +1331,9 @@ pdf_load_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *dict)
 		if (type3)
 			pdf_load_type3_glyphs(ctx, doc, fontdesc);
 
-		pdf_store_item(ctx, dict, fontdesc, fontdesc->size);
+		/* Fonts are expensive to reload (parsing, cmaps, widths), so
+		 * ask the store to favour them over cheaper items. */
+		pdf_store_item_with_cost(ctx, dict, fontdesc, fontdesc->size, fontdesc->size * 4);
 	}
 	fz_always(ctx)
 		pdf_unmark_obj(ctx, dict);
@@ -57,16 +57,23 @@ static const fz_store_type pdf_obj_store_type =
 	pdf_drop_key,
 	pdf_cmp_key,
 	pdf_format_key,
-	NULL
+	NULL,
+	"pdf object"
 };
 
 void
 pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, size_t itemsize)
+{
+	pdf_store_item_with_cost(ctx, key, val, itemsize, itemsize);
+}
+
+void
+pdf_store_item_with_cost(fz_context *ctx, pdf_obj *key, void *val, size_t itemsize, size_t cost)
 {
 	void *existing;
 
 	assert(pdf_is_name(ctx, key) || pdf_is_array(ctx, key) || pdf_is_dict(ctx, key) || pdf_is_indirect(ctx, key));
-	existing = fz_store_item(ctx, key, val, itemsize, &pdf_obj_store_type);
+	existing = fz_store_item_with_cost(ctx, key, val, itemsize, cost, &pdf_obj_store_type);
 	assert(existing == NULL);
 	(void)existing; /* Silence warning in release builds */
 }
@@ -0,0 +1,267 @@
+/*
+ * alloc-cache-test - Check the allocation cache.
+ *
+ * The library is normally built without the cache, so this includes
+ * memory.c itself, built with FZ_ENABLE_ALLOC_CACHE=1, and looks at its
+ * internals. It checks that:
+ *
+ *	a block allocated in a clone and freed in its parent is recycled
+ *	by the parent;
+ *
+ *	blocks freed beyond a full magazine go to the depot, and from
+ *	there serve another context without asking the allocator again;
+ *
+ *	when the allocator runs out, chunks whose blocks are all free are
+ *	given back to it, and a chunk with a block in use is kept;
+ *
+ *	everything is given back once the last context is dropped.
+ *
+ * usage: alloc-cache-test
+ */
+
+#define FZ_ENABLE_ALLOC_CACHE 1
+
+#include "../fitz/memory.c"
+
+#include <pthread.h>
+
+static pthread_mutex_t mutexes[FZ_LOCK_MAX];
+
+static void
+lock(void *user, int lock)
+{
+	pthread_mutex_lock(&mutexes[lock]);
+}
+
+static void
+unlock(void *user, int lock)
+{
+	pthread_mutex_unlock(&mutexes[lock]);
+}
+
+static fz_locks_context locks = { NULL, lock, unlock };
+
+/* A malloc that keeps count, and can be made to fail beyond a limit. */
+typedef struct
+{
+	size_t used;
+	size_t limit;
+	int blocks;
+	int calls;
+} counter;
+
+typedef struct
+{
+	size_t size;
+	double align;
+} counted_header;
+
+static void *
+counted_malloc(void *user, size_t size)
+{
+	counter *c = user;
+	counted_header *h;
+
+	c->calls++;
+	if (c->limit && c->used + size > c->limit)
+		return NULL;
+	h = malloc(sizeof(*h) + size);
+	if (h == NULL)
+		return NULL;
+	h->size = size;
+	c->used += size;
+	c->blocks++;
+	return h + 1;
+}
+
+static void
+counted_free(void *user, void *p)
+{
+	counter *c = user;
+	counted_header *h;
+
+	if (p == NULL)
+		return;
+	h = (counted_header *)p - 1;
+	c->used -= h->size;
+	c->blocks--;
+	free(h);
+}
+
+static void *
+counted_realloc(void *user, void *p, size_t size)
+{
+	counted_header *h;
+	void *q;
+
+	if (p == NULL)
+		return counted_malloc(user, size);
+	h = (counted_header *)p - 1;
+	q = counted_malloc(user, size);
+	if (q == NULL)
+		return NULL;
+	memcpy(q, p, fz_minz(h->size, size));
+	counted_free(user, p);
+	return q;
+}
+
+static counter count;
+static fz_alloc_context alloc = { &count, counted_malloc, counted_realloc, counted_free };
+
+static int failed = 0;
+
+#define CHECK(X) do { if (!(X)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); failed++; } } while (0)
+
+static int
+list_length(fz_alloc_header *hdr)
+{
+	int n = 0;
+	for (; hdr; hdr = hdr->next)
+		n++;
+	return n;
+}
+
+static int
+on_list(fz_alloc_header *list, void *p)
+{
+	fz_alloc_header *hdr = (fz_alloc_header *)p - 1;
+	for (; list; list = list->next)
+		if (list == hdr)
+			return 1;
+	return 0;
+}
+
+/* A block allocated in a clone, and freed in its parent. */
+static void
+test_cross_context(fz_context *ctx)
+{
+	fz_context *clone = fz_clone_context(ctx);
+	void *p, *q;
+	int cls = 2;
+
+	CHECK(clone != NULL);
+	if (!clone)
+		return;
+	CHECK(clone->alloc_cache->depot == ctx->alloc_cache->depot);
+
+	p = fz_malloc(clone, class_size(cls));
+	CHECK(((fz_alloc_header *)p - 1)->cls == (size_t)cls);
+	fz_free(ctx, p);
+	CHECK(on_list(ctx->alloc_cache->free[cls], p));
+	CHECK(!on_list(clone->alloc_cache->free[cls], p));
+
+	q = fz_malloc(ctx, class_size(cls));
+	CHECK(q == p);
+	fz_free(ctx, q);
+
+	fz_drop_context(clone);
+}
+
+/* Blocks overflowing a magazine go to the depot, and another context
+ * takes them from there. */
+static void
+test_depot(fz_context *ctx)
+{
+	enum { N = 3 * FZ_ALLOC_CACHE_MAGAZINE };
+	fz_alloc_cache *cache = ctx->alloc_cache;
+	fz_alloc_depot *depot = cache->depot;
+	fz_context *clone;
+	void *blocks[N];
+	int cls = 5, i, calls, chunks;
+
+	for (i = 0; i < N; i++)
+		blocks[i] = fz_malloc(ctx, class_size(cls));
+	for (i = 0; i < N; i++)
+		fz_free(ctx, blocks[i]);
+	CHECK(cache->count[cls] <= FZ_ALLOC_CACHE_MAGAZINE);
+	CHECK(cache->count[cls] == list_length(cache->free[cls]));
+	CHECK(list_length(depot->free[cls]) >= N - FZ_ALLOC_CACHE_MAGAZINE);
+
+	clone = fz_clone_context(ctx);
+	CHECK(clone != NULL);
+	if (!clone)
+		return;
+
+	chunks = list_length(depot->chunks[cls]);
+	calls = count.calls;
+	for (i = 0; i < FZ_ALLOC_CACHE_MAGAZINE; i++)
+	{
+		blocks[i] = fz_malloc(clone, class_size(cls));
+		CHECK(!on_list(depot->free[cls], blocks[i]));
+	}
+	CHECK(count.calls == calls);
+	CHECK(list_length(depot->chunks[cls]) == chunks);
+
+	for (i = 0; i < FZ_ALLOC_CACHE_MAGAZINE; i++)
+		fz_free(clone, blocks[i]);
+	fz_drop_context(clone);
+	for (i = 0; i < FZ_ALLOC_CACHE_MAGAZINE; i++)
+		CHECK(on_list(depot->free[cls], blocks[i]));
+}
+
+/* An allocation that only fits once idle chunks are given back. */
+static void
+test_release(fz_context *ctx)
+{
+	enum { N = 2 * (FZ_ALLOC_CACHE_CHUNK / 16) };
+	fz_alloc_depot *depot = ctx->alloc_cache->depot;
+	void *blocks[N];
+	void *keep, *big;
+	int cls = 0, i;
+
+	/* Enough blocks to need several chunks, of which only the one
+	 * holding the block that is kept stays in use. */
+	for (i = 0; i < N; i++)
+		blocks[i] = fz_malloc(ctx, class_size(cls));
+	keep = blocks[N / 2];
+	for (i = 0; i < N; i++)
+		if (blocks[i] != keep)
+			fz_free(ctx, blocks[i]);
+	CHECK(list_length(depot->chunks[cls]) >= 3);
+
+	count.limit = count.used + FZ_ALLOC_CACHE_CHUNK;
+	big = fz_malloc_no_throw(ctx, 2 * FZ_ALLOC_CACHE_CHUNK);
+	count.limit = 0;
+	CHECK(big != NULL);
+	fz_free(ctx, big);
+
+	CHECK(list_length(depot->chunks[cls]) == 1);
+	if (depot->chunks[cls])
+	{
+		char *chunk = (char *)depot->chunks[cls];
+		CHECK((char *)keep > chunk && (char *)keep < chunk + FZ_ALLOC_CACHE_CHUNK);
+	}
+	fz_free(ctx, keep);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	int i;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+
+	ctx = fz_new_context(&alloc, &locks, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	test_cross_context(ctx);
+	test_depot(ctx);
+	test_release(ctx);
+
+	fz_drop_context(ctx);
+	CHECK(count.blocks == 0);
+	CHECK(count.used == 0);
+
+	if (failed)
+	{
+		fprintf(stderr, "%d checks failed\n", failed);
+		return EXIT_FAILURE;
+	}
+	printf("allocation cache checks passed\n");
+	return EXIT_SUCCESS;
+}
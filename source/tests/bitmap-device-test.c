@@ -0,0 +1,305 @@
+/*
+ * bitmap-device-test - Check that drawing with the bitmap device gives
+ * exactly the same bits as drawing into a gray band and halftoning it.
+ *
+ * Random scenes of black and white fills, strokes and rectangular clips
+ * are drawn in bands, with the occasional gray fill, translucent fill or
+ * image to switch the bitmap device over to contone part way through a
+ * band. Each band is drawn both ways, and the bits are compared. The
+ * band given to the bitmap device is filled with garbage first, as the
+ * device must not rely on it being clear.
+ *
+ * Anti-aliasing is turned off: with it on, pixels may differ where black
+ * and white anti-aliased edges overlap.
+ *
+ * usage: bitmap-device-test [number of scenes]
+ */
+
+#include "mupdf/fitz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_W 200
+#define PAGE_H 150
+#define ZOOM 2.3f
+#define BAND_H 64
+
+static unsigned int seed;
+
+static unsigned int
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) & 0xffffff;
+}
+
+static float
+frnd(float a, float b)
+{
+	return a + (b - a) * (rnd() & 0xffff) / 65535.0f;
+}
+
+static fz_path *
+rand_path(fz_context *ctx)
+{
+	fz_path *path = fz_new_path(ctx);
+	int i, n = 2 + rnd() % 5;
+
+	if (rnd() % 3 == 0)
+	{
+		float x = frnd(-20, PAGE_W), y = frnd(-20, PAGE_H);
+		fz_rectto(ctx, path, x, y, x + frnd(0.2f, PAGE_W / 2), y + frnd(0.2f, PAGE_H / 2));
+		return path;
+	}
+	fz_moveto(ctx, path, frnd(-20, PAGE_W + 20), frnd(-20, PAGE_H + 20));
+	for (i = 0; i < n; i++)
+	{
+		if (rnd() % 3 == 0)
+			fz_curveto(ctx, path,
+				frnd(-20, PAGE_W + 20), frnd(-20, PAGE_H + 20),
+				frnd(-20, PAGE_W + 20), frnd(-20, PAGE_H + 20),
+				frnd(-20, PAGE_W + 20), frnd(-20, PAGE_H + 20));
+		else
+			fz_lineto(ctx, path, frnd(-20, PAGE_W + 20), frnd(-20, PAGE_H + 20));
+	}
+	fz_closepath(ctx, path);
+	return path;
+}
+
+static fz_image *
+rand_image(fz_context *ctx)
+{
+	int w = 1 + rnd() % 8, h = 1 + rnd() % 8, i;
+	fz_pixmap *pix = fz_new_pixmap(ctx, fz_device_gray(ctx), w, h, NULL, 0);
+	fz_image *image = NULL;
+
+	for (i = 0; i < w * h; i++)
+		pix->samples[i] = rnd() & 0xff;
+	fz_try(ctx)
+		image = fz_new_image_from_pixmap(ctx, pix, NULL);
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return image;
+}
+
+/* Mostly black or white, in a few colorspaces, and now and then a shade
+ * of gray. */
+static fz_colorspace *
+rand_color(fz_context *ctx, float *color)
+{
+	int ink = rnd() % 2;
+
+	switch (rnd() % 7)
+	{
+	default:
+		color[0] = ink;
+		return fz_device_gray(ctx);
+	case 4:
+		color[0] = color[1] = color[2] = ink;
+		return fz_device_rgb(ctx);
+	case 5:
+		color[0] = color[1] = color[2] = 0;
+		color[3] = !ink;
+		return fz_device_cmyk(ctx);
+	case 6:
+		color[0] = frnd(0, 1);
+		return fz_device_gray(ctx);
+	}
+}
+
+static void
+draw_scene(fz_context *ctx, fz_device *dev, unsigned int scene)
+{
+	fz_stroke_state *stroke;
+	fz_image *image;
+	fz_path *path;
+	fz_colorspace *cs;
+	float color[4];
+	int i, clips = 0;
+
+	seed = scene;
+	for (i = 0; i < 16; i++)
+	{
+		fz_matrix ctm = fz_identity;
+		float alpha = rnd() % 8 ? 1 : frnd(0, 1);
+
+		if (rnd() % 4 == 0)
+		{
+			ctm = fz_pre_rotate(fz_translate(PAGE_W / 2, PAGE_H / 2), frnd(-180, 180));
+			ctm = fz_pre_translate(ctm, -PAGE_W / 2, -PAGE_H / 2);
+		}
+
+		switch (rnd() % 10)
+		{
+		case 0: case 1: case 2: case 3:
+			path = rand_path(ctx);
+			cs = rand_color(ctx, color);
+			fz_fill_path(ctx, dev, path, rnd() % 2, ctm, cs, color, alpha, NULL);
+			fz_drop_path(ctx, path);
+			break;
+		case 4: case 5: case 6:
+			path = rand_path(ctx);
+			stroke = fz_new_stroke_state(ctx);
+			stroke->linewidth = rnd() % 3 ? frnd(0, 1) : frnd(1, 8);
+			stroke->linejoin = rnd() % 3;
+			stroke->start_cap = stroke->end_cap = rnd() % 3;
+			cs = rand_color(ctx, color);
+			fz_stroke_path(ctx, dev, path, stroke, ctm, cs, color, alpha, NULL);
+			fz_drop_stroke_state(ctx, stroke);
+			fz_drop_path(ctx, path);
+			break;
+		case 7: case 8:
+			path = fz_new_path(ctx);
+			fz_rectto(ctx, path, frnd(-20, PAGE_W / 2), frnd(-20, PAGE_H / 2), frnd(PAGE_W / 2, PAGE_W + 20), frnd(PAGE_H / 2, PAGE_H + 20));
+			fz_clip_path(ctx, dev, path, 0, fz_identity, fz_infinite_rect);
+			fz_drop_path(ctx, path);
+			clips++;
+			break;
+		case 9:
+			if (rnd() % 3)
+				break;
+			image = rand_image(ctx);
+			ctm = fz_make_matrix(frnd(2, PAGE_W / 2), 0, 0, frnd(2, PAGE_H / 2), frnd(-10, PAGE_W), frnd(-10, PAGE_H));
+			fz_fill_image(ctx, dev, image, ctm, 1, NULL);
+			fz_drop_image(ctx, image);
+			break;
+		}
+	}
+	while (clips-- > 0)
+		fz_pop_clip(ctx, dev);
+}
+
+/* Draw one band of a scene, either halftoning a gray band, or with the
+ * bitmap device. */
+static fz_bitmap *
+render_band(fz_context *ctx, unsigned int scene, fz_irect band, int direct)
+{
+	fz_matrix ctm = fz_scale(ZOOM, ZOOM);
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), band, NULL, 0);
+	fz_bitmap *bit = NULL;
+	fz_device *dev = NULL;
+	size_t i, len = (size_t)pix->stride * pix->h;
+
+	fz_var(bit);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		if (direct)
+		{
+			for (i = 0; i < len; i++)
+				pix->samples[i] = rnd() & 0xff;
+			bit = fz_new_bitmap(ctx, pix->w, pix->h, 1, 72, 72);
+			dev = fz_new_draw_device_with_bitmap(ctx, ctm, pix, bit, band.y0);
+			draw_scene(ctx, dev, scene);
+			fz_close_device(ctx, dev);
+		}
+		else
+		{
+			fz_clear_pixmap_with_value(ctx, pix, 255);
+			dev = fz_new_draw_device(ctx, ctm, pix);
+			draw_scene(ctx, dev, scene);
+			fz_close_device(ctx, dev);
+			bit = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL, band.y0);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_bitmap(ctx, bit);
+		fz_rethrow(ctx);
+	}
+
+	return bit;
+}
+
+/* Count the pixels that differ, ignoring the padding at the end of each row. */
+static int
+compare_bitmaps(fz_bitmap *a, fz_bitmap *b)
+{
+	int x, y, count = 0;
+
+	for (y = 0; y < a->h; y++)
+	{
+		unsigned char *pa = a->samples + y * (size_t)a->stride;
+		unsigned char *pb = b->samples + y * (size_t)b->stride;
+		for (x = 0; x < a->w; x++)
+			if ((pa[x>>3] ^ pb[x>>3]) & (0x80 >> (x & 7)))
+				count++;
+	}
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	int scenes = argc > 1 ? atoi(argv[1]) : 200;
+	int i, failed = 0;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+	fz_set_aa_level(ctx, 0);
+
+	fz_try(ctx)
+	{
+		fz_irect page = fz_round_rect(fz_transform_rect(fz_make_rect(0, 0, PAGE_W, PAGE_H), fz_scale(ZOOM, ZOOM)));
+		int y;
+
+		for (i = 0; i < scenes; i++)
+		{
+			int count = 0;
+
+			for (y = page.y0; y < page.y1; y += BAND_H)
+			{
+				fz_irect band = fz_make_irect(page.x0, y, page.x1, fz_mini(y + BAND_H, page.y1));
+				fz_bitmap *gray = render_band(ctx, i, band, 0);
+				fz_bitmap *direct = NULL;
+
+				fz_try(ctx)
+				{
+					direct = render_band(ctx, i, band, 1);
+					count += compare_bitmaps(gray, direct);
+				}
+				fz_always(ctx)
+				{
+					fz_drop_bitmap(ctx, gray);
+					fz_drop_bitmap(ctx, direct);
+				}
+				fz_catch(ctx)
+					fz_rethrow(ctx);
+			}
+			if (count)
+			{
+				fprintf(stderr, "scene %d: %d pixels differ\n", i, count);
+				failed++;
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed++;
+	}
+
+	fz_drop_context(ctx);
+
+	if (failed)
+	{
+		fprintf(stderr, "%d of %d scenes drawn differently by the bitmap device\n", failed, scenes);
+		return EXIT_FAILURE;
+	}
+	printf("%d scenes drawn identically\n", scenes);
+	return EXIT_SUCCESS;
+}
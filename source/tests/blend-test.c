@@ -0,0 +1,185 @@
+/*
+ * blend-test - Check that the SIMD blend kernels give exactly the same
+ * pixels as the plain C code.
+ *
+ * Every blend mode is run for gray, rgb and cmyk pixmaps with and without
+ * alpha, isolated and not, at full and partial group alpha, and through
+ * the knockout blender. Each case is blended once with all SIMD
+ * instruction sets masked off, and once with everything the machine has,
+ * and the results are compared byte for byte.
+ *
+ * usage: blend-test
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/fitz-imp.h"
+#include "../fitz/draw-imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Odd, so that every kernel has a tail to deal with. */
+#define W 77
+#define H 5
+
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xffffff) % n;
+}
+
+/* Fill a pixmap with premultiplied samples, including fully transparent
+ * and fully opaque pixels. */
+static void
+fill_random(fz_pixmap *pix)
+{
+	int x, y, k, c = pix->n - pix->alpha;
+
+	for (y = 0; y < pix->h; y++)
+	{
+		unsigned char *s = pix->samples + y * (size_t)pix->stride;
+		for (x = 0; x < pix->w; x++)
+		{
+			int a = 255;
+			if (pix->alpha)
+			{
+				switch (rnd(4))
+				{
+				case 0: a = 0; break;
+				case 1: a = 255; break;
+				default: a = rnd(256); break;
+				}
+			}
+			for (k = 0; k < c; k++)
+				*s++ = (unsigned char)fz_mul255(rnd(256), a);
+			if (pix->alpha)
+				*s++ = a;
+		}
+	}
+}
+
+static fz_pixmap *
+copy_pixmap(fz_context *ctx, fz_pixmap *pix)
+{
+	fz_pixmap *copy = fz_new_pixmap_with_bbox(ctx, pix->colorspace, fz_pixmap_bbox(ctx, pix), NULL, pix->alpha);
+	memcpy(copy->samples, pix->samples, (size_t)pix->stride * pix->h);
+	return copy;
+}
+
+/* Blend with and without SIMD, and count the samples that differ. */
+static int
+compare(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, fz_pixmap *shape, int alpha, int blendmode, int isolated, int knockout)
+{
+	fz_pixmap *out[2] = { NULL, NULL };
+	fz_pixmap *in;
+	size_t k, len = (size_t)dst->stride * dst->h;
+	int i, count = 0;
+
+	for (i = 0; i < 2; i++)
+	{
+		fz_mask_cpu_features(i ? 0 : ~0);
+		/* Isolated groups with alpha scale the source in place. */
+		in = copy_pixmap(ctx, src);
+		out[i] = copy_pixmap(ctx, dst);
+		if (knockout)
+			fz_blend_pixmap_knockout(ctx, out[i], in, shape);
+		else
+			fz_blend_pixmap(ctx, out[i], in, alpha, blendmode, isolated, shape);
+		fz_drop_pixmap(ctx, in);
+	}
+	fz_mask_cpu_features(0);
+
+	for (k = 0; k < len; k++)
+		if (out[0]->samples[k] != out[1]->samples[k])
+			count++;
+
+	fz_drop_pixmap(ctx, out[0]);
+	fz_drop_pixmap(ctx, out[1]);
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *cs_names[] = { "gray", "rgb", "cmyk" };
+	fz_context *ctx;
+	fz_colorspace *cs[3];
+	int c, da, sa, bm, isolated, a, cases = 0, failed = 0;
+	static const int alphas[] = { 255, 128 };
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	cs[0] = fz_device_gray(ctx);
+	cs[1] = fz_device_rgb(ctx);
+	cs[2] = fz_device_cmyk(ctx);
+
+	if (!(fz_cpu_features() & FZ_CPU_AVX2))
+		printf("no AVX2 on this machine; only the C code is run\n");
+
+	fz_try(ctx)
+	{
+		for (c = 0; c < 3; c++)
+		for (da = 0; da < 2; da++)
+		for (sa = 0; sa < 2; sa++)
+		{
+			fz_pixmap *dst = fz_new_pixmap(ctx, cs[c], W, H, NULL, da);
+			fz_pixmap *src = fz_new_pixmap(ctx, cs[c], W, H, NULL, sa);
+			fz_pixmap *shape = fz_new_pixmap(ctx, NULL, W, H, NULL, 1);
+			int count;
+
+			fill_random(dst);
+			fill_random(src);
+			fill_random(shape);
+
+			for (bm = 0; bm < FZ_BLEND_MODEMASK + 1; bm++)
+			for (isolated = 0; isolated < 2; isolated++)
+			for (a = 0; a < (int)nelem(alphas); a++)
+			{
+				count = compare(ctx, dst, src, shape, alphas[a], bm, isolated, 0);
+				cases++;
+				if (count)
+				{
+					fprintf(stderr, "%s da=%d sa=%d %s %s alpha=%d: %d samples differ\n",
+						cs_names[c], da, sa, fz_blendmode_name(bm),
+						isolated ? "isolated" : "non-isolated", alphas[a], count);
+					failed++;
+				}
+			}
+
+			count = compare(ctx, dst, src, shape, 255, 0, 0, 1);
+			cases++;
+			if (count)
+			{
+				fprintf(stderr, "%s da=%d sa=%d knockout: %d samples differ\n", cs_names[c], da, sa, count);
+				failed++;
+			}
+
+			fz_drop_pixmap(ctx, dst);
+			fz_drop_pixmap(ctx, src);
+			fz_drop_pixmap(ctx, shape);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed++;
+	}
+
+	fz_drop_context(ctx);
+
+	if (failed)
+	{
+		fprintf(stderr, "%d of %d blends differ between SIMD and C\n", failed, cases);
+		return EXIT_FAILURE;
+	}
+	printf("%d blends identical between SIMD and C\n", cases);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+/*
+ * glyph-bench - Time glyph cache lookups from several threads at once.
+ *
+ * Each thread clones the context and looks up the same set of glyphs
+ * over and over, as threads rendering the pages of one document do. The
+ * cache is filled first, so nearly every lookup is a hit, and what is
+ * measured is the cost of finding a glyph and of the locking around it.
+ * The number of lookups per second (of wall clock time) is printed for
+ * each number of threads, along with the speedup over one thread.
+ *
+ * usage: glyph-bench [max threads [lookups per thread, in thousands]]
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/glyph-cache-imp.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define GLYPHS 200
+
+static pthread_mutex_t mutexes[FZ_LOCK_MAX];
+
+static void
+lock(void *user, int lock)
+{
+	pthread_mutex_lock(&mutexes[lock]);
+}
+
+static void
+unlock(void *user, int lock)
+{
+	pthread_mutex_unlock(&mutexes[lock]);
+}
+
+static fz_locks_context locks = { NULL, lock, unlock };
+
+typedef struct
+{
+	fz_context *ctx;
+	fz_font *font;
+	long lookups;
+	int failed;
+} worker;
+
+/* Look up glyphs of a few sizes and subpixel offsets, as running text
+ * would. */
+static void
+lookup_glyphs(fz_context *ctx, fz_font *font, long count)
+{
+	long i;
+
+	for (i = 0; i < count; i++)
+	{
+		int gid = 1 + i % GLYPHS;
+		float size = 9 + (i / GLYPHS) % 4;
+		fz_matrix ctm = fz_make_matrix(size, 0, 0, -size, 10 + (i % 3) * 0.33f, 20);
+		fz_glyph *glyph = fz_render_glyph(ctx, font, gid, &ctm, NULL, &fz_infinite_irect, 0, 8);
+		fz_drop_glyph(ctx, glyph);
+	}
+}
+
+static void *
+run_worker(void *arg)
+{
+	worker *w = arg;
+
+	fz_try(w->ctx)
+		lookup_glyphs(w->ctx, w->font, w->lookups);
+	fz_catch(w->ctx)
+		w->failed = 1;
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run n threads doing the given number of lookups each, and return
+ * the total number of lookups per second. */
+static double
+measure(fz_context *ctx, fz_font *font, int n, long lookups)
+{
+	worker *w = fz_malloc_array(ctx, n, sizeof(*w));
+	pthread_t *thread = fz_malloc_array(ctx, n, sizeof(*thread));
+	double start, secs;
+	int i, failed = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		w[i].ctx = fz_clone_context(ctx);
+		w[i].font = font;
+		w[i].lookups = lookups;
+		w[i].failed = 0;
+	}
+
+	start = now();
+	for (i = 0; i < n; i++)
+		pthread_create(&thread[i], NULL, run_worker, &w[i]);
+	for (i = 0; i < n; i++)
+		pthread_join(thread[i], NULL);
+	secs = now() - start;
+
+	for (i = 0; i < n; i++)
+	{
+		failed |= w[i].failed;
+		fz_drop_context(w[i].ctx);
+	}
+	fz_free(ctx, thread);
+	fz_free(ctx, w);
+
+	if (failed)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "glyph lookup failed");
+	if (secs <= 0)
+		secs = 1e-9;
+	return n * (double)lookups / secs;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	long lookups = (argc > 2 ? atol(argv[2]) : 2000) * 1000;
+	fz_context *ctx;
+	fz_font *font = NULL;
+	int i, failed = 0;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+
+	ctx = fz_new_context(NULL, &locks, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_var(font);
+
+	fz_try(ctx)
+	{
+		const unsigned char *data;
+		double base = 0;
+		int len, n;
+
+		data = fz_lookup_base14_font(ctx, "Times-Roman", &len);
+		if (!data)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find builtin font");
+		font = fz_new_font_from_memory(ctx, NULL, data, len, 0, 0);
+
+		/* Fill the cache. */
+		lookup_glyphs(ctx, font, 4 * 3 * GLYPHS);
+
+		printf("%-8s %14s %8s\n", "threads", "lookups/s", "speedup");
+		for (n = 1; n <= max_threads; n *= 2)
+		{
+			double rate = measure(ctx, font, n, lookups / n);
+			if (n == 1)
+				base = rate;
+			printf("%-8d %14.0f %7.2fx\n", n, rate, rate / base);
+		}
+	}
+	fz_always(ctx)
+		fz_drop_font(ctx, font);
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed = 1;
+	}
+
+	fz_drop_context(ctx);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
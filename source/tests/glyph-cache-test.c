@@ -0,0 +1,201 @@
+/*
+ * glyph-cache-test - Check that the glyph cache shares glyphs between
+ * documents that embed the same font.
+ *
+ * Each "document" loads its own copy of the same font file, and draws a
+ * line of text with it. With digest keys, the second document is drawn
+ * entirely from glyphs cached by the first, even though the first has
+ * been dropped by then. Without them, nothing is shared.
+ *
+ * It also fills the cache several times over with large glyphs, looking
+ * one of them up again after every other lookup. CLOCK eviction must
+ * keep that glyph, evict the ones that are not looked up again, and keep
+ * every shard within its limit.
+ *
+ * usage: glyph-cache-test
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/glyph-cache-imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define GLYPHS 40
+
+static int failed = 0;
+
+#define CHECK(X) do { if (!(X)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); failed++; } } while (0)
+
+/* Load a private copy of the font file, as a document embedding it
+ * would, and draw some of its glyphs. */
+static void
+draw_document(fz_context *ctx, const unsigned char *data, int len)
+{
+	fz_buffer *buf = NULL;
+	fz_font *font = NULL;
+	fz_text *text = NULL;
+	fz_pixmap *pix = NULL;
+	fz_device *dev = NULL;
+	const float black[1] = { 0 };
+	int gid;
+
+	fz_var(buf);
+	fz_var(font);
+	fz_var(text);
+	fz_var(pix);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer_from_copied_data(ctx, data, len);
+		font = fz_new_font_from_buffer(ctx, NULL, buf, 0, 0);
+		text = fz_new_text(ctx);
+		for (gid = 1; gid <= GLYPHS; gid++)
+			fz_show_glyph(ctx, text, font, fz_make_matrix(12, 0, 0, -12, gid * 10, 20), gid, gid, 0, 0, FZ_BIDI_LTR, FZ_LANG_UNSET);
+
+		pix = fz_new_pixmap(ctx, fz_device_gray(ctx), GLYPHS * 10 + 20, 30, NULL, 0);
+		fz_clear_pixmap_with_value(ctx, pix, 255);
+		dev = fz_new_draw_device(ctx, fz_identity, pix);
+		fz_fill_text(ctx, dev, text, fz_identity, fz_device_gray(ctx), black, 1, NULL);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_text(ctx, text);
+		fz_drop_font(ctx, font);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Draw two documents, and return the hits and inserts for the second. */
+static void
+draw_two_documents(fz_context *ctx, int digest_keys, size_t *hits, size_t *inserts)
+{
+	fz_glyph_cache_stats before, after;
+	const unsigned char *data;
+	int len;
+
+	fz_purge_glyph_cache(ctx);
+	fz_set_glyph_cache_digest_keys(ctx, digest_keys);
+	data = fz_lookup_base14_font(ctx, "Times-Roman", &len);
+	if (!data)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find builtin font");
+
+	draw_document(ctx, data, len);
+	fz_get_glyph_cache_stats(ctx, &before);
+	draw_document(ctx, data, len);
+	fz_get_glyph_cache_stats(ctx, &after);
+
+	*hits = after.hits - before.hits;
+	*inserts = after.inserts - before.inserts;
+}
+
+static fz_glyph_cache_stats
+render_glyph(fz_context *ctx, fz_font *font, int gid, float size)
+{
+	fz_glyph_cache_stats stats;
+	fz_matrix ctm = fz_make_matrix(size, 0, 0, -size, 0, 0);
+
+	fz_drop_glyph(ctx, fz_render_glyph(ctx, font, gid, &ctm, NULL, &fz_infinite_irect, 0, 8));
+	fz_get_glyph_cache_stats(ctx, &stats);
+	return stats;
+}
+
+/* Keep one glyph in use while the cache overflows with others. */
+static void
+test_clock_eviction(fz_context *ctx)
+{
+	const unsigned char *data;
+	fz_glyph_cache_stats start, stats, before;
+	fz_font *font;
+	int len, i;
+
+	fz_purge_glyph_cache(ctx);
+	fz_set_glyph_cache_digest_keys(ctx, 0);
+	data = fz_lookup_base14_font(ctx, "Times-Roman", &len);
+	if (!data)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find builtin font");
+	font = fz_new_font_from_memory(ctx, NULL, data, len, 0, 0);
+
+	fz_try(ctx)
+	{
+		/* Glyphs this large are cached on their own rather than in
+		 * an atlas page, which would be evicted as a whole. */
+		fz_get_glyph_cache_stats(ctx, &start);
+		render_glyph(ctx, font, 40, 150);
+		stats = render_glyph(ctx, font, 41, 150);
+		CHECK(stats.inserts == start.inserts + 2);
+
+		for (i = 0; stats.evicted - start.evicted < 3 * stats.max; i++)
+		{
+			render_glyph(ctx, font, 42 + i % 60, 100 + i / 60);
+			before = render_glyph(ctx, font, 40, 150);
+			CHECK(before.size <= before.max);
+			stats = before;
+		}
+		CHECK(stats.evictions > start.evictions);
+
+		/* The glyph that kept being looked up was never evicted and
+		 * inserted again... */
+		CHECK(stats.inserts == start.inserts + 2 + i);
+		stats = render_glyph(ctx, font, 40, 150);
+		CHECK(stats.hits == before.hits + 1);
+		CHECK(stats.inserts == before.inserts);
+
+		/* ...and the one that was not is gone. */
+		before = stats;
+		stats = render_glyph(ctx, font, 41, 150);
+		CHECK(stats.hits == before.hits);
+		CHECK(stats.inserts == before.inserts + 1);
+	}
+	fz_always(ctx)
+		fz_drop_font(ctx, font);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	size_t hits, inserts;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		draw_two_documents(ctx, 1, &hits, &inserts);
+		CHECK(hits == GLYPHS);
+		CHECK(inserts == 0);
+
+		draw_two_documents(ctx, 0, &hits, &inserts);
+		CHECK(hits == 0);
+		CHECK(inserts == GLYPHS);
+
+		test_clock_eviction(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed++;
+	}
+
+	fz_drop_context(ctx);
+
+	if (failed)
+	{
+		fprintf(stderr, "%d checks failed\n", failed);
+		return EXIT_FAILURE;
+	}
+	printf("glyph cache checks passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/*
+ * image-bench - Time the SIMD image painters against the C versions.
+ *
+ * Paints a large image with fz_paint_image at common scale factors and
+ * rotations, with interpolation off and allowed, for gray and rgb images
+ * onto rgba and for cmyk images onto cmyk. (Unrotated downscales are
+ * painted nearest neighbour even when interpolation is allowed.)
+ *
+ * Each case is run with the SIMD instruction sets masked off and with
+ * everything the machine has; the outputs are checked to be identical
+ * and the throughput of each (in destination pixels, including clearing
+ * the destination) is printed.
+ *
+ * usage: image-bench [megapixels per measurement]
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/fitz-imp.h"
+#include "../fitz/draw-imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define IMG_W 1024
+#define IMG_H 768
+
+static const float scales[] = { 0.5f, 1, 1.5f, 2, 3 };
+static const float rotations[] = { 0, 90, 15 };
+
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xffffff) % n;
+}
+
+/* A smooth image with some noise, so that interpolation has work to do. */
+static fz_pixmap *
+make_image(fz_context *ctx, fz_colorspace *cs)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, IMG_W, IMG_H, NULL, 0);
+	unsigned char *s = pix->samples;
+	int x, y, k;
+
+	for (y = 0; y < IMG_H; y++)
+		for (x = 0; x < IMG_W; x++)
+			for (k = 0; k < pix->n; k++)
+				*s++ = (unsigned char)((x * (k + 1) + y * (3 - k) + rnd(16)) & 255);
+	return pix;
+}
+
+/* Megapixels per second of painting the image. The painted result is
+ * left in dst. */
+static double
+measure(fz_context *ctx, fz_pixmap *img, fz_pixmap *dst, fz_matrix ctm, int lerp, double megapixels)
+{
+	fz_irect bbox = fz_pixmap_bbox(ctx, dst);
+	double area = (double)dst->w * dst->h;
+	long i, iters = (long)(megapixels * 1e6 / area);
+	clock_t start;
+	double secs;
+
+	if (iters < 1)
+		iters = 1;
+
+	start = clock();
+	for (i = 0; i < iters; i++)
+	{
+		fz_clear_pixmap(ctx, dst);
+		fz_paint_image(ctx, dst, &bbox, NULL, NULL, img, ctm, 255, lerp, 0, NULL);
+	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if (secs <= 0)
+		secs = 1e-9;
+	return iters * area / secs / 1e6;
+}
+
+static int
+run_case(fz_context *ctx, const char *name, fz_colorspace *src_cs, fz_colorspace *dst_cs, int dst_alpha, double megapixels)
+{
+	fz_pixmap *img = make_image(ctx, src_cs);
+	int s, r, lerp, mismatches = 0;
+
+	for (lerp = 0; lerp < 2; lerp++)
+	{
+		/* Interpolate upscales too, as for images marked /Interpolate. */
+		if (lerp)
+			img->flags |= FZ_PIXMAP_FLAG_INTERPOLATE;
+		else
+			img->flags &= ~FZ_PIXMAP_FLAG_INTERPOLATE;
+
+		for (s = 0; s < (int)nelem(scales); s++)
+		for (r = 0; r < (int)nelem(rotations); r++)
+		{
+			fz_matrix ctm = fz_scale(IMG_W * scales[s], IMG_H * scales[s]);
+			fz_pixmap *dst[2];
+			fz_irect bbox;
+			double rate[2];
+			int i;
+
+			ctm = fz_concat(ctm, fz_rotate(rotations[r]));
+			/* Off the pixel grid, so that no case is a plain copy. */
+			ctm = fz_concat(ctm, fz_translate(0.25f, 0.25f));
+			bbox = fz_round_rect(fz_transform_rect(fz_unit_rect, ctm));
+
+			for (i = 0; i < 2; i++)
+			{
+				dst[i] = fz_new_pixmap_with_bbox(ctx, dst_cs, bbox, NULL, dst_alpha);
+				fz_mask_cpu_features(i ? 0 : ~0);
+				rate[i] = measure(ctx, img, dst[i], ctm, lerp, megapixels);
+			}
+			fz_mask_cpu_features(0);
+
+			if (memcmp(dst[0]->samples, dst[1]->samples, (size_t)dst[0]->stride * dst[0]->h))
+			{
+				fprintf(stderr, "%s scale %g rotate %g lerp %s: SIMD and C results differ\n",
+					name, scales[s], rotations[r], lerp ? "yes" : "no");
+				mismatches++;
+			}
+			printf("%-14s %5g %6g %4s %10.1f %10.1f %7.2fx\n", name, scales[s], rotations[r],
+				lerp ? "yes" : "no", rate[0], rate[1], rate[1] / rate[0]);
+
+			fz_drop_pixmap(ctx, dst[0]);
+			fz_drop_pixmap(ctx, dst[1]);
+		}
+	}
+
+	fz_drop_pixmap(ctx, img);
+	return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+	double megapixels = argc > 1 ? fz_atof(argv[1]) : 50;
+	fz_context *ctx;
+	int mismatches = 0;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("SIMD: %s\n", (fz_cpu_features() & FZ_CPU_AVX2) ? "AVX2" : "no AVX2");
+	printf("%-14s %5s %6s %4s %10s %10s %8s\n", "case", "scale", "rotate", "lerp", "C Mpix/s", "SIMD", "speedup");
+
+	fz_try(ctx)
+	{
+		mismatches += run_case(ctx, "gray -> rgba", fz_device_gray(ctx), fz_device_rgb(ctx), 1, megapixels);
+		mismatches += run_case(ctx, "rgb -> rgba", fz_device_rgb(ctx), fz_device_rgb(ctx), 1, megapixels);
+		mismatches += run_case(ctx, "cmyk -> cmyk", fz_device_cmyk(ctx), fz_device_cmyk(ctx), 0, megapixels);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mismatches++;
+	}
+
+	fz_drop_context(ctx);
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+/*
+ * image-share-test - Check that image digests let documents share
+ * decoded image tiles.
+ *
+ * Each "document" makes its own image from its own copy of the same
+ * compressed data, and decodes it. With digests, the second document
+ * finds the tile that the first left in the store, even though the
+ * first image has been dropped by then, and the store holds a single
+ * tile. Without them, each document decodes the image for itself.
+ *
+ * This is checked with the image in DeviceRGB, and, when the library is
+ * built with ICC profiles, in an ICC colorspace that each document loads
+ * from its own copy of the same profile.
+ *
+ * usage: image-share-test
+ */
+
+#include "mupdf/fitz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define W 64
+#define H 48
+
+static int failed = 0;
+
+#define CHECK(X) do { if (!(X)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); failed++; } } while (0)
+
+static unsigned char samples[W * H * 3];
+
+/* The colorspace a document would make for its images: either the
+ * device one, or one of its own from an embedded profile. */
+static fz_colorspace *
+document_colorspace(fz_context *ctx, int icc)
+{
+	const unsigned char *data;
+	fz_colorspace *cs = NULL;
+	fz_buffer *buf;
+	size_t len;
+
+	if (!icc)
+		return fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+
+	data = fz_lookup_icc(ctx, FZ_COLORSPACE_RGB, &len);
+	if (!data)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find builtin profile");
+	buf = fz_new_buffer_from_copied_data(ctx, data, len);
+	fz_try(ctx)
+		cs = fz_new_icc_colorspace(ctx, FZ_COLORSPACE_RGB, buf, NULL);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return cs;
+}
+
+/* Make an image from a private copy of the samples, as a document
+ * embedding it would, and decode it. */
+static void
+draw_document(fz_context *ctx, int icc)
+{
+	fz_colorspace *cs = NULL;
+	fz_compressed_buffer *cbuf = NULL;
+	fz_image *image = NULL;
+	fz_pixmap *pix = NULL;
+
+	fz_var(cs);
+	fz_var(cbuf);
+	fz_var(image);
+
+	fz_try(ctx)
+	{
+		cs = document_colorspace(ctx, icc);
+		cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+		cbuf->params.type = FZ_IMAGE_RAW;
+		cbuf->buffer = fz_new_buffer_from_copied_data(ctx, samples, sizeof samples);
+		image = fz_new_image_from_compressed_buffer(ctx, W, H, 8, cs, 72, 72, 0, 0, NULL, NULL, cbuf, NULL);
+		cbuf = NULL;
+		pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+		CHECK(pix->w == W && pix->h == H);
+		CHECK(!memcmp(pix->samples, samples, sizeof samples));
+		fz_drop_pixmap(ctx, pix);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_image(ctx, image);
+		fz_drop_compressed_buffer(ctx, cbuf);
+		fz_drop_colorspace(ctx, cs);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static fz_store_type_stats
+tile_stats(fz_context *ctx)
+{
+	fz_store_type_stats tiles = { 0 };
+	fz_store_stats stats;
+	int i;
+
+	fz_get_store_stats(ctx, &stats);
+	for (i = 0; i < stats.num_types; i++)
+	{
+		if (!strcmp(stats.type[i].name, "image") || !strcmp(stats.type[i].name, "image digest"))
+		{
+			tiles.hits += stats.type[i].hits;
+			tiles.inserts += stats.type[i].inserts;
+			tiles.size += stats.type[i].size;
+		}
+	}
+	return tiles;
+}
+
+/* Draw two documents, and return the tile hits and inserts for the
+ * second, and the size of the tiles left in the store. */
+static void
+draw_two_documents(fz_context *ctx, int digests, int icc, size_t *hits, size_t *inserts, size_t *size)
+{
+	fz_store_type_stats before, after;
+
+	fz_empty_store(ctx);
+	fz_tune_image_digests(ctx, digests);
+
+	draw_document(ctx, icc);
+	before = tile_stats(ctx);
+	draw_document(ctx, icc);
+	after = tile_stats(ctx);
+
+	*hits = after.hits - before.hits;
+	*inserts = after.inserts - before.inserts;
+	*size = after.size;
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	size_t hits, inserts, size;
+	int i, icc;
+
+	for (i = 0; i < (int)sizeof samples; i++)
+		samples[i] = (i * 37) ^ (i >> 5);
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		for (icc = 0; icc < 2; icc++)
+		{
+			if (icc && !fz_lookup_icc(ctx, FZ_COLORSPACE_RGB, &size))
+				break;
+
+			draw_two_documents(ctx, 1, icc, &hits, &inserts, &size);
+			CHECK(hits == 1);
+			CHECK(inserts == 0);
+			CHECK(size == sizeof(fz_pixmap) + W * H * 3);
+
+			draw_two_documents(ctx, 0, icc, &hits, &inserts, &size);
+			CHECK(hits == 0);
+			CHECK(inserts == 1);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed++;
+	}
+
+	fz_drop_context(ctx);
+
+	if (failed)
+	{
+		fprintf(stderr, "%d checks failed\n", failed);
+		return EXIT_FAILURE;
+	}
+	printf("image sharing checks passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,413 @@
+/*
+ * list-device-test - Check that rendering through a display list gives
+ * exactly the same pixels as rendering directly.
+ *
+ * The list device records bounding rects for groups, soft masks and
+ * the nodes drawn inside them, and culls nodes that draw nothing. The
+ * draw device uses those rects to size its buffers, so any rect that is
+ * not exact shows up as changed pixels.
+ *
+ * Random scenes of paths, strokes, images, groups and soft masks are
+ * drawn both ways and compared byte for byte. A further check makes sure
+ * that a page sized group and soft mask are played back only as large as
+ * what is drawn into them. Clip paths are left out:
+ * the list device narrows their scissor to the content drawn inside,
+ * and the rasterizer clamps edges to the scissor, which moves the
+ * antialiased edges of a clip mask by a level or two.
+ *
+ * usage: list-device-test [number of scenes]
+ */
+
+#include "mupdf/fitz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_W 200
+#define PAGE_H 150
+#define ZOOM 1.7f
+
+static unsigned int seed;
+
+static unsigned int
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) & 0xffffff;
+}
+
+static float
+frnd(float a, float b)
+{
+	return a + (b - a) * (rnd() / 16777216.0f);
+}
+
+static fz_colorspace *
+rand_colorspace(fz_context *ctx, int *n)
+{
+	switch (rnd() % 3)
+	{
+	case 0: *n = 1; return fz_device_gray(ctx);
+	case 1: *n = 3; return fz_device_rgb(ctx);
+	default: *n = 4; return fz_device_cmyk(ctx);
+	}
+}
+
+static fz_path *
+rand_path(fz_context *ctx)
+{
+	fz_path *path = fz_new_path(ctx);
+	float cx = frnd(0, PAGE_W), cy = frnd(0, PAGE_H), r = frnd(5, PAGE_W / 3);
+	int i, n = 3 + rnd() % 8;
+
+	fz_moveto(ctx, path, cx + frnd(-r, r), cy + frnd(-r, r));
+	for (i = 0; i < n; i++)
+	{
+		if (rnd() % 3 == 0)
+			fz_curveto(ctx, path,
+				cx + frnd(-r, r), cy + frnd(-r, r),
+				cx + frnd(-r, r), cy + frnd(-r, r),
+				cx + frnd(-r, r), cy + frnd(-r, r));
+		else
+			fz_lineto(ctx, path, cx + frnd(-r, r), cy + frnd(-r, r));
+	}
+	fz_closepath(ctx, path);
+	if (rnd() % 4 == 0)
+		fz_rectto(ctx, path, cx, cy, cx + frnd(1, r), cy + frnd(1, r));
+	return path;
+}
+
+static fz_image *
+rand_image(fz_context *ctx)
+{
+	int n, alpha = rnd() % 3 == 0;
+	fz_colorspace *cs = rand_colorspace(ctx, &n);
+	int w = 3 + rnd() % 120, h = 3 + rnd() % 120;
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+	unsigned char *s = pix->samples;
+	fz_image *image;
+	int i, k;
+
+	for (i = 0; i < w * h; i++)
+	{
+		int a = alpha ? rnd() % 256 : 255;
+		for (k = 0; k < n; k++)
+			*s++ = (unsigned char)(((rnd() % 256) * a + 127) / 255);
+		if (alpha)
+			*s++ = a;
+	}
+
+	image = fz_new_image_from_pixmap(ctx, pix, NULL);
+	fz_drop_pixmap(ctx, pix);
+	return image;
+}
+
+static float
+rand_alpha(void)
+{
+	return rnd() % 2 ? 1 : frnd(0, 1);
+}
+
+static void draw_ops(fz_context *ctx, fz_device *dev, int depth, int count);
+
+static void
+draw_op(fz_context *ctx, fz_device *dev, int depth)
+{
+	fz_matrix ctm = fz_identity;
+	fz_colorspace *cs;
+	fz_path *path;
+	fz_image *image;
+	fz_stroke_state *stroke;
+	fz_rect area;
+	float color[4];
+	int i, n, op = rnd() % 9;
+
+	if (rnd() % 4 == 0)
+	{
+		ctm = fz_pre_rotate(fz_translate(PAGE_W / 2, PAGE_H / 2), frnd(-180, 180));
+		ctm = fz_pre_translate(ctm, -PAGE_W / 2, -PAGE_H / 2);
+	}
+
+	/* Keep the nesting from getting out of hand. */
+	if (depth > 3 && op >= 6)
+		op = rnd() % 6;
+
+	switch (op)
+	{
+	case 0: case 1: case 2:
+		path = rand_path(ctx);
+		cs = rand_colorspace(ctx, &n);
+		for (i = 0; i < n; i++)
+			color[i] = frnd(0, 1);
+		fz_fill_path(ctx, dev, path, rnd() % 2, ctm, cs, color, rand_alpha(), NULL);
+		fz_drop_path(ctx, path);
+		break;
+
+	case 3:
+		path = rand_path(ctx);
+		stroke = fz_new_stroke_state(ctx);
+		stroke->linewidth = frnd(0.1f, 8);
+		stroke->linejoin = rnd() % 3;
+		stroke->start_cap = stroke->end_cap = rnd() % 3;
+		cs = rand_colorspace(ctx, &n);
+		for (i = 0; i < n; i++)
+			color[i] = frnd(0, 1);
+		fz_stroke_path(ctx, dev, path, stroke, ctm, cs, color, rand_alpha(), NULL);
+		fz_drop_stroke_state(ctx, stroke);
+		fz_drop_path(ctx, path);
+		break;
+
+	case 4: case 5:
+		image = rand_image(ctx);
+		switch (rnd() % 3)
+		{
+		case 0:
+			ctm = fz_make_matrix(frnd(2, PAGE_W), 0, 0, frnd(2, PAGE_H), frnd(-10, PAGE_W), frnd(-10, PAGE_H));
+			break;
+		case 1:
+			ctm = fz_concat(fz_scale(frnd(2, PAGE_W), frnd(2, PAGE_H)), fz_rotate(frnd(0, 360)));
+			ctm = fz_concat(ctm, fz_translate(frnd(0, PAGE_W), frnd(0, PAGE_H)));
+			break;
+		default:
+			ctm = fz_make_matrix(frnd(1, 8), 0, 0, frnd(1, 8), frnd(0, PAGE_W), frnd(0, PAGE_H));
+			break;
+		}
+		fz_fill_image(ctx, dev, image, ctm, rand_alpha(), NULL);
+		fz_drop_image(ctx, image);
+		break;
+
+	case 6: case 7:
+		area.x0 = frnd(-20, PAGE_W);
+		area.y0 = frnd(-20, PAGE_H);
+		area.x1 = area.x0 + frnd(1, PAGE_W);
+		area.y1 = area.y0 + frnd(1, PAGE_H);
+		if (rnd() % 3 == 0)
+			area = fz_make_rect(0, 0, PAGE_W, PAGE_H);
+		fz_begin_group(ctx, dev, area, NULL, rnd() % 2, rnd() % 4 == 0, rnd() % 16, rand_alpha());
+		draw_ops(ctx, dev, depth + 1, 1 + rnd() % 5);
+		fz_end_group(ctx, dev);
+		break;
+
+	case 8:
+		area = fz_make_rect(frnd(-20, PAGE_W / 2), frnd(-20, PAGE_H / 2), frnd(PAGE_W / 2, PAGE_W + 20), frnd(PAGE_H / 2, PAGE_H + 20));
+		if (rnd() % 2)
+		{
+			for (i = 0; i < 3; i++)
+				color[i] = frnd(0, 1);
+			fz_begin_mask(ctx, dev, area, 1, fz_device_rgb(ctx), color, NULL);
+		}
+		else
+			fz_begin_mask(ctx, dev, area, 0, NULL, NULL, NULL);
+		draw_ops(ctx, dev, depth + 1, 1 + rnd() % 4);
+		fz_end_mask(ctx, dev);
+		draw_ops(ctx, dev, depth + 1, 1 + rnd() % 4);
+		fz_pop_clip(ctx, dev);
+		break;
+	}
+}
+
+static void
+draw_ops(fz_context *ctx, fz_device *dev, int depth, int count)
+{
+	while (count-- > 0)
+		draw_op(ctx, dev, depth);
+}
+
+static void
+draw_scene(fz_context *ctx, fz_device *dev, unsigned int scene)
+{
+	seed = scene;
+	draw_ops(ctx, dev, 0, 12);
+}
+
+static fz_pixmap *
+render_scene(fz_context *ctx, unsigned int scene, int use_list)
+{
+	fz_matrix ctm = fz_scale(ZOOM, ZOOM);
+	fz_irect bbox = fz_round_rect(fz_transform_rect(fz_make_rect(0, 0, PAGE_W, PAGE_H), ctm));
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 1);
+	fz_display_list *list = NULL;
+	fz_device *dev = NULL;
+
+	fz_var(list);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		fz_clear_pixmap(ctx, pix);
+		if (use_list)
+		{
+			list = fz_new_display_list(ctx, fz_make_rect(0, 0, PAGE_W, PAGE_H));
+			dev = fz_new_list_device(ctx, list);
+			draw_scene(ctx, dev, scene);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+
+			dev = fz_new_draw_device(ctx, fz_identity, pix);
+			fz_run_display_list(ctx, list, dev, ctm, fz_infinite_rect, NULL);
+		}
+		else
+		{
+			dev = fz_new_draw_device(ctx, ctm, pix);
+			draw_scene(ctx, dev, scene);
+		}
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_display_list(ctx, list);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+
+	return pix;
+}
+
+typedef struct
+{
+	fz_device super;
+	fz_rect group;
+	fz_rect mask;
+} area_device;
+
+static void
+area_begin_group(fz_context *ctx, fz_device *dev, fz_rect rect, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+	((area_device *)dev)->group = rect;
+}
+
+static void
+area_begin_mask(fz_context *ctx, fz_device *dev, fz_rect rect, int luminosity, fz_colorspace *cs, const float *color, const fz_color_params *color_params)
+{
+	((area_device *)dev)->mask = rect;
+}
+
+static int
+check_shrink(fz_context *ctx)
+{
+	fz_display_list *list = NULL;
+	fz_device *dev = NULL;
+	fz_path *path = NULL;
+	area_device *area = NULL;
+	const float black[1] = { 0 };
+	fz_rect page = fz_make_rect(0, 0, PAGE_W, PAGE_H);
+	fz_rect inside = fz_make_rect(20, 20, 60, 50);
+	int failed = 0;
+
+	fz_var(list);
+	fz_var(dev);
+	fz_var(path);
+
+	fz_try(ctx)
+	{
+		list = fz_new_display_list(ctx, page);
+		dev = fz_new_list_device(ctx, list);
+		path = fz_new_path(ctx);
+		fz_rectto(ctx, path, inside.x0, inside.y0, inside.x1, inside.y1);
+		fz_begin_group(ctx, dev, page, NULL, 1, 0, FZ_BLEND_MULTIPLY, 1);
+		fz_begin_mask(ctx, dev, page, 0, NULL, NULL, NULL);
+		fz_fill_path(ctx, dev, path, 0, fz_identity, fz_device_gray(ctx), black, 1, NULL);
+		fz_end_mask(ctx, dev);
+		fz_fill_path(ctx, dev, path, 0, fz_identity, fz_device_gray(ctx), black, 1, NULL);
+		fz_pop_clip(ctx, dev);
+		fz_end_group(ctx, dev);
+		fz_close_device(ctx, dev);
+		fz_drop_device(ctx, dev);
+
+		dev = NULL;
+		area = fz_new_derived_device(ctx, area_device);
+		dev = &area->super;
+		dev->begin_group = area_begin_group;
+		dev->begin_mask = area_begin_mask;
+		fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, NULL);
+		fz_close_device(ctx, dev);
+
+		if (!fz_contains_rect(fz_expand_rect(inside, 2), area->group) || !fz_contains_rect(area->group, inside))
+		{
+			fprintf(stderr, "group played back at %g %g %g %g\n", area->group.x0, area->group.y0, area->group.x1, area->group.y1);
+			failed = 1;
+		}
+		if (!fz_contains_rect(fz_expand_rect(inside, 2), area->mask) || !fz_contains_rect(area->mask, inside))
+		{
+			fprintf(stderr, "mask played back at %g %g %g %g\n", area->mask.x0, area->mask.y0, area->mask.x1, area->mask.y1);
+			failed = 1;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_drop_device(ctx, dev);
+		fz_drop_display_list(ctx, list);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	int scenes = argc > 1 ? atoi(argv[1]) : 200;
+	int i, failed = 0, shrunk = 1;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	fz_try(ctx)
+	{
+		shrunk = !check_shrink(ctx);
+		for (i = 0; i < scenes; i++)
+		{
+			fz_pixmap *direct = render_scene(ctx, i, 0);
+			fz_pixmap *listed = render_scene(ctx, i, 1);
+			unsigned char *a = direct->samples;
+			unsigned char *b = listed->samples;
+			size_t k, len = (size_t)direct->stride * direct->h;
+			int count = 0, worst = 0;
+
+			for (k = 0; k < len; k++)
+			{
+				int d = abs(a[k] - b[k]);
+				if (d)
+				{
+					count++;
+					if (d > worst)
+						worst = d;
+				}
+			}
+			if (count)
+			{
+				fprintf(stderr, "scene %d: %d samples differ (by up to %d)\n", i, count, worst);
+				failed++;
+			}
+
+			fz_drop_pixmap(ctx, direct);
+			fz_drop_pixmap(ctx, listed);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed++;
+	}
+
+	fz_drop_context(ctx);
+
+	if (failed)
+		fprintf(stderr, "%d of %d scenes rendered differently through a display list\n", failed, scenes);
+	if (failed || !shrunk)
+		return EXIT_FAILURE;
+	printf("%d scenes rendered identically\n", scenes);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+/*
+ * paint-bench - Time the SIMD span painters against the C versions.
+ *
+ * Paints solid colors, coverage masks with a color, and pixmap spans
+ * over a row of pixels, for the common gray, rgb(a) and cmyk cases, at
+ * a range of span widths. Each case is run with the SIMD instruction
+ * sets masked off and with everything the machine has; the outputs are
+ * checked to be identical and the throughput of each is printed.
+ *
+ * usage: paint-bench [megapixels per measurement]
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/fitz-imp.h"
+#include "../fitz/draw-imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum { SOLID, SPAN_COLOR, SPAN };
+
+typedef struct
+{
+	const char *name;
+	int kind;
+	int n, da, sa, alpha;
+} paint_case;
+
+static const paint_case cases[] =
+{
+	{ "solid gray", SOLID, 1, 0, 0, 255 },
+	{ "solid gray alpha", SOLID, 1, 0, 0, 128 },
+	{ "solid graya", SOLID, 2, 1, 0, 255 },
+	{ "solid rgba", SOLID, 4, 1, 0, 255 },
+	{ "solid rgba alpha", SOLID, 4, 1, 0, 128 },
+	{ "solid cmyk", SOLID, 4, 0, 0, 255 },
+	{ "mask+color gray", SPAN_COLOR, 1, 0, 0, 255 },
+	{ "mask+color rgba", SPAN_COLOR, 4, 1, 0, 255 },
+	{ "mask+color cmyk", SPAN_COLOR, 4, 0, 0, 255 },
+	{ "span rgba over rgba", SPAN, 4, 1, 1, 255 },
+	{ "span rgba over rgba alpha", SPAN, 4, 1, 1, 128 },
+	{ "span gray alpha", SPAN, 1, 0, 0, 128 },
+	{ "span rgb alpha", SPAN, 3, 0, 0, 128 },
+	{ "span cmyk alpha", SPAN, 4, 0, 0, 128 },
+};
+
+static const int widths[] = { 8, 32, 128, 512, 2048 };
+
+#define MAX_W 2048
+
+static unsigned char src[MAX_W * 5];
+static unsigned char mask[MAX_W];
+static unsigned char dst[MAX_W * 5];
+static unsigned char scratch[MAX_W * 5];
+
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xffffff) % n;
+}
+
+/* Premultiplied samples with a mix of clear, opaque and partial alpha. */
+static void
+fill_random(unsigned char *p, int w, int n, int has_alpha)
+{
+	int x, k, a;
+
+	for (x = 0; x < w; x++)
+	{
+		a = 255;
+		if (has_alpha)
+			a = rnd(3) == 0 ? 0 : rnd(3) == 0 ? 255 : rnd(256);
+		for (k = 0; k < n - has_alpha; k++)
+			*p++ = fz_mul255(rnd(256), a);
+		if (has_alpha)
+			*p++ = a;
+	}
+}
+
+/* Paint one span the way the draw device would. Returns 0 if there is
+ * no painter for the case. */
+static int
+paint(const paint_case *pc, unsigned char *dp, int w, const unsigned char *color)
+{
+	fz_solid_color_painter_t *solid;
+	fz_span_color_painter_t *span_color;
+	fz_span_painter_t *span;
+
+	switch (pc->kind)
+	{
+	case SOLID:
+		solid = fz_get_solid_color_painter(pc->n, color, pc->da, NULL);
+		if (!solid)
+			return 0;
+		solid(dp, pc->n, w, color, pc->da, NULL);
+		break;
+	case SPAN_COLOR:
+		span_color = fz_get_span_color_painter(pc->n, pc->da, color, NULL);
+		if (!span_color)
+			return 0;
+		span_color(dp, mask, pc->n, w, color, pc->da, NULL);
+		break;
+	default:
+		span = fz_get_span_painter(pc->da, pc->sa, pc->n, pc->alpha, NULL);
+		if (!span)
+			return 0;
+		span(dp, pc->da, src, pc->sa, pc->n, w, pc->alpha, NULL);
+		break;
+	}
+	return 1;
+}
+
+/* Megapixels per second of painting the case at the given width, or
+ * -1 if there is no painter for it. The painted row is left in out. */
+static double
+measure(const paint_case *pc, int w, const unsigned char *color, double megapixels, unsigned char *out)
+{
+	size_t len = (size_t)w * pc->n;
+	long i, iters = (long)(megapixels * 1e6 / w);
+	clock_t start;
+	double secs;
+
+	if (iters < 1)
+		iters = 1;
+
+	memcpy(out, dst, len);
+	if (!paint(pc, out, w, color))
+		return -1;
+
+	start = clock();
+	for (i = 0; i < iters; i++)
+	{
+		/* Paint onto fresh destination pixels each time, so that
+		 * alpha does not run up to opaque and short cut the work. */
+		memcpy(scratch, dst, len);
+		paint(pc, scratch, w, color);
+	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if (secs <= 0)
+		secs = 1e-9;
+	return iters * (double)w / secs / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	double megapixels = argc > 1 ? fz_atof(argv[1]) : 50;
+	unsigned char color[FZ_MAX_COLORS + 1];
+	unsigned char out[2][MAX_W * 5];
+	int c, i, k, mismatches = 0;
+
+	printf("SIMD: %s\n", (fz_cpu_features() & FZ_CPU_AVX2) ? "AVX2" : (fz_cpu_features() & FZ_CPU_SSE2) ? "SSE2" : "none");
+	printf("%-28s %6s %10s %10s %8s\n", "case", "width", "C Mpix/s", "SIMD", "speedup");
+
+	for (c = 0; c < (int)nelem(cases); c++)
+	{
+		const paint_case *pc = &cases[c];
+
+		fill_random(dst, MAX_W, pc->n, pc->da);
+		fill_random(src, MAX_W, pc->n, pc->sa);
+		for (i = 0; i < MAX_W; i++)
+			mask[i] = rnd(3) == 0 ? 0 : rnd(3) == 0 ? 255 : rnd(256);
+		for (k = 0; k < pc->n - pc->da; k++)
+			color[k] = rnd(256);
+		color[k] = pc->alpha;
+
+		for (i = 0; i < (int)nelem(widths); i++)
+		{
+			int w = widths[i];
+			double c_rate, simd_rate;
+
+			fz_mask_cpu_features(~0);
+			c_rate = measure(pc, w, color, megapixels, out[0]);
+			fz_mask_cpu_features(0);
+			simd_rate = measure(pc, w, color, megapixels, out[1]);
+
+			if (c_rate < 0 || simd_rate < 0)
+			{
+				printf("%-28s %6d %10s\n", pc->name, w, "no painter");
+				continue;
+			}
+			if (memcmp(out[0], out[1], (size_t)w * pc->n))
+			{
+				fprintf(stderr, "%s at width %d: SIMD and C results differ\n", pc->name, w);
+				mismatches++;
+			}
+			printf("%-28s %6d %10.1f %10.1f %7.2fx\n", pc->name, w, c_rate, simd_rate, simd_rate / c_rate);
+		}
+	}
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/*
+ * scale-bench - Time the SIMD smooth scaler against the C version.
+ *
+ * Downscales a large image by 2, 4 and 8 with fz_scale_pixmap, for gray,
+ * rgb, rgba and cmyk pixmaps. Each case is run with the SIMD instruction
+ * sets masked off and with everything the machine has; the outputs are
+ * checked to be identical and the throughput of each (in source pixels)
+ * is printed.
+ *
+ * usage: scale-bench [megapixels per measurement]
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/fitz-imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define IMG_W 2400
+#define IMG_H 1800
+
+static const int factors[] = { 2, 4, 8 };
+
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xffffff) % n;
+}
+
+static fz_pixmap *
+make_image(fz_context *ctx, fz_colorspace *cs, int alpha)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, IMG_W, IMG_H, NULL, alpha);
+	unsigned char *s = pix->samples;
+	int x, y, k, a, c = pix->n - alpha;
+
+	for (y = 0; y < IMG_H; y++)
+	{
+		for (x = 0; x < IMG_W; x++)
+		{
+			a = alpha ? (x + y + rnd(64)) & 255 : 255;
+			for (k = 0; k < c; k++)
+				*s++ = fz_mul255((x * (k + 1) + y * (3 - k) + rnd(16)) & 255, a);
+			if (alpha)
+				*s++ = a;
+		}
+	}
+	return pix;
+}
+
+/* Scale the image down by the factor repeatedly, and set rate to the
+ * source megapixels per second. Returns the last result. */
+static fz_pixmap *
+measure(fz_context *ctx, fz_pixmap *img, int factor, double megapixels, double *rate)
+{
+	double area = (double)img->w * img->h;
+	long i, iters = (long)(megapixels * 1e6 / area);
+	fz_pixmap *scaled = NULL;
+	clock_t start;
+	double secs;
+
+	if (iters < 1)
+		iters = 1;
+
+	start = clock();
+	for (i = 0; i < iters; i++)
+	{
+		fz_drop_pixmap(ctx, scaled);
+		scaled = fz_scale_pixmap(ctx, img, 0, 0, (float)img->w / factor, (float)img->h / factor, NULL);
+	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if (secs <= 0)
+		secs = 1e-9;
+	*rate = iters * area / secs / 1e6;
+	return scaled;
+}
+
+static int
+run_case(fz_context *ctx, const char *name, fz_colorspace *cs, int alpha, double megapixels)
+{
+	fz_pixmap *img = make_image(ctx, cs, alpha);
+	int f, i, mismatches = 0;
+
+	for (f = 0; f < (int)nelem(factors); f++)
+	{
+		fz_pixmap *scaled[2];
+		double rate[2];
+
+		for (i = 0; i < 2; i++)
+		{
+			fz_mask_cpu_features(i ? 0 : ~0);
+			scaled[i] = measure(ctx, img, factors[f], megapixels, &rate[i]);
+		}
+		fz_mask_cpu_features(0);
+
+		if (!scaled[0] || !scaled[1] ||
+			scaled[0]->w != scaled[1]->w || scaled[0]->h != scaled[1]->h ||
+			memcmp(scaled[0]->samples, scaled[1]->samples, (size_t)scaled[0]->stride * scaled[0]->h))
+		{
+			fprintf(stderr, "%s 1/%d: SIMD and C results differ\n", name, factors[f]);
+			mismatches++;
+		}
+		printf("%-6s 1/%-4d %10.1f %10.1f %7.2fx\n", name, factors[f], rate[0], rate[1], rate[1] / rate[0]);
+
+		fz_drop_pixmap(ctx, scaled[0]);
+		fz_drop_pixmap(ctx, scaled[1]);
+	}
+
+	fz_drop_pixmap(ctx, img);
+	return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+	double megapixels = argc > 1 ? fz_atof(argv[1]) : 100;
+	fz_context *ctx;
+	int mismatches = 0;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("SIMD: %s\n", (fz_cpu_features() & FZ_CPU_AVX2) ? "AVX2" : (fz_cpu_features() & FZ_CPU_SSE2) ? "SSE2" : "none");
+	printf("%-6s %-6s %10s %10s %8s\n", "case", "scale", "C Mpix/s", "SIMD", "speedup");
+
+	fz_try(ctx)
+	{
+		mismatches += run_case(ctx, "gray", fz_device_gray(ctx), 0, megapixels);
+		mismatches += run_case(ctx, "rgb", fz_device_rgb(ctx), 0, megapixels);
+		mismatches += run_case(ctx, "rgba", fz_device_rgb(ctx), 1, megapixels);
+		mismatches += run_case(ctx, "cmyk", fz_device_cmyk(ctx), 0, megapixels);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		mismatches++;
+	}
+
+	fz_drop_context(ctx);
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
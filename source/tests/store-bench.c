@@ -0,0 +1,298 @@
+/*
+ * store-bench - Time store lookups from several threads at once, with
+ * the store in one shard and in FZ_STORE_MAX_SHARDS shards.
+ *
+ * Each thread clones the context and looks up items by key, storing a
+ * new item whenever a lookup misses. There are more keys than fit in
+ * the store, so lookups hit most of the time, and the misses keep items
+ * being evicted, as when threads draw the pages of a document that
+ * uses more images than the store can hold. The threads share the store
+ * but not their keys, so that they never race to store the same item
+ * (which the store would warn about). The number of lookups per
+ * second (of wall clock time) is printed for each number of threads and
+ * each number of shards, along with the speedup over one thread with
+ * one shard, and the fraction of lookups that hit.
+ *
+ * usage: store-bench [max threads [lookups per thread, in thousands]]
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/fitz-imp.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ITEMS 4096
+#define KEYS (ITEMS + ITEMS / 4)
+#define ITEM_SIZE 1024
+
+static pthread_mutex_t mutexes[FZ_LOCK_MAX];
+
+static void
+lock(void *user, int lock)
+{
+	pthread_mutex_lock(&mutexes[lock]);
+}
+
+static void
+unlock(void *user, int lock)
+{
+	pthread_mutex_unlock(&mutexes[lock]);
+}
+
+static fz_locks_context locks = { NULL, lock, unlock };
+
+/* The items are bare storables, keyed on a number. */
+typedef struct
+{
+	fz_storable storable;
+	int id;
+} item;
+
+typedef struct
+{
+	int refs;
+	int id;
+} item_key;
+
+static void
+drop_item_imp(fz_context *ctx, fz_storable *item)
+{
+	fz_free(ctx, item);
+}
+
+static int
+make_hash_item_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	item_key *key = key_;
+	hash->u.pi.ptr = NULL;
+	hash->u.pi.i = key->id;
+	return 1;
+}
+
+static void *
+keep_item_key(fz_context *ctx, void *key_)
+{
+	item_key *key = key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+drop_item_key(fz_context *ctx, void *key_)
+{
+	item_key *key = key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+		fz_free(ctx, key);
+}
+
+static int
+cmp_item_key(fz_context *ctx, void *k0, void *k1)
+{
+	return ((item_key *)k0)->id != ((item_key *)k1)->id;
+}
+
+static void
+format_item_key(fz_context *ctx, char *s, int n, void *key_)
+{
+	fz_snprintf(s, n, "(item %d)", ((item_key *)key_)->id);
+}
+
+static const fz_store_type item_store_type =
+{
+	make_hash_item_key,
+	keep_item_key,
+	drop_item_key,
+	cmp_item_key,
+	format_item_key,
+	NULL,
+	"item"
+};
+
+/* Find the item with the given id, storing a new one if it is not
+ * there. */
+static void
+lookup_item(fz_context *ctx, int id)
+{
+	item_key key = { 1, id };
+	item_key *keyp;
+	item *it, *existing;
+
+	fz_var(existing);
+
+	it = fz_find_item(ctx, drop_item_imp, &key, &item_store_type);
+	if (!it)
+	{
+		it = fz_malloc_struct(ctx, item);
+		FZ_INIT_STORABLE(it, 1, drop_item_imp);
+		it->id = id;
+		keyp = fz_malloc_struct(ctx, item_key);
+		keyp->refs = 1;
+		keyp->id = id;
+		fz_try(ctx)
+			existing = fz_store_item(ctx, keyp, it, ITEM_SIZE, &item_store_type);
+		fz_always(ctx)
+			drop_item_key(ctx, keyp);
+		fz_catch(ctx)
+		{
+			fz_drop_storable(ctx, &it->storable);
+			fz_rethrow(ctx);
+		}
+		if (existing)
+		{
+			fz_drop_storable(ctx, &it->storable);
+			it = existing;
+		}
+	}
+	fz_drop_storable(ctx, &it->storable);
+}
+
+typedef struct
+{
+	fz_context *ctx;
+	unsigned int seed;
+	int first, step;
+	long lookups;
+	int failed;
+} worker;
+
+static void *
+run_worker(void *arg)
+{
+	worker *w = arg;
+	long i;
+
+	fz_try(w->ctx)
+	{
+		for (i = 0; i < w->lookups; i++)
+		{
+			w->seed = w->seed * 1103515245 + 12345;
+			lookup_item(w->ctx, w->first + w->step * ((w->seed >> 8) % (KEYS / w->step)));
+		}
+	}
+	fz_catch(w->ctx)
+		w->failed = 1;
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run n threads doing the given number of lookups each, in a store with
+ * the given number of shards, and return the total number of lookups
+ * per second, and the fraction of them that hit. */
+static double
+measure(int nshards, int n, long lookups, double *hit_rate)
+{
+	fz_context *ctx;
+	fz_store_stats stats;
+	worker *w = NULL;
+	pthread_t *thread = NULL;
+	double start, secs = 0;
+	int i, failed = 0;
+
+	ctx = fz_new_context(NULL, &locks, (size_t)ITEMS * ITEM_SIZE);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create mupdf context\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fz_var(w);
+	fz_var(thread);
+	fz_var(secs);
+	fz_var(failed);
+
+	fz_try(ctx)
+	{
+		fz_set_store_shards(ctx, nshards);
+
+		/* Fill the store. */
+		for (i = 0; i < KEYS; i++)
+			lookup_item(ctx, i);
+
+		fz_reset_store_stats(ctx);
+
+		w = fz_malloc_array(ctx, n, sizeof(*w));
+		thread = fz_malloc_array(ctx, n, sizeof(*thread));
+		for (i = 0; i < n; i++)
+		{
+			w[i].ctx = fz_clone_context(ctx);
+			w[i].seed = i + 1;
+			w[i].first = i;
+			w[i].step = n;
+			w[i].lookups = lookups;
+			w[i].failed = 0;
+		}
+
+		start = now();
+		for (i = 0; i < n; i++)
+			pthread_create(&thread[i], NULL, run_worker, &w[i]);
+		for (i = 0; i < n; i++)
+			pthread_join(thread[i], NULL);
+		secs = now() - start;
+
+		for (i = 0; i < n; i++)
+		{
+			failed |= w[i].failed;
+			fz_drop_context(w[i].ctx);
+		}
+
+		fz_get_store_stats(ctx, &stats);
+		*hit_rate = stats.num_types > 0 && stats.type[0].lookups > 0 ? (double)stats.type[0].hits / stats.type[0].lookups : 0;
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, thread);
+		fz_free(ctx, w);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		failed = 1;
+	}
+
+	fz_drop_context(ctx);
+
+	if (failed)
+	{
+		fprintf(stderr, "store lookup failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (secs <= 0)
+		secs = 1e-9;
+	return n * (double)lookups / secs;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	long lookups = (argc > 2 ? atol(argv[2]) : 2000) * 1000;
+	int shards[2] = { 1, FZ_STORE_MAX_SHARDS };
+	double base = 0;
+	int i, n;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+
+	printf("%-8s %-8s %14s %8s %6s\n", "shards", "threads", "lookups/s", "speedup", "hits");
+	for (i = 0; i < 2; i++)
+	{
+		for (n = 1; n <= max_threads; n *= 2)
+		{
+			double hit_rate;
+			double rate = measure(shards[i], n, lookups / n, &hit_rate);
+			if (base == 0)
+				base = rate;
+			printf("%-8d %-8d %14.0f %7.2fx %5.1f%%\n", shards[i], n, rate, rate / base, hit_rate * 100);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
 
 #ifndef DISABLE_MUTHREADS
 #include "mupdf/helpers/mu-threads.h"
+#include "mupdf/helpers/mu-render.h"
 #endif
 
 #include <string.h>
@@ -38,7 +39,7 @@ enum {
 	OUT_PNG, OUT_PNM, OUT_PGM, OUT_PPM, OUT_PAM,
 	OUT_PBM, OUT_PKM, OUT_PWG, OUT_PCL, OUT_PS, OUT_PSD,
 	OUT_TEXT, OUT_HTML, OUT_XHTML, OUT_STEXT, OUT_PCLM,
-	OUT_TRACE, OUT_SVG,
+	OUT_TRACE, OUT_SVG, OUT_DLIST,
 #if FZ_ENABLE_PDF
 	OUT_PDF,
 #endif
@@ -66,6 +67,7 @@ static const suffix_t suffix_table[] =
 	{ ".pbm", OUT_PBM, 0 },
 	{ ".pkm", OUT_PKM, 0 },
 	{ ".svg", OUT_SVG, 0 },
+	{ ".dlist", OUT_DLIST, 0 },
 	{ ".pwg", OUT_PWG, 0 },
 	{ ".pclm", OUT_PCLM, 0 },
 	{ ".pcl", OUT_PCL, 0 },
@@ -133,6 +135,7 @@ static const format_cs_table_t format_cs_table[] =
 
 	{ OUT_TRACE, CS_RGB, { CS_RGB } },
 	{ OUT_SVG, CS_RGB, { CS_RGB } },
+	{ OUT_DLIST, CS_RGB, { CS_RGB } },
 #if FZ_ENABLE_PDF
 	{ OUT_PDF, CS_RGB, { CS_RGB } },
 #endif
@@ -237,6 +240,7 @@ static float min_line_width = 0.0f;
 static int showfeatures = 0;
 static int showtime = 0;
 static int showmemory = 0;
+static int showcache = 0;
 static int showmd5 = 0;
 
 #if FZ_ENABLE_PDF
@@ -245,6 +249,7 @@ static pdf_document *pdfout = NULL;
 
 static int ignore_errors = 0;
 static int uselist = 1;
+static int optimize_list = 0;
 static int alphabits_text = 8;
 static int alphabits_graphics = 8;
 
@@ -256,6 +261,7 @@ static float gamma_value = 1;
 static int invert = 0;
 static int band_height = 0;
 static int lowmemory = 0;
+static int direct_bitmap = 0;
 
 static int quiet = 0;
 static int errored = 0;
@@ -271,6 +277,11 @@ static char *filename;
 static int files = 0;
 static int num_workers = 0;
 static worker_t *workers;
+static int tile_threads = 0;
+static int image_threads = 0;
+static int image_digests = 0;
+static int glyph_digests = 0;
+static int store_policy = FZ_STORE_POLICY_LRU;
 static fz_band_writer *bander = NULL;
 
 #if FZ_ENABLE_ICC
@@ -318,6 +329,7 @@ static void usage(void)
 		"\t-F -\toutput format (default inferred from output file name)\n"
 		"\t\traster: png, pnm, pam, pbm, pkm, pwg, pcl, ps\n"
 		"\t\tvector: svg, pdf, trace\n"
+		"\t\tdisplay list: dlist\n"
 		"\t\ttext: txt, html, stext\n"
 		"\n"
 		"\t-q\tbe quiet (don't print progress messages)\n"
@@ -326,6 +338,7 @@ static void usage(void)
 		"\t\tt - show timings\n"
 		"\t\tf - show page features\n"
 		"\t\t5 - show md5 checksum of rendered image\n"
+		"\t\tc - show store and glyph cache statistics\n"
 		"\n"
 		"\t-R -\trotate clockwise (default: 0 degrees)\n"
 		"\t-r -\tresolution in dpi (default: 72)\n"
@@ -334,9 +347,14 @@ static void usage(void)
 		"\t-f -\tfit width and/or height exactly; ignore original aspect ratio\n"
 		"\t-B -\tmaximum band_height (pXm, pcl, pclm, ps, psd and png output only)\n"
 #ifndef DISABLE_MUTHREADS
-		"\t-T -\tnumber of threads to use for rendering (banded mode only)\n"
+		"\t-T -\tnumber of threads to use for rendering (bands, or tiles when not banding)\n"
 #else
 		"\t-T -\tnumber of threads to use for rendering (disabled in this non-threading build)\n"
+#endif
+#ifndef DISABLE_MUTHREADS
+		"\t-Y -\tnumber of threads to decode each page's images with before rendering\n"
+#else
+		"\t-Y -\tnumber of threads to decode each page's images with before rendering (disabled in this non-threading build)\n"
 #endif
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
@@ -349,13 +367,19 @@ static void usage(void)
 		"\t-e -\tproof icc profile (filename of ICC profile)\n"
 		"\t-G -\tapply gamma correction\n"
 		"\t-I\tinvert colors\n"
+		"\t-b\thalftone mono output as it is drawn (pbm, mono pcl and pwg)\n"
 		"\n"
 		"\t-A -\tnumber of bits of antialiasing (0 to 8)\n"
 		"\t-A -/-\tnumber of bits of antialiasing (0 to 8) (graphics, text)\n"
+		"\t\t(graphics may also be 11 for exact area coverage)\n"
 		"\t-l -\tminimum stroked line width (in pixels)\n"
 		"\t-D\tdisable use of display list\n"
+		"\t-z\toptimize display list (remove nodes that draw nothing)\n"
 		"\t-i\tignore errors\n"
 		"\t-L\tlow memory mode (avoid caching, clear objects after each page)\n"
+		"\t-j\tshare decoded images between files by their contents\n"
+		"\t-J\tshare rendered glyphs between files by their font's contents\n"
+		"\t-E -\tstore eviction policy (lru, gds)\n"
 #ifndef DISABLE_MUTHREADS
 		"\t-P\tparallel interpretation/rendering\n"
 #else
@@ -462,42 +486,88 @@ file_level_trailers(fz_context *ctx)
 static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, fz_matrix ctm, fz_rect tbounds, fz_cookie *cookie, int band_start, fz_pixmap *pix, fz_bitmap **bit)
 {
 	fz_device *dev = NULL;
+	int hints = 0;
+	int mono, direct;
 
 	fz_var(dev);
 
 	*bit = NULL;
 
+	if (lowmemory)
+		hints |= FZ_NO_CACHE;
+	if (alphabits_graphics == 0)
+		hints |= FZ_DONT_INTERPOLATE_IMAGES;
+
+	/* Halftone mono output as it is drawn if asked to, unless the
+	 * contents of the gray band are needed too. With antialiasing this
+	 * is not bit-identical to halftoning the gray band: pixels can
+	 * differ where antialiased black and white edges overlap. */
+	mono = ((output_format == OUT_PCL || output_format == OUT_PWG) && out_cs == CS_MONO) || (output_format == OUT_PBM);
+	direct = direct_bitmap && mono && !invert && gamma_value == 1 && tile_threads == 0 && !proof_cs && !showmd5 &&
+		pix->n == 1 && !pix->alpha && fz_colorspace_is_gray(ctx, pix->colorspace);
+
 	fz_try(ctx)
 	{
-		if (pix->alpha)
-			fz_clear_pixmap(ctx, pix);
+		if (direct)
+		{
+			*bit = fz_new_bitmap(ctx, pix->w, pix->h, 1, pix->xres, pix->yres);
+			dev = fz_new_draw_device_with_bitmap(ctx, fz_identity, pix, *bit, band_start);
+			if (hints)
+				fz_enable_device_hints(ctx, dev, hints);
+			if (list)
+				fz_run_display_list(ctx, list, dev, ctm, tbounds, cookie);
+			else
+				fz_run_page(ctx, page, dev, ctm, cookie);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+		}
 		else
-			fz_clear_pixmap_with_value(ctx, pix, 255);
+		{
+			if (pix->alpha)
+				fz_clear_pixmap(ctx, pix);
+			else
+				fz_clear_pixmap_with_value(ctx, pix, 255);
 
-		dev = fz_new_draw_device_with_proof(ctx, fz_identity, pix, proof_cs);
-		if (lowmemory)
-			fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
-		if (alphabits_graphics == 0)
-			fz_enable_device_hints(ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
-		if (list)
-			fz_run_display_list(ctx, list, dev, ctm, tbounds, cookie);
-		else
-			fz_run_page(ctx, page, dev, ctm, cookie);
-		fz_close_device(ctx, dev);
-		fz_drop_device(ctx, dev);
-		dev = NULL;
+#ifndef DISABLE_MUTHREADS
+			if (list && tile_threads > 0)
+				mu_render_display_list_parallel(ctx, list, ctm, pix, proof_cs, hints, tile_threads, cookie);
+			else
+#endif
+			{
+				dev = fz_new_draw_device_with_proof(ctx, fz_identity, pix, proof_cs);
+				if (hints)
+					fz_enable_device_hints(ctx, dev, hints);
+				if (list)
+					fz_run_display_list(ctx, list, dev, ctm, tbounds, cookie);
+				else
+					fz_run_page(ctx, page, dev, ctm, cookie);
+				fz_close_device(ctx, dev);
+				fz_drop_device(ctx, dev);
+				dev = NULL;
+			}
 
-		if (invert)
-			fz_invert_pixmap(ctx, pix);
-		if (gamma_value != 1)
-			fz_gamma_pixmap(ctx, pix, gamma_value);
+			if (invert)
+				fz_invert_pixmap(ctx, pix);
+			if (gamma_value != 1)
+				fz_gamma_pixmap(ctx, pix, gamma_value);
 
-		if (((output_format == OUT_PCL || output_format == OUT_PWG) && out_cs == CS_MONO) || (output_format == OUT_PBM) || (output_format == OUT_PKM))
-			*bit = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL, band_start);
+			if (mono || (output_format == OUT_PKM))
+			{
+#ifndef DISABLE_MUTHREADS
+				if (tile_threads > 0)
+					*bit = mu_new_bitmap_from_pixmap_band_parallel(ctx, pix, NULL, band_start, tile_threads);
+				else
+#endif
+					*bit = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL, band_start);
+			}
+		}
 	}
 	fz_catch(ctx)
 	{
 		fz_drop_device(ctx, dev);
+		fz_drop_bitmap(ctx, *bit);
+		*bit = NULL;
 		fz_rethrow(ctx);
 	}
 }
@@ -704,6 +774,28 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 			fz_rethrow(ctx);
 		}
 	}
+	else if (output_format == OUT_DLIST)
+	{
+		char buf[512];
+
+		fz_try(ctx)
+		{
+			if (!output || !strcmp(output, "-"))
+				fz_write_display_list(ctx, fz_stdout(ctx), list);
+			else
+			{
+				fz_snprintf(buf, sizeof(buf), output, pagenum);
+				fz_save_display_list(ctx, list, buf);
+			}
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_display_list(ctx, list);
+			fz_drop_separations(ctx, seps);
+			fz_drop_page(ctx, page);
+			fz_rethrow(ctx);
+		}
+	}
 	else
 	{
 		float zoom;
@@ -783,6 +875,11 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 			int totalheight = ibounds.y1 - ibounds.y0;
 			int drawheight = totalheight;
 
+			/* Get the page's images decoded into the store
+			 * before the bands are drawn. */
+			if (list && image_threads > 0)
+				fz_prefetch_display_list_images(ctx, list, ctm, ibounds, band_height, cookie);
+
 			if (band_height != 0)
 			{
 				/* Banded rendering; we'll only render to a
@@ -1023,6 +1120,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	fz_cookie cookie = { 0 };
 	fz_separations *seps = NULL;
 	const char *features = "";
+	char optimized[40] = "";
 
 	fz_var(list);
 	fz_var(dev);
@@ -1079,6 +1177,8 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 				fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
 			fz_run_page(ctx, page, dev, fz_identity, &cookie);
 			fz_close_device(ctx, dev);
+			if (optimize_list)
+				fz_snprintf(optimized, sizeof(optimized), " (%d nodes optimized away)", fz_optimize_display_list(ctx, list));
 		}
 		fz_always(ctx)
 		{
@@ -1149,7 +1249,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		if (bgprint.active)
 		{
 			if (!quiet || showfeatures || showtime || showmd5)
-				fprintf(stderr, "page %s %d%s", filename, pagenum, features);
+				fprintf(stderr, "page %s %d%s%s", filename, pagenum, features, optimized);
 		}
 
 		bgprint.started = 1;
@@ -1169,7 +1269,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	else
 	{
 		if (!quiet || showfeatures || showtime || showmd5)
-			fprintf(stderr, "page %s %d%s", filename, pagenum, features);
+			fprintf(stderr, "page %s %d%s%s", filename, pagenum, features, optimized);
 		dodrawpage(ctx, page, list, pagenum, &cookie, start, 0, filename, 0, seps);
 	}
 }
@@ -1466,7 +1566,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "qp:o:F:R:r:w:h:fB:c:e:G:Is:A:DiW:H:S:T:U:XLvPl:y:NO:")) != -1)
+	while ((c = fz_getopt(argc, argv, "qp:o:F:R:r:w:h:fB:c:e:G:Is:A:DziW:H:S:T:U:XLvPl:y:NO:Y:jJE:b")) != -1)
 	{
 		switch (c)
 		{
@@ -1509,6 +1609,7 @@ int mudraw_main(int argc, char **argv)
 			if (strchr(fz_optarg, 'm')) ++showmemory;
 			if (strchr(fz_optarg, 'f')) ++showfeatures;
 			if (strchr(fz_optarg, '5')) ++showmd5;
+			if (strchr(fz_optarg, 'c')) ++showcache;
 			break;
 
 		case 'A':
@@ -1523,6 +1624,7 @@ int mudraw_main(int argc, char **argv)
 			break;
 		}
 		case 'D': uselist = 0; break;
+		case 'z': optimize_list = 1; break;
 		case 'l': min_line_width = fz_atof(fz_optarg); break;
 		case 'i': ignore_errors = 1; break;
 		case 'N': icc_engine = NULL; break;
@@ -1533,8 +1635,29 @@ int mudraw_main(int argc, char **argv)
 #else
 			fprintf(stderr, "Threads not enabled in this build\n");
 			break;
+#endif
+		case 'Y':
+#ifndef DISABLE_MUTHREADS
+			image_threads = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
 #endif
 		case 'L': lowmemory = 1; break;
+		case 'b': direct_bitmap = 1; break;
+		case 'j': image_digests = 1; break;
+		case 'J': glyph_digests = 1; break;
+		case 'E':
+			if (!strcmp(fz_optarg, "lru"))
+				store_policy = FZ_STORE_POLICY_LRU;
+			else if (!strcmp(fz_optarg, "gds"))
+				store_policy = FZ_STORE_POLICY_GDS;
+			else
+			{
+				fprintf(stderr, "unknown store eviction policy '%s'\n", fz_optarg);
+				exit(1);
+			}
+			break;
 		case 'P':
 #ifndef DISABLE_MUTHREADS
 			bgprint.active = 1; break;
@@ -1559,9 +1682,12 @@ int mudraw_main(int argc, char **argv)
 			exit(1);
 		}
 
+		/* Without banding, the threads share out tiles of each
+		 * page instead. */
 		if (band_height == 0)
 		{
-			fprintf(stderr, "Using multiple threads without banding is pointless\n");
+			tile_threads = num_workers;
+			num_workers = 0;
 		}
 	}
 
@@ -1574,6 +1700,12 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	if (image_threads > 0 && uselist == 0)
+	{
+		fprintf(stderr, "cannot decode images ahead without using display list\n");
+		exit(1);
+	}
+
 #ifndef DISABLE_MUTHREADS
 	locks = init_mudraw_locks();
 	if (locks == NULL)
@@ -1592,6 +1724,24 @@ int mudraw_main(int argc, char **argv)
 
 	fz_try(ctx)
 	{
+#ifndef DISABLE_MUTHREADS
+		/* Let the workers look things up in the store without all
+		 * contending for the alloc lock. */
+		if (num_workers > 0 || tile_threads > 0 || image_threads > 0)
+			fz_set_store_shards(ctx, FZ_STORE_MAX_SHARDS);
+
+		/* Large JPEGs with restart markers can be decoded in
+		 * strips across the threads too. */
+		if (image_threads > 0)
+			fz_tune_parallel(ctx, mu_run_parallel, &image_threads);
+		else if (tile_threads > 0)
+			fz_tune_parallel(ctx, mu_run_parallel, &tile_threads);
+#endif
+
+		fz_tune_image_digests(ctx, image_digests);
+		fz_set_glyph_cache_digest_keys(ctx, glyph_digests);
+		fz_set_store_policy(ctx, store_policy);
+
 		if (proof_filename)
 			proof_cs = fz_new_icc_colorspace_from_file(ctx, FZ_COLORSPACE_NONE, proof_filename);
 
@@ -1699,6 +1849,17 @@ int mudraw_main(int argc, char **argv)
 			}
 		}
 
+		if (output_format == OUT_DLIST && uselist == 0)
+		{
+			fprintf(stderr, "cannot save display lists without using display list\n");
+			exit(1);
+		}
+		if (optimize_list && uselist == 0)
+		{
+			fprintf(stderr, "cannot optimize display lists without using display list\n");
+			exit(1);
+		}
+
 		if (band_height)
 		{
 			if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG && output_format != OUT_PBM && output_format != OUT_PKM && output_format != OUT_PCL && output_format != OUT_PCLM && output_format != OUT_PS && output_format != OUT_PSD)
@@ -1837,6 +1998,12 @@ int mudraw_main(int argc, char **argv)
 			{
 				/* SVG files are always opened for each page. Do not open "output". */
 			}
+			else if (output_format == OUT_DLIST)
+			{
+				/* Display lists are always saved for each page. Do not open "output". */
+				if (!output || !strcmp(output, "-"))
+					quiet = 1;
+			}
 			else if (output && (output[0] != '-' || output[1] != 0) && *output != 0)
 			{
 				if (has_percent_d(output))
@@ -1962,7 +2129,7 @@ int mudraw_main(int argc, char **argv)
 		}
 		else
 #endif
-			if (output_format == OUT_GPROOF || output_format == OUT_SVG)
+			if (output_format == OUT_GPROOF || output_format == OUT_SVG || output_format == OUT_DLIST)
 			{
 				/* No output file to close */
 			}
@@ -2032,6 +2199,12 @@ int mudraw_main(int argc, char **argv)
 			fz_drop_context(bgprint.ctx);
 		}
 #endif /* DISABLE_MUTHREADS */
+
+		if (showcache)
+		{
+			fz_print_store_stats(ctx, fz_stderr(ctx));
+			fz_dump_glyph_cache_stats(ctx);
+		}
 	}
 	fz_always(ctx)
 	{
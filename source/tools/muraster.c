@@ -393,6 +393,7 @@ static int showmemory = 0;
 static int ignore_errors = 0;
 static int alphabits_text = 8;
 static int alphabits_graphics = 8;
+static int direct_bitmap = 0;
 
 static int min_band_height;
 static size_t max_band_memory;
@@ -517,6 +518,7 @@ static void usage(void)
 		"\n"
 		"\t-A -\tnumber of bits of antialiasing (0 to 8)\n"
 		"\t-A -/-\tnumber of bits of antialiasing (0 to 8) (graphics, text)\n"
+		"\t-b\thalftone pbm output as it is drawn\n"
 		"\n"
 		"\tpages\tcomma separated list of page numbers and ranges\n"
 		);
@@ -545,9 +547,17 @@ static int drawband(fz_context *ctx, fz_page *page, fz_display_list *list, fz_ma
 
 	fz_try(ctx)
 	{
-		fz_clear_pixmap_with_value(ctx, pix, 255);
-
-		dev = fz_new_draw_device(ctx, fz_identity, pix);
+		/* Halftone mono output as it is drawn if asked to. */
+		if (direct_bitmap && output_format == OUT_PBM && pix->n == 1 && !pix->alpha && fz_colorspace_is_gray(ctx, pix->colorspace))
+		{
+			*bit = fz_new_bitmap(ctx, pix->w, pix->h, 1, pix->xres, pix->yres);
+			dev = fz_new_draw_device_with_bitmap(ctx, fz_identity, pix, *bit, band_start);
+		}
+		else
+		{
+			fz_clear_pixmap_with_value(ctx, pix, 255);
+			dev = fz_new_draw_device(ctx, fz_identity, pix);
+		}
 		if (alphabits_graphics == 0)
 			fz_enable_device_hints(ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
 		if (list)
@@ -558,12 +568,14 @@ static int drawband(fz_context *ctx, fz_page *page, fz_display_list *list, fz_ma
 		fz_drop_device(ctx, dev);
 		dev = NULL;
 
-		if ((output_format == OUT_PBM) || (output_format == OUT_PKM))
+		if (*bit == NULL && ((output_format == OUT_PBM) || (output_format == OUT_PKM)))
 			*bit = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL, band_start);
 	}
 	fz_catch(ctx)
 	{
 		fz_drop_device(ctx, dev);
+		fz_drop_bitmap(ctx, *bit);
+		*bit = NULL;
 		return RENDER_RETRY;
 	}
 	return RENDER_OK;
@@ -1437,7 +1449,7 @@ int main(int argc, char **argv)
 	x_resolution = X_RESOLUTION;
 	y_resolution = Y_RESOLUTION;
 
-	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:M:s:A:iW:H:S:T:U:XvP")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:M:s:A:iW:H:S:T:U:XvPb")) != -1)
 	{
 		switch (c)
 		{
@@ -1479,6 +1491,7 @@ int main(int argc, char **argv)
 			break;
 		}
 		case 'i': ignore_errors = 1; break;
+		case 'b': direct_bitmap = 1; break;
 
 		case 'T':
 #if MURASTER_THREADS != 0